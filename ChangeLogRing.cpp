@@ -0,0 +1,339 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "ChangeLogRing.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace watchman {
+
+static_assert(
+    sizeof(ChangeLogRingHeader) % W_CHANGELOG_ALIGN == 0,
+    "the record area must be aligned");
+static_assert(
+    sizeof(ChangeLogRingRecord) == W_CHANGELOG_ALIGN,
+    "a record header must fit in the smallest gap at the end of the area");
+
+static uint32_t record_size(uint32_t nameLen) {
+  return (sizeof(ChangeLogRingRecord) + nameLen + W_CHANGELOG_ALIGN - 1) &
+      ~(W_CHANGELOG_ALIGN - 1);
+}
+
+std::unique_ptr<ChangeLogRing>
+ChangeLogRing::create(const std::string& path, uint64_t capacity, mode_t mode) {
+#ifdef _WIN32
+  unused_parameter(path);
+  unused_parameter(capacity);
+  unused_parameter(mode);
+  errno = ENOSYS;
+  return nullptr;
+#else
+  size_t mapSize;
+  void* map;
+  int fd;
+
+  capacity &= ~uint64_t(W_CHANGELOG_ALIGN - 1);
+  if (capacity < W_CHANGELOG_MIN_CAPACITY) {
+    capacity = W_CHANGELOG_MIN_CAPACITY;
+  }
+  mapSize = sizeof(ChangeLogRingHeader) + capacity;
+
+  // Replace rather than reuse the file, so that anyone that still has
+  // the old one mapped can tell that it's gone
+  if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+    return nullptr;
+  }
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+  if (fd == -1) {
+    return nullptr;
+  }
+  if (fchmod(fd, mode) != 0 || ftruncate(fd, mapSize) != 0) {
+    int err = errno;
+    close(fd);
+    unlink(path.c_str());
+    errno = err;
+    return nullptr;
+  }
+  map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    int err = errno;
+    unlink(path.c_str());
+    errno = err;
+    return nullptr;
+  }
+
+  // The new file is zero filled, which is a valid state for the atomics
+  auto header = (ChangeLogRingHeader*)map;
+  header->version = W_CHANGELOG_VERSION;
+  header->capacity = capacity;
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = W_CHANGELOG_MAGIC;
+
+  return std::unique_ptr<ChangeLogRing>(new ChangeLogRing(path, map, mapSize));
+#endif
+}
+
+ChangeLogRing::ChangeLogRing(const std::string& path, void* map, size_t mapSize)
+    : path_(path),
+      map_(map),
+      mapSize_(mapSize),
+      header_((ChangeLogRingHeader*)map),
+      records_((char*)map + sizeof(ChangeLogRingHeader)) {}
+
+ChangeLogRing::~ChangeLogRing() {
+  header_->closed.store(1, std::memory_order_release);
+#ifndef _WIN32
+  munmap(map_, mapSize_);
+  unlink(path_.c_str());
+#endif
+}
+
+void ChangeLogRing::reset(const std::string& clockPrefix) {
+  auto generation = header_->generation.load(std::memory_order_relaxed);
+
+  header_->generation.store(generation + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  header_->tail.store(0, std::memory_order_relaxed);
+  header_->head.store(0, std::memory_order_relaxed);
+  header_->lastTick.store(0, std::memory_order_relaxed);
+  memset(header_->clockPrefix, 0, sizeof(header_->clockPrefix));
+  memcpy(
+      header_->clockPrefix,
+      clockPrefix.data(),
+      std::min(clockPrefix.size(), sizeof(header_->clockPrefix) - 1));
+
+  header_->generation.store(generation + 2, std::memory_order_release);
+}
+
+void ChangeLogRing::reclaim(uint64_t end) {
+  auto tail = header_->tail.load(std::memory_order_relaxed);
+  auto capacity = header_->capacity;
+
+  if (end - tail <= capacity) {
+    return;
+  }
+  while (end - tail > capacity) {
+    auto rec = (const ChangeLogRingRecord*)(records_ + (tail % capacity));
+    tail += rec->size;
+  }
+  // Readers must see the new tail before they can see any of the bytes
+  // that we're about to write over the records that it skipped
+  header_->tail.store(tail, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void ChangeLogRing::write(
+    uint64_t offset,
+    uint32_t size,
+    uint32_t tick,
+    uint32_t flags,
+    const char* name,
+    uint32_t nameLen) {
+  ChangeLogRingRecord rec{size, tick, flags, nameLen};
+  char* dest = records_ + (offset % header_->capacity);
+
+  memcpy(dest, &rec, sizeof(rec));
+  if (nameLen) {
+    memcpy(dest + sizeof(rec), name, nameLen);
+  }
+}
+
+void ChangeLogRing::append(
+    uint32_t tick,
+    uint32_t flags,
+    const char* name,
+    uint32_t nameLen) {
+  auto capacity = header_->capacity;
+  auto head = header_->head.load(std::memory_order_relaxed);
+  uint32_t size = record_size(nameLen);
+
+  if (size > capacity) {
+    // Not possible with real paths and the minimum capacity
+    return;
+  }
+
+  auto avail = capacity - (head % capacity);
+  if (avail < size) {
+    // Pad out the end of the area so that the record starts at the
+    // beginning of it
+    reclaim(head + avail);
+    write(head, uint32_t(avail), tick, W_CHANGELOG_PADDING, nullptr, 0);
+    head += avail;
+  }
+
+  reclaim(head + size);
+  write(head, size, tick, flags, name, nameLen);
+  header_->lastTick.store(tick, std::memory_order_relaxed);
+  header_->head.store(head + size, std::memory_order_release);
+}
+
+std::unique_ptr<ChangeLogRingReader> ChangeLogRingReader::open(
+    const std::string& path) {
+#ifdef _WIN32
+  unused_parameter(path);
+  errno = ENOSYS;
+  return nullptr;
+#else
+  struct stat st;
+  void* map;
+  int fd;
+
+  fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return nullptr;
+  }
+  if (fstat(fd, &st) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return nullptr;
+  }
+  if (size_t(st.st_size) < sizeof(ChangeLogRingHeader)) {
+    close(fd);
+    errno = EINVAL;
+    return nullptr;
+  }
+  map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return nullptr;
+  }
+
+  auto header = (const ChangeLogRingHeader*)map;
+  if (header->magic != W_CHANGELOG_MAGIC ||
+      header->version != W_CHANGELOG_VERSION ||
+      header->capacity % W_CHANGELOG_ALIGN != 0 ||
+      header->capacity > st.st_size - sizeof(ChangeLogRingHeader)) {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return nullptr;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  auto reader = std::unique_ptr<ChangeLogRingReader>(new ChangeLogRingReader(
+      path, map, st.st_size, st.st_dev, st.st_ino));
+  reader->resync();
+  return reader;
+#endif
+}
+
+ChangeLogRingReader::ChangeLogRingReader(
+    const std::string& path,
+    void* map,
+    size_t mapSize,
+    dev_t dev,
+    ino_t ino)
+    : path_(path),
+      map_(map),
+      mapSize_(mapSize),
+      header_((const ChangeLogRingHeader*)map),
+      records_((const char*)map + sizeof(ChangeLogRingHeader)),
+      dev_(dev),
+      ino_(ino) {}
+
+ChangeLogRingReader::~ChangeLogRingReader() {
+#ifndef _WIN32
+  munmap(map_, mapSize_);
+#endif
+}
+
+void ChangeLogRingReader::resync() {
+  char prefix[sizeof(header_->clockPrefix)];
+
+  while (true) {
+    auto generation = header_->generation.load(std::memory_order_acquire);
+    if (generation & 1) {
+      // A reset is in progress
+      sched_yield();
+      continue;
+    }
+    auto head = header_->head.load(std::memory_order_acquire);
+    auto tick = header_->lastTick.load(std::memory_order_relaxed);
+    memcpy(prefix, header_->clockPrefix, sizeof(prefix));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->generation.load(std::memory_order_relaxed) != generation) {
+      continue;
+    }
+
+    prefix[sizeof(prefix) - 1] = '\0';
+    clockPrefix_ = prefix;
+    generation_ = generation;
+    offset_ = head;
+    lastTick_ = tick;
+    return;
+  }
+}
+
+ChangeLogRingReader::Status ChangeLogRingReader::read(
+    std::vector<Change>& changes,
+    size_t maxChanges) {
+  auto capacity = header_->capacity;
+  size_t numRead = 0;
+
+  if (header_->closed.load(std::memory_order_acquire)) {
+    return Status::Closed;
+  }
+
+  while (numRead < maxChanges) {
+    if (header_->generation.load(std::memory_order_acquire) != generation_) {
+      return Status::Reset;
+    }
+    auto head = header_->head.load(std::memory_order_acquire);
+    if (offset_ == head) {
+      break;
+    }
+    if (header_->tail.load(std::memory_order_acquire) > offset_) {
+      return Status::Overrun;
+    }
+
+    // Copy the record out, and then check that the writer didn't start
+    // writing over it while we were doing so
+    ChangeLogRingRecord rec;
+    auto pos = offset_ % capacity;
+    memcpy(&rec, records_ + pos, sizeof(rec));
+    bool valid = rec.size >= sizeof(rec) && rec.size <= capacity - pos &&
+        rec.size % W_CHANGELOG_ALIGN == 0 &&
+        rec.nameLen <= rec.size - sizeof(rec);
+    std::string name;
+    if (valid && !(rec.flags & W_CHANGELOG_PADDING)) {
+      name.assign(records_ + pos + sizeof(rec), rec.nameLen);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->generation.load(std::memory_order_relaxed) != generation_) {
+      return Status::Reset;
+    }
+    if (!valid || header_->tail.load(std::memory_order_relaxed) > offset_) {
+      return Status::Overrun;
+    }
+
+    offset_ += rec.size;
+    if (rec.flags & W_CHANGELOG_PADDING) {
+      continue;
+    }
+    changes.push_back(Change{rec.tick, rec.flags, std::move(name)});
+    lastTick_ = rec.tick;
+    ++numRead;
+  }
+
+#ifndef _WIN32
+  if (numRead == 0) {
+    // If the server went away without closing the ring, the file will
+    // since have been replaced or removed
+    struct stat st;
+    if (stat(path_.c_str(), &st) != 0 || st.st_dev != dev_ ||
+        st.st_ino != ino_) {
+      return Status::Closed;
+    }
+  }
+#endif
+  return Status::Ok;
+}
+
+std::string ChangeLogRingReader::clock() const {
+  return clockPrefix_ + std::to_string(lastTick_ > 0 ? lastTick_ - 1 : 0);
+}
+}
@@ -0,0 +1,192 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace watchman {
+
+/* The change log ring is a file in the state dir that holds the most
+ * recent changes observed in a root, in the order in which the io thread
+ * observed them.  Local consumers that only need to know which paths
+ * changed can map it read-only and tail it without going through the
+ * socket, and without waiting for the root to settle.
+ *
+ * The file is a ChangeLogRingHeader followed by the record area, which
+ * holds ChangeLogRingRecords.  Every record that has been appended since
+ * the last reset has an offset in the stream of records; the record at
+ * offset o is found at o % capacity in the record area.  Records never
+ * straddle the end of the area; a padding record fills the space that
+ * was too small for the next one.
+ *
+ * There is one writer, and no locking.  The writer advances tail past
+ * the records that it is about to overwrite before it writes over them,
+ * and advances head once the new record is in place, so a reader that
+ * copies a record and then finds tail still at or before its offset
+ * knows that the copy is intact.  A reader that finds tail beyond its
+ * offset has been overrun, and should fall back to a since query. */
+
+#define W_CHANGELOG_MAGIC 0x4c43574d // "WMCL"
+#define W_CHANGELOG_VERSION 1
+#define W_CHANGELOG_ALIGN 16
+#define W_CHANGELOG_MIN_CAPACITY 65536
+
+/* Record flags */
+// The file exists as of this change
+#define W_CHANGELOG_EXISTS 0x1
+// The file was created (or came back after being deleted) in this change
+#define W_CHANGELOG_NEW 0x2
+// Fills the rest of the record area; skip to the start of it
+#define W_CHANGELOG_PADDING 0x80000000
+
+// All fields are in host byte order
+struct ChangeLogRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  // The size of the record area that follows the header
+  uint64_t capacity;
+  // Bumped whenever the ring is reset, which happens whenever the view
+  // is built from scratch and the tick values start over.  It is odd
+  // while a reset is in progress.
+  std::atomic<uint64_t> generation;
+  // The offset of the oldest intact record
+  std::atomic<uint64_t> tail;
+  // The offset at which the next record will be written
+  std::atomic<uint64_t> head;
+  // The tick of the most recently appended record
+  std::atomic<uint32_t> lastTick;
+  // Set once the server has stopped writing to the ring
+  std::atomic<uint32_t> closed;
+  // A clock for the root without its tick value ("c:123:456:1:").
+  // Appending a tick yields a clock that can be passed to since.
+  char clockPrefix[64];
+  uint8_t reserved[16];
+};
+
+struct ChangeLogRingRecord {
+  // The size of the record, including this header and the padding
+  // that follows the name
+  uint32_t size;
+  uint32_t tick;
+  uint32_t flags;
+  uint32_t nameLen;
+  // Followed by the name relative to the root, which isn't NUL terminated
+};
+
+class ChangeLogRing {
+ public:
+  /* Creates the ring at path with room for capacity bytes of records,
+   * replacing whatever was there.  Returns nullptr and sets errno if
+   * that isn't possible. */
+  static std::unique_ptr<ChangeLogRing>
+  create(const std::string& path, uint64_t capacity, mode_t mode);
+  /* Marks the ring as closed and removes the file */
+  ~ChangeLogRing();
+
+  const std::string& path() const {
+    return path_;
+  }
+  uint64_t capacity() const {
+    return header_->capacity;
+  }
+
+  /* Discards the records and bumps the generation, so that readers know
+   * that they must start over.  clockPrefix is that of the new view. */
+  void reset(const std::string& clockPrefix);
+
+  /* Appends a record.  Calls to reset and append must be serialized by
+   * the caller; for a root, they happen with the root locked. */
+  void append(
+      uint32_t tick,
+      uint32_t flags,
+      const char* name,
+      uint32_t nameLen);
+
+ private:
+  ChangeLogRing(const std::string& path, void* map, size_t mapSize);
+  // Moves tail beyond the records that a record ending at end would
+  // overwrite
+  void reclaim(uint64_t end);
+  void write(
+      uint64_t offset,
+      uint32_t size,
+      uint32_t tick,
+      uint32_t flags,
+      const char* name,
+      uint32_t nameLen);
+
+  std::string path_;
+  void* map_;
+  size_t mapSize_;
+  ChangeLogRingHeader* header_;
+  char* records_;
+};
+
+/* Tails a change log ring on behalf of a consumer */
+class ChangeLogRingReader {
+ public:
+  struct Change {
+    uint32_t tick;
+    uint32_t flags;
+    std::string name;
+  };
+
+  enum class Status {
+    // The changes that were available have been returned
+    Ok,
+    // The writer overwrote changes that we hadn't yet read.  Do a since
+    // query from clock() to pick up what was missed, then resync().
+    Overrun,
+    // The view was rebuilt, so the tick values started over.  Treat this
+    // like a fresh instance, then resync().
+    Reset,
+    // The server is no longer writing to this ring; open it again once
+    // the root is watched again.
+    Closed,
+  };
+
+  /* Maps the ring at path, positioned so that the first call to read
+   * returns the changes that are appended after this one.  Returns
+   * nullptr and sets errno if that isn't possible. */
+  static std::unique_ptr<ChangeLogRingReader> open(const std::string& path);
+  ~ChangeLogRingReader();
+
+  /* Appends the changes that have been appended to the ring since the
+   * previous call, up to maxChanges of them */
+  Status read(std::vector<Change>& changes, size_t maxChanges = SIZE_MAX);
+
+  /* Returns a clock from which a since query will report at least the
+   * changes after the last one that was read.  It is just before the
+   * tick of that change, since the changes that shared its tick may not
+   * all have been read. */
+  std::string clock() const;
+
+  /* Starts over from the most recent change, after the consumer has
+   * caught up via a query */
+  void resync();
+
+ private:
+  ChangeLogRingReader(
+      const std::string& path,
+      void* map,
+      size_t mapSize,
+      dev_t dev,
+      ino_t ino);
+
+  std::string path_;
+  void* map_;
+  size_t mapSize_;
+  const ChangeLogRingHeader* header_;
+  const char* records_;
+  dev_t dev_;
+  ino_t ino_;
+  uint64_t generation_{0};
+  uint64_t offset_{0};
+  uint32_t lastTick_{0};
+  std::string clockPrefix_;
+};
+}
@@ -25,90 +25,203 @@ void CookieSync::setCookieDir(const w_string& dir) {
       int(getpid()));
 }
 
-bool CookieSync::syncToNow(std::chrono::milliseconds timeout) {
-  Cookie cookie;
-  w_stm_t file;
-  int errcode = 0;
+bool CookieSync::syncToNow(
+    std::chrono::milliseconds timeout,
+    Latency* latency) {
+  /* compute deadline */
+  auto deadline = std::chrono::system_clock::now() + timeout;
 
-  auto cookie_lock = std::unique_lock<std::mutex>(cookie.mutex);
+  std::unique_lock<std::mutex> lock(mutex_);
 
+  // Any cookie that is already in flight may have been written before
+  // the changes that we are asking about, so we wait on the next one.
+  // Everyone else that arrives before it is written shares it with us.
+  if (!next_) {
+    next_ = std::make_shared<Cookie>();
+  }
+  auto cookie = next_;
+  ++cookie->waiters;
+  ++cookie->sharers;
+
+  while (!cookie->seen && !cookie->errcode) {
+    if (!cookie->written && !inflight_) {
+      // The previous cookie was retired; it falls to us to write this one
+      writeCookie(lock, cookie);
+      continue;
+    }
+    if (cookie->cond.wait_until(lock, deadline) == std::cv_status::timeout) {
+      break;
+    }
+  }
+
+  bool seen = cookie->seen;
+  int errcode = cookie->errcode;
+  if (seen) {
+    w_log(W_LOG_DBG, "sync_to_now [%s] done\n", cookie->path.c_str());
+    if (latency) {
+      if (cookie->observed != std::chrono::steady_clock::time_point()) {
+        latency->observed =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                cookie->observed - cookie->created);
+      }
+      latency->acknowledged =
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              cookie->acknowledged - cookie->created);
+      latency->waiters = cookie->sharers;
+    }
+  } else if (!errcode) {
+    errcode = ETIMEDOUT;
+    w_log(
+        W_LOG_ERR,
+        "sync_to_now: %s timedwait failed: %d: istimeout=%d %s\n",
+        cookie->written ? cookie->path.c_str() : "(unwritten cookie)",
+        errcode,
+        errcode == ETIMEDOUT,
+        strerror(errcode));
+  }
+
+  if (--cookie->waiters == 0) {
+    retireCookie(lock, cookie);
+  }
+
+  if (!seen) {
+    errno = errcode;
+    return false;
+  }
+
+  return true;
+}
+
+// Called with mutex_ held; the lock is released while the file is
+// created so that notifications and new arrivals are not held up by
+// a slow filesystem.
+void CookieSync::writeCookie(
+    std::unique_lock<std::mutex>& lock,
+    const std::shared_ptr<Cookie>& cookie) {
   /* generate a cookie name: cookie prefix + id */
-  auto path_str = w_string::printf(
+  cookie->path = w_string::printf(
       "%.*s%" PRIu32, cookiePrefix_.size(), cookiePrefix_.data(), serial_++);
+  cookie->written = true;
+  inflight_ = cookie;
+  if (next_ == cookie) {
+    next_ = nullptr;
+  }
 
   /* insert our cookie in the map */
   {
     auto wlock = cookies_.wlock();
     auto& map = *wlock;
-    map[path_str] = &cookie;
+    map[cookie->path] = cookie;
   }
 
-  /* compute deadline */
-  auto deadline = std::chrono::system_clock::now() + timeout;
+  cookie->created = std::chrono::steady_clock::now();
+  lock.unlock();
 
   /* touch the file */
-  file = w_stm_open(
-      path_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0700);
+  int errcode = 0;
+  auto file = w_stm_open(
+      cookie->path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0700);
   if (!file) {
     errcode = errno;
     w_log(
         W_LOG_ERR,
         "sync_to_now: creat(%s) failed: %s\n",
-        path_str.c_str(),
+        cookie->path.c_str(),
         strerror(errcode));
-    goto out;
+  } else {
+    w_stm_close(file);
+    w_log(W_LOG_DBG, "sync_to_now [%s] waiting\n", cookie->path.c_str());
   }
-  w_stm_close(file);
 
-  w_log(W_LOG_DBG, "sync_to_now [%s] waiting\n", path_str.c_str());
+  lock.lock();
+  if (errcode) {
+    cookie->errcode = errcode;
+    // Don't hold up the callers waiting on the next cookie
+    if (inflight_ == cookie) {
+      inflight_ = nullptr;
+      if (next_) {
+        next_->cond.notify_all();
+      }
+    }
+    cookie->cond.notify_all();
+  }
+}
 
-  /* timed cond wait (unlocks cookie lock, reacquires) */
-  if (!cookie.cond.wait_until(
-          cookie_lock, deadline, [&] { return cookie.seen; })) {
-    w_log(
-        W_LOG_ERR,
-        "sync_to_now: %s timedwait failed: %d: istimeout=%d %s\n",
-        path_str.c_str(),
-        errcode,
-        errcode == ETIMEDOUT,
-        strerror(errcode));
-    goto out;
+// Called with mutex_ held by the last waiter to leave a cookie.
+void CookieSync::retireCookie(
+    std::unique_lock<std::mutex>& lock,
+    const std::shared_ptr<Cookie>& cookie) {
+  if (!cookie->written) {
+    // Everyone waiting on it timed out before it could be written
+    if (next_ == cookie) {
+      next_ = nullptr;
+    }
+    return;
   }
-  w_log(W_LOG_DBG, "sync_to_now [%s] done\n", path_str.c_str());
 
-out:
-  cookie_lock.unlock();
+  if (inflight_ == cookie) {
+    // It timed out; allow the next cookie to be written
+    inflight_ = nullptr;
+    if (next_) {
+      next_->cond.notify_all();
+    }
+  }
+
+  lock.unlock();
 
   // can't unlink the file until after the cookie has been observed because
   // we don't know which file got changed until we look in the cookie dir
-  unlink(path_str.c_str());
+  if (!cookie->errcode) {
+    unlink(cookie->path.c_str());
+  }
 
   {
     auto map = cookies_.wlock();
-    map->erase(path_str);
+    map->erase(cookie->path);
   }
 
-  if (!cookie.seen) {
-    errno = errcode;
-    return false;
-  }
-
-  return true;
+  lock.lock();
 }
 
-void CookieSync::notifyCookie(const w_string& path) const {
+std::shared_ptr<CookieSync::Cookie> CookieSync::lookupCookie(
+    const w_string& path) const {
   auto map = cookies_.rlock();
   auto cookie_iter = map->find(path);
+  if (cookie_iter == map->end()) {
+    return nullptr;
+  }
+  return cookie_iter->second;
+}
+
+void CookieSync::notifyCookie(const w_string& path) {
+  auto cookie = lookupCookie(path);
   w_log(
       W_LOG_DBG,
       "cookie for %s? %s\n",
       path.c_str(),
-      cookie_iter != map->end() ? "yes" : "no");
+      cookie ? "yes" : "no");
 
-  if (cookie_iter != map->end()) {
-    auto cookie = cookie_iter->second;
+  if (cookie) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cookie->acknowledged = std::chrono::steady_clock::now();
     cookie->seen = true;
-    cookie->cond.notify_one();
+    cookie->cond.notify_all();
+    if (inflight_ == cookie) {
+      inflight_ = nullptr;
+      if (next_) {
+        // Someone waiting on the next cookie can write it now
+        next_->cond.notify_all();
+      }
+    }
+  }
+}
+
+void CookieSync::markCookieObserved(const w_string& path) {
+  auto cookie = lookupCookie(path);
+
+  if (cookie) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cookie->observed = std::chrono::steady_clock::now();
   }
 }
 }
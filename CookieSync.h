@@ -8,6 +8,19 @@ namespace watchman {
 
 class CookieSync {
  public:
+  // Timing information about a sync, relative to the time at which
+  // the cookie file was created.
+  struct Latency {
+    // When the notification for the cookie was decoded from the
+    // watcher.  Zero if it was not observed via the fast path.
+    std::chrono::microseconds observed{0};
+    // When the cookie was acknowledged by the io thread, which
+    // indicates that everything that preceded it has been processed
+    std::chrono::microseconds acknowledged{0};
+    // The number of callers that were waiting on the same cookie
+    size_t waiters{0};
+  };
+
   explicit CookieSync(const w_string& dir);
   void setCookieDir(const w_string& dir);
 
@@ -18,15 +31,28 @@ class CookieSync {
    * we've seen everything up to the point in time at which
    * we're asking questions.
    * Returns true if we observe the change within the requested
-   * time, false otherwise. */
-  bool syncToNow(std::chrono::milliseconds timeout);
+   * time, false otherwise.
+   * Concurrent callers share cookies: at most one cookie is in flight
+   * at a time, and callers that arrive while it is in flight wait on
+   * the next one, which is written as soon as the in-flight cookie
+   * is retired.
+   * If latency is not null, it is populated with timing information
+   * about the cookie. */
+  bool syncToNow(
+      std::chrono::milliseconds timeout,
+      Latency* latency = nullptr);
 
   /* If path is a valid cookie in the map, notify the waiter.
    * Returns true if the path matches the cookie prefix (not just
    * whether the cookie is currently valid).
    * Returns false if the path does not match our cookie prefix.
    */
-  void notifyCookie(const w_string& path) const;
+  void notifyCookie(const w_string& path);
+
+  /* Record that the notification for the cookie at path has been
+   * decoded from the watcher, ahead of it being acknowledged by
+   * notifyCookie().  This is used only for latency reporting. */
+  void markCookieObserved(const w_string& path);
 
   // We need to guarantee that we never collapse a cookie notification
   // out of the pending list, because we absolutely must observe it coming
@@ -51,16 +77,41 @@ class CookieSync {
  private:
   struct Cookie {
     std::condition_variable cond;
-    std::mutex mutex;
+    // The path is assigned when the cookie file is written
+    w_string path;
+    bool written{false};
     bool seen{false};
+    int errcode{0};
+    // The number of syncToNow callers waiting on this cookie
+    size_t waiters{0};
+    // The total number of callers that have waited on this cookie
+    size_t sharers{0};
+    std::chrono::steady_clock::time_point created;
+    std::chrono::steady_clock::time_point observed;
+    std::chrono::steady_clock::time_point acknowledged;
   };
 
+  void writeCookie(
+      std::unique_lock<std::mutex>& lock,
+      const std::shared_ptr<Cookie>& cookie);
+  void retireCookie(
+      std::unique_lock<std::mutex>& lock,
+      const std::shared_ptr<Cookie>& cookie);
+  std::shared_ptr<Cookie> lookupCookie(const w_string& path) const;
+
   // path to the query cookie dir
   w_string cookieDir_;
   // valid filename prefix for cookies we create
   w_string cookiePrefix_;
   // Serial number for cookie filename
   std::atomic<uint32_t> serial_{0};
-  Synchronized<std::unordered_map<w_string, Cookie*>> cookies_;
+  // Protects inflight_, next_ and the state of all cookies
+  std::mutex mutex_;
+  // The cookie that has been written and not yet retired
+  std::shared_ptr<Cookie> inflight_;
+  // The cookie that callers arriving while inflight_ is set wait on
+  std::shared_ptr<Cookie> next_;
+  // Maps the path of each written cookie to its state
+  Synchronized<std::unordered_map<w_string, std::shared_ptr<Cookie>>> cookies_;
 };
 }
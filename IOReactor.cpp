@@ -0,0 +1,372 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "IOReactor.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include <algorithm>
+#include <limits>
+#include <system_error>
+#include <thread>
+
+namespace watchman {
+
+TimerWheel::TimerWheel(std::chrono::milliseconds resolution, size_t numSlots)
+    : resolution_(resolution), slots_(numSlots), lastTick_(Clock::now()) {}
+
+uint64_t TimerWheel::add(std::chrono::milliseconds delay, Callback&& func) {
+  if (timers_.empty()) {
+    // Nothing has been advancing the wheel while it was empty, so
+    // measure from now rather than from some arbitrarily old tick
+    lastTick_ = Clock::now();
+  }
+
+  size_t ticks = (delay.count() + resolution_.count() - 1) / resolution_.count();
+  if (ticks == 0) {
+    ticks = 1;
+  }
+
+  auto id = nextId_++;
+  auto slotNo = (current_ + ticks) % slots_.size();
+  auto& slot = slots_[slotNo];
+  auto it = slot.insert(
+      slot.end(), Timer{id, (ticks - 1) / slots_.size(), std::move(func)});
+  timers_.emplace(id, std::make_pair(slotNo, it));
+
+  return id;
+}
+
+bool TimerWheel::cancel(uint64_t id) {
+  auto it = timers_.find(id);
+  if (it == timers_.end()) {
+    return false;
+  }
+  slots_[it->second.first].erase(it->second.second);
+  timers_.erase(it);
+  return true;
+}
+
+void TimerWheel::advance(Clock::time_point now, std::vector<Callback>& due) {
+  if (timers_.empty()) {
+    lastTick_ = now;
+    return;
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     now - lastTick_)
+                     .count() /
+      resolution_.count();
+
+  for (decltype(elapsed) i = 0; i < elapsed && !timers_.empty(); ++i) {
+    current_ = (current_ + 1) % slots_.size();
+    auto& slot = slots_[current_];
+
+    auto it = slot.begin();
+    while (it != slot.end()) {
+      if (it->rounds > 0) {
+        --it->rounds;
+        ++it;
+        continue;
+      }
+      due.emplace_back(std::move(it->func));
+      timers_.erase(it->id);
+      it = slot.erase(it);
+    }
+  }
+
+  lastTick_ += resolution_ * elapsed;
+  if (timers_.empty()) {
+    lastTick_ = now;
+  }
+}
+
+int TimerWheel::nextTimeoutMs(Clock::time_point now) const {
+  if (timers_.empty()) {
+    return -1;
+  }
+
+  // A timer in the slot k ticks ahead of current_ fires once the wheel
+  // has gone around rounds more times, so find the soonest of those
+  // rather than waking up on every tick
+  size_t ticks = 0;
+  for (auto& it : timers_) {
+    auto offset = (it.second.first + slots_.size() - current_) % slots_.size();
+    if (offset == 0) {
+      offset = slots_.size();
+    }
+    auto due = offset + it.second.second->rounds * slots_.size();
+    if (ticks == 0 || due < ticks) {
+      ticks = due;
+    }
+  }
+
+  // Round up, so that the wheel has reached that tick once we wake
+  auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+      lastTick_ + resolution_ * ticks - now);
+  if (remaining.count() <= 0) {
+    return 0;
+  }
+  return int(std::min<int64_t>(
+      (remaining.count() + 999) / 1000, std::numeric_limits<int>::max()));
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+IOReactor::IOReactor() {
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd_ == -1) {
+    throw std::system_error(errno, std::system_category(), "epoll_create1");
+  }
+
+  wakefd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakefd_ == -1) {
+    throw std::system_error(errno, std::system_category(), "eventfd");
+  }
+
+  // handle 0 is reserved for the wakeup descriptor
+  struct epoll_event evt;
+  memset(&evt, 0, sizeof(evt));
+  evt.events = EPOLLIN;
+  evt.data.u64 = 0;
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &evt) == -1) {
+    throw std::system_error(errno, std::system_category(), "epoll_ctl");
+  }
+}
+
+IOReactor::~IOReactor() {
+  close(wakefd_);
+  close(epfd_);
+}
+
+void IOReactor::start(const char* name) {
+  std::string threadName(name);
+  std::thread thr([this, threadName] {
+    w_set_thread_name("%s", threadName.c_str());
+    loop();
+  });
+  thr.detach();
+}
+
+static uint32_t epoll_events(int events) {
+  uint32_t result = 0;
+  if (events & IOReactor::Readable) {
+    result |= EPOLLIN;
+  }
+  if (events & IOReactor::Writable) {
+    result |= EPOLLOUT;
+  }
+  return result;
+}
+
+uint64_t IOReactor::addFd(int fd, Callback&& func) {
+  Callback readable(std::move(func));
+  return addFd(fd, Readable, [readable](int) { readable(); });
+}
+
+uint64_t IOReactor::addFd(int fd, int events, EventCallback&& func) {
+  auto handler = std::make_shared<FdHandler>();
+  handler->fd = fd;
+  handler->events = events;
+  handler->func = std::move(func);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto handle = nextHandle_++;
+
+  if (events) {
+    struct epoll_event evt;
+    memset(&evt, 0, sizeof(evt));
+    evt.events = epoll_events(events);
+    evt.data.u64 = handle;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &evt) == -1) {
+      throw std::system_error(errno, std::system_category(), "epoll_ctl");
+    }
+  }
+
+  handlers_.emplace(handle, std::move(handler));
+  return handle;
+}
+
+void IOReactor::modifyFd(uint64_t handle, int events) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = handlers_.find(handle);
+  if (it == handlers_.end()) {
+    return;
+  }
+  auto& handler = it->second;
+  if (handler->events == events) {
+    return;
+  }
+
+  // Descriptors with no events of interest are taken out of the set
+  // altogether, as epoll would otherwise keep reporting hangups for them
+  int op;
+  if (events == 0) {
+    op = EPOLL_CTL_DEL;
+  } else if (handler->events == 0) {
+    op = EPOLL_CTL_ADD;
+  } else {
+    op = EPOLL_CTL_MOD;
+  }
+
+  struct epoll_event evt;
+  memset(&evt, 0, sizeof(evt));
+  evt.events = epoll_events(events);
+  evt.data.u64 = handle;
+  if (epoll_ctl(epfd_, op, handler->fd, &evt) == -1) {
+    throw std::system_error(errno, std::system_category(), "epoll_ctl");
+  }
+  handler->events = events;
+}
+
+void IOReactor::removeFd(uint64_t handle) {
+  std::shared_ptr<FdHandler> handler;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = handlers_.find(handle);
+    if (it == handlers_.end()) {
+      return;
+    }
+    handler = std::move(it->second);
+    handlers_.erase(it);
+    if (handler->events) {
+      epoll_ctl(epfd_, EPOLL_CTL_DEL, handler->fd, nullptr);
+    }
+  }
+
+  // Wait out any dispatch that is in progress
+  std::unique_lock<std::mutex> lock(handler->mutex);
+  handler->active = false;
+}
+
+uint64_t IOReactor::addTimer(
+    std::chrono::milliseconds delay,
+    Callback&& func) {
+  bool wasEmpty;
+  uint64_t id;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wasEmpty = timers_.size() == 0;
+    id = timers_.add(delay, std::move(func));
+  }
+  if (wasEmpty) {
+    // The reactor may be sleeping without a timeout
+    wakeup();
+  }
+  return id;
+}
+
+void IOReactor::cancelTimer(uint64_t id) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  timers_.cancel(id);
+}
+
+void IOReactor::wakeup() {
+  uint64_t one = 1;
+  ignore_result(write(wakefd_, &one, sizeof(one)));
+}
+
+void IOReactor::loop() {
+  struct epoll_event events[64];
+  std::vector<Callback> due;
+
+  while (true) {
+    int timeoutms;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      timeoutms = timers_.nextTimeoutMs(TimerWheel::Clock::now());
+    }
+
+    int n = epoll_wait(epfd_, events, sizeof(events) / sizeof(events[0]),
+                       timeoutms);
+    if (n == -1) {
+      if (errno != EINTR) {
+        w_log(W_LOG_ERR, "epoll_wait: %s\n", strerror(errno));
+      }
+      n = 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      auto handle = events[i].data.u64;
+      if (handle == 0) {
+        uint64_t ignored;
+        ignore_result(read(wakefd_, &ignored, sizeof(ignored)));
+        continue;
+      }
+
+      std::shared_ptr<FdHandler> handler;
+      int ready = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = handlers_.find(handle);
+        if (it == handlers_.end()) {
+          // Removed after the event was reported
+          continue;
+        }
+        handler = it->second;
+
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          ready = Readable | Writable;
+        }
+        if (events[i].events & EPOLLIN) {
+          ready |= Readable;
+        }
+        if (events[i].events & EPOLLOUT) {
+          ready |= Writable;
+        }
+        // The interest may have changed after the event was reported
+        ready &= handler->events;
+      }
+      if (ready == 0) {
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(handler->mutex);
+      if (handler->active) {
+        handler->func(ready);
+      }
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      timers_.advance(TimerWheel::Clock::now(), due);
+    }
+    for (auto& func : due) {
+      func();
+    }
+    due.clear();
+  }
+}
+
+#else
+
+IOReactor::IOReactor() {
+  throw std::runtime_error("IOReactor is not supported on this system");
+}
+
+IOReactor::~IOReactor() {}
+
+void IOReactor::start(const char*) {}
+
+uint64_t IOReactor::addFd(int, Callback&&) {
+  return 0;
+}
+
+uint64_t IOReactor::addFd(int, int, EventCallback&&) {
+  return 0;
+}
+
+void IOReactor::modifyFd(uint64_t, int) {}
+
+void IOReactor::removeFd(uint64_t) {}
+
+uint64_t IOReactor::addTimer(std::chrono::milliseconds, Callback&&) {
+  return 0;
+}
+
+void IOReactor::cancelTimer(uint64_t) {}
+
+#endif
+}
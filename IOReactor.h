@@ -0,0 +1,133 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace watchman {
+
+/** A hashed timer wheel.
+ * Timers are bucketed into slots by their expiry tick; each slot holds
+ * the timers that are due on that tick or on a subsequent revolution
+ * of the wheel.  Adding and cancelling a timer are O(1), and advancing
+ * the wheel costs O(1) per tick plus the timers that are visited in
+ * the slots that are passed over.
+ * This class is not thread safe; IOReactor serializes access to it. */
+class TimerWheel {
+ public:
+  using Callback = std::function<void()>;
+  using Clock = std::chrono::steady_clock;
+
+  explicit TimerWheel(
+      std::chrono::milliseconds resolution = std::chrono::milliseconds(10),
+      size_t numSlots = 512);
+
+  /* Schedule func to run after delay has elapsed.
+   * Returns an id that may be passed to cancel() */
+  uint64_t add(std::chrono::milliseconds delay, Callback&& func);
+
+  /* Cancel a timer.  Returns false if it already fired
+   * or was previously cancelled */
+  bool cancel(uint64_t id);
+
+  /* Advance the wheel to now, appending the callbacks of any timers
+   * that have expired to the due vector.  The caller is responsible
+   * for invoking them */
+  void advance(Clock::time_point now, std::vector<Callback>& due);
+
+  /* Returns the number of milliseconds until the soonest timer is due,
+   * or -1 if there are no timers */
+  int nextTimeoutMs(Clock::time_point now) const;
+
+  size_t size() const {
+    return timers_.size();
+  }
+
+ private:
+  struct Timer {
+    uint64_t id;
+    size_t rounds;
+    Callback func;
+  };
+  using Slot = std::list<Timer>;
+
+  std::chrono::milliseconds resolution_;
+  std::vector<Slot> slots_;
+  size_t current_{0};
+  Clock::time_point lastTick_;
+  uint64_t nextId_{1};
+  std::unordered_map<uint64_t, std::pair<size_t, Slot::iterator>> timers_;
+};
+
+/** Multiplexes readiness notification for a set of descriptors,
+ * along with a timer wheel, onto a single thread.
+ * Callbacks run on the reactor thread and should do a small,
+ * bounded amount of work; anything heavier should be handed off
+ * to a ThreadPool. */
+class IOReactor {
+ public:
+  using Callback = std::function<void()>;
+
+  /* The events that a descriptor may be observed for.  An error or
+   * hangup on the descriptor is reported as every event of interest. */
+  enum : int { Readable = 1, Writable = 2 };
+  using EventCallback = std::function<void(int events)>;
+
+  IOReactor();
+  IOReactor(const IOReactor&) = delete;
+  ~IOReactor();
+
+  /* Spawn the reactor thread */
+  void start(const char* name);
+
+  /* Invoke func each time that fd becomes readable.
+   * Returns a handle that must be passed to removeFd() */
+  uint64_t addFd(int fd, Callback&& func);
+
+  /* Invoke func with the events that are ready each time that fd
+   * becomes ready for any of the events in the events mask.
+   * Returns a handle that must be passed to removeFd() */
+  uint64_t addFd(int fd, int events, EventCallback&& func);
+
+  /* Change the events of interest for the descriptor associated with
+   * handle.  While the mask is 0 the descriptor is not observed at all,
+   * so not even a hangup will be reported for it.
+   * This may be called from the callback for that descriptor. */
+  void modifyFd(uint64_t handle, int events);
+
+  /* Stop observing the descriptor associated with handle.
+   * When this returns the callback is not running and will not be
+   * invoked again, so it is safe to close the descriptor.
+   * This must not be called from the callback for that descriptor. */
+  void removeFd(uint64_t handle);
+
+  /* Schedule func to run on the reactor thread after delay */
+  uint64_t addTimer(std::chrono::milliseconds delay, Callback&& func);
+  void cancelTimer(uint64_t id);
+
+ private:
+  struct FdHandler {
+    int fd;
+    // Guarded by IOReactor::mutex_
+    int events;
+    EventCallback func;
+    std::mutex mutex;
+    bool active{true};
+  };
+
+  void loop();
+  void wakeup();
+
+  int epfd_{-1};
+  int wakefd_{-1};
+  std::mutex mutex_;
+  uint64_t nextHandle_{1};
+  std::unordered_map<uint64_t, std::shared_ptr<FdHandler>> handlers_;
+  TimerWheel timers_;
+};
+}
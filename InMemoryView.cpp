@@ -4,6 +4,7 @@
 #include <algorithm>
 #include "make_unique.h"
 #include "InMemoryView.h"
+#include "ChangeLogRing.h"
 
 namespace watchman {
 
@@ -41,6 +42,39 @@ void InMemoryView::markFileChanged(
 
   // Flag that we have pending trigger info
   mostRecentTick_ = tick;
+
+  if (changeLog) {
+    logChange(file, tick);
+  }
+}
+
+// Appends the path of dir relative to the root, followed by a separator
+static void append_rel_dir_name(std::string& buf, const watchman_dir* dir) {
+  if (!dir->parent) {
+    // This is the root
+    return;
+  }
+  append_rel_dir_name(buf, dir->parent);
+  buf.append(dir->name.data(), dir->name.size());
+  buf.push_back(WATCHMAN_DIR_SEP);
+}
+
+void InMemoryView::logChange(const watchman_file* file, uint32_t tick) {
+  auto name = w_file_get_name(file);
+  uint32_t flags = 0;
+
+  if (file->exists) {
+    flags |= W_CHANGELOG_EXISTS;
+    if (file->ctime.ticks == tick) {
+      flags |= W_CHANGELOG_NEW;
+    }
+  }
+
+  changeLogName_.clear();
+  append_rel_dir_name(changeLogName_, file->parent);
+  changeLogName_.append(name->buf, name->len);
+  changeLog->append(
+      tick, flags, changeLogName_.data(), uint32_t(changeLogName_.size()));
 }
 
 const watchman_dir* InMemoryView::resolveDir(const w_string& dir_name) const {
@@ -272,6 +306,7 @@ void InMemoryView::ageOutFile(
 
   // Revise tick for fresh instance reporting
   last_age_out_tick = std::max(last_age_out_tick, file->otime.ticks);
+  ++ageOutGeneration_;
 
   // If we have a corresponding dir, we want to arrange to remove it, but only
   // after we have unlinked all of the associated file nodes.
@@ -346,35 +381,111 @@ bool InMemoryView::timeGenerator(
     w_query* query,
     struct w_query_ctx* ctx,
     int64_t* num_walked) const {
+  return timeOrderedWalk(query, ctx, true, num_walked);
+}
+
+// Files only ever leave their place in the time ordered list to move to
+// the head, when they change, or to be freed, by ageOut.  When we yield
+// the lock, the files that change get a tick later than any that we have
+// seen, so we can tell that they moved and skip over them; they will be
+// reported relative to the clock of this query.  The rest of the list
+// keeps its relative order, so we resume after the most recently walked
+// file that hasn't moved.  If ageOut ran, our pointers may be dangling
+// and the query has to give up.
+bool InMemoryView::timeOrderedWalk(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    bool bounded,
+    int64_t* num_walked) const {
   struct watchman_file* f;
+  struct watchman_file* next;
   int64_t n = 0;
   bool result = true;
+  bool yield = query->yield_every && ctx->unlocked;
+  auto start_ticks = ctx->lock->root->inner.ticks;
+  // The files walked since we last yielded, and the most recently walked
+  // file that was still in place when we last resumed
+  std::vector<struct watchman_file*> walked;
+  struct watchman_file* anchor = nullptr;
+
+  for (f = latest_file; f; f = next) {
+    next = f->next;
+
+    if (f->otime.ticks > start_ticks) {
+      // Changed while we had yielded the lock
+      continue;
+    }
 
-  // Walk back in time until we hit the boundary
-  for (f = latest_file; f; f = f->next) {
     ++n;
-    if (ctx->since.is_timestamp && f->otime.timestamp < ctx->since.timestamp) {
-      break;
+    if (bounded) {
+      // Walk back in time until we hit the boundary
+      if (ctx->since.is_timestamp &&
+          f->otime.timestamp < ctx->since.timestamp) {
+        break;
+      }
+      if (!ctx->since.is_timestamp &&
+          f->otime.ticks <= ctx->since.clock.ticks) {
+        break;
+      }
     }
-    if (!ctx->since.is_timestamp && f->otime.ticks <= ctx->since.clock.ticks) {
+
+    if (w_query_file_matches_relative_root(ctx, f) &&
+        !w_query_process_file(query, ctx, f)) {
+      result = false;
       break;
     }
 
-    if (!w_query_file_matches_relative_root(ctx, f)) {
+    if (!yield) {
+      continue;
+    }
+    walked.push_back(f);
+    if (walked.size() < query->yield_every) {
       continue;
     }
 
-    if (!w_query_process_file(query, ctx, f)) {
+    auto generation = ageOutGeneration_;
+    if (!w_query_ctx_yield(ctx)) {
       result = false;
-      goto done;
+      break;
     }
+    if (ageOutGeneration_ != generation) {
+      query->errmsg = strdup(
+          "files were aged out while the query was yielding; "
+          "please retry the query");
+      result = false;
+      break;
+    }
+
+    auto it = std::find_if(
+        walked.rbegin(), walked.rend(), [start_ticks](watchman_file* file) {
+          return file->otime.ticks <= start_ticks;
+        });
+    if (it != walked.rend()) {
+      anchor = *it;
+    } else if (anchor && anchor->otime.ticks > start_ticks) {
+      query->errmsg = strdup(
+          "too many files changed while the query was yielding; "
+          "please retry the query");
+      result = false;
+      break;
+    }
+    walked.clear();
+    next = anchor ? anchor->next : latest_file;
   }
 
-done:
   *num_walked = n;
   return result;
 }
 
+bool InMemoryView::changedFilesSince(
+    uint32_t ticks,
+    std::vector<const watchman_file*>& files) const {
+  for (auto f = latest_file; f && f->otime.ticks > ticks; f = f->next) {
+    files.push_back(f);
+  }
+  return true;
+}
+
 bool InMemoryView::suffixGenerator(
     w_query* query,
     struct w_query_ctx* ctx,
@@ -538,23 +649,254 @@ bool InMemoryView::allFilesGenerator(
     w_query* query,
     struct w_query_ctx* ctx,
     int64_t* num_walked) const {
-  struct watchman_file* f;
+  return timeOrderedWalk(query, ctx, false, num_walked);
+}
+
+// The query planner.
+// When a query uses the default generators (since, suffix or all files)
+// and its expression requires that every match has one of a set of
+// suffixes or lives under a particular directory, we may be able to
+// produce the candidates more cheaply by walking that suffix index or
+// subtree, and filtering out the files that the default generators would
+// not have produced.  A side effect is that each file is produced at most
+// once, whereas the default generators may produce it several times.
+
+static inline bool uses_time_generator(const struct w_query_ctx* ctx) {
+  return ctx->since.is_timestamp || !ctx->since.clock.is_fresh_instance;
+}
+
+// Matches the boundary condition applied by the timeGenerator
+static inline bool file_in_time_range(
+    const struct w_query_ctx* ctx,
+    const watchman_file* f) {
+  if (ctx->since.is_timestamp) {
+    return f->otime.timestamp >= ctx->since.timestamp;
+  }
+  return f->otime.ticks > ctx->since.clock.ticks;
+}
+
+// The suffix index is keyed by the lowercased text following the last
+// dot in the file name, so we can only look up suffixes of that form
+static bool is_indexed_suffix(w_string_t* suffix) {
+  return suffix->len > 0 && suffix->len < 127 &&
+      memchr(suffix->buf, '.', suffix->len) == nullptr;
+}
+
+bool InMemoryView::fileMatchesDefaultGenerators(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    const watchman_file* file) const {
+  bool timeGen = uses_time_generator(ctx);
+
+  if (!timeGen && !query->suffixes) {
+    // allFilesGenerator
+    return true;
+  }
+
+  if (timeGen && file_in_time_range(ctx, file)) {
+    return true;
+  }
+
+  for (uint32_t i = 0; i < query->nsuffixes; i++) {
+    if (is_indexed_suffix(query->suffixes[i]) &&
+        w_string_suffix_match(w_file_get_name(file), query->suffixes[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int64_t InMemoryView::countDefaultCandidates(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    int64_t cap) const {
+  bool timeGen = uses_time_generator(ctx);
   int64_t n = 0;
-  bool result = true;
 
-  for (f = latest_file; f; f = f->next) {
-    ++n;
-    if (!w_query_file_matches_relative_root(ctx, f)) {
+  if (timeGen || !query->suffixes) {
+    for (auto f = latest_file; f && n < cap; f = f->next) {
+      if (timeGen && !file_in_time_range(ctx, f)) {
+        break;
+      }
+      ++n;
+    }
+  }
+
+  if (query->suffixes && n < cap) {
+    std::vector<w_string> suffixes(
+        query->suffixes, query->suffixes + query->nsuffixes);
+    n += countSuffixFiles(suffixes, cap - n);
+  }
+
+  return n;
+}
+
+int64_t InMemoryView::countSuffixFiles(
+    const std::vector<w_string>& suffixes,
+    int64_t cap) const {
+  int64_t n = 0;
+
+  for (auto& suffix : suffixes) {
+    auto it = this->suffixes.find(suffix);
+    if (it == this->suffixes.end()) {
       continue;
     }
+    for (auto f = it->second->head; f && n < cap; f = f->suffix_next) {
+      ++n;
+    }
+  }
 
-    if (!w_query_process_file(query, ctx, f)) {
-      result = false;
-      goto done;
+  return n;
+}
+
+int64_t InMemoryView::countDirFiles(const watchman_dir* dir, int64_t cap)
+    const {
+  int64_t n = dir->files.size();
+
+  for (auto& it : dir->dirs) {
+    if (n >= cap) {
+      break;
     }
+    n += countDirFiles(it.second.get(), cap - n);
+  }
+
+  return n;
+}
+
+bool InMemoryView::plannedDirGenerator(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    const watchman_dir* dir,
+    int64_t* num_walked) const {
+  for (auto& it : dir->files) {
+    auto file = it.second.get();
+    ++*num_walked;
+
+    if (!fileMatchesDefaultGenerators(query, ctx, file)) {
+      continue;
+    }
+
+    if (!w_query_process_file(query, ctx, file)) {
+      return false;
+    }
+  }
+
+  for (auto& it : dir->dirs) {
+    if (!plannedDirGenerator(query, ctx, it.second.get(), num_walked)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool InMemoryView::plannedGenerator(
+    w_query* query,
+    struct w_query_ctx* ctx,
+    int64_t* num_walked) const {
+  auto& plan = ctx->plan;
+  int64_t n = 0;
+  bool result = true;
+
+  *num_walked = 0;
+
+  if (!query->expr || query->npaths || query->glob_tree) {
+    // The path and glob generators are already narrowly targeted
+    return true;
+  }
+
+  bool haveSuffixes = query->expr->requiredSuffixes(plan.suffixes);
+  for (auto& suffix : plan.suffixes) {
+    if (!is_indexed_suffix(suffix)) {
+      haveSuffixes = false;
+    }
+  }
+  if (haveSuffixes) {
+    // Each file is in only one suffix list; don't walk any list twice
+    std::vector<w_string> unique;
+    for (auto& suffix : plan.suffixes) {
+      if (std::find(unique.begin(), unique.end(), suffix) == unique.end()) {
+        unique.push_back(suffix);
+      }
+    }
+    plan.suffixes = std::move(unique);
+  }
+
+  bool haveDir = query->expr->requiredDirName(plan.dirname) &&
+      plan.dirname.data()[plan.dirname.size() - 1] != WATCHMAN_DIR_SEP;
+  const watchman_dir* dir = nullptr;
+  if (haveDir) {
+    dir = resolveDir(w_string::pathCat(
+        {query->relative_root ? w_string(query->relative_root) : root_path,
+         plan.dirname}));
+  }
+
+  if (!haveSuffixes && !haveDir) {
+    return true;
+  }
+
+  // Count the candidates for each approach with increasing caps, so that
+  // the cost of planning is proportional to the cheapest of them rather
+  // than to the most expensive
+  for (int64_t cap = 1024;; cap *= 4) {
+    plan.default_estimate = countDefaultCandidates(query, ctx, cap);
+    int64_t best = plan.default_estimate;
+    plan.driver = W_QUERY_DRIVE_DEFAULT;
+
+    if (haveSuffixes) {
+      plan.suffix_estimate = countSuffixFiles(plan.suffixes, cap);
+      if (plan.suffix_estimate < best) {
+        best = plan.suffix_estimate;
+        plan.driver = W_QUERY_DRIVE_SUFFIX;
+      }
+    }
+    if (haveDir) {
+      // If the dir doesn't exist, nothing can match
+      plan.subtree_estimate = dir ? countDirFiles(dir, cap) : 0;
+      if (plan.subtree_estimate < best) {
+        best = plan.subtree_estimate;
+        plan.driver = W_QUERY_DRIVE_SUBTREE;
+      }
+    }
+
+    if (best < cap) {
+      break;
+    }
+  }
+
+  switch (plan.driver) {
+    case W_QUERY_DRIVE_DEFAULT:
+      return true;
+
+    case W_QUERY_DRIVE_SUFFIX:
+      for (auto& suffix : plan.suffixes) {
+        auto it = suffixes.find(suffix);
+        if (it == suffixes.end()) {
+          continue;
+        }
+        for (auto f = it->second->head; f; f = f->suffix_next) {
+          ++n;
+          if (!w_query_file_matches_relative_root(ctx, f) ||
+              !fileMatchesDefaultGenerators(query, ctx, f)) {
+            continue;
+          }
+          if (!w_query_process_file(query, ctx, f)) {
+            result = false;
+            goto done;
+          }
+        }
+      }
+      break;
+
+    case W_QUERY_DRIVE_SUBTREE:
+      if (dir) {
+        result = plannedDirGenerator(query, ctx, dir, &n);
+      }
+      break;
   }
 
 done:
+  plan.planned = true;
   *num_walked = n;
   return result;
 }
@@ -570,4 +912,8 @@ uint32_t InMemoryView::getLastAgeOutTickValue() const {
 time_t InMemoryView::getLastAgeOutTimeStamp() const {
   return last_age_out_timestamp;
 }
+
+uint32_t InMemoryView::getAgeOutGeneration() const {
+  return ageOutGeneration_;
+}
 }
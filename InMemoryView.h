@@ -16,6 +16,7 @@ struct InMemoryView : public QueryableView {
   uint32_t getMostRecentTickValue() const override;
   uint32_t getLastAgeOutTickValue() const override;
   time_t getLastAgeOutTimeStamp() const override;
+  uint32_t getAgeOutGeneration() const override;
 
   explicit InMemoryView(const w_string& root_path);
 
@@ -77,11 +78,29 @@ struct InMemoryView : public QueryableView {
       struct w_query_ctx* ctx,
       int64_t* num_walked) const override;
 
+  bool plannedGenerator(
+      w_query* query,
+      struct w_query_ctx* ctx,
+      int64_t* num_walked) const override;
+
+  bool changedFilesSince(
+      uint32_t ticks,
+      std::vector<const watchman_file*>& files) const override;
+
  private:
   void ageOutFile(
       std::unordered_set<w_string>& dirs_to_erase,
       watchman_file* file);
 
+  /** Walks the files from the most recently changed, stopping at the
+   * since boundary of the query if bounded is set.  If the query asks
+   * to yield, the root lock is periodically released along the way. */
+  bool timeOrderedWalk(
+      w_query* query,
+      struct w_query_ctx* ctx,
+      bool bounded,
+      int64_t* num_walked) const;
+
   /** Recursively walks files under a specified dir */
   bool dirGenerator(
       w_query* query,
@@ -102,10 +121,35 @@ struct InMemoryView : public QueryableView {
       const char* dir_name,
       uint32_t dir_name_len) const;
   void insertAtHeadOfFileList(struct watchman_file* file);
+  /** Appends the change to file to the change log ring */
+  void logChange(const watchman_file* file, uint32_t tick);
+
+  /** Query planner helpers.  The count functions stop counting once
+   * they reach cap. */
+  int64_t countDefaultCandidates(
+      w_query* query,
+      struct w_query_ctx* ctx,
+      int64_t cap) const;
+  int64_t countSuffixFiles(const std::vector<w_string>& suffixes, int64_t cap)
+      const;
+  int64_t countDirFiles(const watchman_dir* dir, int64_t cap) const;
+  /** Returns true if the default generators would produce file */
+  bool fileMatchesDefaultGenerators(
+      w_query* query,
+      struct w_query_ctx* ctx,
+      const watchman_file* file) const;
+  bool plannedDirGenerator(
+      w_query* query,
+      struct w_query_ctx* ctx,
+      const watchman_dir* dir,
+      int64_t* num_walked) const;
 
   /* the most recently changed file */
   struct watchman_file* latest_file{0};
 
+  /* Reused to build the names for the change log ring */
+  std::string changeLogName_;
+
   /* Holds the list head for files of a given suffix */
   struct file_list_head {
     watchman_file* head{nullptr};
@@ -121,6 +165,9 @@ struct InMemoryView : public QueryableView {
   std::atomic<uint32_t> mostRecentTick_{0};
 
   uint32_t last_age_out_tick{0};
+  // Bumped whenever ageOut frees any nodes, so that a walk that released
+  // the lock can tell whether the nodes it holds are still valid
+  uint32_t ageOutGeneration_{0};
   time_t last_age_out_timestamp{0};
 };
 }
@@ -0,0 +1,232 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "MaterializedQuery.h"
+#include <chrono>
+#include <vector>
+
+namespace watchman {
+
+MaterializedQuery::MaterializedQuery(
+    const w_string& name,
+    std::shared_ptr<w_query> query,
+    const struct w_query_field_list& fieldList)
+    : name_(name), query_(std::move(query)), fieldList_(fieldList) {}
+
+// The suffix generator restricts the candidates to the files with one of
+// the suffixes; everything else about the query is in the expression
+bool MaterializedQuery::matchesGenerators(const watchman_file* file) const {
+  if (query_->nsuffixes == 0) {
+    return true;
+  }
+
+  auto suffix = w_string(w_file_get_name(file)).suffix();
+  if (!suffix) {
+    return false;
+  }
+  for (size_t i = 0; i < query_->nsuffixes; ++i) {
+    if (w_string_equal(suffix, query_->suffixes[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Moves the file to the front of the members, as the most recent change
+void MaterializedQuery::addMember(
+    const w_string& name,
+    const watchman_file* file) {
+  auto removed = removed_.find(name);
+  if (removed != removed_.end()) {
+    removedList_.erase(removed->second);
+    removed_.erase(removed);
+  }
+
+  auto it = members_.find(name);
+  if (it != members_.end()) {
+    memberList_.splice(memberList_.begin(), memberList_, it->second);
+    it->second->file = file;
+    it->second->ticks = file->otime.ticks;
+    return;
+  }
+  memberList_.push_front(Member{name, file, file->otime.ticks});
+  members_[name] = memberList_.begin();
+}
+
+void MaterializedQuery::removeMember(const w_string& name, uint32_t ticks) {
+  auto it = members_.find(name);
+  if (it == members_.end()) {
+    return;
+  }
+  memberList_.erase(it->second);
+  members_.erase(it);
+
+  removedList_.push_front(Removal{name, ticks});
+  removed_[name] = removedList_.begin();
+}
+
+void MaterializedQuery::update(struct read_locked_watchman_root* lock) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  updateLocked(lock);
+}
+
+void MaterializedQuery::updateLocked(struct read_locked_watchman_root* lock) {
+  auto root = lock->root;
+  auto view = root->inner.view.get();
+
+  if (rootNumber_ == root->inner.number && ticks_ == root->inner.ticks) {
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  if (rootNumber_ != root->inner.number) {
+    // The view was rebuilt (or this is our first time through), so the
+    // files that we're holding are gone; start over from everything
+    memberList_.clear();
+    members_.clear();
+    removedList_.clear();
+    removed_.clear();
+    rootNumber_ = root->inner.number;
+    ticks_ = 0;
+    validSince_ = root->inner.ticks;
+    ++numRebuilds_;
+  }
+
+  std::vector<const watchman_file*> files;
+  if (!view->changedFilesSince(ticks_, files)) {
+    w_log(
+        W_LOG_ERR,
+        "materialized query %s: the view for %s can't enumerate its changes\n",
+        name_.c_str(),
+        root->root_path.c_str());
+  }
+
+  w_query_ctx ctx(query_.get(), lock);
+  if (query_->program) {
+    query_->program->prepare(&ctx);
+  }
+
+  // The files come most recent first; apply them oldest first, so that
+  // each one that we touch ends up ahead of those that changed before it
+  for (auto fileIt = files.rbegin(); fileIt != files.rend(); ++fileIt) {
+    auto file = *fileIt;
+    if (!w_query_file_matches_relative_root(&ctx, file)) {
+      continue;
+    }
+
+    ctx.file = file;
+    ctx.wholename = nullptr;
+    ++numEvaluated_;
+
+    bool matched = file->exists && matchesGenerators(file) &&
+        (!query_->program || query_->program->evaluate(&ctx, file));
+    // The wholename belongs to the ctx, so take a copy to keep
+    auto wholename = w_query_ctx_get_wholename(&ctx);
+    w_string name(wholename->buf, wholename->len, wholename->type);
+
+    if (matched) {
+      addMember(name, file);
+    } else {
+      removeMember(name, file->otime.ticks);
+    }
+  }
+
+  // The view has forgotten about the deleted files older than this, so
+  // we can stop remembering their removal too
+  auto ageOutTick = view->getLastAgeOutTickValue();
+  if (ageOutTick > validSince_) {
+    while (!removedList_.empty() && removedList_.back().ticks <= ageOutTick) {
+      removed_.erase(removedList_.back().name);
+      removedList_.pop_back();
+    }
+    validSince_ = ageOutTick;
+  }
+
+  ticks_ = root->inner.ticks;
+  ++numUpdates_;
+  updateUsec_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+}
+
+void MaterializedQuery::fetch(
+    struct read_locked_watchman_root* lock,
+    const struct w_clockspec* since,
+    json_t* response) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  struct w_query_since sinceTicks;
+  std::deque<watchman_rule_match> results;
+  char clockbuf[128];
+
+  updateLocked(lock);
+
+  w_clockspec_eval_readonly(lock, since, &sinceTicks);
+  bool fresh = sinceTicks.is_timestamp ||
+      sinceTicks.clock.is_fresh_instance ||
+      sinceTicks.clock.ticks < validSince_;
+
+  // The members are most recent first, so a delta only visits the
+  // members that changed after since, plus one
+  for (const auto& member : memberList_) {
+    if (!fresh && member.ticks <= sinceTicks.clock.ticks) {
+      break;
+    }
+    bool isNew = fresh || member.file->ctime.ticks > sinceTicks.clock.ticks;
+    results.emplace_back(rootNumber_, member.name, isNew, member.file);
+  }
+
+  if (clock_id_string(rootNumber_, ticks_, clockbuf, sizeof(clockbuf))) {
+    set_unicode_prop(response, "clock", clockbuf);
+  }
+  set_prop(response, "is_fresh_instance", json_boolean(fresh));
+  set_prop(
+      response,
+      "files",
+      w_query_results_to_json(&fieldList_, results.size(), results));
+
+  if (!fresh) {
+    auto removed = json_array();
+    for (const auto& removal : removedList_) {
+      if (removal.ticks <= sinceTicks.clock.ticks) {
+        break;
+      }
+      json_array_append_new(removed, w_string_to_json(removal.name));
+    }
+    set_prop(response, "removed", removed);
+  }
+}
+
+json_t* MaterializedQuery::stats() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return json_pack(
+      "{s:o, s:O, s:i, s:i, s:i, s:i, s:i, s:i}",
+      "name",
+      w_string_to_json(name_),
+      "query",
+      query_->query_spec,
+      "num_files",
+      int64_t(members_.size()),
+      "num_removed",
+      int64_t(removed_.size()),
+      "num_updates",
+      int64_t(numUpdates_),
+      "num_rebuilds",
+      int64_t(numRebuilds_),
+      "num_evaluated",
+      int64_t(numEvaluated_),
+      "update_usec",
+      int64_t(updateUsec_));
+}
+}
+
+void w_root_update_materialized(struct read_locked_watchman_root* lock) {
+  auto map = lock->root->materialized.rlock();
+  for (const auto& it : *map) {
+    it.second->update(lock);
+  }
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,99 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "watchman_query.h"
+#include "watchman_string.h"
+
+namespace watchman {
+
+/** A registered query whose result set is maintained incrementally.
+ * Rather than walking the tree each time the results are wanted, the
+ * expression is re-evaluated only for the files that changed since the
+ * set was last brought up to date.  This happens at each settle point
+ * and again when the set is fetched, so a fetch costs time proportional
+ * to the size of the answer.
+ *
+ * Only files that currently exist are members of the set.  Files that
+ * leave it are remembered, so that a fetch relative to a clock can
+ * report them, until the view ages out the deleted nodes. */
+class MaterializedQuery {
+ public:
+  MaterializedQuery(
+      const w_string& name,
+      std::shared_ptr<w_query> query,
+      const struct w_query_field_list& fieldList);
+
+  const w_string& name() const {
+    return name_;
+  }
+  w_query* query() const {
+    return query_.get();
+  }
+
+  /* Bring the result set up to date with the view.
+   * Must be called with the root locked. */
+  void update(struct read_locked_watchman_root* lock);
+
+  /* Brings the set up to date and populates response with the members
+   * that changed after since, along with the names of those that left
+   * the set.  If since is null, or is older than the changes that we
+   * can account for, all of the members are returned instead and
+   * is_fresh_instance is set.
+   * Must be called with the root locked. */
+  void fetch(
+      struct read_locked_watchman_root* lock,
+      const struct w_clockspec* since,
+      json_t* response);
+
+  /* Returns the size of the set and what it has cost to maintain */
+  json_t* stats();
+
+ private:
+  struct Member {
+    w_string name;
+    const watchman_file* file;
+    // The tick at which the file entered the set or last changed
+    uint32_t ticks;
+  };
+  struct Removal {
+    w_string name;
+    // The tick at which the file left the set
+    uint32_t ticks;
+  };
+
+  void updateLocked(struct read_locked_watchman_root* lock);
+  void addMember(const w_string& name, const watchman_file* file);
+  void removeMember(const w_string& name, uint32_t ticks);
+  bool matchesGenerators(const watchman_file* file) const;
+
+  w_string name_;
+  std::shared_ptr<w_query> query_;
+  struct w_query_field_list fieldList_;
+
+  std::mutex mutex_;
+  // The view that the state below was built from, and the tick
+  // up to which it reflects the changes in that view
+  uint32_t rootNumber_{0};
+  uint32_t ticks_{0};
+  // We can't produce a delta relative to a clock older than this
+  uint32_t validSince_{0};
+  // The members and the files that have left the set, each ordered by
+  // the tick at which they last changed, most recent first, so that a
+  // fetch relative to a clock stops at the first entry that is older.
+  // The maps index them by name.
+  std::list<Member> memberList_;
+  std::unordered_map<w_string, std::list<Member>::iterator> members_;
+  std::list<Removal> removedList_;
+  std::unordered_map<w_string, std::list<Removal>::iterator> removed_;
+
+  // Maintenance cost
+  uint64_t numUpdates_{0};
+  uint64_t numRebuilds_{0};
+  uint64_t numEvaluated_{0};
+  uint64_t updateUsec_{0};
+};
+}
@@ -37,6 +37,17 @@ bool QueryableView::allFilesGenerator(w_query*, struct w_query_ctx*, int64_t*)
   return false;
 }
 
+bool QueryableView::plannedGenerator(w_query*, struct w_query_ctx*, int64_t*)
+    const {
+  return true;
+}
+
+bool QueryableView::changedFilesSince(
+    uint32_t,
+    std::vector<const watchman_file*>&) const {
+  return false;
+}
+
 uint32_t QueryableView::getMostRecentTickValue() const {
   return 0;
 }
@@ -49,5 +60,9 @@ time_t QueryableView::getLastAgeOutTimeStamp() const {
   return 0;
 }
 
+uint32_t QueryableView::getAgeOutGeneration() const {
+  return 0;
+}
+
 void QueryableView::ageOut(w_perf_t&, std::chrono::seconds) {}
 }
@@ -5,6 +5,7 @@
 #include "watchman_perf.h"
 #include "watchman_query.h"
 #include "watchman_string.h"
+#include <vector>
 
 struct watchman_file;
 struct watchman_dir;
@@ -12,9 +13,13 @@ struct Watcher;
 struct watchman_glob_tree;
 
 namespace watchman {
+class ChangeLogRing;
+
 class QueryableView {
  public:
   Watcher* watcher;
+  // If set, the changes to the files in the view are appended to this
+  ChangeLogRing* changeLog{nullptr};
   virtual ~QueryableView();
 
   /** Perform a time-based (since) query and emit results to the supplied
@@ -45,9 +50,29 @@ class QueryableView {
       w_query* query,
       struct w_query_ctx* ctx,
       int64_t* num_walked) const;
+
+  /** Consults the view's indexes to see whether the files for a query
+   * that uses the default generators can be produced more cheaply by
+   * walking an index that is implied by the query expression.
+   * If so, walks it and sets ctx->plan.planned; otherwise, the caller
+   * must run the default generators itself. */
+  virtual bool plannedGenerator(
+      w_query* query,
+      struct w_query_ctx* ctx,
+      int64_t* num_walked) const;
+
+  /** Appends the files that changed after ticks to files, most recent
+   * first.  Returns false if the view can't enumerate them this way,
+   * in which case the caller must use timeGenerator instead. */
+  virtual bool changedFilesSince(
+      uint32_t ticks,
+      std::vector<const watchman_file*>& files) const;
   virtual uint32_t getMostRecentTickValue() const;
   virtual uint32_t getLastAgeOutTickValue() const;
   virtual time_t getLastAgeOutTimeStamp() const;
+  /** Changes whenever ageOut frees any files, after which pointers to
+   * the files that were obtained before it may be dangling */
+  virtual uint32_t getAgeOutGeneration() const;
   virtual void ageOut(w_perf_t& sample, std::chrono::seconds minAge);
 };
 }
@@ -0,0 +1,121 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "ThreadPool.h"
+
+namespace watchman {
+
+ThreadPool::~ThreadPool() {
+  stop();
+}
+
+void ThreadPool::start(size_t numThreads, const char* name) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!threads_.empty()) {
+    throw std::runtime_error("ThreadPool already started");
+  }
+  name_ = name;
+  stopping_ = false;
+
+  for (size_t i = 0; i < numThreads; ++i) {
+    threads_.emplace_back([this, i]() { runWorker(i); });
+  }
+}
+
+void ThreadPool::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+
+  for (auto& th : threads_) {
+    if (th.joinable()) {
+      th.join();
+    }
+  }
+  threads_.clear();
+}
+
+void ThreadPool::run(std::function<void()>&& func) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stopping_) {
+      throw std::runtime_error("ThreadPool is stopping");
+    }
+    queue_.emplace_back(std::move(func));
+  }
+  cond_.notify_one();
+}
+
+void ThreadPool::runWorker(size_t workerNo) {
+  w_set_thread_name("%s %zu", name_.c_str(), workerNo);
+
+  while (true) {
+    std::function<void()> func;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        // stopping and there is nothing left to do
+        return;
+      }
+      func = std::move(queue_.front());
+      queue_.pop_front();
+    }
+
+    try {
+      func();
+    } catch (const std::exception& exc) {
+      w_log(
+          W_LOG_ERR,
+          "%s: unhandled exception in worker: %s\n",
+          name_.c_str(),
+          exc.what());
+    }
+  }
+}
+
+SerialExecutor::SerialExecutor(ThreadPool& pool)
+    : pool_(pool), state_(std::make_shared<State>()) {}
+
+void SerialExecutor::run(std::function<void()>&& func) {
+  {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->queue.emplace_back(std::move(func));
+    if (state_->running) {
+      // The in-flight drain will pick this up
+      return;
+    }
+    state_->running = true;
+  }
+
+  auto state = state_;
+  pool_.run([state] { drain(state); });
+}
+
+void SerialExecutor::drain(std::shared_ptr<State> state) {
+  while (true) {
+    std::function<void()> func;
+    {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      if (state->queue.empty()) {
+        state->running = false;
+        return;
+      }
+      func = std::move(state->queue.front());
+      state->queue.pop_front();
+    }
+
+    try {
+      func();
+    } catch (const std::exception& exc) {
+      w_log(
+          W_LOG_ERR,
+          "SerialExecutor: unhandled exception: %s\n",
+          exc.what());
+    }
+  }
+}
+}
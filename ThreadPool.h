@@ -0,0 +1,73 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace watchman {
+
+/** A fixed size pool of worker threads that run the functions
+ * passed to run() in FIFO order. */
+class ThreadPool {
+ public:
+  ThreadPool() = default;
+  ThreadPool(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  /* Start numThreads workers.  name is used as a prefix
+   * for the worker thread names. */
+  void start(size_t numThreads, const char* name);
+
+  /* Ask the workers to terminate once the queue has drained,
+   * and wait for them to do so. */
+  void stop();
+
+  /* Queue func to be run on one of the workers */
+  void run(std::function<void()>&& func);
+
+  size_t numThreads() const {
+    return threads_.size();
+  }
+
+ private:
+  void runWorker(size_t workerNo);
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::function<void()>> queue_;
+  bool stopping_{false};
+  std::string name_;
+};
+
+/** Runs the functions passed to run() on a ThreadPool, one at a
+ * time and in the order that they were queued.  This allows work
+ * that must be serialized (for example, everything pertaining to
+ * a given root) to share a pool with other such work. */
+class SerialExecutor {
+ public:
+  explicit SerialExecutor(ThreadPool& pool);
+
+  void run(std::function<void()>&& func);
+
+ private:
+  struct State {
+    std::mutex mutex;
+    std::deque<std::function<void()>> queue;
+    bool running{false};
+  };
+
+  static void drain(std::shared_ptr<State> state);
+
+  ThreadPool& pool_;
+  // Shared with any drain operation that is in flight so that the
+  // executor may be destroyed before its queue has been processed
+  std::shared_ptr<State> state_;
+};
+}
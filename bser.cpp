@@ -2,6 +2,12 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 /*
  * This defines a binary serialization of the JSON data objects in this
@@ -29,6 +35,7 @@
 #define BSER_NULL      0x0a
 #define BSER_TEMPLATE  0x0b
 #define BSER_SKIP      0x0c
+#define BSER_PREFIXSTRING 0x0d
 
 static const char bser_true = BSER_TRUE;
 static const char bser_false = BSER_FALSE;
@@ -133,50 +140,54 @@ bool bunser_int(const char *buf, json_int_t avail,
   }
 }
 
-static int bser_int(const bser_ctx_t *ctx, json_int_t val, void *data)
+// Encodes val into buf, which must have room for BSER_MAX_INT_SIZE bytes,
+// and returns the number of bytes used
+#define BSER_MAX_INT_SIZE 9
+static int bser_encode_int(json_int_t val, char *buf)
 {
   int8_t i8;
   int16_t i16;
   int32_t i32;
   int64_t i64;
-  char sz;
   int size = INT_SIZE(val);
-  char *iptr;
-
-  if (!is_bser_version_supported(ctx)) {
-    return -1;
-  }
 
   switch (size) {
     case 1:
-      sz = BSER_INT8;
+      buf[0] = BSER_INT8;
       i8 = (int8_t)val;
-      iptr = (char*)&i8;
+      memcpy(buf + 1, &i8, size);
       break;
     case 2:
-      sz = BSER_INT16;
+      buf[0] = BSER_INT16;
       i16 = (int16_t)val;
-      iptr = (char*)&i16;
+      memcpy(buf + 1, &i16, size);
       break;
     case 4:
-      sz = BSER_INT32;
+      buf[0] = BSER_INT32;
       i32 = (int32_t)val;
-      iptr = (char*)&i32;
+      memcpy(buf + 1, &i32, size);
       break;
-    case 8:
-      sz = BSER_INT64;
+    default:
+      buf[0] = BSER_INT64;
       i64 = (int64_t)val;
-      iptr = (char*)&i64;
+      memcpy(buf + 1, &i64, size);
       break;
-    default:
-      return -1;
   }
 
-  if (ctx->dump(&sz, sizeof(sz), data)) {
+  return size + 1;
+}
+
+static int bser_int(const bser_ctx_t *ctx, json_int_t val, void *data)
+{
+  char buf[BSER_MAX_INT_SIZE];
+  int size;
+
+  if (!is_bser_version_supported(ctx)) {
     return -1;
   }
 
-  return ctx->dump(iptr, size, data);
+  size = bser_encode_int(val, buf);
+  return ctx->dump(buf, size, data);
 }
 
 static int bser_bytestring(const bser_ctx_t *ctx, const char *str, void *data)
@@ -363,61 +374,267 @@ int w_bser_dump(const bser_ctx_t* ctx, json_t *json, void *data)
   }
 }
 
-static int measure(const char *buffer, size_t size, void *ptr)
+void w_bser_append_int(std::string& buf, json_int_t val) {
+  char ibuf[BSER_MAX_INT_SIZE];
+  buf.append(ibuf, bser_encode_int(val, ibuf));
+}
+
+void w_bser_append_real(std::string& buf, double val) {
+  buf.push_back(BSER_REAL);
+  buf.append((const char*)&val, sizeof(val));
+}
+
+void w_bser_append_bool(std::string& buf, bool val) {
+  buf.push_back(val ? BSER_TRUE : BSER_FALSE);
+}
+
+void w_bser_append_null(std::string& buf) {
+  buf.push_back(BSER_NULL);
+}
+
+void w_bser_append_skip(std::string& buf) {
+  buf.push_back(BSER_SKIP);
+}
+
+void w_bser_append_bytestring(std::string& buf, const char* str, size_t len) {
+  buf.push_back(BSER_BYTESTRING);
+  w_bser_append_int(buf, len);
+  buf.append(str, len);
+}
+
+// A prefix-compressed string is encoded as the number of leading bytes
+// that it shares with the previous one in the PDU, followed by the
+// length and the bytes of the rest of it.  Paths that are generated in
+// directory order share most of their bytes with their predecessor.
+void w_bser_append_prefix_string(
+    std::string& buf,
+    std::string& prev,
+    const char* str,
+    size_t len) {
+  size_t common = 0;
+  size_t limit = std::min(len, prev.size());
+
+  while (common < limit && prev[common] == str[common]) {
+    ++common;
+  }
+
+  buf.push_back(BSER_PREFIXSTRING);
+  w_bser_append_int(buf, common);
+  w_bser_append_int(buf, len - common);
+  buf.append(str + common, len - common);
+
+  prev.resize(common);
+  prev.append(str + common, len - common);
+}
+
+void w_bser_append_array_header(std::string& buf, size_t num_items) {
+  buf.push_back(BSER_ARRAY);
+  w_bser_append_int(buf, num_items);
+}
+
+void w_bser_append_object_header(std::string& buf, size_t num_props) {
+  buf.push_back(BSER_OBJECT);
+  w_bser_append_int(buf, num_props);
+}
+
+void w_bser_append_template_header(
+    std::string& buf,
+    const char* const* keys,
+    size_t num_keys,
+    size_t num_items) {
+  buf.push_back(BSER_TEMPLATE);
+  w_bser_append_array_header(buf, num_keys);
+  for (size_t i = 0; i < num_keys; ++i) {
+    w_bser_append_bytestring(buf, keys[i], strlen(keys[i]));
+  }
+  w_bser_append_int(buf, num_items);
+}
+
+static int append_to_string(const char *buffer, size_t size, void *ptr)
 {
-  auto tot = (json_int_t*)ptr;
-  *tot += size;
-  unused_parameter(buffer);
+  ((std::string*)ptr)->append(buffer, size);
   return 0;
 }
 
+// Room for the magic, the capabilities and the length
+#define BSER_MAX_HEADER_SIZE (2 + (2 * BSER_MAX_INT_SIZE))
+
+// The most that a zlib stream can expand by
+#define BSER_MAX_DEFLATE_RATIO 1032
+
+// Fills in the header of a PDU whose body follows the space that was set
+// aside for the header
+static void fill_in_header(
+    uint32_t bser_version,
+    uint32_t bser_capabilities,
+    w_encoded_pdu* pdu) {
+  char header[BSER_MAX_HEADER_SIZE];
+  int header_size;
+
+  memcpy(header, bser_version == 2 ? BSER_V2_MAGIC : BSER_MAGIC, 2);
+  header_size = 2;
+  if (bser_version == 2) {
+    header_size += bser_encode_int(bser_capabilities, header + header_size);
+  }
+  header_size += bser_encode_int(
+      pdu->data.size() - BSER_MAX_HEADER_SIZE, header + header_size);
+
+  pdu->start = BSER_MAX_HEADER_SIZE - header_size;
+  memcpy(&pdu->data[pdu->start], header, header_size);
+}
+
+bool w_bser_encode_pdu(
+    uint32_t bser_version,
+    uint32_t bser_capabilities,
+    json_t* json,
+    const char* key,
+    const w_pdu_value_encoder& encode_value,
+    w_encoded_pdu* pdu) {
+  bser_ctx_t ctx{bser_version, bser_capabilities, append_to_string};
+  auto& buf = pdu->data;
+
+  if (!is_bser_version_supported(&ctx)) {
+    return false;
+  }
+
+  // The header goes in front of the body, but we don't know how long the
+  // body is until we've encoded it, so leave enough space for the largest
+  // header, and fill in the tail end of that space afterwards
+  buf.assign(BSER_MAX_HEADER_SIZE, '\0');
+
+  if (key) {
+    void *iter;
+
+    w_bser_append_object_header(buf, json_object_size(json) + 1);
+    for (iter = json_object_iter(json); iter;
+         iter = json_object_iter_next(json, iter)) {
+      if (bser_bytestring(&ctx, json_object_iter_key(iter), &buf) ||
+          w_bser_dump(&ctx, json_object_iter_value(iter), &buf)) {
+        return false;
+      }
+    }
+    w_bser_append_bytestring(buf, key, strlen(key));
+    if (!encode_value(buf)) {
+      return false;
+    }
+  } else if (w_bser_dump(&ctx, json, &buf)) {
+    return false;
+  }
+
+  fill_in_header(bser_version, bser_capabilities, pdu);
+  return true;
+}
+
 int w_bser_write_pdu(const uint32_t bser_version,
     const uint32_t bser_capabilities, json_dump_callback_t dump, json_t *json,
     void *data)
 {
-  json_int_t m_size = 0;
-  bser_ctx_t ctx{bser_version, bser_capabilities, measure};
+  w_encoded_pdu pdu;
 
-  if (!is_bser_version_supported(&ctx)) {
+  if (!w_bser_encode_pdu(bser_version, bser_capabilities, json, nullptr,
+                         nullptr, &pdu)) {
     return -1;
   }
 
-  if (w_bser_dump(&ctx, json, &m_size)) {
-    return -1;
-  }
+  return dump(pdu.data.data() + pdu.start, pdu.data.size() - pdu.start, data);
+}
 
-  // To actually write the contents
-  ctx.dump = dump;
+bool w_bser_deflate_pdu(const w_encoded_pdu* pdu, w_encoded_pdu* out) {
+#ifdef HAVE_ZLIB
+  const char* buf = pdu->data.data() + pdu->start;
+  const char* end = pdu->data.data() + pdu->data.size();
+  json_int_t needed, caps, len;
+  uLongf zlen;
 
-  if (bser_version == 2) {
-    if (dump(BSER_V2_MAGIC, 2, data)) {
-      return -1;
-    }
-  } else {
-    if (dump(BSER_MAGIC, 2, data)) {
-      return -1;
-    }
+  if (pdu->pdu_type != is_bser_v2 || end - buf < 2) {
+    return false;
   }
-
-  if (bser_version == 2) {
-    if (bser_int(&ctx, bser_capabilities, data)) {
-      return -1;
-    }
+  buf += 2;
+  if (!bunser_int(buf, end - buf, &needed, &caps)) {
+    return false;
+  }
+  buf += needed;
+  if (!bunser_int(buf, end - buf, &needed, &len)) {
+    return false;
+  }
+  buf += needed;
+  if (caps & BSER_CAP_DEFLATE || len != end - buf) {
+    return false;
   }
 
-  if (bser_int(&ctx, m_size, data)) {
-    return -1;
+  // The paths in query results are very repetitive, so the fastest
+  // setting gets most of the benefit
+  auto& data = out->data;
+  data.assign(BSER_MAX_HEADER_SIZE, '\0');
+  w_bser_append_int(data, len);
+  auto zstart = data.size();
+  zlen = compressBound(len);
+  data.resize(zstart + zlen);
+  if (compress2((Bytef*)&data[zstart], &zlen, (const Bytef*)buf, len,
+                Z_BEST_SPEED) != Z_OK) {
+    return false;
+  }
+  data.resize(zstart + zlen);
+  if (data.size() - BSER_MAX_HEADER_SIZE >= (size_t)len) {
+    return false;
   }
 
-  if (w_bser_dump(&ctx, json, data)) {
-    return -1;
+  out->pdu_type = is_bser_v2;
+  fill_in_header(2, uint32_t(caps) | BSER_CAP_DEFLATE, out);
+  return true;
+#else
+  unused_parameter(pdu);
+  unused_parameter(out);
+  return false;
+#endif
+}
+
+bool w_bser_inflate_payload(const char* buf, const char* end,
+    std::string& out, json_error_t* jerr) {
+#ifdef HAVE_ZLIB
+  json_int_t needed, len;
+  uLongf outlen;
+
+  if (!bunser_int(buf, end - buf, &needed, &len) || len < 0) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "invalid compressed payload length");
+    return false;
+  }
+  buf += needed;
+  // The length comes from the peer, so don't believe more than the stream
+  // could possibly expand to before allocating it
+  if (len > (end - buf) * BSER_MAX_DEFLATE_RATIO) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "compressed payload claims to expand to %" PRId64 " bytes",
+        (int64_t)len);
+    return false;
   }
 
-  return 0;
+  out.resize(len);
+  outlen = len;
+  if (uncompress((Bytef*)&out[0], &outlen, (const Bytef*)buf, end - buf) !=
+          Z_OK ||
+      outlen != (uLongf)len) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "failed to expand the compressed payload");
+    return false;
+  }
+  return true;
+#else
+  unused_parameter(buf);
+  unused_parameter(end);
+  unused_parameter(out);
+  snprintf(jerr->text, sizeof(jerr->text),
+      "this build of watchman can't expand compressed PDUs");
+  return false;
+#endif
 }
 
+static json_t *bunser_value(const char *buf, const char *end,
+    json_int_t *needed, json_error_t *jerr, std::string& prev_string);
+
 static json_t *bunser_array(const char *buf, const char *end,
-    json_int_t *used, json_error_t *jerr)
+    json_int_t *used, json_error_t *jerr, std::string& prev_string)
 {
   json_int_t needed;
   json_int_t total = 0;
@@ -449,7 +666,7 @@ static json_t *bunser_array(const char *buf, const char *end,
     json_t *item;
 
     needed = 0;
-    item = bunser(buf, end, &needed, jerr);
+    item = bunser_value(buf, end, &needed, jerr, prev_string);
 
     total += needed;
     buf += needed;
@@ -474,7 +691,7 @@ static json_t *bunser_array(const char *buf, const char *end,
 }
 
 static json_t *bunser_template(const char *buf, const char *end,
-    json_int_t *used, json_error_t *jerr)
+    json_int_t *used, json_error_t *jerr, std::string& prev_string)
 {
   json_int_t needed = 0;
   json_int_t total = 0;
@@ -493,7 +710,7 @@ static json_t *bunser_template(const char *buf, const char *end,
   }
 
   // Load in the property names template
-  templ = bunser_array(buf, end, &needed, jerr);
+  templ = bunser_array(buf, end, &needed, jerr, prev_string);
   if (!templ) {
     *used = needed + total;
     goto bail;
@@ -529,7 +746,7 @@ static json_t *bunser_template(const char *buf, const char *end,
       }
 
       needed = 0;
-      val = bunser(buf, end, &needed, jerr);
+      val = bunser_value(buf, end, &needed, jerr, prev_string);
       if (!val) {
         *used = needed + total;
         goto bail;
@@ -553,7 +770,7 @@ static json_t *bunser_template(const char *buf, const char *end,
 }
 
 static json_t *bunser_object(const char *buf, const char *end,
-    json_int_t *used, json_error_t *jerr)
+    json_int_t *used, json_error_t *jerr, std::string& prev_string)
 {
   json_int_t needed;
   json_int_t total = 0;
@@ -603,7 +820,7 @@ static json_t *bunser_object(const char *buf, const char *end,
     keybuf[slen] = '\0';
 
     // Read value
-    item = bunser(buf, end, &needed, jerr);
+    item = bunser_value(buf, end, &needed, jerr, prev_string);
     total += needed;
     buf += needed;
 
@@ -627,8 +844,48 @@ static json_t *bunser_object(const char *buf, const char *end,
   return objval;
 }
 
-json_t *bunser(const char *buf, const char *end, json_int_t *needed,
-    json_error_t *jerr)
+static json_t *bunser_prefix_string(const char *buf, const char *end,
+    json_int_t *used, json_error_t *jerr, std::string& prev_string)
+{
+  json_int_t needed;
+  json_int_t total = 1;
+  json_int_t prefix_len, len;
+
+  buf++;
+  if (!bunser_int(buf, end - buf, &needed, &prefix_len)) {
+    *used = needed + total;
+    snprintf(jerr->text, sizeof(jerr->text),
+        "invalid prefix string prefix length encoding");
+    return NULL;
+  }
+  total += needed;
+  buf += needed;
+
+  if (!bunser_int(buf, end - buf, &needed, &len)) {
+    *used = needed + total;
+    snprintf(jerr->text, sizeof(jerr->text),
+        "invalid prefix string length encoding");
+    return NULL;
+  }
+  total += needed;
+  buf += needed;
+
+  *used = total + len;
+  if (prefix_len < 0 || (size_t)prefix_len > prev_string.size() ||
+      len < 0 || len > end - buf) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "invalid prefix string encoding");
+    return NULL;
+  }
+
+  prev_string.resize((size_t)prefix_len);
+  prev_string.append(buf, (size_t)len);
+  return typed_string_len_to_json(prev_string.data(), prev_string.size(),
+                                  W_STRING_BYTE);
+}
+
+static json_t *bunser_value(const char *buf, const char *end,
+    json_int_t *needed, json_error_t *jerr, std::string& prev_string)
 {
   json_int_t ival;
 
@@ -675,12 +932,14 @@ json_t *bunser(const char *buf, const char *end, json_int_t *needed,
     case BSER_NULL:
       *needed = 1;
       return json_null();
+    case BSER_PREFIXSTRING:
+      return bunser_prefix_string(buf, end, needed, jerr, prev_string);
     case BSER_ARRAY:
-      return bunser_array(buf, end, needed, jerr);
+      return bunser_array(buf, end, needed, jerr, prev_string);
     case BSER_TEMPLATE:
-      return bunser_template(buf, end, needed, jerr);
+      return bunser_template(buf, end, needed, jerr, prev_string);
     case BSER_OBJECT:
-      return bunser_object(buf, end, needed, jerr);
+      return bunser_object(buf, end, needed, jerr, prev_string);
     default:
       snprintf(jerr->text, sizeof(jerr->text),
             "invalid bser encoding type %02x", (int)buf[0]);
@@ -692,5 +951,697 @@ json_t *bunser(const char *buf, const char *end, json_int_t *needed,
 #endif
 }
 
+json_t *bunser(const char *buf, const char *end, json_int_t *needed,
+    json_error_t *jerr)
+{
+  // The string that the next prefix-compressed string is relative to
+  std::string prev_string;
+
+  return bunser_value(buf, end, needed, jerr, prev_string);
+}
+
+namespace {
+
+// Writes a BSER value out as JSON as it is decoded, in the same format as
+// json_dump_callback, without building a json_t tree for it.  The value is
+// pulled from read a piece at a time; only the part of it that is being
+// decoded, the keys of the enclosing templates and the previous
+// prefix-compressed string are held in memory.
+class BserJsonTranscoder {
+ public:
+  BserJsonTranscoder(
+      const w_bser_read_func& read,
+      size_t flags,
+      json_dump_callback_t dump,
+      void* data,
+      json_error_t* jerr)
+      : read_(read), flags_(flags), dump_(dump), data_(data), jerr_(jerr) {}
+
+  bool transcode() {
+    if (!fill(1)) {
+      return false;
+    }
+    auto type = window_[pos_];
+    if (!(flags_ & JSON_ENCODE_ANY) && type != BSER_ARRAY &&
+        type != BSER_TEMPLATE && type != BSER_OBJECT) {
+      return error("expected an array or an object");
+    }
+    return value(0);
+  }
+
+ private:
+  bool error(const char* what) {
+    snprintf(jerr_->text, sizeof(jerr_->text), "%s", what);
+    return false;
+  }
+
+  // Makes at least n bytes available at pos_
+  bool fill(size_t n) {
+    if (window_.size() - pos_ >= n) {
+      return true;
+    }
+    // Let go of what has already been decoded, so that the window only
+    // grows as large as the largest single string
+    window_.erase(0, pos_);
+    pos_ = 0;
+    while (window_.size() < n) {
+      auto used = window_.size();
+      auto want = std::max(n - used, size_t(WATCHMAN_IO_BUF_SIZE));
+      window_.resize(used + want);
+      int r = read_(&window_[used], (int)want);
+      window_.resize(used + std::max(r, 0));
+      if (r == 0) {
+        return error("the BSER value was truncated");
+      }
+      if (r < 0) {
+        snprintf(jerr_->text, sizeof(jerr_->text),
+            "error reading the BSER value: %s", strerror(errno));
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool readInt(json_int_t* val) {
+    json_int_t needed;
+
+    if (!fill(1)) {
+      return false;
+    }
+    bunser_int(&window_[pos_], 1, &needed, val);
+    if (needed == -1) {
+      return error("invalid integer encoding");
+    }
+    if (!fill((size_t)needed)) {
+      return false;
+    }
+    bunser_int(&window_[pos_], needed, &needed, val);
+    pos_ += (size_t)needed;
+    return true;
+  }
+
+  // Decodes a plain or prefix-compressed string.  *str remains valid until
+  // the next string is read.
+  bool readString(const char** str, size_t* len) {
+    json_int_t prefix_len = 0, slen;
+
+    if (!fill(1)) {
+      return false;
+    }
+    auto type = window_[pos_++];
+    if (type != BSER_BYTESTRING && type != BSER_PREFIXSTRING) {
+      return error("expected a string");
+    }
+    if ((type == BSER_PREFIXSTRING && !readInt(&prefix_len)) ||
+        !readInt(&slen)) {
+      return false;
+    }
+    if (slen < 0 || prefix_len < 0 ||
+        (size_t)prefix_len > prev_string_.size()) {
+      return error("invalid string encoding");
+    }
+    if (!fill((size_t)slen)) {
+      return false;
+    }
+    if (type == BSER_BYTESTRING) {
+      *str = &window_[pos_];
+      *len = (size_t)slen;
+    } else {
+      prev_string_.resize((size_t)prefix_len);
+      prev_string_.append(&window_[pos_], (size_t)slen);
+      *str = prev_string_.data();
+      *len = prev_string_.size();
+    }
+    pos_ += (size_t)slen;
+    return true;
+  }
+
+  bool emit(const char* buf, size_t len) {
+    if (dump_(buf, len, data_)) {
+      return error("failed to write the JSON value");
+    }
+    return true;
+  }
+
+  bool emitString(const char* str, size_t len) {
+    if (json_dump_string(str, len, dump_, data_, flags_)) {
+      return error("failed to write a string");
+    }
+    return true;
+  }
+
+  // Matches the whitespace that json_dump_callback puts between items
+  bool indent(int depth, bool space) {
+    int width = JSON_INDENT(flags_);
+
+    if (width > 0) {
+      if (!emit("\n", 1)) {
+        return false;
+      }
+      for (int i = 0; i < depth * width; ++i) {
+        if (!emit(" ", 1)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    if (space && !(flags_ & JSON_COMPACT)) {
+      return emit(" ", 1);
+    }
+    return true;
+  }
+
+  bool separator() {
+    return (flags_ & JSON_COMPACT) ? emit(":", 1) : emit(": ", 2);
+  }
+
+  bool array(int depth) {
+    json_int_t nelems;
+
+    ++pos_;
+    if (!readInt(&nelems) || !emit("[", 1)) {
+      return false;
+    }
+    if (nelems <= 0) {
+      return emit("]", 1);
+    }
+    for (json_int_t i = 0; i < nelems; ++i) {
+      if ((i > 0 && !emit(",", 1)) || !indent(depth + 1, i > 0) ||
+          !value(depth + 1)) {
+        return false;
+      }
+    }
+    return indent(depth, false) && emit("]", 1);
+  }
+
+  bool object(int depth) {
+    json_int_t nelems;
+    const char* key;
+    size_t key_len;
+
+    ++pos_;
+    if (!readInt(&nelems) || !emit("{", 1)) {
+      return false;
+    }
+    if (nelems <= 0) {
+      return emit("}", 1);
+    }
+    for (json_int_t i = 0; i < nelems; ++i) {
+      if ((i > 0 && !emit(",", 1)) || !indent(depth + 1, i > 0) ||
+          !readString(&key, &key_len) || !emitString(key, key_len) ||
+          !separator() || !value(depth + 1)) {
+        return false;
+      }
+    }
+    return indent(depth, false) && emit("}", 1);
+  }
+
+  bool templ(int depth) {
+    json_int_t nkeys, nelems;
+    std::vector<std::string> keys;
+    const char* key;
+    size_t key_len;
+
+    ++pos_;
+    if (!fill(1)) {
+      return false;
+    }
+    if (window_[pos_] != BSER_ARRAY) {
+      return error("expected the array of template keys");
+    }
+    ++pos_;
+    if (!readInt(&nkeys)) {
+      return false;
+    }
+    for (json_int_t i = 0; i < nkeys; ++i) {
+      if (!readString(&key, &key_len)) {
+        return false;
+      }
+      keys.emplace_back(key, key_len);
+    }
+    if (!readInt(&nelems) || !emit("[", 1)) {
+      return false;
+    }
+    if (nelems <= 0) {
+      return emit("]", 1);
+    }
+
+    for (json_int_t i = 0; i < nelems; ++i) {
+      size_t nprops = 0;
+
+      if ((i > 0 && !emit(",", 1)) || !indent(depth + 1, i > 0) ||
+          !emit("{", 1)) {
+        return false;
+      }
+      for (auto& k : keys) {
+        if (!fill(1)) {
+          return false;
+        }
+        if (window_[pos_] == BSER_SKIP) {
+          ++pos_;
+          continue;
+        }
+        if ((nprops > 0 && !emit(",", 1)) ||
+            !indent(depth + 2, nprops > 0) ||
+            !emitString(k.data(), k.size()) || !separator() ||
+            !value(depth + 2)) {
+          return false;
+        }
+        ++nprops;
+      }
+      if ((nprops > 0 && !indent(depth + 1, false)) || !emit("}", 1)) {
+        return false;
+      }
+    }
+    return indent(depth, false) && emit("]", 1);
+  }
+
+  bool value(int depth) {
+    char buf[32];
+    json_int_t ival;
+    const char* str;
+    size_t len;
+
+    if (!fill(1)) {
+      return false;
+    }
+    switch (window_[pos_]) {
+      case BSER_INT8:
+      case BSER_INT16:
+      case BSER_INT32:
+      case BSER_INT64:
+        if (!readInt(&ival)) {
+          return false;
+        }
+        len = snprintf(buf, sizeof(buf), "%" JSON_INTEGER_FORMAT, ival);
+        return emit(buf, len);
+
+      case BSER_BYTESTRING:
+      case BSER_PREFIXSTRING:
+        return readString(&str, &len) && emitString(str, len);
+
+      case BSER_REAL:
+      {
+        double dval;
+        if (!fill(1 + sizeof(dval))) {
+          return false;
+        }
+        memcpy(&dval, &window_[pos_ + 1], sizeof(dval));
+        pos_ += 1 + sizeof(dval);
+        if (json_dump_real(dval, dump_, data_)) {
+          return error("failed to write a real");
+        }
+        return true;
+      }
+
+      case BSER_TRUE:
+        ++pos_;
+        return emit("true", 4);
+      case BSER_FALSE:
+        ++pos_;
+        return emit("false", 5);
+      case BSER_NULL:
+        ++pos_;
+        return emit("null", 4);
+      case BSER_ARRAY:
+        return array(depth);
+      case BSER_TEMPLATE:
+        return templ(depth);
+      case BSER_OBJECT:
+        return object(depth);
+      default:
+        snprintf(jerr_->text, sizeof(jerr_->text),
+            "invalid bser encoding type %02x", (int)window_[pos_]);
+        return false;
+    }
+  }
+
+  const w_bser_read_func& read_;
+  size_t flags_;
+  json_dump_callback_t dump_;
+  void* data_;
+  json_error_t* jerr_;
+  std::string window_;
+  size_t pos_{0};
+  // The string that the next prefix-compressed string is relative to
+  std::string prev_string_;
+};
+
+// Encodes JSON text as BSER as it is parsed, without building a json_t
+// tree for it.  The number of items in an array or object isn't known
+// until it is closed, so its header is written with a fixed width count
+// that is filled in afterwards.
+class JsonBserTranscoder {
+ public:
+  JsonBserTranscoder(
+      const char* buf,
+      const char* end,
+      std::string& out,
+      json_error_t* jerr)
+      : start_(buf), pos_(buf), end_(end), out_(out), jerr_(jerr) {}
+
+  bool transcode() {
+    skipSpace();
+    if (pos_ == end_ || (*pos_ != '[' && *pos_ != '{')) {
+      return error("'[' or '{' expected");
+    }
+    if (!value()) {
+      return false;
+    }
+    skipSpace();
+    if (pos_ != end_) {
+      return error("end of input expected");
+    }
+    return true;
+  }
+
+ private:
+  bool error(const char* what) {
+    snprintf(jerr_->text, sizeof(jerr_->text), "%s near offset %d", what,
+        (int)(pos_ - start_));
+    jerr_->position = (int)(pos_ - start_);
+    return false;
+  }
+
+  void skipSpace() {
+    while (pos_ < end_ &&
+           (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r')) {
+      ++pos_;
+    }
+  }
+
+  bool container(bool is_object) {
+    char close = is_object ? '}' : ']';
+    int32_t count = 0;
+
+    ++pos_;
+    out_.push_back(is_object ? BSER_OBJECT : BSER_ARRAY);
+    auto count_pos = out_.size();
+    out_.push_back(BSER_INT32);
+    out_.append(sizeof(count), '\0');
+
+    skipSpace();
+    if (pos_ < end_ && *pos_ == close) {
+      ++pos_;
+    } else {
+      while (true) {
+        if (is_object) {
+          skipSpace();
+          if (pos_ == end_ || *pos_ != '"') {
+            return error("string or '}' expected");
+          }
+          if (!string()) {
+            return false;
+          }
+          w_bser_append_bytestring(out_, str_.data(), str_.size());
+          skipSpace();
+          if (pos_ == end_ || *pos_ != ':') {
+            return error("':' expected");
+          }
+          ++pos_;
+        }
+        if (!value()) {
+          return false;
+        }
+        ++count;
+        skipSpace();
+        if (pos_ < end_ && *pos_ == ',') {
+          ++pos_;
+        } else if (pos_ < end_ && *pos_ == close) {
+          ++pos_;
+          break;
+        } else {
+          return error(is_object ? "'}' expected" : "']' expected");
+        }
+      }
+    }
+
+    memcpy(&out_[count_pos + 1], &count, sizeof(count));
+    return true;
+  }
+
+  bool hex4(int32_t* val) {
+    *val = 0;
+    for (int i = 0; i < 4; ++i, ++pos_) {
+      if (pos_ == end_ || !isxdigit((uint8_t)*pos_)) {
+        return error("invalid \\u escape");
+      }
+      char c = *pos_;
+      *val = (*val << 4) |
+          (isdigit((uint8_t)c) ? c - '0' : (tolower((uint8_t)c) - 'a' + 10));
+    }
+    return true;
+  }
+
+  void appendUtf8(int32_t cp) {
+    if (cp < 0x80) {
+      str_.push_back((char)cp);
+    } else if (cp < 0x800) {
+      str_.push_back((char)(0xc0 | (cp >> 6)));
+      str_.push_back((char)(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+      str_.push_back((char)(0xe0 | (cp >> 12)));
+      str_.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+      str_.push_back((char)(0x80 | (cp & 0x3f)));
+    } else {
+      str_.push_back((char)(0xf0 | (cp >> 18)));
+      str_.push_back((char)(0x80 | ((cp >> 12) & 0x3f)));
+      str_.push_back((char)(0x80 | ((cp >> 6) & 0x3f)));
+      str_.push_back((char)(0x80 | (cp & 0x3f)));
+    }
+  }
+
+  // Decodes the string at pos_ into str_
+  bool string() {
+    str_.clear();
+    ++pos_;
+    while (true) {
+      auto run = pos_;
+      while (pos_ < end_ && *pos_ != '"' && *pos_ != '\\' &&
+             (uint8_t)*pos_ >= 0x20) {
+        ++pos_;
+      }
+      str_.append(run, pos_ - run);
+      if (pos_ == end_) {
+        return error("premature end of input");
+      }
+      if (*pos_ == '"') {
+        ++pos_;
+        return true;
+      }
+      if (*pos_ != '\\') {
+        return error("control character in string");
+      }
+      if (++pos_ == end_) {
+        return error("premature end of input");
+      }
+      switch (*pos_++) {
+        case '"':
+          str_.push_back('"');
+          break;
+        case '\\':
+          str_.push_back('\\');
+          break;
+        case '/':
+          str_.push_back('/');
+          break;
+        case 'b':
+          str_.push_back('\b');
+          break;
+        case 'f':
+          str_.push_back('\f');
+          break;
+        case 'n':
+          str_.push_back('\n');
+          break;
+        case 'r':
+          str_.push_back('\r');
+          break;
+        case 't':
+          str_.push_back('\t');
+          break;
+        case 'u':
+        {
+          int32_t cp, low;
+          if (!hex4(&cp)) {
+            return false;
+          }
+          if (cp >= 0xd800 && cp <= 0xdbff) {
+            if (end_ - pos_ < 2 || pos_[0] != '\\' || pos_[1] != 'u') {
+              return error("invalid Unicode surrogate pair");
+            }
+            pos_ += 2;
+            if (!hex4(&low)) {
+              return false;
+            }
+            if (low < 0xdc00 || low > 0xdfff) {
+              return error("invalid Unicode surrogate pair");
+            }
+            cp = 0x10000 + (((cp - 0xd800) << 10) | (low - 0xdc00));
+          } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+            return error("invalid Unicode surrogate pair");
+          } else if (cp == 0) {
+            return error("\\u0000 is not allowed");
+          }
+          appendUtf8(cp);
+          break;
+        }
+        default:
+          return error("invalid escape");
+      }
+    }
+  }
+
+  bool digits() {
+    auto start = pos_;
+    while (pos_ < end_ && isdigit((uint8_t)*pos_)) {
+      ++pos_;
+    }
+    return pos_ != start;
+  }
+
+  bool number() {
+    auto start = pos_;
+    bool is_real = false;
+
+    if (*pos_ == '-') {
+      ++pos_;
+    }
+    if (pos_ < end_ && *pos_ == '0') {
+      ++pos_;
+    } else if (!digits()) {
+      return error("invalid number");
+    }
+    if (pos_ < end_ && *pos_ == '.') {
+      ++pos_;
+      is_real = true;
+      if (!digits()) {
+        return error("invalid number");
+      }
+    }
+    if (pos_ < end_ && (*pos_ == 'e' || *pos_ == 'E')) {
+      ++pos_;
+      is_real = true;
+      if (pos_ < end_ && (*pos_ == '+' || *pos_ == '-')) {
+        ++pos_;
+      }
+      if (!digits()) {
+        return error("invalid number");
+      }
+    }
+
+    std::string text(start, pos_ - start);
+    errno = 0;
+    if (!is_real) {
+      json_int_t ival = strtoll(text.c_str(), nullptr, 10);
+      if (errno == ERANGE) {
+        return error("too big integer");
+      }
+      w_bser_append_int(out_, ival);
+    } else {
+      double dval = strtod(text.c_str(), nullptr);
+      if (errno == ERANGE && (std::isinf(dval))) {
+        return error("real number overflow");
+      }
+      w_bser_append_real(out_, dval);
+    }
+    return true;
+  }
+
+  bool literal(const char* word, size_t len) {
+    if ((size_t)(end_ - pos_) < len || memcmp(pos_, word, len)) {
+      return error("invalid token");
+    }
+    pos_ += len;
+    return true;
+  }
+
+  bool value() {
+    skipSpace();
+    if (pos_ == end_) {
+      return error("premature end of input");
+    }
+    switch (*pos_) {
+      case '{':
+        return container(true);
+      case '[':
+        return container(false);
+      case '"':
+        if (!string()) {
+          return false;
+        }
+        w_bser_append_bytestring(out_, str_.data(), str_.size());
+        return true;
+      case 't':
+        if (!literal("true", 4)) {
+          return false;
+        }
+        w_bser_append_bool(out_, true);
+        return true;
+      case 'f':
+        if (!literal("false", 5)) {
+          return false;
+        }
+        w_bser_append_bool(out_, false);
+        return true;
+      case 'n':
+        if (!literal("null", 4)) {
+          return false;
+        }
+        w_bser_append_null(out_);
+        return true;
+      default:
+        if (*pos_ == '-' || isdigit((uint8_t)*pos_)) {
+          return number();
+        }
+        return error("invalid token");
+    }
+  }
+
+  const char* start_;
+  const char* pos_;
+  const char* end_;
+  std::string& out_;
+  json_error_t* jerr_;
+  // The most recently decoded string
+  std::string str_;
+};
+}
+
+bool w_bser_transcode_json(
+    const w_bser_read_func& read,
+    size_t flags,
+    json_dump_callback_t dump,
+    void* data,
+    json_error_t* jerr) {
+  BserJsonTranscoder transcoder(read, flags, dump, data, jerr);
+  return transcoder.transcode();
+}
+
+bool w_json_transcode_bser_pdu(
+    uint32_t bser_version,
+    uint32_t bser_capabilities,
+    const char* buf,
+    const char* end,
+    w_encoded_pdu* pdu,
+    json_error_t* jerr) {
+  bser_ctx_t ctx{bser_version, bser_capabilities, nullptr};
+
+  if (!is_bser_version_supported(&ctx)) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "unsupported BSER version %" PRIu32, bser_version);
+    return false;
+  }
+
+  pdu->pdu_type = bser_version == 2 ? is_bser_v2 : is_bser;
+  pdu->data.assign(BSER_MAX_HEADER_SIZE, '\0');
+  JsonBserTranscoder transcoder(buf, end, pdu->data, jerr);
+  if (!transcoder.transcode()) {
+    return false;
+  }
+  fill_in_header(bser_version, bser_capabilities, pdu);
+  return true;
+}
+
 /* vim:ts=2:sw=2:et:
  */
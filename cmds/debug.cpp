@@ -99,6 +99,41 @@ static void cmd_debug_ageout(struct watchman_client *client, json_t *args)
 }
 W_CMD_REG("debug-ageout", cmd_debug_ageout, CMD_DAEMON, w_cmd_realpath_root)
 
+/* debug-io-histograms */
+static void cmd_debug_io_histograms(
+    struct watchman_client* client,
+    json_t* args) {
+  json_t* resp;
+  struct read_locked_watchman_root lock;
+  struct unlocked_watchman_root unlocked;
+
+  /* resolve the root */
+  if (json_array_size(args) != 2) {
+    send_error_response(
+        client, "wrong number of arguments for 'debug-io-histograms'");
+    return;
+  }
+
+  if (!resolve_root_or_err(client, args, 1, false, &unlocked)) {
+    return;
+  }
+
+  resp = make_response();
+
+  w_root_read_lock(&unlocked, "debug-io-histograms", &lock);
+  set_prop(resp, "slice_items", lock.root->ioThread.slice_items.to_json());
+  set_prop(
+      resp,
+      "slice_lock_hold_us",
+      lock.root->ioThread.slice_lock_hold_us.to_json());
+  w_root_read_unlock(&lock, &unlocked);
+
+  send_and_dispose_response(client, resp);
+  w_root_delref(&unlocked);
+}
+W_CMD_REG("debug-io-histograms", cmd_debug_io_histograms, CMD_DAEMON,
+    w_cmd_realpath_root)
+
 static void cmd_debug_poison(struct watchman_client *client, json_t *args)
 {
   struct timeval now;
@@ -120,6 +155,49 @@ static void cmd_debug_poison(struct watchman_client *client, json_t *args)
 }
 W_CMD_REG("debug-poison", cmd_debug_poison, CMD_DAEMON, w_cmd_realpath_root)
 
+/* debug-client-queues
+ * Reports on the responses that are queued for each client */
+static void cmd_debug_client_queues(struct watchman_client *client,
+    json_t *args)
+{
+  json_t *resp, *arr;
+  w_ht_iter_t iter;
+
+  unused_parameter(args);
+
+  resp = make_response();
+
+  pthread_mutex_lock(&w_client_lock);
+  arr = json_array_of_size(w_ht_size(clients));
+  if (w_ht_first(clients, &iter)) do {
+    auto other = (watchman_user_client *)w_ht_val_ptr(iter.value);
+    json_t *info = json_object();
+    json_t *subs = json_array();
+    w_ht_iter_t citer;
+
+    if (w_ht_first(other->subscriptions, &citer)) do {
+      auto sub = (watchman_client_subscription *)w_ht_val_ptr(citer.value);
+      json_array_append_new(subs, w_string_to_json(sub->name));
+    } while (w_ht_next(other->subscriptions, &citer));
+
+    set_prop(info, "self", json_boolean(&other->client == client));
+    set_prop(info, "queue_depth", json_integer(other->client.queue_depth));
+    set_prop(info, "queued_bytes", json_integer(other->client.queued_bytes));
+    set_prop(info, "max_queued_bytes",
+        json_integer(other->client.max_queued_bytes));
+    set_prop(info, "dropped", json_integer(other->client.num_dropped));
+    set_prop(info, "coalesced", json_integer(other->client.num_coalesced));
+    set_prop(info, "overflowed", json_boolean(other->client.overflowed));
+    set_prop(info, "subscriptions", subs);
+    json_array_append_new(arr, info);
+  } while (w_ht_next(clients, &iter));
+  pthread_mutex_unlock(&w_client_lock);
+
+  set_prop(resp, "clients", arr);
+  send_and_dispose_response(client, resp);
+}
+W_CMD_REG("debug-client-queues", cmd_debug_client_queues, CMD_DAEMON, NULL)
+
 static void cmd_debug_drop_privs(struct watchman_client *client, json_t *args)
 {
   json_t *resp;
@@ -2,6 +2,7 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "ChangeLogRing.h"
 
 static bool query_caps(json_t *response, json_t *result,
     json_t *arr, bool required) {
@@ -148,5 +149,42 @@ static void cmd_get_config(struct watchman_client *client, json_t *args)
 }
 W_CMD_REG("get-config", cmd_get_config, CMD_DAEMON, w_cmd_realpath_root)
 
+/* get-changelog /root
+ * Returns the location of the change log ring for the root, which local
+ * consumers can map and tail; see ChangeLogRing.h */
+static void cmd_get_changelog(struct watchman_client *client, json_t *args)
+{
+  json_t *resp;
+  struct unlocked_watchman_root unlocked;
+
+  if (json_array_size(args) != 2) {
+    send_error_response(client,
+                        "wrong number of arguments for 'get-changelog'");
+    return;
+  }
+
+  if (!resolve_root_or_err(client, args, 1, false, &unlocked)) {
+    return;
+  }
+
+  // The ring is created along with the root, and lives as long as it does
+  auto ring = unlocked.root->changeLog.get();
+  if (!ring) {
+    send_error_response(client,
+                        "the change log is not enabled for this root; "
+                        "set changelog_size to enable it");
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  resp = make_response();
+  set_bytestring_prop(resp, "changelog", ring->path().c_str());
+  set_prop(resp, "capacity", json_integer(ring->capacity()));
+  send_and_dispose_response(client, resp);
+  w_root_delref(&unlocked);
+}
+W_CMD_REG("get-changelog", cmd_get_changelog, CMD_DAEMON,
+          w_cmd_realpath_root)
+
 /* vim:ts=2:sw=2:et:
  */
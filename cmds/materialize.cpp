@@ -0,0 +1,249 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "MaterializedQuery.h"
+
+using watchman::MaterializedQuery;
+
+static std::shared_ptr<MaterializedQuery> find_materialized(
+    w_root_t* root,
+    const w_string& name) {
+  auto map = root->materialized.rlock();
+  auto it = map->find(name);
+  if (it == map->end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+/* materialize /root name {query}
+ * Registers a query whose results are maintained incrementally */
+static void cmd_materialize(struct watchman_client *client, json_t *args)
+{
+  json_t *jname;
+  json_t *query_spec;
+  json_t *resp;
+  char *errmsg = NULL;
+  struct w_query_field_list field_list;
+  struct unlocked_watchman_root unlocked;
+  struct read_locked_watchman_root lock;
+  char clockbuf[128];
+
+  if (json_array_size(args) != 4) {
+    send_error_response(client, "wrong number of arguments for 'materialize'");
+    return;
+  }
+
+  if (!resolve_root_or_err(client, args, 1, false, &unlocked)) {
+    return;
+  }
+
+  jname = json_array_get(args, 2);
+  if (!json_is_string(jname)) {
+    send_error_response(client,
+        "expected 2nd parameter to be materialized query name");
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  query_spec = json_array_get(args, 3);
+  if (!parse_field_list(json_object_get(query_spec, "fields"), &field_list,
+                        &errmsg)) {
+    send_error_response(client, "invalid field list: %s", errmsg);
+    free(errmsg);
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  auto query = w_query_parse(unlocked.root, query_spec, &errmsg);
+  if (!query) {
+    send_error_response(client, "failed to parse query: %s", errmsg);
+    free(errmsg);
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  // The result set is the current state of the matching files, so these
+  // don't make sense here
+  if (query->since_spec || query->npaths || query->glob_tree) {
+    send_error_response(client,
+        "materialized queries may not use 'since', 'path' or 'glob'");
+    w_root_delref(&unlocked);
+    return;
+  }
+  if (query->result_mode != W_QUERY_RESULT_FILES ||
+      query->collapse_threshold) {
+    send_error_response(client,
+        "materialized queries may only produce files; 'result_mode' and "
+        "'collapse_threshold' are not supported");
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  auto name = json_to_w_string(jname);
+  auto view =
+      std::make_shared<MaterializedQuery>(name, std::move(query), field_list);
+
+  w_root_read_lock(&unlocked, "materialize", &lock);
+  view->update(&lock);
+  resp = make_response();
+  if (clock_id_string(lock.root->inner.number, lock.root->inner.ticks,
+                      clockbuf, sizeof(clockbuf))) {
+    set_unicode_prop(resp, "clock", clockbuf);
+  }
+  w_root_read_unlock(&lock, &unlocked);
+
+  (*unlocked.root->materialized.wlock())[name] = view;
+
+  json_incref(jname);
+  set_prop(resp, "materialize", jname);
+  send_and_dispose_response(client, resp);
+  w_root_delref(&unlocked);
+}
+W_CMD_REG("materialize", cmd_materialize, CMD_DAEMON | CMD_ALLOW_ANY_USER,
+          w_cmd_realpath_root)
+
+/* materialize-query /root name [since]
+ * Returns the results of a materialized query, either in full, or the
+ * changes to them since the supplied clock */
+static void cmd_materialize_query(struct watchman_client *client, json_t *args)
+{
+  json_t *jname;
+  json_t *resp;
+  std::unique_ptr<w_clockspec> since;
+  struct unlocked_watchman_root unlocked;
+  struct read_locked_watchman_root lock;
+
+  if (json_array_size(args) < 3 || json_array_size(args) > 4) {
+    send_error_response(client,
+        "wrong number of arguments for 'materialize-query'");
+    return;
+  }
+
+  if (!resolve_root_or_err(client, args, 1, false, &unlocked)) {
+    return;
+  }
+
+  jname = json_array_get(args, 2);
+  if (!json_is_string(jname)) {
+    send_error_response(client,
+        "expected 2nd parameter to be materialized query name");
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  if (json_array_size(args) == 4) {
+    since = w_clockspec_parse(json_array_get(args, 3));
+    if (!since || since->tag == w_cs_timestamp) {
+      send_error_response(client, "expected 3rd parameter to be a clock");
+      w_root_delref(&unlocked);
+      return;
+    }
+  }
+
+  auto view = find_materialized(unlocked.root, json_to_w_string(jname));
+  if (!view) {
+    send_error_response(client, "no materialized query named %s",
+                        json_string_value(jname));
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  auto sync_timeout = view->query()->sync_timeout;
+  if (sync_timeout && !client->client_mode &&
+      !w_root_sync_to_now(&unlocked, sync_timeout)) {
+    send_error_response(client, "synchronization failed: %s",
+                        strerror(errno));
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  resp = make_response();
+  w_root_read_lock(&unlocked, "materialize-query", &lock);
+  view->fetch(&lock, since.get(), resp);
+  add_root_warnings_to_response(resp, &lock);
+  w_root_read_unlock(&lock, &unlocked);
+
+  send_and_dispose_response(client, resp);
+  w_root_delref(&unlocked);
+}
+W_CMD_REG("materialize-query", cmd_materialize_query,
+          CMD_DAEMON | CMD_ALLOW_ANY_USER, w_cmd_realpath_root)
+
+/* materialize-del /root name
+ * Deletes a materialized query */
+static void cmd_materialize_delete(struct watchman_client *client,
+                                   json_t *args)
+{
+  json_t *jname;
+  json_t *resp;
+  bool deleted;
+  struct unlocked_watchman_root unlocked;
+
+  if (!resolve_root_or_err(client, args, 1, false, &unlocked)) {
+    return;
+  }
+
+  if (json_array_size(args) != 3) {
+    send_error_response(client, "wrong number of arguments");
+    w_root_delref(&unlocked);
+    return;
+  }
+  jname = json_array_get(args, 2);
+  if (!json_is_string(jname)) {
+    send_error_response(client,
+        "expected 2nd parameter to be materialized query name");
+    w_root_delref(&unlocked);
+    return;
+  }
+
+  deleted = unlocked.root->materialized.wlock()->erase(
+      json_to_w_string(jname)) > 0;
+
+  resp = make_response();
+  set_prop(resp, "deleted", json_boolean(deleted));
+  json_incref(jname);
+  set_prop(resp, "materialize", jname);
+  send_and_dispose_response(client, resp);
+  w_root_delref(&unlocked);
+}
+W_CMD_REG("materialize-del", cmd_materialize_delete,
+          CMD_DAEMON | CMD_ALLOW_ANY_USER, w_cmd_realpath_root)
+
+/* materialize-list /root
+ * Lists the materialized queries for a root along with what it
+ * costs to maintain them */
+static void cmd_materialize_list(struct watchman_client *client, json_t *args)
+{
+  json_t *resp;
+  json_t *arr;
+  std::vector<std::shared_ptr<MaterializedQuery>> views;
+  struct unlocked_watchman_root unlocked;
+
+  if (!resolve_root_or_err(client, args, 1, false, &unlocked)) {
+    return;
+  }
+
+  {
+    auto map = unlocked.root->materialized.rlock();
+    for (const auto& it : *map) {
+      views.push_back(it.second);
+    }
+  }
+
+  arr = json_array();
+  for (const auto& view : views) {
+    json_array_append_new(arr, view->stats());
+  }
+
+  resp = make_response();
+  set_prop(resp, "materialized", arr);
+  send_and_dispose_response(client, resp);
+  w_root_delref(&unlocked);
+}
+W_CMD_REG("materialize-list", cmd_materialize_list,
+          CMD_DAEMON | CMD_ALLOW_ANY_USER, w_cmd_realpath_root)
+
+/* vim:ts=2:sw=2:et:
+ */
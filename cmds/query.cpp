@@ -3,15 +3,110 @@
 
 #include "watchman.h"
 
+// Locks the root again to render more of res.  If the files that its
+// matches refer to were freed while the root was unlocked, this tells
+// the client to retry the query and returns false, without the lock.
+static bool relock_to_render(
+    struct watchman_client* client,
+    struct unlocked_watchman_root* unlocked,
+    const w_query_res* res,
+    struct read_locked_watchman_root* lock) {
+  w_root_read_lock(unlocked, "render_results", lock);
+  if (w_query_res_is_current(res, lock)) {
+    return true;
+  }
+  w_root_read_unlock(lock, unlocked);
+  send_error_response(
+      client,
+      "query failed: files were aged out or the watch was recrawled "
+      "while the results were being sent; please retry the query");
+  return false;
+}
+
+namespace {
+// A query whose results have been computed and are being sent.  When it
+// has a chunk_size, all but the last chunk of files are sent as partial
+// responses, rendering each and releasing its matches as we go, so that
+// neither we nor the client have to hold the whole result set in one
+// piece.  The first is rendered under the lock that produced the matches;
+// we don't hold it while sending, so each one after that checks that the
+// files it refers to haven't been freed in the meantime.
+struct query_sender {
+  struct watchman_client* client;
+  std::shared_ptr<w_query> query;
+  struct w_query_field_list field_list;
+  w_query_res res;
+  struct unlocked_watchman_root unlocked;
+  struct read_locked_watchman_root lock;
+  bool locked{false};
+
+  ~query_sender() {
+    if (locked) {
+      w_root_read_unlock(&lock, &unlocked);
+    }
+    w_root_delref(&unlocked);
+  }
+
+  bool chunked() const {
+    return query->chunk_size && !client->client_mode && !res.collapsed &&
+        query->result_mode == W_QUERY_RESULT_FILES;
+  }
+
+  // Sends the next chunk.  Returns false once it has sent the final
+  // response, or failed.
+  bool sendNext() {
+    if (!locked) {
+      if (!relock_to_render(client, &unlocked, &res, &lock)) {
+        return false;
+      }
+      locked = true;
+    }
+
+    if (chunked() && res.results.size() > query->chunk_size) {
+      auto chunk = make_response();
+      set_prop(chunk, "partial", json_true());
+      auto pdu = w_query_render_results(client->pdu_type,
+                                        client->writer.bser_capabilities,
+                                        chunk, "files", &field_list,
+                                        res.results, 0, query->chunk_size);
+      w_root_read_unlock(&lock, &unlocked);
+      locked = false;
+      res.results.erase(res.results.begin(),
+                        res.results.begin() + query->chunk_size);
+
+      return send_response_now(client, chunk, pdu);
+    }
+
+    char clockbuf[128];
+    auto response = make_response();
+    if (clock_id_string(res.root_number, res.ticks, clockbuf,
+                        sizeof(clockbuf))) {
+      set_unicode_prop(response, "clock", clockbuf);
+    }
+    set_prop(response, "is_fresh_instance",
+             json_pack("b", res.is_fresh_instance));
+
+    add_root_warnings_to_response(response, &lock);
+
+    // This goes last, as it may encode the response as it stands
+    auto pdu = w_query_render_result(client->pdu_type,
+                                     client->writer.bser_capabilities,
+                                     query.get(), &field_list, &res, response);
+    w_root_read_unlock(&lock, &unlocked);
+    locked = false;
+
+    send_and_dispose_response(client, response, pdu);
+    return false;
+  }
+};
+}
+
 /* query /root {query} */
 static void cmd_query(struct watchman_client *client, json_t *args)
 {
   json_t *query_spec;
   char *errmsg = NULL;
-  w_query_res res;
-  json_t *response;
-  json_t *file_list, *jfield_list;
-  char clockbuf[128];
+  json_t *jfield_list;
   struct w_query_field_list field_list;
   struct unlocked_watchman_root unlocked;
 
@@ -44,37 +139,153 @@ static void cmd_query(struct watchman_client *client, json_t *args)
 
   if (client->client_mode) {
     query->sync_timeout = 0;
+  } else {
+    // Don't keep working on behalf of a client that has gone away
+    auto stm = client->stm;
+    query->is_cancelled = [stm] { return w_stm_peer_closed(stm); };
   }
 
-  if (!w_query_execute(query.get(), &unlocked, &res, nullptr)) {
-    send_error_response(client, "query failed: %s", res.errmsg);
+  // This takes over our reference to the root
+  auto sender = std::make_shared<query_sender>();
+  sender->client = client;
+  sender->query = query;
+  sender->field_list = field_list;
+  sender->unlocked = unlocked;
+
+  if (!w_query_execute_and_hold(query.get(), &sender->unlocked, &sender->res,
+                                nullptr, &sender->lock)) {
+    send_error_response(client, "query failed: %s", sender->res.errmsg);
+    return;
+  }
+  sender->locked = true;
+
+  if (!sender->chunked()) {
+    sender->sendNext();
+    return;
+  }
+  // Under the client reactor, this may carry on after we return
+  w_client_send_series(client, [sender] { return sender->sendNext(); });
+}
+W_CMD_REG("query", cmd_query, CMD_DAEMON | CMD_CLIENT | CMD_ALLOW_ANY_USER,
+          w_cmd_realpath_root)
+
+/* query-batch /root [{query}, ...]
+ * Runs several queries against the same root, sharing the sync, the
+ * lock and, where the queries allow it, the traversal of the files */
+static void cmd_query_batch(struct watchman_client *client, json_t *args)
+{
+  json_t *query_specs;
+  json_t *response;
+  json_t *result_list;
+  char clockbuf[128];
+  struct unlocked_watchman_root unlocked;
+  std::vector<std::shared_ptr<w_query>> parsed;
+  std::vector<struct w_query_field_list> field_lists;
+  std::vector<char*> errmsgs;
+  std::vector<w_query*> queries;
+  std::deque<w_query_res> results;
+
+  if (json_array_size(args) != 3) {
+    send_error_response(client, "wrong number of arguments for 'query-batch'");
+    return;
+  }
+
+  if (!resolve_root_or_err(client, args, 1, false, &unlocked)) {
+    return;
+  }
+
+  query_specs = json_array_get(args, 2);
+  if (!json_is_array(query_specs)) {
+    send_error_response(client,
+                        "expected 2nd parameter to be an array of queries");
     w_root_delref(&unlocked);
     return;
   }
 
-  file_list =
-      w_query_results_to_json(&field_list, res.results.size(), res.results);
+  // A query that fails to parse produces an error in its own slot of
+  // the results, rather than failing the whole batch
+  for (size_t i = 0; i < json_array_size(query_specs); ++i) {
+    auto query_spec = json_array_get(query_specs, i);
+    struct w_query_field_list field_list;
+    char *errmsg = NULL;
+    std::shared_ptr<w_query> query;
 
-  response = make_response();
-  if (clock_id_string(res.root_number, res.ticks, clockbuf, sizeof(clockbuf))) {
-    set_unicode_prop(response, "clock", clockbuf);
+    if (!parse_field_list(json_object_get(query_spec, "fields"), &field_list,
+                          &errmsg)) {
+      char *msg = NULL;
+      ignore_result(asprintf(&msg, "invalid field list: %s", errmsg));
+      free(errmsg);
+      errmsg = msg;
+    } else {
+      query = w_query_parse(unlocked.root, query_spec, &errmsg);
+      if (!query) {
+        char *msg = NULL;
+        ignore_result(asprintf(&msg, "failed to parse query: %s", errmsg));
+        free(errmsg);
+        errmsg = msg;
+      } else {
+        if (client->client_mode) {
+          query->sync_timeout = 0;
+        } else {
+          auto stm = client->stm;
+          query->is_cancelled = [stm] { return w_stm_peer_closed(stm); };
+        }
+        queries.push_back(query.get());
+      }
+    }
+
+    parsed.push_back(query);
+    field_lists.push_back(field_list);
+    errmsgs.push_back(errmsg);
   }
-  set_prop(response, "is_fresh_instance",
-           json_pack("b", res.is_fresh_instance));
-  set_prop(response, "files", file_list);
 
-  {
-    struct read_locked_watchman_root lock;
+  // The results are rendered under the lock that produced them, as they
+  // refer to the files in the view
+  struct read_locked_watchman_root lock;
+  bool locked = !queries.empty() &&
+      w_query_execute_batch(queries, &unlocked, results, &lock);
+
+  result_list = json_array_of_size(parsed.size());
+  size_t executed = 0;
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    auto result = json_object();
+
+    if (!parsed[i]) {
+      set_unicode_prop(result, "error", errmsgs[i]);
+      free(errmsgs[i]);
+    } else {
+      auto& res = results[executed++];
+      if (res.errmsg) {
+        set_unicode_prop(result, "error", res.errmsg);
+      } else {
+        if (clock_id_string(res.root_number, res.ticks, clockbuf,
+                            sizeof(clockbuf))) {
+          set_unicode_prop(result, "clock", clockbuf);
+        }
+        set_prop(result, "is_fresh_instance",
+                 json_pack("b", res.is_fresh_instance));
+        set_prop(result, w_query_result_prop_name(parsed[i].get(), &res),
+                 w_query_result_to_json(parsed[i].get(), &field_lists[i],
+                                        &res));
+      }
+    }
+    json_array_append_new(result_list, result);
+  }
+
+  response = make_response();
+  set_prop(response, "results", result_list);
+
+  if (!locked) {
     w_root_read_lock(&unlocked, "obtain_warnings", &lock);
-    add_root_warnings_to_response(response, &lock);
-    w_root_read_unlock(&lock, &unlocked);
   }
+  add_root_warnings_to_response(response, &lock);
+  w_root_read_unlock(&lock, &unlocked);
 
   send_and_dispose_response(client, response);
   w_root_delref(&unlocked);
 }
-W_CMD_REG("query", cmd_query, CMD_DAEMON | CMD_CLIENT | CMD_ALLOW_ANY_USER,
-          w_cmd_realpath_root)
+W_CMD_REG("query-batch", cmd_query_batch,
+          CMD_DAEMON | CMD_CLIENT | CMD_ALLOW_ANY_USER, w_cmd_realpath_root)
 
 /* vim:ts=2:sw=2:et:
  */
@@ -11,7 +11,7 @@ static void cmd_since(struct watchman_client *client, json_t *args)
   struct w_query_field_list field_list;
   w_query_res res;
   json_t *response, *clock_ele;
-  json_t *file_list;
+  w_encoded_pdu *pdu;
   char clockbuf[128];
   struct unlocked_watchman_root unlocked;
 
@@ -45,31 +45,31 @@ static void cmd_since(struct watchman_client *client, json_t *args)
 
   w_query_legacy_field_list(&field_list);
 
-  if (!w_query_execute(query.get(), &unlocked, &res, nullptr)) {
+  // The results are rendered under the lock that produced them, as they
+  // refer to the files in the view
+  struct read_locked_watchman_root lock;
+  if (!w_query_execute_and_hold(query.get(), &unlocked, &res, nullptr,
+                                &lock)) {
     send_error_response(client, "query failed: %s", res.errmsg);
     w_root_delref(&unlocked);
     return;
   }
 
-  file_list =
-      w_query_results_to_json(&field_list, res.results.size(), res.results);
-
   response = make_response();
   if (clock_id_string(res.root_number, res.ticks, clockbuf, sizeof(clockbuf))) {
     set_unicode_prop(response, "clock", clockbuf);
   }
   set_prop(response, "is_fresh_instance",
            json_pack("b", res.is_fresh_instance));
-  set_prop(response, "files", file_list);
 
-  {
-    struct read_locked_watchman_root lock;
-    w_root_read_lock(&unlocked, "obtain_warnings", &lock);
-    add_root_warnings_to_response(response, &lock);
-    w_root_read_unlock(&lock, &unlocked);
-  }
+  add_root_warnings_to_response(response, &lock);
+  pdu = w_query_render_results(client->pdu_type,
+                               client->writer.bser_capabilities, response,
+                               "files", &field_list, res.results, 0,
+                               res.results.size());
+  w_root_read_unlock(&lock, &unlocked);
 
-  send_and_dispose_response(client, response);
+  send_and_dispose_response(client, response, pdu);
   w_root_delref(&unlocked);
 }
 W_CMD_REG("since", cmd_since, CMD_DAEMON | CMD_ALLOW_ANY_USER,
@@ -3,11 +3,38 @@
 
 #include "watchman.h"
 
-/** This is called from the IO thread */
-void process_subscriptions(struct write_locked_watchman_root *lock) {
+#include "ThreadPool.h"
+#include <unordered_map>
+#include <vector>
+
+// When subscription_threads is set, subscriptions are evaluated and
+// their results rendered on a shared pool, rather than on the io thread
+// while it holds the root write lock.  The work for a given root runs on
+// a serial executor, so each client still sees the notifications for a
+// subscription in order, and it holds only a read lock so that queries
+// can proceed alongside it.
+
+#define DEFAULT_SUBSCRIPTION_THREADS 0
+
+namespace {
+struct pending_subscription {
+  watchman_user_client* client;
+  watchman_client_subscription* sub;
+};
+}
+
+static void dispatch_subscriptions(
+    struct read_locked_watchman_root* lock,
+    std::vector<pending_subscription>& pending,
+    SettleCandidates* candidates);
+
+static void run_pending_subscriptions(
+    struct read_locked_watchman_root* lock,
+    bool vcs_in_progress,
+    SettleCandidates* candidates) {
   w_ht_iter_t iter;
-  bool vcs_in_progress;
-  w_root_t *root = lock->root;
+  const w_root_t* root = lock->root;
+  std::vector<pending_subscription> pending;
 
   pthread_mutex_lock(&w_client_lock);
 
@@ -16,11 +43,6 @@ void process_subscriptions(struct write_locked_watchman_root *lock) {
     goto done;
   }
 
-  // If it looks like we're in a repo undergoing a rebase or
-  // other similar operation, we want to defer subscription
-  // notifications until things settle down
-  vcs_in_progress = is_vcs_op_in_progress(lock);
-
   do {
     auto client = (watchman_user_client*)w_ht_val_ptr(iter.value);
     w_ht_iter_t citer;
@@ -112,30 +134,135 @@ void process_subscriptions(struct write_locked_watchman_root *lock) {
         continue;
       }
 
-      w_run_subscription_rules(client, sub, lock);
-      sub->last_sub_tick = root->inner.view->getMostRecentTickValue();
+      // If the client hasn't taken the previous notification yet, this
+      // one takes its place and covers the changes that it reported too
+      w_client_coalesce_subscription(&client->client, sub);
+
+      pending.push_back(pending_subscription{client, sub});
 
     } while (w_ht_next(client->subscriptions, &citer));
 
   } while (w_ht_next(clients, &iter));
+
+  dispatch_subscriptions(lock, pending, candidates);
+
 done:
   pthread_mutex_unlock(&w_client_lock);
 }
 
+static watchman::ThreadPool* get_subscription_pool() {
+  static std::once_flag once;
+  static watchman::ThreadPool* pool;
+
+  std::call_once(once, [] {
+    auto numThreads = cfg_get_int(
+        nullptr, "subscription_threads", DEFAULT_SUBSCRIPTION_THREADS);
+    if (numThreads > 0) {
+      // This is intentionally never freed; roots may still be
+      // referencing it during process shutdown
+      pool = new watchman::ThreadPool;
+      pool->start(size_t(numThreads), "sub-worker");
+    }
+  });
+  return pool;
+}
+
+static void run_subscriptions_for_root(w_root_t* root) {
+  auto& dispatch = root->subscriptionDispatch;
+  struct unlocked_watchman_root unlocked = {root};
+  struct read_locked_watchman_root lock;
+
+  dispatch.queued = false;
+
+  w_root_read_lock(&unlocked, "run subscriptions", &lock);
+  if (!root->inner.cancelled) {
+    if (root->inner.view->getMostRecentTickValue() != dispatch.settle_tick) {
+      // The io thread has processed more changes since it settled, so
+      // the view is no longer at a settle point.  It will settle again
+      // and queue another run, which covers these changes too.
+      w_log(W_LOG_DBG, "root changed since it settled; skipping this run\n");
+    } else {
+      SettleCandidates candidates(&lock);
+      run_pending_subscriptions(&lock, dispatch.vcs_in_progress, &candidates);
+    }
+  }
+  w_root_read_unlock(&lock, &unlocked);
+
+  w_root_delref_raw(root);
+}
+
+/** This is called from the IO thread */
+void process_subscriptions(
+    struct write_locked_watchman_root* lock,
+    SettleCandidates* candidates) {
+  w_root_t* root = lock->root;
+
+  // If it looks like we're in a repo undergoing a rebase or
+  // other similar operation, we want to defer subscription
+  // notifications until things settle down
+  bool vcs_in_progress = is_vcs_op_in_progress(lock);
+
+  auto pool = get_subscription_pool();
+  if (!pool) {
+    run_pending_subscriptions(
+        w_root_read_lock_from_write(lock), vcs_in_progress, candidates);
+    return;
+  }
+
+  auto& dispatch = root->subscriptionDispatch;
+  dispatch.vcs_in_progress = vcs_in_progress;
+  // Updated even if a run is already queued, as that run will see the
+  // view as of this settle rather than the one that queued it
+  dispatch.settle_tick = root->inner.view->getMostRecentTickValue();
+  if (!dispatch.executor) {
+    dispatch.executor = std::make_shared<watchman::SerialExecutor>(*pool);
+  }
+  if (dispatch.queued.exchange(true)) {
+    // There's already a run waiting to start; it will observe
+    // everything that we would have looked at
+    return;
+  }
+  w_root_addref(root);
+  dispatch.executor->run([root] { run_subscriptions_for_root(root); });
+}
+
 static void update_subscription_ticks(struct watchman_client_subscription *sub,
     w_query_res *res) {
   // create a new spec that will be used the next time
   sub->query->since_spec = w_clockspec_new_clock(res->root_number, res->ticks);
 }
 
-static json_t *build_subscription_results(
-    struct watchman_client_subscription *sub,
-    struct write_locked_watchman_root *lock)
-{
-  w_query_res res;
-  json_t *response;
-  json_t *file_list;
-  char clockbuf[128];
+// Subscriptions whose queries differ only in these fields produce the
+// same results: since is superseded by the cursor that we maintain for
+// the subscription, and the others only control when it is dispatched
+static const char* const dispatch_only_fields[] = {
+    "since",
+    "defer",
+    "drop",
+    "defer_vcs",
+};
+
+static w_string subscription_spec_key(json_t* query_spec) {
+  auto spec = json_copy(query_spec);
+  for (auto field : dispatch_only_fields) {
+    json_object_del(spec, field);
+  }
+  auto dumped = json_dumps(spec, JSON_SORT_KEYS | JSON_COMPACT);
+  json_decref(spec);
+  if (!dumped) {
+    return nullptr;
+  }
+  w_string key(dumped, W_STRING_BYTE);
+  free(dumped);
+  return key;
+}
+
+template <typename Lock>
+static bool execute_subscription_query(
+    struct watchman_client_subscription* sub,
+    Lock* lock,
+    w_query_res* res,
+    w_query_generator generator) {
   auto since_spec = sub->query->since_spec.get();
 
   if (since_spec && since_spec->tag == w_cs_clock) {
@@ -156,27 +283,29 @@ static json_t *build_subscription_results(
       (uint32_t)cfg_get_int(lock->root, "subscription_lock_timeout_ms", 100);
   w_log(W_LOG_DBG, "running subscription %s %p\n", sub->name->buf, sub);
 
-  if (!w_query_execute_locked(sub->query.get(), lock, &res, time_generator)) {
+  if (!w_query_execute_locked(sub->query.get(), lock, res, generator)) {
     w_log(W_LOG_ERR, "error running subscription %s query: %s",
-        sub->name->buf, res.errmsg);
-    return NULL;
+        sub->name->buf, res->errmsg);
+    return false;
   }
 
   w_log(
       W_LOG_DBG,
       "subscription %s generated %" PRIu32 " results\n",
       sub->name->buf,
-      uint32_t(res.results.size()));
-
-  if (res.results.empty()) {
-    update_subscription_ticks(sub, &res);
-    return NULL;
-  }
-
-  file_list = w_query_results_to_json(
-      &sub->field_list, res.results.size(), res.results);
+      uint32_t(res->results.size()));
+  return true;
+}
 
-  response = make_response();
+// Builds the response for sub from the results of its query, leaving
+// out the results themselves, and advances its cursor
+static json_t* make_subscription_response(
+    struct watchman_client_subscription* sub,
+    struct read_locked_watchman_root* lock,
+    w_query_res* res) {
+  auto since_spec = sub->query->since_spec.get();
+  char clockbuf[128];
+  json_t* response = make_response();
 
   // It is way too much of a hassle to try to recreate the clock value if it's
   // not a relative clock spec, and it's only going to happen on the first run
@@ -186,13 +315,12 @@ static json_t *build_subscription_results(
                       clockbuf, sizeof(clockbuf))) {
     set_unicode_prop(response, "since", clockbuf);
   }
-  if (clock_id_string(res.root_number, res.ticks, clockbuf, sizeof(clockbuf))) {
+  if (clock_id_string(res->root_number, res->ticks, clockbuf, sizeof(clockbuf))) {
     set_unicode_prop(response, "clock", clockbuf);
   }
-  update_subscription_ticks(sub, &res);
+  update_subscription_ticks(sub, res);
 
-  set_prop(response, "is_fresh_instance", json_boolean(res.is_fresh_instance));
-  set_prop(response, "files", file_list);
+  set_prop(response, "is_fresh_instance", json_boolean(res->is_fresh_instance));
   set_prop(response, "root", w_string_to_json(lock->root->root_path));
   set_prop(response, "subscription", w_string_to_json(sub->name));
   set_prop(response, "unilateral", json_true());
@@ -200,26 +328,230 @@ static json_t *build_subscription_results(
   return response;
 }
 
-/* must be called with root and client locked */
-void w_run_subscription_rules(
-    struct watchman_user_client *client,
+// A response to a subscriber, along with its encoded form if it has one
+struct subscription_pdu {
+  json_t* json;
+  w_encoded_pdu* pdu;
+};
+
+// Adds the results of sub's query to response, which must otherwise be
+// complete, encoding them for pdu_type and a peer with bser_capabilities
+// where we can.  If the subscription
+// asked for its files in chunks, all but the last chunk of files go into
+// partial responses of their own, which are appended to pdus ahead of
+// response itself; the final response carries the clock and the rest of
+// the subscription metadata.
+// Must be called with the root locked, as the results refer to its files.
+// Every chunk is rendered here, rather than as the client takes the one
+// before it: by then the files may have changed or been freed, and the
+// subscription's cursor has already moved past them.
+static void render_subscription_pdus(
+    enum w_pdu_type pdu_type,
+    uint32_t bser_capabilities,
+    struct watchman_client_subscription* sub,
+    w_query_res* res,
+    json_t* response,
+    std::vector<subscription_pdu>& pdus) {
+  auto query = sub->query.get();
+  auto chunk_size = query->chunk_size;
+  auto num_files = res->results.size();
+  size_t start = 0;
+
+  if (res->collapsed || query->result_mode != W_QUERY_RESULT_FILES) {
+    pdus.push_back(subscription_pdu{
+        response,
+        w_query_render_result(pdu_type, bser_capabilities, query,
+                              &sub->field_list, res, response)});
+    return;
+  }
+
+  while (chunk_size && num_files - start > chunk_size) {
+    auto partial = make_response();
+    set_prop(partial, "root", json_incref(json_object_get(response, "root")));
+    set_prop(partial, "subscription",
+             json_incref(json_object_get(response, "subscription")));
+    set_prop(partial, "unilateral", json_true());
+    set_prop(partial, "partial", json_true());
+    pdus.push_back(subscription_pdu{
+        partial,
+        w_query_render_results(pdu_type, bser_capabilities, partial, "files",
+                               &sub->field_list, res->results, start,
+                               chunk_size)});
+    start += chunk_size;
+  }
+
+  pdus.push_back(subscription_pdu{
+      response,
+      w_query_render_results(pdu_type, bser_capabilities, response, "files",
+                             &sub->field_list, res->results, start,
+                             num_files - start)});
+}
+
+// Runs the query for a new subscription, rendering its initial results
+// into pdus for the subscriber
+static void build_subscription_results(
     struct watchman_client_subscription *sub,
-    struct write_locked_watchman_root *lock)
+    struct write_locked_watchman_root *lock,
+    enum w_pdu_type pdu_type,
+    uint32_t bser_capabilities,
+    std::vector<subscription_pdu>& pdus)
 {
-  json_t *response = build_subscription_results(sub, lock);
+  w_query_res res;
 
-  if (!response) {
+  if (!execute_subscription_query(sub, lock, &res, time_generator)) {
     return;
   }
 
-  add_root_warnings_to_response(response, w_root_read_lock_from_write(lock));
+  if (res.num_matches == 0) {
+    update_subscription_ticks(sub, &res);
+    return;
+  }
+
+  auto read_lock = w_root_read_lock_from_write(lock);
+  render_subscription_pdus(pdu_type, bser_capabilities, sub, &res,
+                           make_subscription_response(sub, read_lock, &res),
+                           pdus);
+}
+
+static void enqueue_subscription_response(
+    struct watchman_user_client* client,
+    struct read_locked_watchman_root* lock,
+    struct watchman_client_subscription* sub,
+    const struct w_clockspec* since,
+    w_query_res* res,
+    json_t* response) {
+  std::vector<subscription_pdu> pdus;
+
+  add_root_warnings_to_response(response, lock);
+  render_subscription_pdus(client->client.pdu_type,
+                           client->client.writer.bser_capabilities, sub, res,
+                           response, pdus);
+
+  bool continued = false;
+  for (auto& item : pdus) {
+    if (!w_client_enqueue_notification(&client->client, sub, since, item.json,
+                                       item.pdu, continued)) {
+      w_log(W_LOG_DBG, "failed to queue sub response\n");
+      json_decref(item.json);
+      delete item.pdu;
+    }
+    continued = true;
+  }
+}
+
+// Evaluates the query for the first member of group and sends the
+// results to all of them.  The members have equivalent queries and
+// cursors, so they would all have produced the same files.
+static void run_subscription_group(
+    struct read_locked_watchman_root* lock,
+    const std::vector<pending_subscription>& group,
+    w_query_generator generator) {
+  auto leader = group.front().sub;
+  w_query_res res;
+
+  if (!execute_subscription_query(leader, lock, &res, generator)) {
+    return;
+  }
+
+  if (res.num_matches == 0) {
+    for (auto& member : group) {
+      update_subscription_ticks(member.sub, &res);
+    }
+    return;
+  }
+
+  // Each member gets its own rendering of the results, encoded for its
+  // client; the results refer to the files, so this is done under the lock
+  for (auto& member : group) {
+    if (member.sub != leader) {
+      w_log(
+          W_LOG_DBG,
+          "subscription %s shares the results of %s\n",
+          member.sub->name->buf,
+          leader->name->buf);
+    }
+    // The results are relative to the cursor as it was before the
+    // response moves it on
+    std::unique_ptr<w_clockspec> since;
+    auto since_spec = member.sub->query->since_spec.get();
+    if (since_spec && since_spec->tag == w_cs_clock) {
+      since = w_clockspec_new_clock(
+          since_spec->clock.root_number, since_spec->clock.ticks);
+    }
+    auto response = make_subscription_response(member.sub, lock, &res);
+    enqueue_subscription_response(
+        member.client, lock, member.sub, since.get(), &res, response);
+  }
+}
+
+// Groups the pending subscriptions that would produce identical results
+// so that each distinct query is evaluated once per settle, and has the
+// rest share the files that changed since the previous settle
+static void dispatch_subscriptions(
+    struct read_locked_watchman_root* lock,
+    std::vector<pending_subscription>& pending,
+    SettleCandidates* candidates) {
+  const w_root_t* root = lock->root;
+  std::vector<std::vector<pending_subscription>> groups;
+  std::unordered_map<w_string, size_t> group_index;
+
+  for (auto& item : pending) {
+    auto since_spec = item.sub->query->since_spec.get();
+
+    if (since_spec && since_spec->tag == w_cs_clock) {
+      if (since_spec->clock.root_number == root->inner.number) {
+        candidates->include(since_spec->clock.ticks);
+      }
+
+      if (item.sub->spec_key) {
+        auto key = w_string::printf(
+            "%" PRIu32 ":%" PRIu32 ":%s",
+            since_spec->clock.root_number,
+            since_spec->clock.ticks,
+            item.sub->spec_key.c_str());
+        auto it = group_index.find(key);
+        if (it != group_index.end()) {
+          groups[it->second].push_back(item);
+          continue;
+        }
+        group_index.emplace(key, groups.size());
+      }
+    }
 
-  if (!enqueue_response(&client->client, response, true)) {
-    w_log(W_LOG_DBG, "failed to queue sub response\n");
-    json_decref(response);
+    groups.emplace_back(1, item);
+  }
+
+  if (groups.size() < pending.size()) {
+    w_log(
+        W_LOG_DBG,
+        "evaluating %" PRIu32 " distinct queries for %" PRIu32
+        " subscriptions\n",
+        uint32_t(groups.size()),
+        uint32_t(pending.size()));
+  }
+
+  for (auto& group : groups) {
+    run_subscription_group(lock, group, candidates->generator());
+  }
+
+  auto mostRecent = root->inner.view->getMostRecentTickValue();
+  for (auto& item : pending) {
+    item.sub->last_sub_tick = mostRecent;
   }
 }
 
+/* must be called with root and client locked */
+void w_run_subscription_rules(
+    struct watchman_user_client *client,
+    struct watchman_client_subscription *sub,
+    struct write_locked_watchman_root *lock)
+{
+  run_subscription_group(
+      w_root_read_lock_from_write(lock),
+      {pending_subscription{client, sub}},
+      time_generator);
+}
+
 void w_cancel_subscriptions_for_root(const w_root_t *root) {
   w_ht_iter_t iter;
   pthread_mutex_lock(&w_client_lock);
@@ -303,12 +635,15 @@ static void cmd_unsubscribe(struct watchman_client *clientbase, json_t *args)
 W_CMD_REG("unsubscribe", cmd_unsubscribe, CMD_DAEMON | CMD_ALLOW_ANY_USER,
           w_cmd_realpath_root)
 
+static std::atomic<uint64_t> next_subscription_id{0};
+
 /* subscribe /root subname {query}
  * Subscribes the client connection to the specified root. */
 static void cmd_subscribe(struct watchman_client *clientbase, json_t *args)
 {
   struct watchman_client_subscription *sub;
-  json_t *resp, *initial_subscription_results;
+  json_t *resp;
+  std::vector<subscription_pdu> initial_pdus;
   json_t *jfield_list;
   json_t *jname;
   std::shared_ptr<w_query> query;
@@ -376,7 +711,9 @@ static void cmd_subscribe(struct watchman_client *clientbase, json_t *args)
   }
 
   sub->name = json_to_w_string_incref(jname);
+  sub->id = ++next_subscription_id;
   sub->query = query;
+  sub->spec_key = subscription_spec_key(query_spec);
 
   json_unpack(query_spec, "{s?:b}", "defer_vcs", &defer);
   sub->vcs_defer = defer;
@@ -417,12 +754,14 @@ static void cmd_subscribe(struct watchman_client *clientbase, json_t *args)
 
   add_root_warnings_to_response(resp, w_root_read_lock_from_write(&lock));
   annotate_with_clock(w_root_read_lock_from_write(&lock), resp);
-  initial_subscription_results = build_subscription_results(sub, &lock);
+  build_subscription_results(sub, &lock, client->client.pdu_type,
+                             client->client.writer.bser_capabilities,
+                             initial_pdus);
   w_root_unlock(&lock, &unlocked);
 
   send_and_dispose_response(&client->client, resp);
-  if (initial_subscription_results) {
-    send_and_dispose_response(&client->client, initial_subscription_results);
+  for (auto& item : initial_pdus) {
+    send_and_dispose_response(&client->client, item.json, item.pdu);
   }
 done:
   w_root_delref(&unlocked);
@@ -7,7 +7,9 @@
 
 /* process any pending triggers.
  * This is called from the IO thread */
-void process_triggers(struct write_locked_watchman_root *lock) {
+void process_triggers(
+    struct write_locked_watchman_root* lock,
+    SettleCandidates* candidates) {
   w_root_t *root = lock->root;
 
   auto mostRecent = root->inner.ticks;
@@ -45,7 +47,7 @@ void process_triggers(struct write_locked_watchman_root *lock) {
         continue;
       }
 
-      w_assess_trigger(lock, cmd.get());
+      w_assess_trigger(lock, cmd.get(), candidates->generator());
     }
   }
 
@@ -2,6 +2,10 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include <algorithm>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 
 bool w_json_buffer_init(w_jbuffer_t *jr)
 {
@@ -193,66 +197,214 @@ bool w_bser_decode_pdu_info(w_jbuffer_t *jr, w_stm_t stm, uint32_t bser_version,
   return true;
 }
 
-static json_t *read_bser_pdu(w_jbuffer_t *jr, w_stm_t stm, uint32_t bser_version,
+static json_t *decode_bser_payload(uint32_t bser_capabilities,
+    const char *buf, const char *end, w_stm_t stm, json_error_t *jerr);
+
+#ifdef HAVE_MEMFD_CREATE
+// The value of a PDU with BSER_CAP_MEMFD is the size of the memfd that
+// was passed along with it, which holds a BSER v2 PDU of its own.  That
+// is mapped and decoded in place.
+static json_t *read_memfd_pdu(const char *buf, const char *end, w_stm_t stm,
     json_error_t *jerr)
 {
-  json_int_t needed;
-  json_int_t val;
-  json_int_t bser_capabilities;
-  uint32_t ideal;
-  json_int_t need;
-  int r;
-  json_t *obj;
+  json_int_t needed, len, caps, plen;
+  json_t *obj = NULL;
+  const char *pdu;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = w_stm_take_fd(stm);
+  if (fd == -1) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "no memfd was passed along with the PDU");
+    return NULL;
+  }
+  // The sender must not be able to truncate or change the pages while
+  // we're decoding them
+  if (!bunser_int(buf, end - buf, &needed, &len) || len < 2 ||
+      (fcntl(fd, F_GET_SEALS) & (F_SEAL_SHRINK | F_SEAL_WRITE)) !=
+          (F_SEAL_SHRINK | F_SEAL_WRITE) ||
+      fstat(fd, &st) != 0 || st.st_size < len) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "invalid memfd PDU");
+    close(fd);
+    return NULL;
+  }
 
-  jr->rpos += 2;
+  map = mmap(NULL, (size_t)len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    snprintf(jerr->text, sizeof(jerr->text),
+        "failed to map the memfd PDU: %s", strerror(errno));
+    return NULL;
+  }
+  pdu = (const char*)map;
+  end = pdu + len;
 
-  // We don't handle EAGAIN cleanly in here
-  w_stm_set_nonblock(stm, false);
-  if (!w_bser_decode_pdu_info(jr, stm, bser_version, &val, &bser_capabilities,
-      jerr)) {
+  buf = pdu + 2;
+  if (memcmp(pdu, BSER_V2_MAGIC, 2) ||
+      !bunser_int(buf, end - buf, &needed, &caps)) {
+    goto bad_header;
+  }
+  buf += needed;
+  if (!bunser_int(buf, end - buf, &needed, &plen)) {
+    goto bad_header;
+  }
+  buf += needed;
+  if (plen != end - buf || (caps & BSER_CAP_MEMFD)) {
+    goto bad_header;
+  }
+  obj = decode_bser_payload((uint32_t)caps, buf, end, stm, jerr);
+  munmap(map, (size_t)len);
+  return obj;
+
+bad_header:
+  snprintf(jerr->text, sizeof(jerr->text),
+      "invalid header in the memfd PDU");
+  munmap(map, (size_t)len);
+  return obj;
+}
+#endif
+
+// Decodes the payload of a BSER PDU with bser_capabilities
+static json_t *decode_bser_payload(uint32_t bser_capabilities,
+    const char *buf, const char *end, w_stm_t stm, json_error_t *jerr)
+{
+  json_int_t needed;
+
+  if (bser_capabilities & BSER_CAP_MEMFD) {
+#ifdef HAVE_MEMFD_CREATE
+    return read_memfd_pdu(buf, end, stm, jerr);
+#else
+    unused_parameter(stm);
+    snprintf(jerr->text, sizeof(jerr->text),
+        "this build of watchman can't receive memfd PDUs");
     return NULL;
+#endif
   }
+  if (bser_capabilities & BSER_CAP_DEFLATE) {
+    std::string expanded;
+    if (!w_bser_inflate_payload(buf, end, expanded, jerr)) {
+      return NULL;
+    }
+    return bunser(expanded.data(), expanded.data() + expanded.size(),
+                  &needed, jerr);
+  }
+  return bunser(buf, end, &needed, jerr);
+}
+
+// Parses the header of the BSER PDU at the read position without consuming
+// it.  Returns 1 if it is complete, 0 if more data is needed and -1 if it
+// is invalid.
+static int peek_bser_header(w_jbuffer_t *jr, uint32_t bser_version,
+    json_int_t *header_len, json_int_t *len, json_int_t *bser_capabilities)
+{
+  const char *start = jr->buf + jr->rpos;
+  const char *buf = start + 2;
+  const char *end = jr->buf + jr->wpos;
+  json_int_t needed;
+
+  *bser_capabilities = 0;
+  if (bser_version == 2) {
+    if (buf >= end) {
+      return 0;
+    }
+    if (!bunser_int(buf, end - buf, &needed, bser_capabilities)) {
+      return needed == -1 ? -1 : 0;
+    }
+    buf += needed;
+  }
+  if (buf >= end) {
+    return 0;
+  }
+  if (!bunser_int(buf, end - buf, &needed, len)) {
+    return needed == -1 ? -1 : 0;
+  }
+  if (*len < 0) {
+    return -1;
+  }
+  *header_len = (buf + needed) - start;
+  return 1;
+}
+
+// The PDU is left in the buffer until all of it has arrived, so that a
+// non-blocking stream can return EAGAIN part way through and pick up where
+// it left off on the next call
+static json_t *read_bser_pdu(w_jbuffer_t *jr, w_stm_t stm, uint32_t bser_version,
+    json_error_t *jerr)
+{
+  json_int_t header_len = 0;
+  json_int_t val = 0;
+  json_int_t bser_capabilities;
+  json_t *obj;
+  int res;
 
-  // val tells us exactly how much storage we need for this PDU
-  need = val - (jr->allocd - jr->wpos);
-  if (need > 0) {
-    ideal = jr->allocd;
-    while (ideal < (uint32_t)need) {
-      ideal *= 2;
+  while (true) {
+    res = peek_bser_header(jr, bser_version, &header_len, &val,
+                           &bser_capabilities);
+    if (res == -1) {
+      snprintf(jerr->text, sizeof(jerr->text),
+          "failed to read PDU header");
+      return NULL;
     }
-    if (ideal > jr->allocd) {
-      auto buf = (char*)realloc(jr->buf, ideal);
+    if (res == 1) {
+      if (bser_version == 2 &&
+          (bser_capabilities & jr->refused_capabilities)) {
+        snprintf(jerr->text, sizeof(jerr->text),
+            "PDUs with capabilities 0x%" PRIx32 " are not accepted here",
+            (uint32_t)(bser_capabilities & jr->refused_capabilities));
+        return NULL;
+      }
+      if ((json_int_t)(jr->wpos - jr->rpos) >= header_len + val) {
+        break;
+      }
 
-      if (!buf) {
+      // We know exactly how much storage we need for this PDU
+      if (header_len + val > UINT32_MAX / 2) {
         snprintf(jerr->text, sizeof(jerr->text),
-            "out of memory while allocating %" PRIu32 " bytes",
-            ideal);
+            "PDU of %" PRId64 " bytes is too large", (int64_t)val);
         return NULL;
       }
+      shunt_down(jr);
+      uint32_t ideal = jr->allocd;
+      while (ideal < (uint32_t)(header_len + val)) {
+        ideal *= 2;
+      }
+      if (ideal > jr->allocd) {
+        auto buf = (char*)realloc(jr->buf, ideal);
+
+        if (!buf) {
+          snprintf(jerr->text, sizeof(jerr->text),
+              "out of memory while allocating %" PRIu32 " bytes",
+              ideal);
+          return NULL;
+        }
 
-      jr->buf = buf;
-      jr->allocd = ideal;
+        jr->buf = buf;
+        jr->allocd = ideal;
+      }
     }
-  }
 
-  // We have enough room for the whole thing, let's read it in
-  while ((jr->wpos - jr->rpos) < val) {
-    r = w_stm_read(stm, jr->buf + jr->wpos, jr->allocd - jr->wpos);
-    if (r <= 0) {
-      snprintf(jerr->text, sizeof(jerr->text),
-          "error reading PDU: %s",
-          strerror(errno));
+    if (!fill_buffer(jr, stm)) {
+      if (errno != EAGAIN) {
+        snprintf(jerr->text, sizeof(jerr->text),
+            "error reading PDU: %s",
+            errno ? strerror(errno) : "EOF");
+      }
       return NULL;
     }
-    jr->wpos += r;
   }
 
-  obj = bunser(jr->buf + jr->rpos, jr->buf + jr->wpos, &needed, jerr);
+  jr->rpos += (uint32_t)header_len;
+  jr->bser_capabilities = bser_version == 2 ? (uint32_t)bser_capabilities : 0;
+  obj = decode_bser_payload(jr->bser_capabilities, jr->buf + jr->rpos,
+                            jr->buf + jr->rpos + val, stm, jerr);
 
-  // Ensure that we move the read position to the wpos; we consumed it all
-  jr->rpos = jr->wpos;
+  // Move the read position past this PDU; anything beyond it that we
+  // read is the start of the next one
+  jr->rpos += (uint32_t)val;
 
-  w_stm_set_nonblock(stm, true);
   return obj;
 }
 
@@ -429,6 +581,65 @@ static json_t *read_pdu_into_json(w_jbuffer_t *jr, w_stm_t stm,
   }
 }
 
+// Returns the capabilities in the header of the BSER v2 PDU at the read
+// position, or 0 for any other PDU
+static json_int_t peek_bser_capabilities(w_jbuffer_t *jr, w_stm_t stm)
+{
+  json_int_t needed, caps;
+
+  if (jr->pdu_type != is_bser_v2) {
+    return 0;
+  }
+  while (!bunser_int(jr->buf + jr->rpos + 2, jr->wpos - jr->rpos - 2,
+                     &needed, &caps)) {
+    // If the header is bad, let the caller report it
+    if (needed == -1 || !fill_buffer(jr, stm)) {
+      return 0;
+    }
+  }
+  return caps;
+}
+
+// Returns true if the PDU at the read position has a compressed payload,
+// prefix-compressed strings or was passed in a memfd, which the recipient
+// of the passthru may not be able to decode
+static bool uses_negotiated_encoding(w_jbuffer_t *jr, w_stm_t stm)
+{
+  return peek_bser_capabilities(jr, stm) &
+      (BSER_CAP_DEFLATE | BSER_CAP_PREFIX_STRINGS | BSER_CAP_MEMFD);
+}
+
+static bool transcode_bser_pdu(w_jbuffer_t *jr, w_stm_t stm,
+    enum w_pdu_type output_pdu, w_jbuffer_t *output_pdu_buf,
+    json_error_t *jerr);
+static bool transcode_json_pdu(w_jbuffer_t *jr, w_stm_t stm,
+    enum w_pdu_type output_pdu, w_jbuffer_t *output_pdu_buf,
+    json_error_t *jerr);
+
+// Returns true if the PDU at the read position can be converted to
+// output_pdu as it is read, rather than by decoding it into a json_t.
+// A compressed payload or one passed in a memfd has to be expanded or
+// mapped as a whole, so those take the slow path.
+static bool can_transcode(w_jbuffer_t *jr, w_stm_t stm,
+    enum w_pdu_type output_pdu)
+{
+  bool json_output =
+      output_pdu == is_json_compact || output_pdu == is_json_pretty;
+
+  switch (jr->pdu_type) {
+    case is_bser:
+      return json_output;
+    case is_bser_v2:
+      return json_output &&
+          !(peek_bser_capabilities(jr, stm) &
+            (BSER_CAP_DEFLATE | BSER_CAP_MEMFD));
+    case is_json_compact:
+      return output_pdu == is_bser || output_pdu == is_bser_v2;
+    default:
+      return false;
+  }
+}
+
 bool w_json_buffer_passthru(w_jbuffer_t *jr,
     enum w_pdu_type output_pdu,
     w_jbuffer_t *output_pdu_buf,
@@ -445,7 +656,7 @@ bool w_json_buffer_passthru(w_jbuffer_t *jr,
     return false;
   }
 
-  if (jr->pdu_type == output_pdu) {
+  if (jr->pdu_type == output_pdu && !uses_negotiated_encoding(jr, stm)) {
     // We can stream it through
     if (!stream_pdu(jr, stm, &jerr)) {
       w_log(W_LOG_ERR, "stream_pdu: %s\n", jerr.text);
@@ -454,6 +665,18 @@ bool w_json_buffer_passthru(w_jbuffer_t *jr,
     return true;
   }
 
+  if (can_transcode(jr, stm, output_pdu)) {
+    if (jr->pdu_type == is_json_compact) {
+      res = transcode_json_pdu(jr, stm, output_pdu, output_pdu_buf, &jerr);
+    } else {
+      res = transcode_bser_pdu(jr, stm, output_pdu, output_pdu_buf, &jerr);
+    }
+    if (!res) {
+      w_log(W_LOG_ERR, "failed to transcode response: %s\n", jerr.text);
+    }
+    return res;
+  }
+
   j = read_pdu_into_json(jr, stm, &jerr);
 
   if (!j) {
@@ -473,6 +696,9 @@ bool w_json_buffer_passthru(w_jbuffer_t *jr,
 json_t *w_json_buffer_next(w_jbuffer_t *jr, w_stm_t stm, json_error_t *jerr)
 {
   memset(jerr, 0, sizeof(*jerr));
+  // Callers tell a partial PDU on a non-blocking stream from a failure
+  // by errno being EAGAIN, so don't let a stale value leak out
+  errno = 0;
   if (!read_and_detect_pdu(jr, stm, jerr)) {
     return NULL;
   }
@@ -535,20 +761,111 @@ static int jbuffer_write(const char *buffer, size_t size, void *ptr)
   return 0;
 }
 
+// Writes the BSER PDU at the read position to stdout as JSON while it is
+// being read
+static bool transcode_bser_pdu(w_jbuffer_t *jr, w_stm_t stm,
+    enum w_pdu_type output_pdu, w_jbuffer_t *output_pdu_buf,
+    json_error_t *jerr)
+{
+  struct jbuffer_write_data data = { w_stm_stdout(), output_pdu_buf };
+  uint32_t bser_version = jr->pdu_type == is_bser_v2 ? 2 : 1;
+  json_int_t len, bser_capabilities;
+  char discard[WATCHMAN_IO_BUF_SIZE];
+  bool res;
+
+  jr->rpos += 2;
+  if (!w_bser_decode_pdu_info(jr, stm, bser_version, &len, &bser_capabilities,
+      jerr)) {
+    return false;
+  }
+  jr->bser_capabilities = bser_version == 2 ? (uint32_t)bser_capabilities : 0;
+
+  // Hand over whatever of the payload is already buffered, then read the
+  // rest of it straight from the stream, stopping at the end of the PDU
+  w_bser_read_func read = [jr, stm, &len](char *buf, int size) {
+    int r;
+
+    if (len <= 0) {
+      return 0;
+    }
+    size = (int)std::min((json_int_t)size, len);
+    if (jr->wpos > jr->rpos) {
+      r = (int)std::min((uint32_t)size, jr->wpos - jr->rpos);
+      memcpy(buf, jr->buf + jr->rpos, r);
+      jr->rpos += r;
+    } else {
+      r = w_stm_read(stm, buf, size);
+      if (r <= 0) {
+        return r;
+      }
+    }
+    len -= r;
+    return r;
+  };
+
+  w_json_buffer_reset(output_pdu_buf);
+  res = w_bser_transcode_json(read,
+            output_pdu == is_json_compact ? JSON_COMPACT : JSON_INDENT(4),
+            jbuffer_write, &data, jerr) &&
+      jbuffer_write("\n", 1, &data) == 0 && jbuffer_flush(&data);
+
+  // Skip anything that follows the value, so that the next PDU can be read
+  while (res && len > 0) {
+    if (read(discard, sizeof(discard)) <= 0) {
+      res = false;
+    }
+  }
+  return res;
+}
+
+// Writes the JSON PDU at the read position to stdout as BSER.  The BSER
+// header holds the length of the PDU, so the whole of the JSON text has to
+// be read before any of it can be written.
+static bool transcode_json_pdu(w_jbuffer_t *jr, w_stm_t stm,
+    enum w_pdu_type output_pdu, w_jbuffer_t *output_pdu_buf,
+    json_error_t *jerr)
+{
+  uint32_t scanned = 0;
+  w_encoded_pdu pdu;
+  char *nl;
+  bool res;
+
+  while (!(nl = (char*)memchr(jr->buf + jr->rpos + scanned, '\n',
+                              jr->wpos - jr->rpos - scanned))) {
+    scanned = jr->wpos - jr->rpos;
+    if (!fill_buffer(jr, stm)) {
+      snprintf(jerr->text, sizeof(jerr->text),
+          "unable to fill buffer");
+      return false;
+    }
+  }
+
+  if (output_pdu == is_bser_v2) {
+    res = w_json_transcode_bser_pdu(2, BSER_CAPS_SUPPORTED,
+        jr->buf + jr->rpos, nl, &pdu, jerr);
+  } else {
+    res = w_json_transcode_bser_pdu(1, 0, jr->buf + jr->rpos, nl, &pdu, jerr);
+  }
+  jr->rpos = (uint32_t)(nl + 1 - jr->buf);
+  if (!res) {
+    return false;
+  }
+
+  w_json_buffer_reset(output_pdu_buf);
+  return w_ser_write_encoded_pdu(output_pdu_buf, w_stm_stdout(), &pdu);
+}
+
 bool w_json_buffer_write_bser(uint32_t bser_version, uint32_t bser_capabilities,
     w_jbuffer_t *jr, w_stm_t stm, json_t *json)
 {
-  struct jbuffer_write_data data = { stm, jr };
-  int res;
-
-  res = w_bser_write_pdu(bser_version, bser_capabilities, jbuffer_write, json,
-      &data);
+  w_encoded_pdu pdu;
 
-  if (res != 0) {
+  if (!w_bser_encode_pdu(bser_version, bser_capabilities, json, nullptr,
+                         nullptr, &pdu)) {
     return false;
   }
 
-  return jbuffer_flush(&data);
+  return w_ser_write_encoded_pdu(jr, stm, &pdu);
 }
 
 bool w_json_buffer_write(w_jbuffer_t *jr, w_stm_t stm, json_t *json, int flags)
@@ -580,12 +897,224 @@ bool w_ser_write_pdu(enum w_pdu_type pdu_type,
     case is_bser:
       return w_json_buffer_write_bser(1, 0, jr, stm, json);
     case is_bser_v2:
-      return w_json_buffer_write_bser(2, 0, jr, stm, json);
+      return w_json_buffer_write_bser(2, BSER_CAPS_SUPPORTED, jr, stm, json);
+    case need_data:
+    default:
+      return false;
+  }
+}
+
+static int append_to_string(const char *buffer, size_t size, void *ptr)
+{
+  ((std::string*)ptr)->append(buffer, size);
+  return 0;
+}
+
+static bool json_encode_pdu(json_t *json, const char *key,
+    const w_pdu_value_encoder& encode_value, w_encoded_pdu *pdu)
+{
+  auto& buf = pdu->data;
+
+  if (json_dump_callback(json, append_to_string, &buf, JSON_COMPACT)) {
+    return false;
+  }
+
+  if (key) {
+    // Re-open the object and add the property to the end of it
+    buf.pop_back();
+    if (json_object_size(json) > 0) {
+      buf.push_back(',');
+    }
+    if (json_dump_string(key, strlen(key), append_to_string, &buf,
+                         JSON_COMPACT)) {
+      return false;
+    }
+    buf.push_back(':');
+    if (!encode_value(buf)) {
+      return false;
+    }
+    buf.push_back('}');
+  }
+
+  buf.push_back('\n');
+  return true;
+}
+
+bool w_ser_encode_pdu(enum w_pdu_type pdu_type, uint32_t bser_capabilities,
+    json_t *json, const char *key, const w_pdu_value_encoder& encode_value,
+    w_encoded_pdu *pdu)
+{
+  pdu->pdu_type = pdu_type;
+  pdu->data.clear();
+  pdu->start = 0;
+
+  switch (pdu_type) {
+    case is_json_compact:
+      return json_encode_pdu(json, key, encode_value, pdu);
+    case is_bser:
+      return w_bser_encode_pdu(1, 0, json, key, encode_value, pdu);
+    case is_bser_v2:
+      return w_bser_encode_pdu(2, BSER_CAPS_SUPPORTED | bser_capabilities,
+                               json, key, encode_value, pdu);
+    case is_json_pretty:
     case need_data:
     default:
       return false;
   }
 }
 
+static bool write_all(w_stm_t stm, const char *buf, size_t len)
+{
+  int x;
+
+  while (len > 0) {
+    x = w_stm_write(stm, buf, (int)MIN(len, INT_MAX));
+    if (x <= 0) {
+      return false;
+    }
+    buf += x;
+    len -= x;
+  }
+  return true;
+}
+
+#ifdef HAVE_MEMFD_CREATE
+// Copies the PDU into a sealed memfd and sends a stub PDU holding its
+// size along with the descriptor, so that a local peer can map the
+// result rather than read it through the socket.  Returns false if that
+// wasn't possible and the PDU should be written normally instead; if it
+// returns true, *ok holds the outcome of the write.
+static bool send_pdu_via_memfd(struct jbuffer_write_data *data,
+    const w_encoded_pdu *pdu, bool *ok)
+{
+  const char *buf = pdu->data.data() + pdu->start;
+  size_t len = pdu->data.size() - pdu->start;
+  w_encoded_pdu stub;
+  size_t done = 0;
+  bool encoded;
+  json_t *size;
+  int fd;
+  int x;
+
+  fd = memfd_create("watchman-pdu", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1) {
+    return false;
+  }
+  while (done < len) {
+    x = write(fd, buf + done, MIN(len - done, INT_MAX));
+    if (x <= 0) {
+      close(fd);
+      return false;
+    }
+    done += x;
+  }
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+    close(fd);
+    return false;
+  }
+
+  size = json_integer(len);
+  encoded = w_ser_encode_pdu(is_bser_v2, BSER_CAP_MEMFD, size, nullptr,
+                             nullptr, &stub);
+  json_decref(size);
+  if (!encoded) {
+    close(fd);
+    return false;
+  }
+  buf = stub.data.data() + stub.start;
+  len = stub.data.size() - stub.start;
+
+  if (!jbuffer_flush(data)) {
+    close(fd);
+    *ok = false;
+    return true;
+  }
+  x = w_stm_write_with_fd(data->stm, buf, (int)len, fd);
+  close(fd);
+  if (x == -1 && errno == ENOTSOCK) {
+    return false;
+  }
+  *ok = x > 0 && write_all(data->stm, buf + x, len - x);
+  return true;
+}
+#endif
+
+bool w_ser_write_encoded_pdu(w_jbuffer_t *jr, w_stm_t stm,
+    const w_encoded_pdu *pdu)
+{
+  struct jbuffer_write_data data = { stm, jr };
+  w_encoded_pdu deflated;
+  size_t len = pdu->data.size() - pdu->start;
+
+#ifdef HAVE_MEMFD_CREATE
+  // Hand very large PDUs to a local peer that can map them
+  if (pdu->pdu_type == is_bser_v2 &&
+      (jr->bser_capabilities & BSER_CAP_ACCEPT_MEMFD) &&
+      jr->memfd_threshold > 0 && len >= jr->memfd_threshold) {
+    bool ok;
+    if (send_pdu_via_memfd(&data, pdu, &ok)) {
+      return ok;
+    }
+  }
+#endif
+
+  // Compress large PDUs for a peer that can expand them
+  if (pdu->pdu_type == is_bser_v2 &&
+      (jr->bser_capabilities & BSER_CAP_ACCEPT_DEFLATE) &&
+      jr->deflate_threshold > 0 && len >= jr->deflate_threshold &&
+      w_bser_deflate_pdu(pdu, &deflated)) {
+    pdu = &deflated;
+  }
+
+  // Anything that is already buffered goes first
+  if (!jbuffer_flush(&data)) {
+    return false;
+  }
+
+  // The PDU is already in one piece, so there's no need to copy it
+  // through the buffer
+  return write_all(stm, pdu->data.data() + pdu->start,
+                   pdu->data.size() - pdu->start);
+}
+
+json_t *w_encoded_pdu_to_json(const w_encoded_pdu *pdu, json_error_t *jerr)
+{
+  const char *buf = pdu->data.data() + pdu->start;
+  const char *end = pdu->data.data() + pdu->data.size();
+  json_int_t needed, val;
+
+  memset(jerr, 0, sizeof(*jerr));
+
+  switch (pdu->pdu_type) {
+    case is_json_compact:
+      return json_loadb(buf, end - buf, 0, jerr);
+    case is_bser:
+    case is_bser_v2:
+      buf += 2;
+      if (pdu->pdu_type == is_bser_v2) {
+        // capabilities
+        if (!bunser_int(buf, end - buf, &needed, &val)) {
+          snprintf(jerr->text, sizeof(jerr->text),
+                   "invalid bser capabilities encoding");
+          return nullptr;
+        }
+        buf += needed;
+      }
+      // length
+      if (!bunser_int(buf, end - buf, &needed, &val)) {
+        snprintf(jerr->text, sizeof(jerr->text),
+                 "invalid bser length encoding");
+        return nullptr;
+      }
+      buf += needed;
+      return bunser(buf, end, &needed, jerr);
+    default:
+      snprintf(jerr->text, sizeof(jerr->text),
+               "can't decode pdu type %d", pdu->pdu_type);
+      return nullptr;
+  }
+}
+
 /* vim:ts=2:sw=2:et:
  */
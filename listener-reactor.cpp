@@ -0,0 +1,649 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "IOReactor.h"
+#include "ThreadPool.h"
+#include <deque>
+
+// When the client_reactor option is enabled, client sessions don't get a
+// thread of their own.  The sockets for all of them are multiplexed onto a
+// single reactor thread, which reads requests without blocking and hands
+// each complete one to a bounded pool of client workers to dispatch.  The
+// commands for a given session run one at a time and in order, and the
+// reactor stops reading from the session while one is in flight.
+// Responses are encoded on the workers into an output buffer for the
+// session, which is written out as the socket drains, so a client that is
+// slow to read holds on to its own buffer rather than a thread.  Once
+// that buffer holds WATCHMAN_IO_BUF_SIZE bytes, the session stops taking
+// responses from its queue, where they are subject to the queue limit and
+// coalescing, stops producing the rest of a response that is sent as a
+// series of PDUs, and stops reading requests, until the client catches up.
+// None of this holds on to a worker while it waits.
+
+#define DEFAULT_CLIENT_REACTOR_THREADS 16
+
+namespace {
+struct client_reactor_globals {
+  watchman::IOReactor reactor;
+  watchman::ThreadPool pool;
+};
+
+// Encoded responses, along with the descriptors that are to be passed
+// to the client with them
+struct output_buffer {
+  std::string data;
+  // (offset, fd) pairs, in offset order.  fd is sent along with the
+  // bytes that start at offset in data.
+  std::deque<std::pair<size_t, int>> fds;
+
+  void closeFds() {
+    for (auto& it : fds) {
+      close(it.second);
+    }
+    fds.clear();
+  }
+};
+}
+
+static client_reactor_globals* get_client_reactor() {
+  static std::once_flag once;
+  static client_reactor_globals* globals;
+
+  std::call_once(once, [] {
+    auto numThreads = cfg_get_int(
+        nullptr, "client_reactor_threads", DEFAULT_CLIENT_REACTOR_THREADS);
+    if (numThreads < 1) {
+      numThreads = 1;
+    }
+    // This is intentionally never freed; sessions may still be
+    // referencing it during process shutdown
+    globals = new client_reactor_globals;
+    globals->pool.start(size_t(numThreads), "client-worker");
+    globals->reactor.start("client-reactor");
+  });
+  return globals;
+}
+
+/* A stream that appends whatever is written to it to an output_buffer,
+ * which lets the usual PDU writers encode responses without touching
+ * the socket */
+static int outbuf_close(w_stm_t stm) {
+  unused_parameter(stm);
+  return -1;
+}
+
+static int outbuf_read(w_stm_t stm, void *buf, int size) {
+  unused_parameter(stm);
+  unused_parameter(buf);
+  unused_parameter(size);
+  errno = EBADF;
+  return -1;
+}
+
+static int outbuf_write(w_stm_t stm, const void *buf, int size) {
+  auto out = (output_buffer*)stm->handle;
+  out->data.append((const char*)buf, size);
+  return size;
+}
+
+static void outbuf_get_events(w_stm_t stm, w_evt_t *readable) {
+  unused_parameter(stm);
+  unused_parameter(readable);
+  w_log(W_LOG_FATAL, "calling get_events on an output buffer stm\n");
+}
+
+static void outbuf_set_nonb(w_stm_t stm, bool nonb) {
+  unused_parameter(stm);
+  unused_parameter(nonb);
+}
+
+static bool outbuf_rewind(w_stm_t stm) {
+  unused_parameter(stm);
+  return false;
+}
+
+static bool outbuf_shutdown(w_stm_t stm) {
+  unused_parameter(stm);
+  return false;
+}
+
+#ifndef _WIN32
+static int outbuf_write_with_fd(w_stm_t stm, const void *buf, int size,
+                                int fd) {
+  auto out = (output_buffer*)stm->handle;
+  int dupfd = dup(fd);
+
+  if (dupfd == -1) {
+    return -1;
+  }
+  w_set_cloexec(dupfd);
+  out->fds.emplace_back(out->data.size(), dupfd);
+  out->data.append((const char*)buf, size);
+  return size;
+}
+#endif
+
+static struct watchman_stream_ops outbuf_ops = {
+  outbuf_close,
+  outbuf_read,
+  outbuf_write,
+  outbuf_get_events,
+  outbuf_set_nonb,
+  outbuf_rewind,
+  outbuf_shutdown,
+  nullptr,
+  nullptr,
+#ifndef _WIN32
+  outbuf_write_with_fd,
+#else
+  nullptr,
+#endif
+  nullptr,
+};
+
+struct watchman_client_reactor
+    : public std::enable_shared_from_this<watchman_client_reactor> {
+  // We own the client; it is deleted along with us
+  struct watchman_client* client;
+  client_reactor_globals* globals;
+  watchman::SerialExecutor executor;
+  uint64_t fd_handle{0};
+  // true if a flush of the queued responses is waiting on the executor
+  std::atomic<bool> flush_queued{false};
+
+  // Produces the rest of the response to the command in flight, if it is
+  // being sent as a series of PDUs; see w_client_send_series.  Only used
+  // via the executor.
+  std::function<bool()> producer;
+
+  std::mutex mutex;
+  // The remaining members are guarded by mutex.
+  // true while the reactor is responsible for reading the next request,
+  // and false while a command is in flight
+  bool reading{false};
+  // true from when a request is dispatched until the response to it has
+  // been encoded into the output
+  bool in_flight{false};
+  // Set once the client has finished sending requests, or we have been
+  // stopped; we close the session once the output has been written out
+  bool hungup{false};
+  // Set once the session has failed or is being shut down
+  bool closing{false};
+  output_buffer output;
+  // The number of bytes at the front of output.data that have been sent
+  size_t output_pos{0};
+  // Set if we stopped taking responses from the queue, producing the
+  // response to the command in flight, or reading requests, because the
+  // output was backlogged
+  bool flush_when_drained{false};
+  bool produce_when_drained{false};
+  bool read_when_drained{false};
+
+  watchman_client_reactor(
+      struct watchman_client* client,
+      client_reactor_globals* globals)
+      : client(client), globals(globals), executor(globals->pool) {}
+
+  ~watchman_client_reactor() {
+    output.closeFds();
+    if (client) {
+      client->reactor = nullptr;
+      w_client_delete(client);
+    }
+  }
+
+  bool backloggedLocked() const {
+    return output.data.size() - output_pos >= WATCHMAN_IO_BUF_SIZE;
+  }
+
+  void updateInterestLocked() {
+    int events = 0;
+    if (!closing) {
+      if (reading) {
+        events |= watchman::IOReactor::Readable;
+      }
+      if (output_pos < output.data.size()) {
+        events |= watchman::IOReactor::Writable;
+      }
+    }
+    globals->reactor.modifyFd(fd_handle, events);
+  }
+
+  // Marks the session as failed, and arranges for it to be torn down
+  // once any command that is in flight has finished
+  void closeLocked() {
+    if (closing) {
+      return;
+    }
+    closing = true;
+    updateInterestLocked();
+
+    auto self = shared_from_this();
+    executor.run([self] { self->teardown(); });
+  }
+
+  void teardown() {
+    // Once it is out of the map, nothing else will queue responses for
+    // the client or wake us up
+    pthread_mutex_lock(&w_client_lock);
+    w_ht_del(clients, w_ht_ptr_val(client));
+    pthread_mutex_unlock(&w_client_lock);
+
+    // This drops the reference held by the reactor; we're deleted
+    // along with the client once the last queued function has run
+    globals->reactor.removeFd(fd_handle);
+  }
+
+  // Sends as much of the output as the socket will take
+  void writeOutputLocked() {
+    while (output_pos < output.data.size()) {
+      size_t end = output.data.size();
+      int fd = -1;
+      int x;
+
+      if (!output.fds.empty()) {
+        if (output.fds.front().first == output_pos) {
+          fd = output.fds.front().second;
+          if (output.fds.size() > 1) {
+            end = output.fds[1].first;
+          }
+        } else {
+          end = output.fds.front().first;
+        }
+      }
+
+      auto len = (int)MIN(end - output_pos, (size_t)INT_MAX);
+      auto buf = output.data.data() + output_pos;
+      if (fd == -1) {
+        x = w_stm_write(client->stm, buf, len);
+      } else {
+        x = w_stm_write_with_fd(client->stm, buf, len, fd);
+      }
+      if (x <= 0) {
+        if (x == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        }
+        closeLocked();
+        return;
+      }
+
+      if (fd != -1) {
+        close(fd);
+        output.fds.pop_front();
+      }
+      output_pos += x;
+    }
+
+    if (output_pos == output.data.size()) {
+      output.data.clear();
+      output_pos = 0;
+      if (hungup && !in_flight) {
+        closeLocked();
+      }
+    } else if (output_pos >= WATCHMAN_IO_BUF_SIZE &&
+               output_pos >= output.data.size() / 2) {
+      // Don't let the part that has been sent accumulate indefinitely
+      output.data.erase(0, output_pos);
+      for (auto& it : output.fds) {
+        it.first -= output_pos;
+      }
+      output_pos = 0;
+    }
+
+    if ((flush_when_drained || produce_when_drained || read_when_drained) &&
+        !backloggedLocked()) {
+      bool produce = produce_when_drained;
+      bool read = read_when_drained;
+      flush_when_drained = false;
+      produce_when_drained = false;
+      read_when_drained = false;
+
+      auto self = shared_from_this();
+      executor.run([self, produce, read] {
+        if (produce) {
+          // This flushes the queue once the command has finished
+          self->continueProducing();
+          return;
+        }
+        self->flushResponses();
+        if (read) {
+          self->resumeReading();
+        }
+      });
+    }
+  }
+
+  // Adds encoded to the output and starts sending it.  Returns false if
+  // the session has failed.
+  bool appendOutputLocked(output_buffer& encoded) {
+    if (closing) {
+      encoded.closeFds();
+      return false;
+    }
+
+    auto base = output.data.size();
+    for (auto& it : encoded.fds) {
+      output.fds.emplace_back(base + it.first, it.second);
+    }
+    encoded.fds.clear();
+    output.data.append(encoded.data);
+
+    writeOutputLocked();
+    updateInterestLocked();
+    return !closing;
+  }
+
+  // Called on the reactor thread
+  void onEvents(int events) {
+    if (events & watchman::IOReactor::Writable) {
+      std::unique_lock<std::mutex> lock(mutex);
+      writeOutputLocked();
+      updateInterestLocked();
+    }
+
+    if (events & watchman::IOReactor::Readable) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!reading || closing) {
+          return;
+        }
+        reading = false;
+        updateInterestLocked();
+      }
+      readRequest();
+    }
+  }
+
+  // Reads the next request, and dispatches it if it is complete.  Only
+  // the party that cleared reading (the reactor, or the worker that has
+  // just finished a command) may call this.
+  void readRequest() {
+    json_error_t jerr;
+    auto request = w_json_buffer_next(&client->reader, client->stm, &jerr);
+
+    if (!request && errno == EAGAIN) {
+      // Wait for the rest of it
+      std::unique_lock<std::mutex> lock(mutex);
+      reading = true;
+      updateInterestLocked();
+      return;
+    }
+
+    if (!request) {
+      if (client->reader.wpos != client->reader.rpos) {
+        w_log(W_LOG_ERR, "invalid data from client: %s\n", jerr.text);
+        std::unique_lock<std::mutex> lock(mutex);
+        closeLocked();
+        return;
+      }
+      // They disconnected in between PDUs; finish sending them whatever
+      // is left of the output first
+      std::unique_lock<std::mutex> lock(mutex);
+      hungup = true;
+      if (output.data.empty()) {
+        closeLocked();
+      }
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      in_flight = true;
+    }
+    auto self = shared_from_this();
+    executor.run([self, request] { self->runCommand(request); });
+  }
+
+  // Called on a worker, via the executor
+  void runCommand(json_t* request) {
+    client->pdu_type = client->reader.pdu_type;
+    client->writer.bser_capabilities = client->pdu_type == is_bser_v2
+        ? client->reader.bser_capabilities
+        : 0;
+    dispatch_command(client, request, CMD_DAEMON);
+    json_decref(request);
+
+    if (producer) {
+      continueProducing();
+      return;
+    }
+    finishCommand();
+  }
+
+  // Runs the producer for the command in flight until it has sent the
+  // last of its PDUs, or until the output is backlogged, in which case we
+  // give up the worker and pick up where we left off once it drains.
+  // Called on a worker, via the executor.
+  void continueProducing() {
+    while (producer) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (closing) {
+          producer = nullptr;
+          return;
+        }
+        if (backloggedLocked()) {
+          produce_when_drained = true;
+          return;
+        }
+      }
+      if (!producer()) {
+        producer = nullptr;
+      }
+    }
+    finishCommand();
+  }
+
+  // Sends whatever the command queued and moves on to the next request.
+  // Called on a worker, via the executor.
+  void finishCommand() {
+    flushResponses();
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      in_flight = false;
+      if (closing) {
+        return;
+      }
+      if (hungup) {
+        // We were stopped while the command ran; finish sending the
+        // output, if there is any, and don't read any more requests
+        if (output.data.empty()) {
+          closeLocked();
+        }
+        return;
+      }
+      if (backloggedLocked()) {
+        // Don't take on more work until the client catches up
+        read_when_drained = true;
+        return;
+      }
+    }
+    // There may be another request in the reader already
+    readRequest();
+  }
+
+  void resumeReading() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (closing) {
+        return;
+      }
+    }
+    readRequest();
+  }
+
+  // Encodes and sends the responses that are queued for the client.
+  // Called on a worker, via the executor.
+  void flushResponses() {
+    struct watchman_client_response *queued;
+    output_buffer encoded;
+    struct watchman_stream stm = {&encoded, &outbuf_ops};
+    bool ok = true;
+
+    flush_queued = false;
+
+    if (producer) {
+      // Nothing may come between the PDUs of the response to the command
+      // in flight; finishCommand flushes the queue once it has been sent
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (closing) {
+        return;
+      }
+    }
+    // This takes w_client_lock, which is acquired before our mutex
+    // elsewhere, so it can't be called with the mutex held
+    if (w_client_overflowed(client)) {
+      // It's the output that is holding up the queue, so there is no
+      // point trying to tell the client why
+      std::unique_lock<std::mutex> lock(mutex);
+      closeLocked();
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (closing) {
+        return;
+      }
+      if (backloggedLocked()) {
+        // Leave them in the queue until the client catches up
+        flush_when_drained = true;
+        return;
+      }
+    }
+
+    queued = w_client_take_responses(client);
+
+    while (queued) {
+      auto resp = queued;
+      if (ok) {
+        ok = w_client_write_response(client, &stm, resp->json, resp->pdu);
+      }
+      queued = resp->next;
+      json_decref(resp->json);
+      delete resp->pdu;
+      free(resp);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!ok) {
+      encoded.closeFds();
+      closeLocked();
+      return;
+    }
+    if (!encoded.data.empty()) {
+      appendOutputLocked(encoded);
+    }
+  }
+
+  void wake() {
+    if (flush_queued.exchange(true)) {
+      // There's already a flush waiting to run; it will pick up
+      // whatever we were woken for
+      return;
+    }
+    auto self = shared_from_this();
+    executor.run([self] { self->flushResponses(); });
+  }
+
+  bool sendNow(json_t* response, struct w_encoded_pdu* pdu) {
+    output_buffer encoded;
+    struct watchman_stream stm = {&encoded, &outbuf_ops};
+    bool ok = w_client_write_response(client, &stm, response, pdu);
+
+    json_decref(response);
+    delete pdu;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!ok) {
+      encoded.closeFds();
+      closeLocked();
+      return false;
+    }
+    // The producer that sent it waits for the output to drain, if need
+    // be, before building the next one
+    return appendOutputLocked(encoded);
+  }
+
+  // Stops reading requests and closes the session once the response to
+  // any command in flight, and the rest of the output, has been written
+  // out.  force closes it at once.
+  void stop(bool force) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (force || (!in_flight && output.data.empty())) {
+      closeLocked();
+      return;
+    }
+    hungup = true;
+    reading = false;
+    read_when_drained = false;
+    updateInterestLocked();
+  }
+};
+
+bool w_client_reactor_enabled(void) {
+#ifdef HAVE_SYS_EPOLL_H
+  return cfg_get_bool(nullptr, "client_reactor", false);
+#else
+  return false;
+#endif
+}
+
+bool w_client_reactor_add(struct watchman_client *client) {
+  auto globals = get_client_reactor();
+  auto session = std::make_shared<watchman_client_reactor>(client, globals);
+
+  w_stm_set_nonblock(client->stm, true);
+  client->client_is_owner = w_stm_peer_is_owner(client->stm);
+
+  // Hold the lock so that anything that queues a response for the client
+  // sees it either before or after it is set up, not in between
+  pthread_mutex_lock(&w_client_lock);
+  try {
+    std::unique_lock<std::mutex> lock(session->mutex);
+    session->fd_handle = globals->reactor.addFd(
+        w_stm_fileno(client->stm),
+        watchman::IOReactor::Readable,
+        [session](int events) { session->onEvents(events); });
+    session->reading = true;
+  } catch (const std::exception& exc) {
+    pthread_mutex_unlock(&w_client_lock);
+    w_log(W_LOG_ERR, "failed to add client to the reactor: %s\n", exc.what());
+    // The caller still owns the client
+    session->client = nullptr;
+    return false;
+  }
+  client->reactor = session.get();
+  pthread_mutex_unlock(&w_client_lock);
+
+  return true;
+}
+
+void w_client_reactor_wake(struct watchman_client *client) {
+  client->reactor->wake();
+}
+
+bool w_client_reactor_send_now(struct watchman_client *client,
+    json_t *response, struct w_encoded_pdu *pdu) {
+  return client->reactor->sendNow(response, pdu);
+}
+
+void w_client_reactor_send_series(struct watchman_client *client,
+    std::function<bool()> produce) {
+  // This is called by the command, on the worker running it; runCommand
+  // takes it from here once the command returns
+  client->reactor->producer = std::move(produce);
+}
+
+void w_client_reactor_stop(struct watchman_client *client, bool force) {
+  client->reactor->stop(force);
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -121,6 +121,7 @@ static void delete_subscription(w_ht_val_t val)
 
   w_string_delref(sub->name);
   sub->query.reset();
+  sub->spec_key.reset();
   if (sub->drop_or_defer) {
     w_ht_free(sub->drop_or_defer);
   }
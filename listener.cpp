@@ -21,6 +21,26 @@ static volatile bool stopping = false;
 static volatile struct gimli_heartbeat *hb = NULL;
 #endif
 
+// BSER v2 responses at least this many bytes long are compressed for
+// the clients that can expand them
+#define DEFAULT_BSER_DEFLATE_THRESHOLD 65536
+// and those at least this long are passed in a memfd to the local
+// clients that can map them
+#define DEFAULT_BSER_MEMFD_THRESHOLD 1048576
+// Log messages for a client are dropped, and a client whose other
+// unilateral responses would take the queue past this many bytes is
+// disconnected
+#define DEFAULT_CLIENT_MAX_QUEUED_BYTES (16 * 1024 * 1024)
+
+W_CAP_REG("bser-v2")
+W_CAP_REG("bser-prefix-strings")
+#ifdef HAVE_ZLIB
+W_CAP_REG("bser-deflate")
+#endif
+#ifdef HAVE_MEMFD_CREATE
+W_CAP_REG("bser-memfd")
+#endif
+
 bool w_is_stopping(void) {
   return stopping;
 }
@@ -43,17 +63,64 @@ json_t *make_response(void)
   return resp;
 }
 
-/* must be called with the w_client_lock held */
-bool enqueue_response(struct watchman_client *client,
-    json_t *json, bool ping)
+static int count_bytes(const char *buffer, size_t size, void *ptr)
+{
+  unused_parameter(buffer);
+  *(size_t*)ptr += size;
+  return 0;
+}
+
+/* Roughly how many bytes a response takes up on the wire.  This is only
+ * used to bound the queues, so it doesn't matter which format the client
+ * ends up receiving it in. */
+static size_t response_size(json_t *json, const struct w_encoded_pdu *pdu)
+{
+  size_t size = 0;
+
+  if (pdu) {
+    return pdu->data.size() - pdu->start;
+  }
+  json_dump_callback(json, count_bytes, &size, JSON_COMPACT);
+  return size;
+}
+
+/* must be called with the w_client_lock held.  Unilateral responses
+ * (those with ping set) are refused once the client has overflowed its
+ * queue, and bounded ones are refused if they would overflow it.  A
+ * response that finds the queue empty always fits, so that a client that
+ * keeps up can receive notifications of any size. */
+static struct watchman_client_response *queue_response(
+    struct watchman_client *client, json_t *json, bool ping,
+    struct w_encoded_pdu *pdu, bool bounded)
 {
   struct watchman_client_response *resp;
+  size_t size = response_size(json, pdu);
+
+  if (ping &&
+      (client->overflowed ||
+       (bounded && client->max_queued_bytes > 0 && client->queued_bytes > 0 &&
+        client->queued_bytes + size > client->max_queued_bytes))) {
+    // The client isn't reading its notifications.  Rather than let the
+    // backlog grow without bound, or silently leave a gap in them, we
+    // refuse this one and have the client disconnected.
+    if (!client->overflowed) {
+      client->overflowed = true;
+      if (client->reactor) {
+        w_client_reactor_wake(client);
+      } else {
+        w_event_set(client->ping);
+      }
+    }
+    return NULL;
+  }
 
   resp = (watchman_client_response*)calloc(1, sizeof(*resp));
   if (!resp) {
-    return false;
+    return NULL;
   }
   resp->json = json;
+  resp->pdu = pdu;
+  resp->size = size;
 
   if (client->tail) {
     client->tail->next = resp;
@@ -61,24 +128,203 @@ bool enqueue_response(struct watchman_client *client,
     client->head = resp;
   }
   client->tail = resp;
-
-  if (ping) {
+  client->queue_depth++;
+  client->queued_bytes += resp->size;
+
+  if (client->reactor) {
+    // There's no thread to pick up the response when the current command
+    // finishes, so always arrange for it to be sent
+    w_client_reactor_wake(client);
+  } else if (ping) {
     w_event_set(client->ping);
   }
 
+  return resp;
+}
+
+/* must be called with the w_client_lock held */
+bool enqueue_response(struct watchman_client *client,
+    json_t *json, bool ping, struct w_encoded_pdu *pdu)
+{
+  return queue_response(client, json, ping, pdu, ping) != NULL;
+}
+
+/* must be called with the w_client_lock held */
+bool w_client_enqueue_notification(struct watchman_client *client,
+    struct watchman_client_subscription *sub, const struct w_clockspec *since,
+    json_t *json, struct w_encoded_pdu *pdu, bool continued)
+{
+  // The later chunks of a notification go wherever the first one went
+  auto resp = queue_response(client, json, true, pdu, !continued);
+
+  if (!resp) {
+    return false;
+  }
+  resp->sub_id = sub->id;
+  if (since && since->tag == w_cs_clock) {
+    resp->has_since = true;
+    resp->since_root_number = since->clock.root_number;
+    resp->since_ticks = since->clock.ticks;
+  }
   return true;
 }
 
+static void free_response(struct watchman_client_response *resp)
+{
+  json_decref(resp->json);
+  delete resp->pdu;
+  free(resp);
+}
+
+/* must be called with the w_client_lock held */
+void w_client_coalesce_subscription(struct watchman_client *client,
+    struct watchman_client_subscription *sub)
+{
+  struct watchman_client_response **link = &client->head;
+  struct watchman_client_response *resp, *last = NULL;
+  uint32_t root_number = 0, ticks = 0;
+  bool found = false;
+
+  while ((resp = *link) != NULL) {
+    if (resp->sub_id != sub->id) {
+      last = resp;
+      link = &resp->next;
+      continue;
+    }
+    if (!found) {
+      if (!resp->has_since) {
+        // We can't reproduce its results from our cursor
+        return;
+      }
+      found = true;
+      root_number = resp->since_root_number;
+      ticks = resp->since_ticks;
+    }
+
+    *link = resp->next;
+    client->queue_depth--;
+    client->queued_bytes -= resp->size;
+    free_response(resp);
+  }
+  client->tail = last;
+
+  if (found) {
+    sub->query->since_spec = w_clockspec_new_clock(root_number, ticks);
+    client->num_coalesced++;
+    w_log(W_LOG_DBG, "coalescing unsent notification for subscription %s\n",
+        sub->name->buf);
+  }
+}
+
+struct watchman_client_response *w_client_take_responses(
+    struct watchman_client *client)
+{
+  struct watchman_client_response *resp;
+
+  pthread_mutex_lock(&w_client_lock);
+  resp = client->head;
+  client->head = NULL;
+  client->tail = NULL;
+  client->queue_depth = 0;
+  client->queued_bytes = 0;
+  pthread_mutex_unlock(&w_client_lock);
+
+  return resp;
+}
+
+bool w_client_overflowed(struct watchman_client *client)
+{
+  bool overflowed;
+
+  pthread_mutex_lock(&w_client_lock);
+  overflowed = client->overflowed;
+  pthread_mutex_unlock(&w_client_lock);
+
+  if (overflowed) {
+    w_log(W_LOG_ERR,
+        "client=%p:stm=%p has more than client_max_queued_bytes of "
+        "notifications waiting to be sent; disconnecting it\n",
+        client, client->stm);
+  }
+  return overflowed;
+}
+
 void send_and_dispose_response(struct watchman_client *client,
-    json_t *response)
+    json_t *response, struct w_encoded_pdu *pdu)
 {
   pthread_mutex_lock(&w_client_lock);
-  if (!enqueue_response(client, response, false)) {
+  if (!enqueue_response(client, response, false, pdu)) {
     json_decref(response);
+    delete pdu;
   }
   pthread_mutex_unlock(&w_client_lock);
 }
 
+/* Writes a response in the format that the client used for its request */
+bool w_client_write_response(struct watchman_client *client, w_stm_t stm,
+    json_t *response, const struct w_encoded_pdu *pdu)
+{
+  json_error_t jerr;
+  json_t *decoded;
+  bool ok;
+
+  if (!pdu) {
+    return w_ser_write_pdu(client->pdu_type, &client->writer, stm, response);
+  }
+  if (pdu->pdu_type == client->pdu_type) {
+    return w_ser_write_encoded_pdu(&client->writer, stm, pdu);
+  }
+
+  // The client has switched formats since the response was encoded
+  decoded = w_encoded_pdu_to_json(pdu, &jerr);
+  if (!decoded) {
+    w_log(W_LOG_ERR, "failed to decode response: %s\n", jerr.text);
+    return false;
+  }
+  ok = w_ser_write_pdu(client->pdu_type, &client->writer, stm, decoded);
+  json_decref(decoded);
+  return ok;
+}
+
+/* Encodes and writes response to the client immediately, instead of
+ * queueing it for the client thread.  Only for use by the producer passed
+ * to w_client_send_series.  Returns false if the client has gone away.
+ * Takes ownership of response. */
+bool send_response_now(struct watchman_client *client, json_t *response,
+    struct w_encoded_pdu *pdu)
+{
+  bool ok;
+
+  if (client->reactor) {
+    return w_client_reactor_send_now(client, response, pdu);
+  }
+
+  w_stm_set_nonblock(client->stm, false);
+  ok = w_client_write_response(client, client->stm, response, pdu);
+  w_stm_set_nonblock(client->stm, true);
+  json_decref(response);
+  delete pdu;
+
+  return ok;
+}
+
+/* The client thread writes each PDU out before producing the next, so it
+ * just runs the producer to completion.  The client reactor returns the
+ * worker to the pool whenever the client's output is backlogged and calls
+ * the producer again once it drains, so the rest of the response is sent
+ * after the command has returned. */
+void w_client_send_series(struct watchman_client *client,
+    std::function<bool()> produce)
+{
+  if (client->reactor) {
+    w_client_reactor_send_series(client, std::move(produce));
+    return;
+  }
+  while (produce()) {
+    // Each PDU has been written out by the time it returns
+  }
+}
+
 void send_error_response(struct watchman_client *client,
     const char *fmt, ...)
 {
@@ -112,7 +358,7 @@ void send_error_response(struct watchman_client *client,
   send_and_dispose_response(client, resp);
 }
 
-static void client_delete(struct watchman_client *client)
+void w_client_delete(struct watchman_client *client)
 {
   struct watchman_client_response *resp;
 
@@ -122,13 +368,14 @@ static void client_delete(struct watchman_client *client)
   while (client->head) {
     resp = client->head;
     client->head = resp->next;
-    json_decref(resp->json);
-    free(resp);
+    free_response(resp);
   }
 
   w_json_buffer_free(&client->reader);
   w_json_buffer_free(&client->writer);
-  w_event_destroy(client->ping);
+  if (client->ping) {
+    w_event_destroy(client->ping);
+  }
   w_stm_shutdown(client->stm);
   w_stm_close(client->stm);
   free(client);
@@ -194,6 +441,9 @@ static void *client_thread(void *ptr)
         goto disconnected;
       } else if (request) {
         client->pdu_type = client->reader.pdu_type;
+        client->writer.bser_capabilities =
+            client->pdu_type == is_bser_v2 ? client->reader.bser_capabilities
+                                           : 0;
         dispatch_command(client, request, CMD_DAEMON);
         json_decref(request);
       }
@@ -203,12 +453,10 @@ static void *client_thread(void *ptr)
       w_event_test_and_clear(client->ping);
     }
 
-    /* de-queue the pending responses under the lock */
-    pthread_mutex_lock(&w_client_lock);
-    queued_responses_to_send = client->head;
-    client->head = NULL;
-    client->tail = NULL;
-    pthread_mutex_unlock(&w_client_lock);
+    /* de-queue the pending responses under the lock.  While we're blocked
+     * writing them, anything else that is queued for us is subject to the
+     * queue limit, and notifications for the same subscription coalesce. */
+    queued_responses_to_send = w_client_take_responses(client);
 
     /* now send our response(s) */
     while (queued_responses_to_send) {
@@ -221,15 +469,29 @@ static void *client_thread(void *ptr)
          * Don't bother sending any more messages if the client disconnects,
          * but still free their memory.
          */
-        send_ok = w_ser_write_pdu(client->pdu_type, &client->writer,
-                                  client->stm, response_to_send->json);
+        send_ok = w_client_write_response(client, client->stm,
+                                          response_to_send->json,
+                                          response_to_send->pdu);
         w_stm_set_nonblock(client->stm, true);
       }
 
       queued_responses_to_send = response_to_send->next;
+      free_response(response_to_send);
+    }
 
-      json_decref(response_to_send->json);
-      free(response_to_send);
+    if (w_client_overflowed(client)) {
+      // Let it know why, after the notifications that did fit, if it has
+      // room for it; we don't wait for a client that isn't reading
+      json_t *resp = make_response();
+      set_unicode_prop(resp, "error",
+          "too many unilateral responses are waiting to be sent to this "
+          "client; disconnecting it");
+      set_prop(resp, "unilateral", json_true());
+      if (send_ok) {
+        w_client_write_response(client, client->stm, resp, NULL);
+      }
+      json_decref(resp);
+      goto disconnected;
     }
   }
 
@@ -242,7 +504,7 @@ disconnected:
   w_ht_del(clients, w_ht_ptr_val(client));
   pthread_mutex_unlock(&w_client_lock);
 
-  client_delete(client);
+  w_client_delete(client);
 
   return NULL;
 }
@@ -291,7 +553,14 @@ void w_log_to_clients(int level, const char *buf)
       if (json) {
         set_mixed_string_prop(json, "log", buf);
         set_prop(json, "unilateral", json_true());
-        if (!enqueue_response(client, json, true)) {
+        if (client->max_queued_bytes > 0 &&
+            client->queued_bytes + response_size(json, NULL) >
+                client->max_queued_bytes) {
+          // The client isn't keeping up; it misses out on this one rather
+          // than being disconnected as it would be for a notification
+          client->num_dropped++;
+          json_decref(json);
+        } else if (!enqueue_response(client, json, true)) {
           json_decref(json);
         }
       }
@@ -427,13 +696,37 @@ static struct watchman_client *make_new_client(w_stm_t stm) {
   if (!w_json_buffer_init(&client->writer)) {
     // FIXME: error handling
   }
+  client->reader.refused_capabilities = BSER_CAP_DEFLATE | BSER_CAP_MEMFD;
+  client->writer.deflate_threshold = (uint32_t)cfg_get_int(
+      nullptr, "bser_deflate_threshold", DEFAULT_BSER_DEFLATE_THRESHOLD);
+  client->writer.memfd_threshold = (uint32_t)cfg_get_int(
+      nullptr, "bser_memfd_threshold", DEFAULT_BSER_MEMFD_THRESHOLD);
+  client->max_queued_bytes = (size_t)cfg_get_int(
+      nullptr, "client_max_queued_bytes", DEFAULT_CLIENT_MAX_QUEUED_BYTES);
+  derived_client_ctor(client);
+
+  if (w_client_reactor_enabled()) {
+    pthread_attr_destroy(&attr);
+
+    pthread_mutex_lock(&w_client_lock);
+    w_ht_set(clients, w_ht_ptr_val(client), w_ht_ptr_val(client));
+    pthread_mutex_unlock(&w_client_lock);
+
+    if (!w_client_reactor_add(client)) {
+      pthread_mutex_lock(&w_client_lock);
+      w_ht_del(clients, w_ht_ptr_val(client));
+      pthread_mutex_unlock(&w_client_lock);
+      w_client_delete(client);
+      return NULL;
+    }
+    return client;
+  }
+
   client->ping = w_event_make();
   if (!client->ping) {
     // FIXME: error handling
   }
 
-  derived_client_ctor(client);
-
   pthread_mutex_lock(&w_client_lock);
   w_ht_set(clients, w_ht_ptr_val(client), w_ht_ptr_val(client));
   pthread_mutex_unlock(&w_client_lock);
@@ -448,7 +741,7 @@ static struct watchman_client *make_new_client(w_stm_t stm) {
     pthread_mutex_lock(&w_client_lock);
     w_ht_del(clients, w_ht_ptr_val(client));
     pthread_mutex_unlock(&w_client_lock);
-    client_delete(client);
+    w_client_delete(client);
   }
 
   pthread_attr_destroy(&attr);
@@ -735,6 +1028,12 @@ bool w_start_listener(const char *path)
 
       if (w_ht_first(clients, &iter)) do {
         auto client = (watchman_client *)w_ht_val_ptr(iter.value);
+        if (client->reactor) {
+          // Give it the chance to send the response to shutdown-server,
+          // unless it isn't reading
+          w_client_reactor_stop(client, interval >= max_interval);
+          continue;
+        }
         w_event_set(client->ping);
 
 #ifndef _WIN32
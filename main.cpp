@@ -832,12 +832,50 @@ static bool should_start(int err)
   return false;
 }
 
+// A query that asks for its files in chunks produces a series of
+// partial responses ahead of the final one
+static bool is_chunked_query(json_t *cmd)
+{
+  const char *name = json_string_value(json_array_get(cmd, 0));
+  json_t *spec = json_array_get(cmd, 2);
+
+  return name && !strcmp(name, "query") && json_is_object(spec) &&
+    json_integer_value(json_object_get(spec, "chunk_size")) > 0;
+}
+
+// Relays the responses to a chunked query through to stdout, up to and
+// including the final one
+static bool relay_chunked_responses(w_jbuffer_t *buffer,
+    w_jbuffer_t *output_pdu_buffer, w_stm_t client)
+{
+  json_error_t jerr;
+  bool more = true;
+
+  while (more) {
+    json_t *j = w_json_buffer_next(buffer, client, &jerr);
+    if (!j) {
+      w_log(W_LOG_ERR, "failed to parse response: %s\n", jerr.text);
+      return false;
+    }
+
+    more = json_is_true(json_object_get(j, "partial"));
+    w_json_buffer_reset(output_pdu_buffer);
+    if (!w_ser_write_pdu(output_pdu, output_pdu_buffer, w_stm_stdout(), j)) {
+      json_decref(j);
+      return false;
+    }
+    json_decref(j);
+  }
+  return true;
+}
+
 static bool try_command(json_t *cmd, int timeout)
 {
   w_stm_t client = NULL;
   w_jbuffer_t buffer;
   w_jbuffer_t output_pdu_buffer;
   int err;
+  bool chunked, ok;
 
   client = w_stm_connect(sock_name, timeout * 1000);
   if (client == NULL) {
@@ -865,9 +903,17 @@ static bool try_command(json_t *cmd, int timeout)
 
   w_json_buffer_init(&output_pdu_buffer);
 
+  chunked = is_chunked_query(cmd);
+
   do {
-    if (!w_json_buffer_passthru(
-          &buffer, output_pdu, &output_pdu_buffer, client)) {
+    if (chunked) {
+      ok = relay_chunked_responses(&buffer, &output_pdu_buffer, client);
+      chunked = false;
+    } else {
+      ok = w_json_buffer_passthru(
+          &buffer, output_pdu, &output_pdu_buffer, client);
+    }
+    if (!ok) {
       err = errno;
       w_json_buffer_free(&buffer);
       w_json_buffer_free(&output_pdu_buffer);
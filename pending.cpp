@@ -373,6 +373,48 @@ struct watchman_pending_fs *w_pending_coll_pop(
   return p;
 }
 
+/* Pop an entry from the collection and remove it from the uniq hash.
+ * Unlike w_pending_coll_pop(), this leaves the remainder of the collection
+ * in a consistent state, so it is suitable for consuming the collection
+ * incrementally while new items continue to be added to it. */
+struct watchman_pending_fs *w_pending_coll_take(
+    struct watchman_pending_collection *coll) {
+  struct watchman_pending_fs *p = w_pending_coll_pop(coll);
+
+  if (p) {
+    art_delete(&coll->tree, (const uint8_t *)p->path->buf, p->path->len);
+  }
+
+  return p;
+}
+
+/* Remove the items whose path starts with prefix from the collection,
+ * appending their paths to the paths vector.
+ * Returns true if any items were removed. */
+bool w_pending_coll_extract_prefix(
+    struct watchman_pending_collection *coll,
+    const w_string& prefix,
+    std::vector<w_string>& paths) {
+  struct watchman_pending_fs *p = coll->pending;
+  bool found = false;
+
+  while (p) {
+    struct watchman_pending_fs *next = p->next;
+
+    if (w_string_startswith(p->path, prefix)) {
+      unlink_item(coll, p);
+      art_delete(&coll->tree, (const uint8_t *)p->path->buf, p->path->len);
+      paths.emplace_back(p->path);
+      w_pending_fs_free(p);
+      found = true;
+    }
+
+    p = next;
+  }
+
+  return found;
+}
+
 /* Returns the number of unique pending items in the collection */
 uint32_t w_pending_coll_size(struct watchman_pending_collection *coll) {
   return (uint32_t)art_size(&coll->tree);
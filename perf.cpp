@@ -80,6 +80,48 @@ void watchman_perf_sample::add_meta(const char* key, json_t* val) {
   set_prop(meta_data, key, val);
 }
 
+watchman_log2_histogram::watchman_log2_histogram()
+    : count(0), sum(0), max(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void watchman_log2_histogram::add(uint64_t value) {
+  int bucket = 0;
+  while (bucket < 64 && (value >> bucket) != 0) {
+    ++bucket;
+  }
+  ++buckets[bucket];
+  ++count;
+  sum += value;
+  if (value > max) {
+    max = value;
+  }
+}
+
+json_t* watchman_log2_histogram::to_json() const {
+  auto arr = json_array();
+  for (int i = 0; i < 65; ++i) {
+    if (buckets[i] == 0) {
+      continue;
+    }
+    // The largest value that falls into this bucket
+    uint64_t upper = i == 0 ? 0 : i == 64 ? UINT64_MAX : (uint64_t(1) << i) - 1;
+    json_array_append_new(
+        arr,
+        json_pack("[I, I]", (json_int_t)upper, (json_int_t)buckets[i]));
+  }
+  return json_pack(
+      "{s:I, s:I, s:I, s:o}",
+      "count",
+      (json_int_t)count,
+      "sum",
+      (json_int_t)sum,
+      "max",
+      (json_int_t)max,
+      "buckets",
+      arr);
+}
+
 void watchman_perf_sample::add_root_meta(const w_root_t* root) {
   // Note: if the root lock isn't held, we may read inaccurate numbers for
   // some of these properties.  We're ok with that, and don't want to force
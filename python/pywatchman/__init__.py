@@ -31,6 +31,8 @@ from __future__ import division
 from __future__ import print_function
 # no unicode literals
 
+import array
+import mmap
 import os
 import math
 import socket
@@ -234,6 +236,8 @@ class CommandError(WatchmanError):
 class Transport(object):
     """ communication transport to the watchman server """
     buf = None
+    # Whether the transport can receive file descriptors from the server
+    canPassFds = False
 
     def close(self):
         """ tear it down """
@@ -250,6 +254,11 @@ class Transport(object):
     def setTimeout(self, value):
         pass
 
+    def takeFd(self):
+        """ return the oldest file descriptor that was passed to us along
+        with the data that has been read, or None """
+        return None
+
     def readLine(self):
         """ read a line
         Maintains its own buffer, callers of the transport should not mix
@@ -295,10 +304,14 @@ class Codec(object):
 class UnixSocketTransport(Transport):
     """ local unix domain socket transport """
     sock = None
+    # recvmsg is only available in Python 3
+    canPassFds = hasattr(socket.socket, 'recvmsg') and \
+        hasattr(socket, 'SCM_RIGHTS')
 
     def __init__(self, sockpath, timeout):
         self.sockpath = sockpath
         self.timeout = timeout
+        self.fds = []
 
         sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
         try:
@@ -312,14 +325,36 @@ class UnixSocketTransport(Transport):
     def close(self):
         self.sock.close()
         self.sock = None
+        for fd in self.fds:
+            os.close(fd)
+        self.fds = []
 
     def setTimeout(self, value):
         self.timeout = value
         self.sock.settimeout(self.timeout)
 
+    def takeFd(self):
+        if self.fds:
+            return self.fds.pop(0)
+        return None
+
+    def _recv(self, size):
+        if not self.canPassFds:
+            return self.sock.recv(size)
+
+        fdsize = array.array('i').itemsize
+        data, ancdata, _flags, _addr = self.sock.recvmsg(
+            size, socket.CMSG_SPACE(8 * fdsize))
+        for level, kind, cdata in ancdata:
+            if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                fds = array.array('i')
+                fds.frombytes(cdata[:len(cdata) - (len(cdata) % fdsize)])
+                self.fds.extend(fds)
+        return data
+
     def readBytes(self, size):
         try:
-            buf = [self.sock.recv(size)]
+            buf = [self._recv(size)]
             if not buf[0]:
                 raise WatchmanError('empty watchman response')
             return buf[0]
@@ -631,7 +666,9 @@ class Bser2WithFallbackCodec(BserCodec):
         super(Bser2WithFallbackCodec, self).__init__(transport)
         # Once the server advertises support for bser-v2 we should switch this
         # to 'required' on Python 3.
-        self.send(["version", {"optional": ["bser-v2"]}])
+        self.send(["version", {"optional": ["bser-v2", "bser-deflate",
+                                            "bser-prefix-strings",
+                                            "bser-memfd"]}])
 
         capabilities = self.receive()
 
@@ -640,7 +677,19 @@ class Bser2WithFallbackCodec(BserCodec):
 
         if capabilities['capabilities']['bser-v2']:
             self.bser_version = 2
+            # Let the server use the encodings that both of us support:
+            # compressed payloads (0x1) and prefix-compressed strings (0x4)
+            supported = getattr(bser, 'CAPS_SUPPORTED', 0)
             self.bser_capabilities = 0
+            if capabilities['capabilities']['bser-deflate']:
+                self.bser_capabilities |= supported & 0x1
+            if capabilities['capabilities']['bser-prefix-strings']:
+                self.bser_capabilities |= supported & 0x4
+            # Very large responses can be passed to us in a memfd (0x10)
+            # if we can receive file descriptors
+            if capabilities['capabilities']['bser-memfd'] and \
+                    transport.canPassFds:
+                self.bser_capabilities |= 0x10
         else:
             self.bser_version = 1
             self.bser_capabilities = 0
@@ -666,12 +715,31 @@ class Bser2WithFallbackCodec(BserCodec):
             rlen += len(buf[-1])
 
         response = b''.join(buf)
+        if recv_bser_capabilities & 0x20:
+            response = self._readMemfd(response)
         try:
             res = self._loads(response)
             return res
         except ValueError as e:
             raise WatchmanError('watchman response decode error: %s' % e)
 
+    def _readMemfd(self, stub):
+        """ the stub holds the size of the memfd that was passed along
+        with it, which holds the real PDU """
+        fd = self.transport.takeFd()
+        if fd is None:
+            raise WatchmanError('no memfd was passed along with the response')
+        try:
+            length = bser.loads(stub)
+            mapped = mmap.mmap(fd, length, access=mmap.ACCESS_READ)
+            try:
+                # The C extension can only decode bytes
+                return mapped[:]
+            finally:
+                mapped.close()
+        finally:
+            os.close(fd)
+
     def send(self, *args):
         if hasattr(self, 'bser_version'):
             cmd = bser.dumps(*args, version=self.bser_version,
@@ -30,6 +30,9 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <Python.h>
 #include <bytesobject.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #ifdef _MSC_VER
 #define inline __inline
 #if _MSC_VER >= 1800
@@ -67,6 +70,24 @@ typedef unsigned __int64 uint64_t;
 #define BSER_NULL      0x0a
 #define BSER_TEMPLATE  0x0b
 #define BSER_SKIP      0x0c
+#define BSER_PREFIXSTRING 0x0d
+
+// BSER v2 capabilities
+// The sender can decode PDUs whose payload is compressed
+#define BSER_CAP_ACCEPT_DEFLATE 0x1
+// The payload of this PDU is the length of the BSER value that it holds,
+// followed by that value compressed as a zlib stream
+#define BSER_CAP_DEFLATE 0x2
+// The sender can decode prefix-compressed strings
+#define BSER_CAP_ACCEPT_PREFIX_STRINGS 0x4
+// This PDU holds prefix-compressed strings
+#define BSER_CAP_PREFIX_STRINGS 0x8
+#ifdef HAVE_ZLIB
+#define BSER_CAPS_SUPPORTED \
+  (BSER_CAP_ACCEPT_DEFLATE | BSER_CAP_ACCEPT_PREFIX_STRINGS)
+#else
+#define BSER_CAPS_SUPPORTED BSER_CAP_ACCEPT_PREFIX_STRINGS
+#endif
 
 // An immutable object representation of BSER_OBJECT.
 // Rather than build a hash table, key -> value are obtained
@@ -218,12 +239,20 @@ PyTypeObject bserObjectType = {
   0,                         /* tp_new */
 };
 
+// The string that the next prefix-compressed string is relative to
+typedef struct prefix_string {
+  char *buf;
+  int64_t len;
+  int64_t allocd;
+} prefix_string_t;
+
 typedef struct loads_ctx {
   int mutable;
   const char *value_encoding;
   const char *value_errors;
   uint32_t bser_version;
   uint32_t bser_capabilities;
+  prefix_string_t *prev_string;
 } unser_ctx_t;
 
 static PyObject *bser_loads_recursive(const char **ptr, const char *end,
@@ -627,6 +656,47 @@ static int bunser_bytestring(const char **ptr, const char *end,
   return 1;
 }
 
+// A prefix-compressed string is encoded as the number of leading bytes
+// that it shares with the previous one, followed by the length and the
+// bytes of the rest of it
+static int bunser_prefix_string(const char **ptr, const char *end,
+    prefix_string_t *prev, const char **start, int64_t *len)
+{
+  const char *buf = *ptr;
+  int64_t prefix_len, suffix_len;
+
+  // skip string marker
+  buf++;
+  if (!bunser_int(&buf, end, &prefix_len) ||
+      !bunser_int(&buf, end, &suffix_len)) {
+    return 0;
+  }
+
+  if (!prev || prefix_len < 0 || prefix_len > prev->len || suffix_len < 0 ||
+      buf + suffix_len > end) {
+    PyErr_Format(PyExc_ValueError, "invalid prefix string in bser data");
+    return 0;
+  }
+
+  if (prefix_len + suffix_len > prev->allocd) {
+    int64_t allocd = prefix_len + suffix_len + 128;
+    char *nbuf = realloc(prev->buf, (size_t)allocd);
+    if (!nbuf) {
+      PyErr_NoMemory();
+      return 0;
+    }
+    prev->buf = nbuf;
+    prev->allocd = allocd;
+  }
+  memcpy(prev->buf + prefix_len, buf, (size_t)suffix_len);
+  prev->len = prefix_len + suffix_len;
+
+  *ptr = buf + suffix_len;
+  *start = prev->buf;
+  *len = prev->len;
+  return 1;
+}
+
 static PyObject *bunser_array(const char **ptr, const char *end,
                               const unser_ctx_t *ctx)
 {
@@ -916,11 +986,17 @@ static PyObject *bser_loads_recursive(const char **ptr, const char *end,
       return Py_None;
 
     case BSER_BYTESTRING:
+    case BSER_PREFIXSTRING:
       {
         const char *start;
         int64_t len;
 
-        if (!bunser_bytestring(ptr, end, &start, &len)) {
+        if (buf[0] == BSER_PREFIXSTRING) {
+          if (!bunser_prefix_string(ptr, end, ctx->prev_string, &start,
+                                    &len)) {
+            return NULL;
+          }
+        } else if (!bunser_bytestring(ptr, end, &start, &len)) {
           return NULL;
         }
 
@@ -1048,6 +1124,53 @@ static PyObject *bser_pdu_len(PyObject *self, PyObject *args)
   return Py_BuildValue("L", total_len);
 }
 
+// Expands the compressed payload of a PDU and decodes the value in it
+static PyObject *bser_loads_deflated(const char *data, const char *end,
+    const unser_ctx_t *ctx)
+{
+#ifdef HAVE_ZLIB
+  int64_t expected_len;
+  uLongf outlen;
+  char *buf;
+  const char *ptr;
+  PyObject *res;
+
+  if (!bunser_int(&data, end, &expected_len)) {
+    return NULL;
+  }
+  if (expected_len < 0) {
+    PyErr_SetString(PyExc_ValueError, "invalid compressed payload length");
+    return NULL;
+  }
+
+  buf = malloc(expected_len ? (size_t)expected_len : 1);
+  if (!buf) {
+    return PyErr_NoMemory();
+  }
+  outlen = (uLongf)expected_len;
+  if (uncompress((Bytef *)buf, &outlen, (const Bytef *)data,
+                 (uLong)(end - data)) != Z_OK ||
+      outlen != (uLongf)expected_len) {
+    free(buf);
+    PyErr_SetString(PyExc_ValueError,
+                    "failed to expand the compressed payload");
+    return NULL;
+  }
+
+  ptr = buf;
+  res = bser_loads_recursive(&ptr, buf + expected_len, ctx);
+  free(buf);
+  return res;
+#else
+  (void)data;
+  (void)end;
+  (void)ctx;
+  PyErr_SetString(PyExc_ValueError,
+                  "bser was built without support for compressed PDUs");
+  return NULL;
+#endif
+}
+
 static PyObject *bser_loads(PyObject *self, PyObject *args, PyObject *kw)
 {
   const char *data = NULL;
@@ -1059,7 +1182,9 @@ static PyObject *bser_loads(PyObject *self, PyObject *args, PyObject *kw)
   PyObject *mutable_obj = NULL;
   const char *value_encoding = NULL;
   const char *value_errors = NULL;
+  prefix_string_t prev_string = {NULL, 0, 0};
   unser_ctx_t ctx = {1, 0};
+  PyObject *res;
 
   static char *kw_list[] = {"buf", "mutable", "value_encoding", "value_errors",
                             NULL};
@@ -1096,7 +1221,14 @@ static PyObject *bser_loads(PyObject *self, PyObject *args, PyObject *kw)
     return NULL;
   }
 
-  return bser_loads_recursive(&data, end, &ctx);
+  ctx.prev_string = &prev_string;
+  if (ctx.bser_capabilities & BSER_CAP_DEFLATE) {
+    res = bser_loads_deflated(data, end, &ctx);
+  } else {
+    res = bser_loads_recursive(&data, end, &ctx);
+  }
+  free(prev_string.buf);
+  return res;
 }
 
 static PyObject *bser_load(PyObject *self, PyObject *args, PyObject *kw)
@@ -1155,6 +1287,7 @@ PyMODINIT_FUNC PyInit_bser(void)
 
   mod = PyModule_Create(&bser_module);
   PyType_Ready(&bserObjectType);
+  PyModule_AddIntConstant(mod, "CAPS_SUPPORTED", BSER_CAPS_SUPPORTED);
 
   return mod;
 }
@@ -1162,8 +1295,11 @@ PyMODINIT_FUNC PyInit_bser(void)
 
 PyMODINIT_FUNC initbser(void)
 {
-  (void)Py_InitModule("bser", bser_methods);
+  PyObject *mod;
+
+  mod = Py_InitModule("bser", bser_methods);
   PyType_Ready(&bserObjectType);
+  PyModule_AddIntConstant(mod, "CAPS_SUPPORTED", BSER_CAPS_SUPPORTED);
 }
 #endif // PY_MAJOR_VERSION >= 3
 
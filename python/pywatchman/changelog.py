@@ -0,0 +1,219 @@
+# Copyright 2016 Facebook, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#  * Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+#  * Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+#  * Neither the name Facebook nor the names of its contributors may be used to
+#    endorse or promote products derived from this software without specific
+#    prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import mmap
+import os
+import struct
+
+# Tails the change log ring that the server maintains for a root when
+# changelog_size is configured.  Find the ring with:
+#
+#   path = client.query('get-changelog', root)['changelog']
+#
+# The layout of the file is described in ChangeLogRing.h.  Like the C++
+# reader, this doesn't take any locks; it relies on the writer updating
+# tail before it overwrites anything, and on re-checking tail after
+# copying each record.
+
+MAGIC = 0x4c43574d
+VERSION = 1
+
+EXISTS = 0x1
+NEW = 0x2
+PADDING = 0x80000000
+
+# read() returns one of these along with the changes
+OK = 'ok'
+# The writer overwrote changes that we hadn't yet read.  Do a since query
+# from clock() to pick up what was missed, then resync().
+OVERRUN = 'overrun'
+# The view was rebuilt, so the tick values started over.  Treat this like
+# a fresh instance, then resync().
+RESET = 'reset'
+# The server is no longer writing to this ring; open it again once the
+# root is watched again.
+CLOSED = 'closed'
+
+_HEADER = struct.Struct('=IIQ')
+_HEADER_SIZE = 128
+_ALIGN = 16
+_GENERATION = 16
+_TAIL = 24
+_HEAD = 32
+_LAST_TICK = 40
+_CLOSED = 44
+_CLOCK_PREFIX = 48
+_CLOCK_PREFIX_SIZE = 64
+_RECORD = struct.Struct('=IIII')
+_U64 = struct.Struct('=Q')
+_U32 = struct.Struct('=I')
+
+
+class Change(object):
+    __slots__ = ('tick', 'flags', 'name')
+
+    def __init__(self, tick, flags, name):
+        self.tick = tick
+        self.flags = flags
+        # The name relative to the root, as bytes
+        self.name = name
+
+    @property
+    def exists(self):
+        return bool(self.flags & EXISTS)
+
+    @property
+    def new(self):
+        return bool(self.flags & NEW)
+
+    def __repr__(self):
+        return 'Change(%d, %#x, %r)' % (self.tick, self.flags, self.name)
+
+
+class ChangeLogReader(object):
+    """ Maps the ring at path, positioned so that the first call to read()
+    returns the changes that are appended after this one """
+
+    def __init__(self, path):
+        self.path = path
+        with open(path, 'rb') as f:
+            st = os.fstat(f.fileno())
+            self._ident = (st.st_dev, st.st_ino)
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, capacity = _HEADER.unpack_from(self._map, 0)
+        if magic != MAGIC or version != VERSION or \
+                capacity > len(self._map) - _HEADER_SIZE:
+            self._map.close()
+            raise ValueError('%s is not a change log ring' % path)
+        self.capacity = capacity
+        self.resync()
+
+    def close(self):
+        if self._map is not None:
+            self._map.close()
+            self._map = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def _u64(self, offset):
+        # Python may copy the bytes of a value one at a time, so read it
+        # until it's stable to be sure that it isn't torn
+        value = _U64.unpack_from(self._map, offset)[0]
+        while True:
+            again = _U64.unpack_from(self._map, offset)[0]
+            if again == value:
+                return value
+            value = again
+
+    def _u32(self, offset):
+        return _U32.unpack_from(self._map, offset)[0]
+
+    def resync(self):
+        """ Starts over from the most recent change, after the consumer
+        has caught up via a query """
+        while True:
+            generation = self._u64(_GENERATION)
+            if generation & 1:
+                # A reset is in progress
+                continue
+            head = self._u64(_HEAD)
+            tick = self._u32(_LAST_TICK)
+            prefix = self._map[_CLOCK_PREFIX:
+                               _CLOCK_PREFIX + _CLOCK_PREFIX_SIZE]
+            if self._u64(_GENERATION) == generation:
+                break
+        self._generation = generation
+        self._offset = head
+        self._last_tick = tick
+        self._clock_prefix = prefix.split(b'\0', 1)[0].decode('ascii')
+
+    def clock(self):
+        """ Returns a clock from which a since query will report at least
+        the changes after the last one that was read.  It is just before
+        the tick of that change, since the changes that shared its tick may
+        not all have been read. """
+        return '%s%d' % (self._clock_prefix, max(self._last_tick - 1, 0))
+
+    def read(self, max_changes=None):
+        """ Returns (status, changes) with the changes that have been
+        appended to the ring since the previous call """
+        changes = []
+        if self._u32(_CLOSED):
+            return CLOSED, changes
+
+        while max_changes is None or len(changes) < max_changes:
+            if self._u64(_GENERATION) != self._generation:
+                return RESET, changes
+            head = self._u64(_HEAD)
+            if self._offset == head:
+                break
+            if self._u64(_TAIL) > self._offset:
+                return OVERRUN, changes
+
+            # Copy the record out, and then check that the writer didn't
+            # start writing over it while we were doing so
+            area_pos = self._offset % self.capacity
+            pos = _HEADER_SIZE + area_pos
+            size, tick, flags, name_len = _RECORD.unpack_from(self._map, pos)
+            valid = (_RECORD.size <= size <= self.capacity - area_pos and
+                     size % _ALIGN == 0 and
+                     name_len <= size - _RECORD.size)
+            if valid and not flags & PADDING:
+                start = pos + _RECORD.size
+                name = self._map[start:start + name_len]
+            if self._u64(_GENERATION) != self._generation:
+                return RESET, changes
+            if not valid or self._u64(_TAIL) > self._offset:
+                return OVERRUN, changes
+
+            self._offset += size
+            if flags & PADDING:
+                continue
+            changes.append(Change(tick, flags, name))
+            self._last_tick = tick
+
+        if not changes:
+            # If the server went away without closing the ring, the file
+            # will since have been replaced or removed
+            try:
+                st = os.stat(self.path)
+            except OSError:
+                return CLOSED, changes
+            if (st.st_dev, st.st_ino) != self._ident:
+                return CLOSED, changes
+        return OK, changes
@@ -36,6 +36,7 @@ import collections
 import ctypes
 import struct
 import sys
+import zlib
 
 from . import (
     compat,
@@ -54,6 +55,19 @@ BSER_FALSE = b'\x09'
 BSER_NULL = b'\x0a'
 BSER_TEMPLATE = b'\x0b'
 BSER_SKIP = b'\x0c'
+BSER_PREFIXSTRING = b'\x0d'
+
+# BSER v2 capabilities
+# The sender can decode PDUs whose payload is compressed
+BSER_CAP_ACCEPT_DEFLATE = 0x1
+# The payload of this PDU is the length of the BSER value that it holds,
+# followed by that value compressed as a zlib stream
+BSER_CAP_DEFLATE = 0x2
+# The sender can decode prefix-compressed strings
+BSER_CAP_ACCEPT_PREFIX_STRINGS = 0x4
+# This PDU holds prefix-compressed strings
+BSER_CAP_PREFIX_STRINGS = 0x8
+CAPS_SUPPORTED = BSER_CAP_ACCEPT_DEFLATE | BSER_CAP_ACCEPT_PREFIX_STRINGS
 
 if compat.PYTHON3:
     STRING_TYPES = (str, bytes)
@@ -284,6 +298,9 @@ class Bunser(object):
         else:
             self.value_errors = value_errors
 
+        # The string that the next prefix-compressed string is relative to
+        self.prev_string = b''
+
     @staticmethod
     def unser_int(buf, pos):
         try:
@@ -321,6 +338,20 @@ class Bunser(object):
             # str_len stays the same because that's the length in bytes
         return (str_val, pos + str_len)
 
+    def unser_prefix_string(self, buf, pos):
+        # The number of bytes shared with the previous prefix-compressed
+        # string, followed by the rest of this one
+        prefix_len, pos = self.unser_int(buf, pos + 1)
+        str_len, pos = self.unser_int(buf, pos)
+        if prefix_len < 0 or prefix_len > len(self.prev_string):
+            raise ValueError('Invalid bser prefix string encoding')
+        str_val = self.prev_string[:prefix_len] + \
+            struct.unpack_from(tobytes(str_len) + b's', buf, pos)[0]
+        self.prev_string = str_val
+        if self.value_encoding is not None:
+            str_val = str_val.decode(self.value_encoding, self.value_errors)
+        return (str_val, pos + str_len)
+
     def unser_array(self, buf, pos):
         arr_len, pos = self.unser_int(buf, pos + 1)
         arr = []
@@ -405,6 +436,8 @@ class Bunser(object):
             return (None, pos + 1)
         elif val_type == BSER_BYTESTRING:
             return self.unser_string(buf, pos)
+        elif val_type == BSER_PREFIXSTRING:
+            return self.unser_prefix_string(buf, pos)
         elif val_type == BSER_ARRAY:
             return self.unser_array(buf, pos)
         elif val_type == BSER_OBJECT:
@@ -471,6 +504,13 @@ def loads(buf, mutable=True, value_encoding=None, value_errors=None):
     bunser = Bunser(mutable=mutable, value_encoding=value_encoding,
                     value_errors=value_errors)
 
+    if info[1] & BSER_CAP_DEFLATE:
+        value_len, pos = Bunser.unser_int(buf, pos)
+        buf = zlib.decompress(buf[pos:])
+        if len(buf) != value_len:
+            raise ValueError('compressed payload has the wrong length')
+        pos = 0
+
     return bunser.loads_recursive(buf, pos)[0]
 
 
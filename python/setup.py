@@ -6,6 +6,13 @@ try:
 except:
     from distutils.core import setup, Extension
 
+import os
+
+# Compressed BSER PDUs can be expanded if we can link against zlib
+bser_zlib = {}
+if os.name != 'nt':
+    bser_zlib = dict(define_macros=[('HAVE_ZLIB', '1')], libraries=['z'])
+
 setup(
     name = 'pywatchman',
     version = '1.3.0',
@@ -22,7 +29,8 @@ setup(
     license = 'BSD',
     packages = ['pywatchman'],
     ext_modules = [
-        Extension('pywatchman.bser', sources = ['pywatchman/bser.c'])
+        Extension('pywatchman.bser', sources = ['pywatchman/bser.c'],
+                  **bser_zlib)
     ],
     platforms = 'Platform Independent',
     classifiers = [
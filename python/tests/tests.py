@@ -268,6 +268,39 @@ class TestBSERDump(unittest.TestCase):
         enc = self.bser_mod.dumps([1, 2, 3, "hello there, much larger"])
         self.assertEqual(len(enc), self.bser_mod.pdu_len(enc[0:7]))
 
+    def test_deflated(self):
+        if not getattr(self.bser_mod, 'CAPS_SUPPORTED', 0) & 0x1:
+            return
+        import struct
+        import zlib
+        val = {"files": ["dir/file%d.txt" % i for i in range(100)]}
+        # Skip the magic and the int32 length that dumps puts in front
+        value = self.bser_mod.dumps(val)[7:]
+
+        def bser_int(n):
+            return b'\x05' + struct.pack(b'=i', n)
+
+        payload = bser_int(len(value)) + zlib.compress(value)
+        pdu = b'\x00\x02' + bser_int(0x3) + bser_int(len(payload)) + payload
+        self.assertEqual(self.bser_mod.pdu_info(pdu)[1], 0x3)
+        self.assertEqual(val,
+                         self.bser_mod.loads(pdu, value_encoding='utf-8'))
+
+    def test_prefix_strings(self):
+        if not getattr(self.bser_mod, 'CAPS_SUPPORTED', 0) & 0x4:
+            return
+        # Two strings sharing "foo/ba", then one sharing nothing
+        value = (b'\x00\x03\x03' +
+                 b'\x0d\x03\x00\x03\x07foo/bar' +
+                 b'\x0d\x03\x06\x03\x01z' +
+                 b'\x0d\x03\x00\x03\x03qux')
+        pdu = b'\x00\x02\x03\x08\x03' + bytes(bytearray([len(value)])) + value
+        self.assertEqual(['foo/bar', 'foo/baz', 'qux'],
+                         self.bser_mod.loads(pdu, value_encoding='utf-8'))
+        # The prefix can't be longer than the previous string
+        self.assertRaises(ValueError, self.bser_mod.loads,
+                          b'\x00\x02\x03\x08\x03\x05\x0d\x03\x02\x03\x00')
+
     def test_garbage(self):
         # can't use the with form here because Python 2.6
         self.assertRaises(ValueError, self.bser_mod.loads, b"\x00\x01\n")
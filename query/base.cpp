@@ -3,6 +3,7 @@
 
 #include "watchman.h"
 
+#include <algorithm>
 #include <vector>
 #include "make_unique.h"
 
@@ -18,6 +19,23 @@ class NotExpr : public QueryExpr {
   bool evaluate(w_query_ctx* ctx, const watchman_file* file) override {
     return !expr->evaluate(ctx, file);
   }
+
+  void prepare(w_query_ctx* ctx) override {
+    expr->prepare(ctx);
+  }
+
+  double estimateCost() const override {
+    return expr->estimateCost();
+  }
+
+  double estimateSelectivity() const override {
+    return 1 - expr->estimateSelectivity();
+  }
+
+  uint32_t compile(QueryProgram* prog, uint32_t onTrue, uint32_t onFalse)
+      override {
+    return expr->compile(prog, onFalse, onTrue);
+  }
   static std::unique_ptr<QueryExpr> parse(w_query* query, json_t* term) {
     json_t* other;
 
@@ -46,6 +64,18 @@ class TrueExpr : public QueryExpr {
     return true;
   }
 
+  double estimateCost() const override {
+    return 0;
+  }
+
+  double estimateSelectivity() const override {
+    return 1;
+  }
+
+  uint32_t compile(QueryProgram*, uint32_t onTrue, uint32_t) override {
+    return onTrue;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query*, json_t*) {
     return watchman::make_unique<TrueExpr>();
   }
@@ -59,6 +89,18 @@ class FalseExpr : public QueryExpr {
     return false;
   }
 
+  double estimateCost() const override {
+    return 0;
+  }
+
+  double estimateSelectivity() const override {
+    return 0;
+  }
+
+  uint32_t compile(QueryProgram*, uint32_t, uint32_t onFalse) override {
+    return onFalse;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query*, json_t*) {
     return watchman::make_unique<FalseExpr>();
   }
@@ -89,6 +131,109 @@ class ListExpr : public QueryExpr {
     return allof;
   }
 
+  void prepare(w_query_ctx* ctx) override {
+    for (auto& expr : exprs) {
+      expr->prepare(ctx);
+    }
+  }
+
+  // For allof, we want to evaluate the terms that are cheapest to run
+  // and most likely to reject the file first; for anyof, those that are
+  // cheapest and most likely to accept it.  The terms have no side
+  // effects, so they can be evaluated in any order.
+  std::vector<QueryExpr*> orderedByCost() const {
+    std::vector<std::pair<double, QueryExpr*>> ranked;
+    ranked.reserve(exprs.size());
+    for (auto& expr : exprs) {
+      auto decisive = allof ? 1 - expr->estimateSelectivity()
+                            : expr->estimateSelectivity();
+      ranked.emplace_back(
+          expr->estimateCost() / std::max(decisive, 0.001), expr.get());
+    }
+    std::stable_sort(
+        ranked.begin(),
+        ranked.end(),
+        [](const std::pair<double, QueryExpr*>& a,
+           const std::pair<double, QueryExpr*>& b) {
+          return a.first < b.first;
+        });
+
+    std::vector<QueryExpr*> ordered;
+    ordered.reserve(ranked.size());
+    for (auto& it : ranked) {
+      ordered.push_back(it.second);
+    }
+    return ordered;
+  }
+
+  double estimateCost() const override {
+    // Each term only runs if the ones before it were not decisive
+    double cost = 0;
+    double reached = 1;
+    for (auto expr : orderedByCost()) {
+      cost += reached * expr->estimateCost();
+      reached *= allof ? expr->estimateSelectivity()
+                       : 1 - expr->estimateSelectivity();
+    }
+    return cost;
+  }
+
+  double estimateSelectivity() const override {
+    double sel = 1;
+    for (auto& expr : exprs) {
+      sel *= allof ? expr->estimateSelectivity()
+                   : 1 - expr->estimateSelectivity();
+    }
+    return allof ? sel : 1 - sel;
+  }
+
+  bool requiredSuffixes(std::vector<w_string>& suffixes) const override {
+    if (allof) {
+      // Any one of the terms is sufficient
+      for (auto& expr : exprs) {
+        if (expr->requiredSuffixes(suffixes)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Each alternative must be constrained
+    std::vector<w_string> all;
+    for (auto& expr : exprs) {
+      if (!expr->requiredSuffixes(all)) {
+        return false;
+      }
+    }
+    suffixes.insert(suffixes.end(), all.begin(), all.end());
+    return true;
+  }
+
+  bool requiredDirName(w_string& dirname) const override {
+    if (!allof && exprs.size() != 1) {
+      return false;
+    }
+    for (auto& expr : exprs) {
+      if (expr->requiredDirName(dirname)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint32_t compile(QueryProgram* prog, uint32_t onTrue, uint32_t onFalse)
+      override {
+    auto ordered = orderedByCost();
+    // Emit from the last term to the first; each term continues on to
+    // the next one unless its result decides the outcome of the list
+    auto next = allof ? onTrue : onFalse;
+    for (auto it = ordered.rbegin(); it != ordered.rend(); ++it) {
+      next = allof ? (*it)->compile(prog, next, onFalse)
+                   : (*it)->compile(prog, onTrue, next);
+    }
+    return next;
+  }
+
   static std::unique_ptr<QueryExpr>
   parse(w_query* query, json_t* term, bool allof) {
     std::vector<std::unique_ptr<QueryExpr>> list;
@@ -22,6 +22,24 @@ class DirNameExpr : public QueryExpr {
       StartsWith startswith)
       : dirname(dirname), depth(depth), startswith(startswith) {}
 
+  double estimateCost() const override {
+    // Dominated by computing the wholename
+    return 4;
+  }
+
+  double estimateSelectivity() const override {
+    return 0.3;
+  }
+
+  bool requiredDirName(w_string& dir) const override {
+    // We can't resolve a caseless match against the view
+    if (startswith != w_string_startswith || dirname.size() == 0) {
+      return false;
+    }
+    dir = dirname;
+    return true;
+  }
+
   bool evaluate(w_query_ctx* ctx, const watchman_file* file) override {
     w_string_t* str = w_query_ctx_get_wholename(ctx);
     size_t i;
@@ -10,6 +10,12 @@ class ExistsExpr : public QueryExpr {
   bool evaluate(struct w_query_ctx*, const watchman_file* file) override {
     return file->exists;
   }
+  double estimateCost() const override {
+    return 0.5;
+  }
+  double estimateSelectivity() const override {
+    return 0.9;
+  }
   static std::unique_ptr<QueryExpr> parse(w_query*, json_t*) {
     return watchman::make_unique<ExistsExpr>();
   }
@@ -30,6 +36,14 @@ class EmptyExpr : public QueryExpr {
     return false;
   }
 
+  double estimateCost() const override {
+    return 0.5;
+  }
+
+  double estimateSelectivity() const override {
+    return 0.05;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query*, json_t*) {
     return watchman::make_unique<EmptyExpr>();
   }
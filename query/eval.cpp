@@ -3,6 +3,12 @@
 
 #include "watchman.h"
 
+#include "make_unique.h"
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <thread>
+
 /* Query evaluator */
 
 static w_string_t* compute_parent_path(
@@ -22,38 +28,213 @@ static w_string_t* compute_parent_path(
   return ctx->last_parent_path;
 }
 
-w_string_t *w_query_ctx_get_wholename(
-    struct w_query_ctx *ctx
-)
-{
-  uint32_t name_start;
+w_string_piece RelNameBuilder::build(
+    const watchman_file* file,
+    uint32_t name_start) {
+  auto name = w_file_get_name(file);
+
+  if (file->parent != parent_) {
+    // Lay out the full path of the parent from the root down, followed
+    // by a separator
+    size_t len = 0;
+    for (auto d = file->parent; d; d = d->parent) {
+      len += d->name.size() + 1;
+    }
+    buf_.resize(len);
+    auto end = &buf_[0] + len;
+    for (auto d = file->parent; d; d = d->parent) {
+      *--end = WATCHMAN_DIR_SEP;
+      end -= d->name.size();
+      memcpy(end, d->name.data(), d->name.size());
+    }
+    parent_ = file->parent;
+    parent_len_ = len;
+  } else {
+    buf_.resize(parent_len_);
+  }
 
-  if (ctx->wholename) {
-    return ctx->wholename;
+  buf_.append(name->buf, name->len);
+  return w_string_piece(buf_.data() + name_start, buf_.size() - name_start);
+}
+
+// Names longer than this get a block of their own
+#define QUERY_NAME_ARENA_BLOCK_SIZE 65536
+
+w_string_t* QueryNameArena::copy(w_string_piece name) {
+  auto align = alignof(w_string_t);
+  auto size =
+      (sizeof(w_string_t) + name.size() + 1 + align - 1) & ~(align - 1);
+  char* mem;
+
+  if (size > QUERY_NAME_ARENA_BLOCK_SIZE / 4) {
+    blocks_.emplace_back(new char[size]);
+    mem = blocks_.back().get();
+  } else {
+    if (size > avail_) {
+      blocks_.emplace_back(new char[QUERY_NAME_ARENA_BLOCK_SIZE]);
+      next_ = blocks_.back().get();
+      avail_ = QUERY_NAME_ARENA_BLOCK_SIZE;
+    }
+    mem = next_;
+    next_ += size;
+    avail_ -= size;
   }
 
+  auto str = new (mem) watchman_string();
+  auto buf = mem + sizeof(w_string_t);
+  memcpy(buf, name.data(), name.size());
+  buf[name.size()] = 0;
+  w_string_new_len_typed_stack(str, buf, name.size(), W_STRING_BYTE);
+  return str;
+}
+
+uint32_t w_query_ctx_name_start(struct w_query_ctx* ctx) {
   if (ctx->query->relative_root != NULL) {
     // At this point every path should start with the relative root, so this is
     // legal
-    name_start = ctx->query->relative_root->len + 1;
-  } else {
-    name_start = ctx->lock->root->root_path.size() + 1;
+    return ctx->query->relative_root->len + 1;
   }
+  return ctx->lock->root->root_path.size() + 1;
+}
 
-  auto full_name = w_string::pathCat(
-      {compute_parent_path(ctx, ctx->file), w_file_get_name(ctx->file)});
+w_string_t *w_query_ctx_get_wholename(
+    struct w_query_ctx *ctx
+)
+{
+  if (ctx->wholename) {
+    return ctx->wholename;
+  }
 
   // Record the name relative to the root
-  ctx->wholename = full_name.slice(name_start, full_name.size() - name_start);
+  auto name = ctx->names.build(ctx->file, w_query_ctx_name_start(ctx));
+  w_string_new_len_typed_stack(
+      &ctx->wholename_str, name.data(), name.size(), W_STRING_BYTE);
+  ctx->wholename = &ctx->wholename_str;
 
   return ctx->wholename;
 }
 
+// The dedup set doesn't own its keys; they live in the ctx's arena
+static const struct watchman_hash_funcs dedup_funcs = {
+  NULL,
+  NULL,
+  w_ht_string_equal,
+  w_ht_string_hash,
+  NULL,
+  NULL
+};
+
+void w_query_ctx_enable_dedup(struct w_query_ctx* ctx) {
+  ctx->dedup = w_ht_new(64, &dedup_funcs);
+}
+
+bool w_query_ctx_is_dup(struct w_query_ctx* ctx, w_string_piece name) {
+  w_string_t key;
+
+  w_string_new_len_typed_stack(
+      &key, name.data(), name.size(), W_STRING_BYTE);
+  if (w_ht_get(ctx->dedup, w_ht_ptr_val(&key))) {
+    return true;
+  }
+
+  w_ht_set(ctx->dedup, w_ht_ptr_val(ctx->dedup_names.copy(name)), 1);
+  return false;
+}
+
+// Arranges for w_query_process_file to check for cancellation, if
+// the query asked for a deadline or can be cancelled
+static void arm_cancellation(struct w_query_ctx* ctx) {
+  auto query = ctx->query;
+
+  if (query->deadline_ms) {
+    ctx->deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(query->deadline_ms);
+    ctx->check_cancel = true;
+  }
+  if (query->is_cancelled) {
+    ctx->check_cancel = true;
+  }
+}
+
+// Returns true, setting the query's errmsg, if the query should be
+// abandoned
+static bool query_cancelled(w_query* query, struct w_query_ctx* ctx) {
+  if (query->deadline_ms && std::chrono::steady_clock::now() >= ctx->deadline) {
+    ignore_result(asprintf(&query->errmsg,
+                           "query exceeded its deadline_ms of %u",
+                           query->deadline_ms));
+    return true;
+  }
+  if (query->is_cancelled && query->is_cancelled()) {
+    query->errmsg = strdup("query was cancelled");
+    return true;
+  }
+  return false;
+}
+
+bool w_query_ctx_yield(struct w_query_ctx* ctx) {
+  auto lock = ctx->lock;
+  auto root_number = lock->root->inner.number;
+  auto view = lock->root->inner.view.get();
+
+  w_root_read_unlock(lock, ctx->unlocked);
+  std::this_thread::yield();
+  w_root_read_lock(ctx->unlocked, "w_query_execute", lock);
+  ctx->num_yields++;
+
+  if (lock->root->inner.number != root_number ||
+      lock->root->inner.view.get() != view) {
+    ctx->query->errmsg = strdup(
+        "the watch was recrawled while the query was yielding; "
+        "please retry the query");
+    return false;
+  }
+  return true;
+}
+
+// Counts the change to file against the directory that contains it.
+// A directory that still exists is counted against itself: its entry
+// changes whenever its contents do, so counting it in the parent would
+// collapse every change in the tree into the parent.
+static void tally_dir(
+    struct w_query_ctx* ctx,
+    const watchman_file* file,
+    bool is_new) {
+  const watchman_dir* dir = file->parent;
+  if (file->exists && S_ISDIR(file->stat.mode)) {
+    auto child = file->parent->getChildDir(w_string(w_file_get_name(file)));
+    if (child) {
+      dir = child;
+    }
+  }
+
+  auto& summary = ctx->dirs[dir];
+  if (!file->exists) {
+    summary.removed++;
+  } else if (is_new) {
+    summary.added++;
+  } else {
+    summary.modified++;
+  }
+}
+
 bool w_query_process_file(
     w_query* query,
     struct w_query_ctx* ctx,
     const watchman_file* file) {
-  ctx->wholename.reset();
+  if (ctx->check_cancel &&
+      ++ctx->num_until_check >= QUERY_CANCEL_CHECK_INTERVAL) {
+    ctx->num_until_check = 0;
+    if (query_cancelled(query, ctx)) {
+      return false;
+    }
+  }
+
+  if (ctx->parallel) {
+    return ctx->parallel->add(file);
+  }
+
+  ctx->wholename = nullptr;
   ctx->file = file;
 
   // For fresh instances, only return files that currently exist.
@@ -64,21 +245,27 @@ bool w_query_process_file(
 
   // We produce an output for this file if there is no expression,
   // or if the expression matched.
-  if (query->expr && !query->expr->evaluate(ctx, file)) {
+  if (query->program && !query->program->evaluate(ctx, file)) {
     // No matched
     return true;
   }
 
-  if (ctx->dedup) {
-    w_string_t *name = w_query_ctx_get_wholename(ctx);
+  if (ctx->dedup && w_query_ctx_is_dup(ctx, w_query_ctx_get_wholename(ctx))) {
+    // Already present in the results, no need to emit it again
+    ctx->num_deduped++;
+    return true;
+  }
 
-    if (w_ht_get(ctx->dedup, w_ht_ptr_val(name))) {
-      // Already present in the results, no need to emit it again
-      ctx->num_deduped++;
-      return true;
+  if (query->result_mode == W_QUERY_RESULT_COUNT ||
+      query->result_mode == W_QUERY_RESULT_EXISTS) {
+    // Only the number of matches matters, so there's no need to build
+    // the match (or its name, unless we deduplicated above)
+    ctx->num_matches++;
+    if (query->result_mode == W_QUERY_RESULT_EXISTS) {
+      ctx->complete = true;
+      return false;
     }
-
-    w_ht_set(ctx->dedup, w_ht_ptr_val(name), 1);
+    return true;
   }
 
   bool is_new;
@@ -89,24 +276,33 @@ bool w_query_process_file(
   } else {
     is_new = file->ctime.ticks > ctx->since.clock.ticks;
   }
+
+  if (ctx->collapsed || query->result_mode == W_QUERY_RESULT_DIRS) {
+    tally_dir(ctx, file, is_new);
+    return true;
+  }
+
+  // The name is built when the results are rendered
   ctx->results.emplace_back(
       ctx->lock->root->inner.number,
-      w_query_ctx_get_wholename(ctx),
+      w_query_ctx_name_start(ctx),
       is_new,
       file);
 
+  if (query->collapse_threshold &&
+      ctx->results.size() > query->collapse_threshold) {
+    w_query_ctx_collapse(ctx);
+  }
+
   return true;
 }
 
-void w_match_results_free(uint32_t num_matches,
-    struct watchman_rule_match *matches)
-{
-  uint32_t i;
-
-  for (i = 0; i < num_matches; i++) {
-    w_string_delref(matches[i].relname);
+void w_query_ctx_collapse(struct w_query_ctx* ctx) {
+  ctx->collapsed = true;
+  for (const auto& match : ctx->results) {
+    tally_dir(ctx, match.file, match.is_new);
   }
-  free(matches);
+  ctx->results.clear();
 }
 
 bool w_query_file_matches_relative_root(
@@ -136,6 +332,59 @@ bool time_generator(
   return lock->root->inner.view->timeGenerator(query, ctx, num_walked);
 }
 
+SettleCandidates::SettleCandidates(struct read_locked_watchman_root* lock)
+    : lock_(lock), boundary_(std::numeric_limits<uint32_t>::max()) {}
+
+void SettleCandidates::include(uint32_t ticks) {
+  if (!collected_ && ticks < boundary_) {
+    boundary_ = ticks;
+  }
+}
+
+bool SettleCandidates::generate(
+    w_query* query,
+    struct read_locked_watchman_root* lock,
+    struct w_query_ctx* ctx,
+    int64_t* num_walked) {
+  if (lock->root != lock_->root || !supported_ || ctx->since.is_timestamp) {
+    return time_generator(query, lock, ctx, num_walked);
+  }
+
+  auto ticks = ctx->since.clock.ticks;
+  if (!collected_ || ticks < boundary_) {
+    // Either this is the first walk, or this query wants to look further
+    // back than anyone said they would; (re)collect from the top
+    boundary_ = std::min(boundary_, ticks);
+    files_.clear();
+    supported_ = lock->root->inner.view->changedFilesSince(boundary_, files_);
+    collected_ = true;
+    if (!supported_) {
+      return time_generator(query, lock, ctx, num_walked);
+    }
+  }
+
+  int64_t n = 0;
+  bool result = true;
+  for (auto f : files_) {
+    if (f->otime.ticks <= ticks) {
+      break;
+    }
+    ++n;
+
+    if (!w_query_file_matches_relative_root(ctx, f)) {
+      continue;
+    }
+
+    if (!w_query_process_file(query, ctx, f)) {
+      result = false;
+      break;
+    }
+  }
+
+  *num_walked = n;
+  return result;
+}
+
 static bool default_generators(
     w_query* query,
     struct read_locked_watchman_root* lock,
@@ -146,6 +395,13 @@ static bool default_generators(
   int64_t total = 0;
   bool result = true;
 
+  // See if the expression lets us produce the files more cheaply
+  result = lock->root->inner.view->plannedGenerator(query, ctx, &n);
+  total += n;
+  if (!result || ctx->plan.planned) {
+    goto done;
+  }
+
   // Time based query
   if (ctx->since.is_timestamp || !ctx->since.clock.is_fresh_instance) {
     n = 0;
@@ -204,10 +460,94 @@ done:
   return result;
 }
 
+json_t* w_query_plan::to_json() const {
+  const char* driverName = "default";
+  switch (driver) {
+    case W_QUERY_DRIVE_DEFAULT:
+      break;
+    case W_QUERY_DRIVE_SUFFIX:
+      driverName = "suffix";
+      break;
+    case W_QUERY_DRIVE_SUBTREE:
+      driverName = "subtree";
+      break;
+  }
+
+  auto plan = json_pack("{s:s}", "driver", driverName);
+  if (default_estimate >= 0) {
+    set_prop(plan, "default_estimate", json_integer(default_estimate));
+  }
+  if (suffix_estimate >= 0) {
+    set_prop(plan, "suffix_estimate", json_integer(suffix_estimate));
+  }
+  if (subtree_estimate >= 0) {
+    set_prop(plan, "subtree_estimate", json_integer(subtree_estimate));
+  }
+  return plan;
+}
+
 w_query_result::~w_query_result() {
   free(errmsg);
 }
 
+// Folds the tally for each directory into that of its outermost ancestor
+// that also has changes, leaving res with the minimal set of directories
+// that contain all of the matches
+static void summarize_dirs(struct w_query_ctx* ctx, w_query_res* res) {
+  std::unordered_map<const watchman_dir*, w_query_dir_summary> tops;
+  uint32_t name_start;
+
+  if (ctx->query->relative_root != NULL) {
+    name_start = ctx->query->relative_root->len + 1;
+  } else {
+    name_start = ctx->lock->root->root_path.size() + 1;
+  }
+
+  res->num_matches = 0;
+  for (const auto& it : ctx->dirs) {
+    auto top = it.first;
+    for (auto dir = top->parent; dir; dir = dir->parent) {
+      if (ctx->dirs.find(dir) != ctx->dirs.end()) {
+        top = dir;
+      }
+    }
+    tops[top].add(it.second);
+    res->num_matches +=
+        it.second.added + it.second.modified + it.second.removed;
+  }
+
+  res->dirs.reserve(tops.size());
+  for (auto& it : tops) {
+    auto full_name = it.first->getFullPath();
+    it.second.name = full_name.size() > name_start
+        ? full_name.slice(name_start, full_name.size() - name_start)
+        : w_string("", W_STRING_BYTE);
+    res->dirs.emplace_back(std::move(it.second));
+  }
+  std::sort(
+      res->dirs.begin(),
+      res->dirs.end(),
+      [](const w_query_dir_summary& a, const w_query_dir_summary& b) {
+        return w_string_compare(a.name, b.name) < 0;
+      });
+
+  res->collapsed = true;
+  res->results.clear();
+}
+
+// Moves the results that the query collected in ctx over to res
+static void take_results(struct w_query_ctx* ctx, w_query_res* res) {
+  if (ctx->collapsed || ctx->query->result_mode == W_QUERY_RESULT_DIRS) {
+    w_query_ctx_collapse(ctx);
+    summarize_dirs(ctx, res);
+    return;
+  }
+  res->num_matches = ctx->query->result_mode == W_QUERY_RESULT_FILES
+      ? uint32_t(ctx->results.size())
+      : ctx->num_matches;
+  res->results = std::move(ctx->results);
+}
+
 static bool execute_common(
     struct w_query_ctx* ctx,
     w_perf_t* sample,
@@ -215,52 +555,96 @@ static bool execute_common(
     w_query_generator generator) {
   int64_t num_walked = 0;
   bool result = true;
+  std::unique_ptr<QueryParallelizer> parallel;
 
   if (ctx->query->dedup_results) {
-    ctx->dedup = w_ht_new(64, &w_ht_string_funcs);
+    w_query_ctx_enable_dedup(ctx);
+  }
+
+  // Stopping at the first match is inherently serial, and the workers
+  // can't deduplicate across their chunks without the matches themselves,
+  // and must not run while a yielding generator has released the lock
+  auto mode = ctx->query->result_mode;
+  bool can_parallelize = mode != W_QUERY_RESULT_EXISTS &&
+      (!ctx->query->dedup_results ||
+       (mode == W_QUERY_RESULT_FILES && !ctx->query->collapse_threshold)) &&
+      !(ctx->unlocked && ctx->query->yield_every);
+  if (can_parallelize && ctx->lock->root->query_parallel_threshold > 0) {
+    parallel = watchman::make_unique<QueryParallelizer>(
+        ctx, size_t(ctx->lock->root->query_parallel_threshold));
+    ctx->parallel = parallel.get();
   }
 
   res->is_fresh_instance = !ctx->since.is_timestamp &&
     ctx->since.clock.is_fresh_instance;
+  arm_cancellation(ctx);
 
   if (!(res->is_fresh_instance && ctx->query->empty_on_fresh_instance)) {
+    if (ctx->query->program) {
+      ctx->query->program->prepare(ctx);
+    }
     if (!generator) {
       generator = default_generators;
     }
 
-    if (!generator(ctx->query, ctx->lock, ctx, &num_walked)) {
+    if (!generator(ctx->query, ctx->lock, ctx, &num_walked) &&
+        !ctx->complete) {
       res->errmsg = ctx->query->errmsg;
       ctx->query->errmsg = NULL;
       result = false;
     }
   }
 
+  if (parallel) {
+    // The generator may have stopped because a worker gave up, in which
+    // case the worker has the reason
+    char* errmsg = nullptr;
+    if (!parallel->finish(&errmsg)) {
+      if (!res->errmsg) {
+        res->errmsg = errmsg;
+        errmsg = nullptr;
+      }
+      result = false;
+    }
+    free(errmsg);
+  }
+
   if (sample->finish()) {
     sample->add_root_meta(ctx->lock->root);
-    sample->add_meta(
-        "query_execute",
-        json_pack(
-            "{s:b, s:i, s:i, s:i, s:O}",
-            "fresh_instance",
-            res->is_fresh_instance,
-            "num_deduped",
-            ctx->num_deduped,
-            "num_results",
-            int64_t(ctx->results.size()),
-            "num_walked",
-            num_walked,
-            "query",
-            ctx->query->query_spec));
+    auto meta = json_pack(
+        "{s:b, s:i, s:i, s:i, s:O, s:o}",
+        "fresh_instance",
+        res->is_fresh_instance,
+        "num_deduped",
+        ctx->num_deduped,
+        "num_results",
+        int64_t(ctx->results.size()),
+        "num_walked",
+        num_walked,
+        "query",
+        ctx->query->query_spec,
+        "plan",
+        ctx->plan.to_json());
+    if (parallel) {
+      auto stats = parallel->stats();
+      if (stats) {
+        set_prop(meta, "parallel", stats);
+      }
+    }
+    if (ctx->num_yields) {
+      set_prop(meta, "num_yields", json_integer(ctx->num_yields));
+    }
+    sample->add_meta("query_execute", meta);
     sample->log();
   }
 
-  res->results = std::move(ctx->results);
+  take_results(ctx, res);
 
   return result;
 }
 
 w_query_ctx::w_query_ctx(w_query* q, read_locked_watchman_root* lock)
-    : query(q), lock(lock) {}
+    : query(q), lock(lock), since_terms(q->num_since_terms) {}
 
 w_query_ctx::~w_query_ctx() {
   if (last_parent_path) {
@@ -293,6 +677,7 @@ bool w_query_execute_locked(
    */
 
   res->root_number = lock->root->inner.number;
+  res->age_out_generation = lock->root->inner.view->getAgeOutGeneration();
   res->ticks = lock->root->inner.ticks;
 
   // Evaluate the cursor for this root
@@ -301,11 +686,45 @@ bool w_query_execute_locked(
   return execute_common(&ctx, &sample, res, generator);
 }
 
+bool w_query_execute_locked(
+    w_query* query,
+    struct read_locked_watchman_root* lock,
+    w_query_res* res,
+    w_query_generator generator) {
+  w_query_ctx ctx(query, lock);
+
+  memset(res, 0, sizeof(*res));
+  w_perf_t sample("query_execute");
+
+  res->root_number = lock->root->inner.number;
+  res->age_out_generation = lock->root->inner.view->getAgeOutGeneration();
+  res->ticks = lock->root->inner.ticks;
+
+  w_clockspec_eval_readonly(lock, query->since_spec.get(), &ctx.since);
+
+  return execute_common(&ctx, &sample, res, generator);
+}
+
 bool w_query_execute(
     w_query* query,
     struct unlocked_watchman_root* unlocked,
     w_query_res* res,
     w_query_generator generator) {
+  struct read_locked_watchman_root lock;
+
+  if (!w_query_execute_and_hold(query, unlocked, res, generator, &lock)) {
+    return false;
+  }
+  w_root_read_unlock(&lock, unlocked);
+  return true;
+}
+
+bool w_query_execute_and_hold(
+    w_query* query,
+    struct unlocked_watchman_root* unlocked,
+    w_query_res* res,
+    w_query_generator generator,
+    struct read_locked_watchman_root* lock) {
   struct write_locked_watchman_root wlock;
   struct read_locked_watchman_root rlock;
   bool result;
@@ -364,20 +783,240 @@ bool w_query_execute(
       return false;
     }
     ctx.lock = &rlock;
+    ctx.unlocked = unlocked;
     // Evaluate the cursor for this root
     w_clockspec_eval_readonly(&rlock, query->since_spec.get(), &ctx.since);
   }
 
   res->root_number = ctx.lock->root->inner.number;
+  res->age_out_generation =
+      ctx.lock->root->inner.view->getAgeOutGeneration();
   res->ticks = ctx.lock->root->inner.ticks;
 
   result = execute_common(&ctx, &sample, res, generator);
-  // This handles the unlock in both the read and write case, as ctx.lock
-  // points to the read or write lock as appropriate, and the underlying
-  // unlock operation is defined to be safe for either.
-  w_root_read_unlock(ctx.lock, unlocked);
+  // ctx.lock points to the read or write lock as appropriate, and the
+  // underlying unlock operation is defined to be safe for either, so the
+  // caller can treat both as a read lock
+  *lock = *ctx.lock;
+  if (!result) {
+    w_root_read_unlock(lock, unlocked);
+  }
   return result;
 }
 
+bool w_query_res_is_current(
+    const w_query_res* res,
+    struct read_locked_watchman_root* lock) {
+  return lock->root->inner.number == res->root_number &&
+      lock->root->inner.view->getAgeOutGeneration() ==
+      res->age_out_generation;
+}
+
+// True if the query would have the default generators walk every file;
+// that is, it has no generators of its own, and doesn't have a shape
+// that the planner could drive from an index instead
+static bool walks_all_files(w_query* query, const struct w_query_since& since) {
+  std::vector<w_string> suffixes;
+  w_string dirname;
+
+  if (!(!since.is_timestamp && since.clock.is_fresh_instance) ||
+      query->nsuffixes || query->npaths || query->glob_tree) {
+    return false;
+  }
+  if (query->expr && (query->expr->requiredSuffixes(suffixes) ||
+                      query->expr->requiredDirName(dirname))) {
+    return false;
+  }
+  return true;
+}
+
+// True if the only generator that the query would use is the time
+// generator
+static bool uses_only_time_generator(
+    w_query* query,
+    const struct w_query_since& since) {
+  return (since.is_timestamp || !since.clock.is_fresh_instance) &&
+      !query->nsuffixes && !query->npaths && !query->glob_tree;
+}
+
+// Walks all of the files in the view once, evaluating each of them
+// against each of the queries
+static void execute_shared_walk(
+    struct read_locked_watchman_root* lock,
+    const std::vector<w_query_ctx*>& ctxs,
+    const std::vector<w_query_res*>& results) {
+  std::vector<w_query_ctx*> active;
+  std::vector<const watchman_file*> files;
+  w_perf_t sample("query_batch_walk");
+
+  for (size_t i = 0; i < ctxs.size(); ++i) {
+    auto ctx = ctxs[i];
+    if (ctx->query->dedup_results) {
+      w_query_ctx_enable_dedup(ctx);
+    }
+    results[i]->is_fresh_instance = true;
+    arm_cancellation(ctx);
+    if (ctx->query->empty_on_fresh_instance) {
+      continue;
+    }
+    if (ctx->query->program) {
+      ctx->query->program->prepare(ctx);
+    }
+    active.push_back(ctx);
+  }
+
+  lock->root->inner.view->changedFilesSince(0, files);
+  for (auto file : files) {
+    for (auto& ctx : active) {
+      if (!ctx) {
+        continue;
+      }
+      if (!w_query_file_matches_relative_root(ctx, file)) {
+        continue;
+      }
+      if (!w_query_process_file(ctx->query, ctx, file)) {
+        ctx = nullptr;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < ctxs.size(); ++i) {
+    auto ctx = ctxs[i];
+    if (ctx->query->errmsg) {
+      results[i]->errmsg = ctx->query->errmsg;
+      ctx->query->errmsg = nullptr;
+    }
+    take_results(ctx, results[i]);
+  }
+
+  if (sample.finish()) {
+    sample.add_root_meta(lock->root);
+    sample.add_meta(
+        "query_batch_walk",
+        json_pack(
+            "{s:i, s:i}",
+            "num_queries",
+            int64_t(ctxs.size()),
+            "num_walked",
+            int64_t(files.size())));
+    sample.log();
+  }
+}
+
+bool w_query_execute_batch(
+    const std::vector<w_query*>& queries,
+    struct unlocked_watchman_root* unlocked,
+    std::deque<w_query_res>& results,
+    struct read_locked_watchman_root* held) {
+  struct write_locked_watchman_root wlock;
+  struct read_locked_watchman_root rlock;
+  struct read_locked_watchman_root* lock = nullptr;
+  uint32_t sync_timeout = 0;
+  uint32_t lock_timeout = 0;
+  bool need_write_lock = false;
+  char* errmsg = nullptr;
+
+  results.resize(queries.size());
+
+  for (auto query : queries) {
+    sync_timeout = std::max(sync_timeout, query->sync_timeout);
+    lock_timeout = std::max(lock_timeout, query->lock_timeout);
+    if (query->since_spec && query->since_spec->tag == w_cs_named_cursor) {
+      need_write_lock = true;
+    }
+  }
+
+  if (sync_timeout && !w_root_sync_to_now(unlocked, sync_timeout)) {
+    ignore_result(asprintf(&errmsg, "synchronization failed: %s\n",
+        strerror(errno)));
+  } else if (need_write_lock) {
+    // We need a write lock to evaluate the named cursors
+    if (w_root_lock_with_timeout(unlocked, "w_query_execute_batch",
+                                 lock_timeout, &wlock)) {
+      lock = w_root_read_lock_from_write(&wlock);
+    } else {
+      ignore_result(asprintf(&errmsg,
+                             "couldn't acquire root wrlock within "
+                             "lock_timeout of %dms. root is "
+                             "currently busy (%s)\n",
+                             lock_timeout, unlocked->root->lock_reason));
+    }
+  } else if (w_root_read_lock_with_timeout(unlocked, "w_query_execute_batch",
+                                           lock_timeout, &rlock)) {
+    lock = &rlock;
+  } else {
+    ignore_result(asprintf(&errmsg,
+                           "couldn't acquire root rdlock within "
+                           "lock_timeout of %dms. root is "
+                           "currently busy (%s)\n",
+                           lock_timeout, unlocked->root->lock_reason));
+  }
+
+  if (errmsg) {
+    for (auto& res : results) {
+      res.errmsg = strdup(errmsg);
+    }
+    free(errmsg);
+    return false;
+  }
+
+  std::vector<std::unique_ptr<w_query_ctx>> ctxs;
+  std::vector<w_query_ctx*> shared_ctxs;
+  std::vector<w_query_res*> shared_results;
+  SettleCandidates candidates(lock);
+
+  for (size_t i = 0; i < queries.size(); ++i) {
+    auto query = queries[i];
+    auto res = &results[i];
+
+    ctxs.emplace_back(watchman::make_unique<w_query_ctx>(query, lock));
+    auto ctx = ctxs.back().get();
+    if (need_write_lock) {
+      w_clockspec_eval(&wlock, query->since_spec.get(), &ctx->since);
+    } else {
+      w_clockspec_eval_readonly(lock, query->since_spec.get(), &ctx->since);
+    }
+    res->root_number = lock->root->inner.number;
+    res->age_out_generation = lock->root->inner.view->getAgeOutGeneration();
+    res->ticks = lock->root->inner.ticks;
+
+    if (walks_all_files(query, ctx->since)) {
+      shared_ctxs.push_back(ctx);
+      shared_results.push_back(res);
+    } else if (uses_only_time_generator(query, ctx->since)) {
+      if (!ctx->since.is_timestamp) {
+        candidates.include(ctx->since.clock.ticks);
+      }
+    }
+  }
+
+  if (shared_ctxs.size() > 1) {
+    execute_shared_walk(lock, shared_ctxs, shared_results);
+  } else {
+    shared_ctxs.clear();
+  }
+
+  // Everything else runs on its own, with the queries that look only
+  // at recent changes sharing the list of changed files
+  for (size_t i = 0; i < queries.size(); ++i) {
+    auto ctx = ctxs[i].get();
+    if (std::find(shared_ctxs.begin(), shared_ctxs.end(), ctx) !=
+        shared_ctxs.end()) {
+      continue;
+    }
+    w_perf_t sample("query_execute");
+    execute_common(
+        ctx,
+        &sample,
+        &results[i],
+        uses_only_time_generator(queries[i], ctx->since)
+            ? candidates.generator()
+            : w_query_generator());
+  }
+
+  *held = *lock;
+  return true;
+}
+
 /* vim:ts=2:sw=2:et:
  */
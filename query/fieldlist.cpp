@@ -3,34 +3,111 @@
 
 #include "watchman.h"
 
-static json_t* make_name(const struct watchman_rule_match* match) {
-  return w_string_to_json(match->relname);
+// The value of a field for a single result.  Rendering a field produces
+// one of these without allocating, so that the value can either be turned
+// into json or encoded straight into a PDU.
+struct w_query_field_value {
+  enum {
+    // The field has no value for this result and is left out
+    MISSING,
+    NUL,
+    BOOLEAN,
+    INTEGER,
+    REAL,
+    STRING
+  } type;
+  json_int_t ival;
+  double dval;
+  // For STRING: the text, and the string that holds it, if there is one;
+  // otherwise the text is either static or held in buf or names
+  const char* str;
+  uint32_t len;
+  w_string_t* wstr;
+  w_string_type_t stype;
+  char buf[128];
+  // Builds the name of each result as it is rendered
+  RelNameBuilder names;
+
+  void set_null() {
+    type = NUL;
+  }
+
+  void set_boolean(bool val) {
+    type = BOOLEAN;
+    ival = val;
+  }
+
+  void set_integer(json_int_t val) {
+    type = INTEGER;
+    ival = val;
+  }
+
+  void set_real(double val) {
+    type = REAL;
+    dval = val;
+  }
+
+  void set_string(w_string_t* val) {
+    type = STRING;
+    str = val->buf;
+    len = val->len;
+    wstr = val;
+  }
+
+  void set_text(
+      const char* val,
+      uint32_t val_len,
+      w_string_type_t val_type = W_STRING_UNICODE) {
+    type = STRING;
+    str = val;
+    len = val_len;
+    wstr = nullptr;
+    stype = val_type;
+  }
+};
+
+static void make_name(
+    const struct watchman_rule_match* match,
+    w_query_field_value* value) {
+  auto name = value->names.build(*match);
+  value->set_text(name.data(), name.size(), W_STRING_BYTE);
 }
 
-static json_t* make_symlink(const struct watchman_rule_match* match) {
-  return (match->file->symlink_target) ?
-    w_string_to_json(match->file->symlink_target) : json_null();
+static void make_symlink(
+    const struct watchman_rule_match* match,
+    w_query_field_value* value) {
+  if (match->file->symlink_target) {
+    value->set_string(match->file->symlink_target);
+  } else {
+    value->set_null();
+  }
 }
 
-static json_t* make_exists(const struct watchman_rule_match* match) {
-  return json_boolean(match->file->exists);
+static void make_exists(
+    const struct watchman_rule_match* match,
+    w_query_field_value* value) {
+  value->set_boolean(match->file->exists);
 }
 
-static json_t* make_new(const struct watchman_rule_match* match) {
-  return json_boolean(match->is_new);
+static void make_new(
+    const struct watchman_rule_match* match,
+    w_query_field_value* value) {
+  value->set_boolean(match->is_new);
 }
 
-#define MAKE_CLOCK_FIELD(name, member)                                  \
-  static json_t* make_##name(const struct watchman_rule_match* match) { \
-    char buf[128];                                                      \
-    if (clock_id_string(                                                \
-            match->root_number,                                         \
-            match->file->member.ticks,                                  \
-            buf,                                                        \
-            sizeof(buf))) {                                             \
-      return typed_string_to_json(buf, W_STRING_UNICODE);               \
-    }                                                                   \
-    return nullptr;                                                     \
+#define MAKE_CLOCK_FIELD(name, member)                                      \
+  static void make_##name(                                                  \
+      const struct watchman_rule_match* match,                              \
+      w_query_field_value* value) {                                         \
+    if (clock_id_string(                                                    \
+            match->root_number,                                             \
+            match->file->member.ticks,                                      \
+            value->buf,                                                     \
+            sizeof(value->buf))) {                                          \
+      value->set_text(value->buf, strlen(value->buf));                      \
+    } else {                                                                \
+      value->type = w_query_field_value::MISSING;                           \
+    }                                                                       \
   }
 MAKE_CLOCK_FIELD(cclock, ctime)
 MAKE_CLOCK_FIELD(oclock, otime)
@@ -38,23 +115,29 @@ MAKE_CLOCK_FIELD(oclock, otime)
 // Note: our JSON library supports 64-bit integers, but this may
 // pose a compatibility issue for others.  We'll see if anyone
 // runs into an issue and deal with it then...
-#define MAKE_INT_FIELD(name, member)                                    \
-  static json_t* make_##name(const struct watchman_rule_match* match) { \
-    return json_integer(match->file->stat.member);                      \
+#define MAKE_INT_FIELD(name, member)                                        \
+  static void make_##name(                                                  \
+      const struct watchman_rule_match* match,                              \
+      w_query_field_value* value) {                                         \
+    value->set_integer(match->file->stat.member);                           \
   }
 
-#define MAKE_TIME_INT_FIELD(name, type, scale)                          \
-  static json_t* make_##name(const struct watchman_rule_match* match) { \
-    struct timespec spec = match->file->stat.type##time;                \
-    return json_integer(                                                \
-        ((int64_t)spec.tv_sec * scale) +                                \
-        ((int64_t)spec.tv_nsec * scale / WATCHMAN_NSEC_IN_SEC));        \
+#define MAKE_TIME_INT_FIELD(name, type, scale)                              \
+  static void make_##name(                                                  \
+      const struct watchman_rule_match* match,                              \
+      w_query_field_value* value) {                                         \
+    struct timespec spec = match->file->stat.type##time;                    \
+    value->set_integer(                                                     \
+        ((int64_t)spec.tv_sec * scale) +                                    \
+        ((int64_t)spec.tv_nsec * scale / WATCHMAN_NSEC_IN_SEC));            \
   }
 
-#define MAKE_TIME_DOUBLE_FIELD(name, type)                              \
-  static json_t* make_##name(const struct watchman_rule_match* match) { \
-    struct timespec spec = match->file->stat.type##time;                \
-    return json_real(spec.tv_sec + 1e-9 * spec.tv_nsec);                \
+#define MAKE_TIME_DOUBLE_FIELD(name, type)                                  \
+  static void make_##name(                                                  \
+      const struct watchman_rule_match* match,                              \
+      w_query_field_value* value) {                                         \
+    struct timespec spec = match->file->stat.type##time;                    \
+    value->set_real(spec.tv_sec + 1e-9 * spec.tv_nsec);                     \
   }
 
 /* For each type (e.g. "m"), define fields
@@ -83,65 +166,76 @@ MAKE_INT_FIELD(dev, dev)
 MAKE_INT_FIELD(nlink, nlink)
 
 #define MAKE_TIME_FIELD_DEFS(type) \
-  { #type "time", make_##type##time }, \
-  { #type "time_ms", make_##type##time_ms }, \
-  { #type "time_us", make_##type##time_us }, \
-  { #type "time_ns", make_##type##time_ns }, \
-  { #type "time_f", make_##type##time_f }
+  { #type "time", make_##type##time, false }, \
+  { #type "time_ms", make_##type##time_ms, false }, \
+  { #type "time_us", make_##type##time_us, false }, \
+  { #type "time_ns", make_##type##time_ns, false }, \
+  { #type "time_f", make_##type##time_f, false }
 
-static json_t* make_type_field(const struct watchman_rule_match* match) {
+static const char* file_type_name(mode_t mode) {
   // Bias towards the more common file types first
-  if (S_ISREG(match->file->stat.mode)) {
-    return typed_string_to_json("f", W_STRING_UNICODE);
+  if (S_ISREG(mode)) {
+    return "f";
   }
-  if (S_ISDIR(match->file->stat.mode)) {
-    return typed_string_to_json("d", W_STRING_UNICODE);
+  if (S_ISDIR(mode)) {
+    return "d";
   }
-  if (S_ISLNK(match->file->stat.mode)) {
-    return typed_string_to_json("l", W_STRING_UNICODE);
+  if (S_ISLNK(mode)) {
+    return "l";
   }
-  if (S_ISBLK(match->file->stat.mode)) {
-    return typed_string_to_json("b", W_STRING_UNICODE);
+  if (S_ISBLK(mode)) {
+    return "b";
   }
-  if (S_ISCHR(match->file->stat.mode)) {
-    return typed_string_to_json("c", W_STRING_UNICODE);
+  if (S_ISCHR(mode)) {
+    return "c";
   }
-  if (S_ISFIFO(match->file->stat.mode)) {
-    return typed_string_to_json("p", W_STRING_UNICODE);
+  if (S_ISFIFO(mode)) {
+    return "p";
   }
-  if (S_ISSOCK(match->file->stat.mode)) {
-    return typed_string_to_json("s", W_STRING_UNICODE);
+  if (S_ISSOCK(mode)) {
+    return "s";
   }
 #ifdef S_ISDOOR
-  if (S_ISDOOR(match->file->stat.mode)) {
-    return typed_string_to_json("D", W_STRING_UNICODE);
+  if (S_ISDOOR(mode)) {
+    return "D";
   }
 #endif
-  return typed_string_to_json("?", W_STRING_UNICODE);
+  return "?";
+}
+
+static void make_type_field(
+    const struct watchman_rule_match* match,
+    w_query_field_value* value) {
+  value->set_text(file_type_name(match->file->stat.mode), 1);
 }
 
 static struct w_query_field_renderer {
   const char *name;
-  json_t* (*make)(const struct watchman_rule_match* match);
+  void (*make)(
+      const struct watchman_rule_match* match,
+      w_query_field_value* value);
+  // Successive values share long prefixes, so are worth encoding as
+  // prefix-compressed strings for a peer that accepts them
+  bool prefix_compress;
 } field_defs[] = {
-  { "name", make_name },
-  { "symlink_target", make_symlink },
-  { "exists", make_exists },
-  { "size", make_size },
-  { "mode", make_mode },
-  { "uid", make_uid },
-  { "gid", make_gid },
+  { "name", make_name, true },
+  { "symlink_target", make_symlink, false },
+  { "exists", make_exists, false },
+  { "size", make_size, false },
+  { "mode", make_mode, false },
+  { "uid", make_uid, false },
+  { "gid", make_gid, false },
   MAKE_TIME_FIELD_DEFS(a),
   MAKE_TIME_FIELD_DEFS(m),
   MAKE_TIME_FIELD_DEFS(c),
-  { "ino", make_ino },
-  { "dev", make_dev },
-  { "nlink", make_nlink },
-  { "new", make_new },
-  { "oclock", make_oclock },
-  { "cclock", make_cclock },
-  { "type", make_type_field },
-  { NULL, NULL }
+  { "ino", make_ino, false },
+  { "dev", make_dev, false },
+  { "nlink", make_nlink, false },
+  { "new", make_new, false },
+  { "oclock", make_oclock, false },
+  { "cclock", make_cclock, false },
+  { "type", make_type_field, false },
+  { NULL, NULL, false }
 };
 
 static w_ctor_fn_type(register_field_capabilities) {
@@ -155,11 +249,41 @@ static w_ctor_fn_type(register_field_capabilities) {
 }
 w_ctor_fn_reg(register_field_capabilities)
 
+static json_t* field_value_to_json(const w_query_field_value* value) {
+  switch (value->type) {
+    case w_query_field_value::NUL:
+      return json_null();
+    case w_query_field_value::BOOLEAN:
+      return json_boolean(value->ival);
+    case w_query_field_value::INTEGER:
+      return json_integer(value->ival);
+    case w_query_field_value::REAL:
+      return json_real(value->dval);
+    case w_query_field_value::STRING:
+      if (value->wstr) {
+        return w_string_to_json(value->wstr);
+      }
+      return typed_string_len_to_json(value->str, value->len, value->stype);
+    case w_query_field_value::MISSING:
+    default:
+      return nullptr;
+  }
+}
+
 json_t* w_query_results_to_json(
     struct w_query_field_list* field_list,
     uint32_t num_results,
     const std::deque<watchman_rule_match>& results) {
+  return w_query_results_slice_to_json(field_list, results, 0, num_results);
+}
+
+json_t* w_query_results_slice_to_json(
+    struct w_query_field_list* field_list,
+    const std::deque<watchman_rule_match>& results,
+    size_t start,
+    size_t num_results) {
   json_t *file_list = json_array_of_size(num_results);
+  w_query_field_value field_value;
   uint32_t i, f;
 
   // build a template for the serializer
@@ -179,12 +303,14 @@ json_t* w_query_results_to_json(
     json_t *value, *ele;
 
     if (field_list->num_fields == 1) {
-      value = field_list->fields[0]->make(&results[i]);
+      field_list->fields[0]->make(&results[start + i], &field_value);
+      value = field_value_to_json(&field_value);
     } else {
       value = json_object_of_size(field_list->num_fields);
 
       for (f = 0; f < field_list->num_fields; f++) {
-        ele = field_list->fields[f]->make(&results[i]);
+        field_list->fields[f]->make(&results[start + i], &field_value);
+        ele = field_value_to_json(&field_value);
         set_prop(value, field_list->fields[f]->name, ele);
       }
     }
@@ -193,6 +319,316 @@ json_t* w_query_results_to_json(
   return file_list;
 }
 
+static void append_bser_value(
+    std::string& buf,
+    const w_query_field_value* value,
+    std::string* prev_string) {
+  switch (value->type) {
+    case w_query_field_value::NUL:
+      w_bser_append_null(buf);
+      break;
+    case w_query_field_value::BOOLEAN:
+      w_bser_append_bool(buf, value->ival);
+      break;
+    case w_query_field_value::INTEGER:
+      w_bser_append_int(buf, value->ival);
+      break;
+    case w_query_field_value::REAL:
+      w_bser_append_real(buf, value->dval);
+      break;
+    case w_query_field_value::STRING:
+      if (prev_string) {
+        w_bser_append_prefix_string(buf, *prev_string, value->str, value->len);
+      } else {
+        w_bser_append_bytestring(buf, value->str, value->len);
+      }
+      break;
+    case w_query_field_value::MISSING:
+    default:
+      w_bser_append_skip(buf);
+      break;
+  }
+}
+
+// If prefix_strings is set, the values of the fields that call for it are
+// encoded as prefix-compressed strings
+static bool encode_results_bser(
+    std::string& buf,
+    struct w_query_field_list* field_list,
+    const std::deque<watchman_rule_match>& results,
+    size_t start,
+    size_t num_results,
+    bool prefix_strings) {
+  w_query_field_value value;
+  const char* keys[sizeof(field_list->fields) / sizeof(field_list->fields[0])];
+  std::string* prev_strings[sizeof(keys) / sizeof(keys[0])];
+  std::string prev_string;
+  uint32_t f;
+
+  for (f = 0; f < field_list->num_fields; f++) {
+    prev_strings[f] = prefix_strings && field_list->fields[f]->prefix_compress
+        ? &prev_string
+        : nullptr;
+  }
+
+  if (num_results && field_list->num_fields > 1) {
+    for (f = 0; f < field_list->num_fields; f++) {
+      keys[f] = field_list->fields[f]->name;
+    }
+    w_bser_append_template_header(
+        buf, keys, field_list->num_fields, num_results);
+
+    for (size_t i = start; i < start + num_results; i++) {
+      for (f = 0; f < field_list->num_fields; f++) {
+        field_list->fields[f]->make(&results[i], &value);
+        append_bser_value(buf, &value, prev_strings[f]);
+      }
+    }
+    return true;
+  }
+
+  w_bser_append_array_header(buf, num_results);
+  for (size_t i = start; i < start + num_results; i++) {
+    if (field_list->num_fields == 1) {
+      field_list->fields[0]->make(&results[i], &value);
+      if (value.type == w_query_field_value::MISSING) {
+        value.set_null();
+      }
+      append_bser_value(buf, &value, prev_strings[0]);
+    } else {
+      w_bser_append_object_header(buf, 0);
+    }
+  }
+  return true;
+}
+
+static int append_to_string(const char* buffer, size_t size, void* ptr) {
+  ((std::string*)ptr)->append(buffer, size);
+  return 0;
+}
+
+static bool append_json_value(
+    std::string& buf,
+    const w_query_field_value* value) {
+  char ibuf[32];
+  int len;
+
+  switch (value->type) {
+    case w_query_field_value::BOOLEAN:
+      if (value->ival) {
+        buf.append("true", 4);
+      } else {
+        buf.append("false", 5);
+      }
+      return true;
+    case w_query_field_value::INTEGER:
+      len = snprintf(ibuf, sizeof(ibuf), "%" JSON_INTEGER_FORMAT, value->ival);
+      buf.append(ibuf, len);
+      return true;
+    case w_query_field_value::REAL:
+      return json_dump_real(value->dval, append_to_string, &buf) == 0;
+    case w_query_field_value::STRING:
+      return json_dump_string(
+                 value->str,
+                 value->len,
+                 append_to_string,
+                 &buf,
+                 JSON_COMPACT) == 0;
+    case w_query_field_value::NUL:
+    case w_query_field_value::MISSING:
+    default:
+      buf.append("null", 4);
+      return true;
+  }
+}
+
+static bool encode_results_json(
+    std::string& buf,
+    struct w_query_field_list* field_list,
+    const std::deque<watchman_rule_match>& results,
+    size_t start,
+    size_t num_results) {
+  w_query_field_value value;
+  std::string keys[sizeof(field_list->fields) / sizeof(field_list->fields[0])];
+  uint32_t f;
+
+  // The quoted names of the fields, ready to go in front of the values
+  for (f = 0; f < field_list->num_fields; f++) {
+    auto name = field_list->fields[f]->name;
+    if (json_dump_string(
+            name, strlen(name), append_to_string, &keys[f], JSON_COMPACT)) {
+      return false;
+    }
+    keys[f].push_back(':');
+  }
+
+  buf.push_back('[');
+  for (size_t i = start; i < start + num_results; i++) {
+    if (i > start) {
+      buf.push_back(',');
+    }
+
+    if (field_list->num_fields == 1) {
+      field_list->fields[0]->make(&results[i], &value);
+      if (!append_json_value(buf, &value)) {
+        return false;
+      }
+      continue;
+    }
+
+    bool first = true;
+    buf.push_back('{');
+    for (f = 0; f < field_list->num_fields; f++) {
+      field_list->fields[f]->make(&results[i], &value);
+      if (value.type == w_query_field_value::MISSING) {
+        continue;
+      }
+      if (!first) {
+        buf.push_back(',');
+      }
+      first = false;
+      buf.append(keys[f]);
+      if (!append_json_value(buf, &value)) {
+        return false;
+      }
+    }
+    buf.push_back('}');
+  }
+  buf.push_back(']');
+  return true;
+}
+
+w_encoded_pdu* w_query_render_results(
+    enum w_pdu_type pdu_type,
+    uint32_t bser_capabilities,
+    json_t* response,
+    const char* key,
+    struct w_query_field_list* field_list,
+    const std::deque<watchman_rule_match>& results,
+    size_t start,
+    size_t num_results) {
+  std::unique_ptr<w_encoded_pdu> pdu(new w_encoded_pdu);
+  bool encoded = false;
+  bool prefix_strings = pdu_type == is_bser_v2 &&
+      (bser_capabilities & BSER_CAP_ACCEPT_PREFIX_STRINGS);
+
+  switch (pdu_type) {
+    case is_bser:
+    case is_bser_v2:
+      encoded = w_ser_encode_pdu(
+          pdu_type,
+          prefix_strings ? BSER_CAP_PREFIX_STRINGS : 0,
+          response,
+          key,
+          [&](std::string& buf) {
+            return encode_results_bser(
+                buf, field_list, results, start, num_results, prefix_strings);
+          },
+          pdu.get());
+      break;
+    case is_json_compact:
+      encoded = w_ser_encode_pdu(
+          pdu_type,
+          0,
+          response,
+          key,
+          [&](std::string& buf) {
+            return encode_results_json(
+                buf, field_list, results, start, num_results);
+          },
+          pdu.get());
+      break;
+    default:
+      break;
+  }
+
+  if (encoded) {
+    return pdu.release();
+  }
+
+  set_prop(
+      response,
+      key,
+      w_query_results_slice_to_json(field_list, results, start, num_results));
+  return nullptr;
+}
+
+const char* w_query_result_prop_name(w_query* query, w_query_res* res) {
+  if (res->collapsed) {
+    return "dirs";
+  }
+  switch (query->result_mode) {
+    case W_QUERY_RESULT_COUNT:
+      return "count";
+    case W_QUERY_RESULT_EXISTS:
+      return "exists";
+    case W_QUERY_RESULT_DIRS:
+      return "dirs";
+    case W_QUERY_RESULT_FILES:
+    default:
+      return "files";
+  }
+}
+
+json_t* w_query_result_to_json(
+    w_query* query,
+    struct w_query_field_list* field_list,
+    w_query_res* res) {
+  if (res->collapsed) {
+    auto dirs = json_array_of_size(res->dirs.size());
+    for (const auto& dir : res->dirs) {
+      json_array_append_new(
+          dirs,
+          json_pack(
+              "{s:o, s:i, s:i, s:i}",
+              "name",
+              w_string_to_json(dir.name),
+              "added",
+              int64_t(dir.added),
+              "modified",
+              int64_t(dir.modified),
+              "removed",
+              int64_t(dir.removed)));
+    }
+    return dirs;
+  }
+  switch (query->result_mode) {
+    case W_QUERY_RESULT_COUNT:
+      return json_integer(res->num_matches);
+    case W_QUERY_RESULT_EXISTS:
+      return json_boolean(res->num_matches > 0);
+    case W_QUERY_RESULT_FILES:
+    default:
+      return w_query_results_to_json(
+          field_list, res->results.size(), res->results);
+  }
+}
+
+w_encoded_pdu* w_query_render_result(
+    enum w_pdu_type pdu_type,
+    uint32_t bser_capabilities,
+    w_query* query,
+    struct w_query_field_list* field_list,
+    w_query_res* res,
+    json_t* response) {
+  if (!res->collapsed && query->result_mode == W_QUERY_RESULT_FILES) {
+    return w_query_render_results(
+        pdu_type,
+        bser_capabilities,
+        response,
+        "files",
+        field_list,
+        res->results,
+        0,
+        res->results.size());
+  }
+
+  set_prop(
+      response,
+      w_query_result_prop_name(query, res),
+      w_query_result_to_json(query, field_list, res));
+  return nullptr;
+}
 
 bool parse_field_list(json_t *field_list,
     struct w_query_field_list *selected,
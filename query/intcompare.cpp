@@ -97,6 +97,10 @@ class SizeExpr : public QueryExpr {
     return eval_int_compare(file->stat.size, &comp);
   }
 
+  double estimateCost() const override {
+    return 0.5;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query* query, json_t* term) {
     if (!json_is_array(term)) {
       ignore_result(asprintf(&query->errmsg, "Expected array for 'size' term"));
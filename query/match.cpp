@@ -27,6 +27,15 @@ class WildMatchExpr : public QueryExpr {
         noescape(noescape),
         includedotfiles(includedotfiles) {}
 
+  double estimateCost() const override {
+    // Computing the wholename costs around 4
+    return wholename ? 9 : 5;
+  }
+
+  double estimateSelectivity() const override {
+    return 0.2;
+  }
+
   bool evaluate(struct w_query_ctx* ctx, const watchman_file* file) override {
     w_string_t* str;
     bool res;
@@ -3,6 +3,8 @@
 
 #include "watchman.h"
 
+#include <algorithm>
+
 class NameExpr : public QueryExpr {
   w_string name;
   w_ht_t *map;
@@ -18,6 +20,16 @@ class NameExpr : public QueryExpr {
   }
 
  public:
+  double estimateCost() const override {
+    // Computing the wholename costs around 4
+    return (wholename ? 5 : 1) + (caseless ? 1 : 0);
+  }
+
+  double estimateSelectivity() const override {
+    auto n = map ? w_ht_size(map) : 1;
+    return std::min(0.05 * n, 0.5);
+  }
+
   bool evaluate(struct w_query_ctx* ctx, const watchman_file* file) override {
     w_string_t* str;
 
@@ -0,0 +1,269 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "ThreadPool.h"
+#include <atomic>
+
+/* Parallel query evaluation */
+
+// The number of files that are evaluated by a worker in one go
+#define QUERY_PARALLEL_CHUNK_SIZE 8192
+#define DEFAULT_QUERY_PARALLEL_THREADS 4
+
+static watchman::ThreadPool& get_query_pool() {
+  static std::once_flag once;
+  static watchman::ThreadPool* pool;
+
+  std::call_once(once, [] {
+    auto numThreads = cfg_get_int(
+        nullptr, "query_parallel_threads", DEFAULT_QUERY_PARALLEL_THREADS);
+    if (numThreads < 1) {
+      numThreads = 1;
+    }
+    // This is intentionally never freed; queries may still be running
+    // during process shutdown
+    pool = new watchman::ThreadPool;
+    pool->start(size_t(numThreads), "query-worker");
+  });
+  return *pool;
+}
+
+struct QueryParallelizer::Chunk {
+  std::vector<const watchman_file*> files;
+  std::deque<watchman_rule_match> results;
+  uint32_t num_deduped{0};
+  uint32_t num_matches{0};
+  bool collapsed{false};
+  std::unordered_map<const watchman_dir*, w_query_dir_summary> dirs;
+};
+
+struct QueryParallelizer::State {
+  std::mutex mutex;
+  std::condition_variable cond;
+  size_t outstanding{0};
+  std::string error;
+  // Set once any worker gives up, so that the others stop evaluating
+  // their chunks and no more are dispatched
+  std::atomic<bool> cancelled{false};
+
+  void fail(const std::string& reason) {
+    std::lock_guard<std::mutex> guard(mutex);
+    if (error.empty()) {
+      error = reason;
+    }
+    cancelled = true;
+  }
+};
+
+// Returns why the query should be abandoned, or an empty string if it
+// should carry on.  This is w_query_process_file's check, except that
+// it leaves query->errmsg alone as the workers share the query.
+static std::string parallel_cancel_reason(
+    w_query* query,
+    std::chrono::steady_clock::time_point deadline) {
+  if (query->deadline_ms && std::chrono::steady_clock::now() >= deadline) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "query exceeded its deadline_ms of %u",
+             query->deadline_ms);
+    return buf;
+  }
+  if (query->is_cancelled && query->is_cancelled()) {
+    return "query was cancelled";
+  }
+  return std::string();
+}
+
+QueryParallelizer::QueryParallelizer(w_query_ctx* ctx, size_t threshold)
+    : ctx_(ctx), threshold_(threshold), state_(std::make_shared<State>()) {}
+
+QueryParallelizer::~QueryParallelizer() {
+  // The chunks reference the view, so we must not return while any
+  // of them are still being evaluated
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  state_->cond.wait(lock, [this] { return state_->outstanding == 0; });
+}
+
+bool QueryParallelizer::add(const watchman_file* file) {
+  if (state_->cancelled) {
+    return false;
+  }
+
+  ++numFiles_;
+  pending_.push_back(file);
+
+  if (!parallel_) {
+    if (pending_.size() < threshold_) {
+      return true;
+    }
+    parallel_ = true;
+  }
+
+  if (pending_.size() >= QUERY_PARALLEL_CHUNK_SIZE) {
+    dispatch();
+  }
+  return true;
+}
+
+// Hands the pending files off to the workers, in chunks.  The chunks
+// share the deadline that the query was armed with.
+void QueryParallelizer::dispatch() {
+  auto& pool = get_query_pool();
+  auto query = ctx_->query;
+  auto lock = ctx_->lock;
+  auto since = ctx_->since;
+  auto since_terms = ctx_->since_terms;
+  auto check_cancel = ctx_->check_cancel;
+  auto deadline = ctx_->deadline;
+
+  for (size_t start = 0; start < pending_.size() && !state_->cancelled;
+       start += QUERY_PARALLEL_CHUNK_SIZE) {
+    auto end = std::min(start + QUERY_PARALLEL_CHUNK_SIZE, pending_.size());
+    auto chunk = std::make_shared<Chunk>();
+    chunk->files.assign(pending_.begin() + start, pending_.begin() + end);
+    chunks_.push_back(chunk);
+
+    {
+      std::lock_guard<std::mutex> guard(state_->mutex);
+      ++state_->outstanding;
+    }
+
+    auto state = state_;
+    pool.run([chunk,
+              state,
+              query,
+              lock,
+              since,
+              since_terms,
+              check_cancel,
+              deadline] {
+      try {
+        w_query_ctx ctx(query, lock);
+        ctx.since = since;
+        ctx.since_terms = since_terms;
+        if (query->dedup_results) {
+          w_query_ctx_enable_dedup(&ctx);
+        }
+
+        uint32_t num_until_check = 0;
+        for (auto file : chunk->files) {
+          if (state->cancelled) {
+            break;
+          }
+          if (check_cancel &&
+              ++num_until_check >= QUERY_CANCEL_CHECK_INTERVAL) {
+            num_until_check = 0;
+            auto reason = parallel_cancel_reason(query, deadline);
+            if (!reason.empty()) {
+              state->fail(reason);
+              break;
+            }
+          }
+          if (!w_query_process_file(query, &ctx, file)) {
+            // The worker ctx never checks for cancellation itself, so
+            // this only happens once it has everything that it needs
+            break;
+          }
+        }
+
+        chunk->results = std::move(ctx.results);
+        chunk->num_deduped = ctx.num_deduped;
+        chunk->num_matches = ctx.num_matches;
+        chunk->collapsed = ctx.collapsed;
+        chunk->dirs = std::move(ctx.dirs);
+      } catch (const std::exception& exc) {
+        state->fail(
+            std::string("parallel query evaluation failed: ") + exc.what());
+      }
+
+      std::lock_guard<std::mutex> guard(state->mutex);
+      if (--state->outstanding == 0) {
+        state->cond.notify_all();
+      }
+    });
+  }
+
+  pending_.clear();
+}
+
+bool QueryParallelizer::finish(char** errmsg) {
+  // Files produced from here on are evaluated by the ctx itself
+  ctx_->parallel = nullptr;
+
+  if (!parallel_) {
+    // Not worth the overhead; evaluate them here
+    auto query = ctx_->query;
+    for (auto file : pending_) {
+      if (!w_query_process_file(query, ctx_, file) && !ctx_->complete) {
+        *errmsg = query->errmsg;
+        query->errmsg = nullptr;
+        pending_.clear();
+        return false;
+      }
+    }
+    pending_.clear();
+    return true;
+  }
+
+  dispatch();
+
+  {
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->cond.wait(lock, [this] { return state_->outstanding == 0; });
+    if (state_->cancelled) {
+      *errmsg = strdup(state_->error.c_str());
+      return false;
+    }
+  }
+
+  // Each chunk was deduplicated independently; catch the duplicates
+  // that span chunks as we merge them
+  for (auto& chunk : chunks_) {
+    ctx_->num_deduped += chunk->num_deduped;
+    ctx_->num_matches += chunk->num_matches;
+
+    for (auto& match : chunk->results) {
+      if (ctx_->dedup && w_query_ctx_is_dup(ctx_, ctx_->names.build(match))) {
+        ctx_->num_deduped++;
+        continue;
+      }
+      ctx_->results.emplace_back(std::move(match));
+    }
+    chunk->results.clear();
+
+    for (const auto& it : chunk->dirs) {
+      ctx_->dirs[it.first].add(it.second);
+    }
+    chunk->dirs.clear();
+    if (chunk->collapsed) {
+      ctx_->collapsed = true;
+    }
+  }
+
+  // A chunk that crossed the threshold on its own collapsed its results;
+  // fold the rest in with them, as we would have done serially
+  auto threshold = ctx_->query->collapse_threshold;
+  if (ctx_->collapsed ||
+      (threshold && ctx_->results.size() > threshold)) {
+    w_query_ctx_collapse(ctx_);
+  }
+
+  return true;
+}
+
+json_t* QueryParallelizer::stats() const {
+  if (!parallel_) {
+    return nullptr;
+  }
+  return json_pack(
+      "{s:i, s:i, s:i}",
+      "files",
+      int64_t(numFiles_),
+      "chunks",
+      int64_t(chunks_.size()),
+      "threads",
+      int64_t(get_query_pool().numThreads()));
+}
+
+/* vim:ts=2:sw=2:et:
+ */
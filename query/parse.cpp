@@ -3,9 +3,9 @@
 
 #include "watchman.h"
 
-static w_ht_t *term_hash = NULL;
+#include "make_unique.h"
 
-QueryExpr::~QueryExpr() {}
+static w_ht_t *term_hash = NULL;
 
 bool w_query_register_expression_parser(
     const char *term,
@@ -237,6 +237,7 @@ static bool parse_query_expression(w_query *res, json_t *query)
   if (!res->expr) {
     return false;
   }
+  res->program = watchman::make_unique<QueryProgram>(res->expr.get());
 
   return true;
 }
@@ -279,6 +280,69 @@ static bool parse_lock_timeout(w_query *res, json_t *query)
   return true;
 }
 
+W_CAP_REG("deadline_ms")
+
+static bool parse_deadline(w_query *res, json_t *query)
+{
+  int value = 0;
+
+  if (query &&
+      json_unpack(query, "{s?:i*}", "deadline_ms", &value) != 0) {
+    res->errmsg = strdup("deadline_ms must be an integer value >= 0");
+    return false;
+  }
+
+  if (value < 0) {
+    res->errmsg = strdup("deadline_ms must be an integer value >= 0");
+    return false;
+  }
+
+  res->deadline_ms = value;
+  return true;
+}
+
+W_CAP_REG("yield_every")
+
+static bool parse_yield_every(w_query *res, json_t *query)
+{
+  int value = 0;
+
+  if (query &&
+      json_unpack(query, "{s?:i*}", "yield_every", &value) != 0) {
+    res->errmsg = strdup("yield_every must be an integer value >= 0");
+    return false;
+  }
+
+  if (value < 0) {
+    res->errmsg = strdup("yield_every must be an integer value >= 0");
+    return false;
+  }
+
+  res->yield_every = value;
+  return true;
+}
+
+W_CAP_REG("chunk_size")
+
+static bool parse_chunk_size(w_query *res, json_t *query)
+{
+  int value = 0;
+
+  if (query &&
+      json_unpack(query, "{s?:i*}", "chunk_size", &value) != 0) {
+    res->errmsg = strdup("chunk_size must be an integer value >= 0");
+    return false;
+  }
+
+  if (value < 0) {
+    res->errmsg = strdup("chunk_size must be an integer value >= 0");
+    return false;
+  }
+
+  res->chunk_size = value;
+  return true;
+}
+
 W_CAP_REG("dedup_results")
 
 static bool parse_dedup(w_query *res, json_t *query)
@@ -295,6 +359,55 @@ static bool parse_dedup(w_query *res, json_t *query)
   return true;
 }
 
+W_CAP_REG("result_mode")
+
+static bool parse_result_mode(w_query *res, json_t *query)
+{
+  const char *mode = nullptr;
+
+  if (query &&
+      json_unpack(query, "{s?:s}", "result_mode", &mode) != 0) {
+    res->errmsg = strdup("result_mode must be a string");
+    return false;
+  }
+
+  if (!mode || !strcmp(mode, "files")) {
+    res->result_mode = W_QUERY_RESULT_FILES;
+  } else if (!strcmp(mode, "count")) {
+    res->result_mode = W_QUERY_RESULT_COUNT;
+  } else if (!strcmp(mode, "exists")) {
+    res->result_mode = W_QUERY_RESULT_EXISTS;
+  } else if (!strcmp(mode, "dirs")) {
+    res->result_mode = W_QUERY_RESULT_DIRS;
+  } else {
+    ignore_result(asprintf(&res->errmsg,
+        "result_mode must be one of 'files', 'count', 'exists' or 'dirs', "
+        "not '%s'",
+        mode));
+    return false;
+  }
+  return true;
+}
+
+static bool parse_collapse_threshold(w_query *res, json_t *query)
+{
+  int value = 0;
+
+  if (query &&
+      json_unpack(query, "{s?:i*}", "collapse_threshold", &value) != 0) {
+    res->errmsg = strdup("collapse_threshold must be an integer value >= 0");
+    return false;
+  }
+
+  if (value < 0) {
+    res->errmsg = strdup("collapse_threshold must be an integer value >= 0");
+    return false;
+  }
+
+  res->collapse_threshold = value;
+  return true;
+}
+
 static bool parse_empty_on_fresh_instance(w_query *res, json_t *query)
 {
   int value = 0;
@@ -345,6 +458,18 @@ w_query_parse(const w_root_t* root, json_t* query, char** errmsg) {
     goto error;
   }
 
+  if (!parse_deadline(res, query)) {
+    goto error;
+  }
+
+  if (!parse_yield_every(res, query)) {
+    goto error;
+  }
+
+  if (!parse_chunk_size(res, query)) {
+    goto error;
+  }
+
   if (!parse_relative_root(root, res, query)) {
     goto error;
   }
@@ -353,6 +478,14 @@ w_query_parse(const w_root_t* root, json_t* query, char** errmsg) {
     goto error;
   }
 
+  if (!parse_result_mode(res, query)) {
+    goto error;
+  }
+
+  if (!parse_collapse_threshold(res, query)) {
+    goto error;
+  }
+
   /* Look for path generators */
   if (!parse_paths(res, query)) {
     goto error;
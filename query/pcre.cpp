@@ -24,6 +24,15 @@ class PcreExpr : public QueryExpr {
     }
   }
 
+  double estimateCost() const override {
+    // Computing the wholename costs around 4
+    return wholename ? 24 : 20;
+  }
+
+  double estimateSelectivity() const override {
+    return 0.2;
+  }
+
   bool evaluate(struct w_query_ctx* ctx, const watchman_file* file) override {
     w_string_t* str;
     int rc;
@@ -0,0 +1,66 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+
+#include <algorithm>
+
+/* Expression compiler */
+
+QueryExpr::~QueryExpr() {}
+
+void QueryExpr::prepare(w_query_ctx*) {}
+
+double QueryExpr::estimateCost() const {
+  return 1;
+}
+
+double QueryExpr::estimateSelectivity() const {
+  return 0.5;
+}
+
+uint32_t
+QueryExpr::compile(QueryProgram* prog, uint32_t onTrue, uint32_t onFalse) {
+  return prog->emit(this, onTrue, onFalse);
+}
+
+bool QueryExpr::requiredSuffixes(std::vector<w_string>&) const {
+  return false;
+}
+
+bool QueryExpr::requiredDirName(w_string&) const {
+  return false;
+}
+
+QueryProgram::QueryProgram(QueryExpr* expr) {
+  // Expressions are compiled back to front, because the labels that an
+  // instruction branches to must be known when it is emitted.  Having
+  // done so, reverse the program so that it generally flows forwards.
+  auto entry = expr->compile(this, kAccept, kReject);
+
+  auto n = uint32_t(instrs_.size());
+  auto relabel = [n](uint32_t label) {
+    return label >= kReject ? label : n - 1 - label;
+  };
+  std::reverse(instrs_.begin(), instrs_.end());
+  for (auto& instr : instrs_) {
+    instr.onTrue = relabel(instr.onTrue);
+    instr.onFalse = relabel(instr.onFalse);
+  }
+  entry_ = relabel(entry);
+}
+
+uint32_t
+QueryProgram::emit(QueryExpr* expr, uint32_t onTrue, uint32_t onFalse) {
+  instrs_.emplace_back(Instr{expr, onTrue, onFalse});
+  return uint32_t(instrs_.size() - 1);
+}
+
+void QueryProgram::prepare(w_query_ctx* ctx) {
+  for (auto& instr : instrs_) {
+    instr.expr->prepare(ctx);
+  }
+}
+
+/* vim:ts=2:sw=2:et:
+ */
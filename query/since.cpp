@@ -20,18 +20,36 @@ static struct {
 class SinceExpr : public QueryExpr {
   std::unique_ptr<w_clockspec> spec;
   enum since_what field;
+  // Where prepare() leaves the evaluated clockspec in
+  // w_query_ctx::since_terms
+  uint32_t slot;
 
  public:
-  explicit SinceExpr(std::unique_ptr<w_clockspec> spec, enum since_what field)
-      : spec(std::move(spec)), field(field) {}
+  explicit SinceExpr(
+      std::unique_ptr<w_clockspec> spec,
+      enum since_what field,
+      uint32_t slot)
+      : spec(std::move(spec)), field(field), slot(slot) {}
+
+  void prepare(struct w_query_ctx* ctx) override {
+    // The root is locked for the duration of the query, so the clock
+    // evaluates the same way for every file
+    w_clockspec_eval_readonly(ctx->lock, spec.get(), &ctx->since_terms[slot]);
+  }
+
+  double estimateCost() const override {
+    return 0.5;
+  }
+
+  double estimateSelectivity() const override {
+    return 0.1;
+  }
 
   bool evaluate(struct w_query_ctx* ctx, const watchman_file* file) override {
+    const auto& since = ctx->since_terms[slot];
     w_clock_t clock;
-    struct w_query_since since;
     time_t tval = 0;
 
-    w_clockspec_eval_readonly(ctx->lock, spec.get(), &since);
-
     switch (field) {
       case since_what::SINCE_OCLOCK:
       case since_what::SINCE_CCLOCK:
@@ -130,7 +148,8 @@ class SinceExpr : public QueryExpr {
         break;
     }
 
-    return watchman::make_unique<SinceExpr>(std::move(spec), selected_field);
+    return watchman::make_unique<SinceExpr>(
+        std::move(spec), selected_field, query->num_since_terms++);
   }
 };
 W_TERM_PARSER("since", SinceExpr::parse)
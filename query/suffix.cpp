@@ -15,6 +15,15 @@ class SuffixExpr : public QueryExpr {
     return w_string_suffix_match(w_file_get_name(file), suffix);
   }
 
+  double estimateSelectivity() const override {
+    return 0.1;
+  }
+
+  bool requiredSuffixes(std::vector<w_string>& suffixes) const override {
+    suffixes.push_back(suffix);
+    return true;
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query* query, json_t* term) {
     const char *ignore, *suffix;
 
@@ -36,6 +36,21 @@ class TypeExpr : public QueryExpr {
     }
   }
 
+  double estimateCost() const override {
+    return 0.5;
+  }
+
+  double estimateSelectivity() const override {
+    switch (arg) {
+      case 'f':
+        return 0.8;
+      case 'd':
+        return 0.15;
+      default:
+        return 0.02;
+    }
+  }
+
   static std::unique_ptr<QueryExpr> parse(w_query* query, json_t* term) {
     const char *ignore, *typestr, *found;
     char arg;
@@ -28,6 +28,13 @@ void watchman_root::performAgeOut(std::chrono::seconds min_age) {
   // of build tooling or atomic renames)
   w_perf_t sample("age_out");
 
+  // The materialized queries may be holding on to files that are about
+  // to be aged out; bring them up to date so that they let go
+  {
+    struct read_locked_watchman_root lock = {this};
+    w_root_update_materialized(&lock);
+  }
+
   inner.view->ageOut(sample, std::chrono::seconds(min_age));
 
   // Age out cursors too.
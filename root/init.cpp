@@ -3,6 +3,7 @@
 
 #include "watchman.h"
 
+#include "ChangeLogRing.h"
 #include "InMemoryView.h"
 #include "make_unique.h"
 
@@ -74,6 +75,51 @@ static void apply_ignore_configuration(w_root_t *root) {
   }
 }
 
+// The change log ring lives in the state dir, named for the root
+static void create_change_log(w_root_t *root) {
+  auto size = cfg_get_int(root, "changelog_size", 0);
+  if (size <= 0 || !watchman_state_file) {
+    return;
+  }
+
+  auto state_dir = w_string(watchman_state_file, W_STRING_BYTE).dirName();
+  auto path = w_string::printf(
+      "%.*s%cchangelog-%08x",
+      int(state_dir.size()),
+      state_dir.data(),
+      WATCHMAN_DIR_SEP,
+      w_hash_bytes(root->root_path.data(), root->root_path.size(), 0));
+  root->changeLog = watchman::ChangeLogRing::create(
+      path.c_str(),
+      uint64_t(size),
+      cfg_get_perms(root, "sock_access", false, false));
+  if (!root->changeLog) {
+    w_log(
+        W_LOG_ERR,
+        "failed to create the change log for %s at %s: %s\n",
+        root->root_path.c_str(),
+        path.c_str(),
+        strerror(errno));
+  }
+}
+
+// Starts the change log over for the new view
+static void reset_change_log(w_root_t *root) {
+  char clockbuf[128];
+
+  if (!root->changeLog) {
+    return;
+  }
+  // The clock for tick 0 ends in "0"; leave that off
+  if (clock_id_string(root->inner.number, 0, clockbuf, sizeof(clockbuf))) {
+    clockbuf[strlen(clockbuf) - 1] = '\0';
+  } else {
+    clockbuf[0] = '\0';
+  }
+  root->changeLog->reset(clockbuf);
+  root->inner.view->changeLog = root->changeLog.get();
+}
+
 // internal initialization for root
 bool w_root_init(w_root_t *root, char **errmsg) {
   struct watchman_dir_handle *osdir;
@@ -92,6 +138,7 @@ bool w_root_init(w_root_t *root, char **errmsg) {
   }
 
   root->inner.number = next_root_number++;
+  reset_change_log(root);
 
   time(&root->inner.last_cmd_timestamp);
 
@@ -109,6 +156,11 @@ w_root_t *w_root_new(const char *path, char **errmsg) {
   load_root_config(root, path);
   root->trigger_settle = (int)cfg_get_int(
       root, "settle", DEFAULT_SETTLE_PERIOD);
+  root->io_slice_items =
+      (int)cfg_get_int(root, "io_slice_items", DEFAULT_IO_SLICE_ITEMS);
+  root->io_slice_ms = (int)cfg_get_int(root, "io_slice_ms", DEFAULT_IO_SLICE_MS);
+  root->query_parallel_threshold = (int)cfg_get_int(
+      root, "query_parallel_threshold", DEFAULT_QUERY_PARALLEL_THRESHOLD);
   root->gc_age = (int)cfg_get_int(root, "gc_age_seconds", DEFAULT_GC_AGE);
   root->gc_interval = (int)cfg_get_int(root, "gc_interval_seconds",
       DEFAULT_GC_INTERVAL);
@@ -116,6 +168,7 @@ w_root_t *w_root_new(const char *path, char **errmsg) {
       DEFAULT_REAP_AGE);
 
   apply_ignore_configuration(root);
+  create_change_log(root);
 
   if (!apply_ignore_vcs_configuration(root, errmsg)) {
     w_root_delref_raw(root);
@@ -130,7 +183,10 @@ w_root_t *w_root_new(const char *path, char **errmsg) {
 }
 
 void w_root_teardown(w_root_t *root) {
+  w_pending_coll_lock(&root->ioThread.pending);
   w_pending_coll_drain(&root->ioThread.pending);
+  root->ioThread.barriers.clear();
+  w_pending_coll_unlock(&root->ioThread.pending);
 
   // Placement delete and then new to re-init the storage.
   // We can't just delete because we need to leave things
@@ -70,8 +70,12 @@ static bool do_settle_things(struct unlocked_watchman_root* unlocked) {
     return false;
   }
 
-  process_subscriptions(&lock);
-  process_triggers(&lock);
+  w_root_update_materialized(w_root_read_lock_from_write(&lock));
+  {
+    SettleCandidates candidates(w_root_read_lock_from_write(&lock));
+    process_subscriptions(&lock, &candidates);
+    process_triggers(&lock, &candidates);
+  }
   if (consider_reap(&lock)) {
     w_root_unlock(&lock, unlocked);
     w_root_stop_watch(unlocked);
@@ -83,78 +87,214 @@ static bool do_settle_things(struct unlocked_watchman_root* unlocked) {
   return false;
 }
 
-static void io_thread(struct unlocked_watchman_root *unlocked)
-{
-  int timeoutms, biggest_timeout;
-  struct watchman_pending_collection pending;
-  struct write_locked_watchman_root lock;
-
-  timeoutms = unlocked->root->trigger_settle;
+void w_root_io_loop_init(
+    w_root_t* root,
+    struct watchman_io_loop_state* state) {
+  state->timeoutms = root->trigger_settle;
 
   // Upper bound on sleep delay.  These options are measured in seconds.
-  biggest_timeout = unlocked->root->gc_interval;
-  if (biggest_timeout == 0 ||
-      (unlocked->root->idle_reap_age != 0 &&
-       unlocked->root->idle_reap_age < biggest_timeout)) {
-    biggest_timeout = unlocked->root->idle_reap_age;
+  state->biggest_timeout = root->gc_interval;
+  if (state->biggest_timeout == 0 ||
+      (root->idle_reap_age != 0 &&
+       root->idle_reap_age < state->biggest_timeout)) {
+    state->biggest_timeout = root->idle_reap_age;
   }
-  if (biggest_timeout == 0) {
-    biggest_timeout = 86400;
+  if (state->biggest_timeout == 0) {
+    state->biggest_timeout = 86400;
   }
   // And convert to milliseconds
-  biggest_timeout *= 1000;
+  state->biggest_timeout *= 1000;
+}
 
-  while (!unlocked->root->inner.cancelled) {
-    bool pinged;
+void w_root_io_loop_crawl(
+    struct unlocked_watchman_root* unlocked,
+    struct watchman_io_loop_state* state) {
+  if (!unlocked->root->inner.done_initial) {
+    /* first order of business is to find all the files under our root */
+    full_crawl(unlocked, state->pending);
+
+    state->timeoutms = unlocked->root->trigger_settle;
+  }
+}
 
-    if (!unlocked->root->inner.done_initial) {
-      /* first order of business is to find all the files under our root */
-      full_crawl(unlocked, pending);
+static uint64_t elapsed_usec(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - since)
+      .count();
+}
 
-      timeoutms = unlocked->root->trigger_settle;
+// Process items from coll until it is empty, or until we've processed
+// max_items of them or spent max_ms doing so.  Items discovered while
+// crawling are added to coll and are eligible for processing in this
+// same slice.
+// Cookies are not processed here; they are moved to the cookies vector
+// so that the caller can process them once everything that was pending
+// ahead of them has been processed.  Otherwise, since we release the lock
+// between slices, a sync_to_now caller could observe the view before we
+// have finished processing the changes that preceded its cookie.
+// Returns the number of items that were processed.
+static uint32_t process_pending_slice(
+    struct write_locked_watchman_root* lock,
+    struct watchman_pending_collection* coll,
+    std::vector<struct watchman_pending_fs*>& cookies) {
+  auto root = lock->root;
+  auto start = std::chrono::steady_clock::now();
+  uint32_t n = 0;
+  struct watchman_pending_fs* p;
+
+  while ((p = w_pending_coll_take(coll)) != NULL) {
+    if (w_string_startswith(p->path, root->cookies.cookiePrefix())) {
+      cookies.push_back(p);
+      continue;
     }
 
-    // Wait for the notify thread to give us pending items, or for
-    // the settle period to expire
-    w_log(W_LOG_DBG, "poll_events timeout=%dms\n", timeoutms);
-    pinged = w_pending_coll_lock_and_wait(
-        &unlocked->root->ioThread.pending, timeoutms);
-    w_log(W_LOG_DBG, " ... wake up (pinged=%s)\n", pinged ? "true" : "false");
-    w_pending_coll_append(&pending, &unlocked->root->ioThread.pending);
-    w_pending_coll_unlock(&unlocked->root->ioThread.pending);
+    if (!root->inner.cancelled) {
+      w_root_process_path(lock, coll, p->path, p->now, p->flags, NULL);
+    }
+    w_pending_fs_free(p);
+    ++n;
 
-    if (!pinged && w_pending_coll_size(&pending) == 0) {
-      if (do_settle_things(unlocked)) {
-        break;
-      }
-      timeoutms = MIN(biggest_timeout, timeoutms * 2);
-      continue;
+    if (root->io_slice_items > 0 && n >= (uint32_t)root->io_slice_items) {
+      break;
+    }
+    // Checking the clock is cheap, but not free
+    if (root->io_slice_ms > 0 && (n % 64) == 0 &&
+        elapsed_usec(start) >= (uint64_t)root->io_slice_ms * 1000) {
+      break;
+    }
+  }
+
+  return n;
+}
+
+// Called after the pending items from the root have been appended to
+// state->pending.  pinged is false if we were woken up only because
+// the settle period expired.
+// Returns false if the root was reaped and the io loop should terminate.
+bool w_root_io_loop_step(
+    struct unlocked_watchman_root* unlocked,
+    struct watchman_io_loop_state* state,
+    bool pinged) {
+  struct write_locked_watchman_root lock;
+
+  if (!pinged && w_pending_coll_size(&state->pending) == 0 &&
+      state->cookies.empty()) {
+    if (do_settle_things(unlocked)) {
+      return false;
     }
+    state->timeoutms = MIN(state->biggest_timeout, state->timeoutms * 2);
+    return true;
+  }
 
-    // Otherwise we have pending items to stat and crawl
+  // Otherwise we have pending items to stat and crawl
+
+  // We are now, by definition, unsettled, so reduce sleep timeout
+  // to the settle duration ready for the next loop through
+  state->timeoutms = unlocked->root->trigger_settle;
+
+  w_root_lock(unlocked, "io_thread: process notifications", &lock);
+  auto lock_start = std::chrono::steady_clock::now();
+  if (!lock.root->inner.done_initial) {
+    // we need to recrawl.  Discard these notifications
+    w_pending_coll_drain(&state->pending);
+    state->cookies.clear();
+    w_root_unlock(&lock, unlocked);
+    return true;
+  }
+
+  lock.root->inner.ticks++;
+  // If we're not settled, we need an opportunity to age out
+  // dead file nodes.  This happens in the test harness.
+  lock.root->considerAgeOut();
+
+  std::vector<struct watchman_pending_fs*> cookies;
+  auto slices_before = lock.root->ioThread.slice_items.count;
+  while (true) {
+    auto n = process_pending_slice(&lock, &state->pending, cookies);
+    if (n > 0) {
+      lock.root->ioThread.slice_items.add(n);
+    }
 
-    // We are now, by definition, unsettled, so reduce sleep timeout
-    // to the settle duration ready for the next loop through
-    timeoutms = unlocked->root->trigger_settle;
+    if (!state->pending.pending) {
+      break;
+    }
 
+    // There's more to do; release the lock so that any queued readers
+    // can make progress before we continue
+    lock.root->ioThread.slice_lock_hold_us.add(elapsed_usec(lock_start));
+    w_root_unlock(&lock, unlocked);
     w_root_lock(unlocked, "io_thread: process notifications", &lock);
+    lock_start = std::chrono::steady_clock::now();
+
     if (!lock.root->inner.done_initial) {
-      // we need to recrawl.  Discard these notifications
-      w_pending_coll_drain(&pending);
+      // A recrawl was scheduled while we didn't hold the lock.
+      // Discard these notifications
+      w_pending_coll_drain(&state->pending);
+      state->cookies.clear();
+      for (auto p : cookies) {
+        w_pending_fs_free(p);
+      }
       w_root_unlock(&lock, unlocked);
-      continue;
+      return true;
     }
 
+    // Readers may have observed the current tick value while we released
+    // the lock; the changes from the next slice must be distinguishable
+    // from those that they have already seen.
     lock.root->inner.ticks++;
-    // If we're not settled, we need an opportunity to age out
-    // dead file nodes.  This happens in the test harness.
-    lock.root->considerAgeOut();
+  }
 
-    while (w_root_process_pending(&lock, &pending, false)) {
-      ;
+  bool did_work = lock.root->ioThread.slice_items.count != slices_before ||
+      !cookies.empty() || !state->cookies.empty();
+
+  // Everything that was pending ahead of the cookies has now been
+  // processed, so it is safe to wake up the sync_to_now waiters
+  for (auto p : cookies) {
+    if (!lock.root->inner.cancelled) {
+      w_root_process_path(&lock, &state->pending, p->path, p->now, p->flags,
+                          NULL);
     }
+    w_pending_fs_free(p);
+  }
+  for (const auto& cookie : state->cookies) {
+    lock.root->cookies.notifyCookie(cookie);
+  }
+  state->cookies.clear();
 
-    w_root_unlock(&lock, unlocked);
+  if (did_work) {
+    lock.root->ioThread.slice_lock_hold_us.add(elapsed_usec(lock_start));
+  }
+  w_root_unlock(&lock, unlocked);
+  return true;
+}
+
+static void io_thread(struct unlocked_watchman_root *unlocked)
+{
+  struct watchman_io_loop_state state;
+
+  w_root_io_loop_init(unlocked->root, &state);
+
+  while (!unlocked->root->inner.cancelled) {
+    bool pinged;
+
+    w_root_io_loop_crawl(unlocked, &state);
+
+    // Wait for the notify thread to give us pending items, or for
+    // the settle period to expire
+    w_log(W_LOG_DBG, "poll_events timeout=%dms\n", state.timeoutms);
+    pinged = w_pending_coll_lock_and_wait(
+        &unlocked->root->ioThread.pending, state.timeoutms);
+    w_log(W_LOG_DBG, " ... wake up (pinged=%s)\n", pinged ? "true" : "false");
+    if (w_root_pull_pending(unlocked->root, &state.pending, state.cookies)) {
+      // We stopped at a cookie barrier; make sure that we come straight
+      // back for the items that were queued after it
+      unlocked->root->ioThread.pending.pinged = true;
+    }
+    w_pending_coll_unlock(&unlocked->root->ioThread.pending);
+
+    if (!w_root_io_loop_step(unlocked, &state, pinged)) {
+      break;
+    }
   }
 }
 
@@ -202,19 +342,52 @@ void w_root_process_path(
   }
 }
 
+// Move the items that are pending for the root into coll, stopping at
+// the first cookie barrier, if any.  The cookies for that barrier are
+// appended to the cookies vector; they may be acknowledged once the
+// contents of coll have been processed.
+// Returns true if there are further items pending beyond that barrier.
+// The caller must own the lock on root->ioThread.pending.
+bool w_root_pull_pending(
+    w_root_t* root,
+    struct watchman_pending_collection* coll,
+    std::vector<w_string>& cookies) {
+  auto root_pending = &root->ioThread.pending;
+  auto& barriers = root->ioThread.barriers;
+
+  w_pending_coll_append(coll, root_pending);
+  if (barriers.empty()) {
+    return false;
+  }
+
+  auto& barrier = barriers.front();
+  cookies.insert(cookies.end(), barrier.cookies.begin(), barrier.cookies.end());
+  // The items that arrived after the barrier are now at the head
+  // of the queue
+  w_pending_coll_append(root_pending, barrier.after.get());
+  barriers.pop_front();
+
+  return root_pending->pending != nullptr || !barriers.empty();
+}
+
 bool w_root_process_pending(struct write_locked_watchman_root *lock,
     struct watchman_pending_collection *coll,
     bool pull_from_root)
 {
   struct watchman_pending_fs *p, *pending;
+  std::vector<w_string> cookies;
 
   if (pull_from_root) {
-    // You MUST own root->pending lock for this
-    w_pending_coll_append(coll, &lock->root->ioThread.pending);
+    w_pending_coll_lock(&lock->root->ioThread.pending);
+    w_root_pull_pending(lock->root, coll, cookies);
+    w_pending_coll_unlock(&lock->root->ioThread.pending);
   }
 
   if (!coll->pending) {
-    return false;
+    for (const auto& cookie : cookies) {
+      lock->root->cookies.notifyCookie(cookie);
+    }
+    return !cookies.empty();
   }
 
   w_log(
@@ -239,6 +412,10 @@ bool w_root_process_pending(struct write_locked_watchman_root *lock,
     w_pending_fs_free(p);
   }
 
+  for (const auto& cookie : cookies) {
+    lock->root->cookies.notifyCookie(cookie);
+  }
+
   return true;
 }
 
@@ -2,8 +2,9 @@
  * Licensed under the Apache License, Version 2.0 */
 
 #include "watchman.h"
+#include "make_unique.h"
 
-static void handle_should_recrawl(struct unlocked_watchman_root* unlocked) {
+void w_root_handle_should_recrawl(struct unlocked_watchman_root* unlocked) {
   {
     auto info = unlocked->root->recrawlInfo.rlock();
     if (!info->shouldRecrawl) {
@@ -46,6 +47,55 @@ static void handle_should_recrawl(struct unlocked_watchman_root* unlocked) {
   w_root_unlock(&lock, unlocked);
 }
 
+// Consume the notifications that are available from the watcher,
+// up to WATCHMAN_BATCH_LIMIT items, and hand them to the io loop.
+// Returns true if anything was queued.
+bool w_root_consume_notify(
+    w_root_t* root,
+    struct watchman_pending_collection* pending) {
+  auto root_pending = &root->ioThread.pending;
+  std::vector<w_string> cookies;
+
+  while (root->inner.watcher->consumeNotify(root, pending)) {
+    if (w_pending_coll_size(pending) >= WATCHMAN_BATCH_LIMIT) {
+      break;
+    }
+    if (!root->inner.watcher->waitNotify(0)) {
+      break;
+    }
+  }
+
+  // If the watcher reports individual files, our cookies show up here
+  // by name.  Pull them out so that they can be acknowledged as soon as
+  // everything that was queued ahead of them has been processed.
+  // We can't tell where the cookie fell within this batch, so we
+  // conservatively treat the whole batch as being ahead of it.
+  if (root->inner.watcher->flags & WATCHER_HAS_PER_FILE_NOTIFICATIONS) {
+    w_pending_coll_extract_prefix(
+        pending, root->cookies.cookiePrefix(), cookies);
+    for (const auto& cookie : cookies) {
+      root->cookies.markCookieObserved(cookie);
+    }
+  }
+
+  if (w_pending_coll_size(pending) == 0 && cookies.empty()) {
+    return false;
+  }
+
+  w_pending_coll_lock(root_pending);
+  auto& barriers = root->ioThread.barriers;
+  w_pending_coll_append(
+      barriers.empty() ? root_pending : barriers.back().after.get(), pending);
+  if (!cookies.empty()) {
+    barriers.emplace_back(watchman_root::IOThread::CookieBarrier{
+        std::move(cookies),
+        watchman::make_unique<watchman_pending_collection>()});
+  }
+  w_pending_coll_ping(root_pending);
+  w_pending_coll_unlock(root_pending);
+  return true;
+}
+
 // we want to consume inotify events as quickly as possible
 // to minimize the risk that the kernel event buffer overflows,
 // so we do this as a blocking thread that reads the inotify
@@ -77,24 +127,10 @@ static void notify_thread(struct unlocked_watchman_root *unlocked)
     // big number because not all watchers can deal with
     // -1 meaning infinite wait at the moment
     if (unlocked->root->inner.watcher->waitNotify(86400)) {
-      while (unlocked->root->inner.watcher->consumeNotify(
-          unlocked->root, &pending)) {
-        if (w_pending_coll_size(&pending) >= WATCHMAN_BATCH_LIMIT) {
-          break;
-        }
-        if (!unlocked->root->inner.watcher->waitNotify(0)) {
-          break;
-        }
-      }
-      if (w_pending_coll_size(&pending) > 0) {
-        w_pending_coll_lock(root_pending);
-        w_pending_coll_append(root_pending, &pending);
-        w_pending_coll_ping(root_pending);
-        w_pending_coll_unlock(root_pending);
-      }
+      w_root_consume_notify(unlocked->root, &pending);
     }
 
-    handle_should_recrawl(unlocked);
+    w_root_handle_should_recrawl(unlocked);
   }
 }
 
@@ -0,0 +1,225 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0 */
+
+#include "watchman.h"
+#include "IOReactor.h"
+#include "ThreadPool.h"
+
+// When the io_reactor option is enabled, roots whose watcher exposes a
+// pollable descriptor don't get a notify thread and an io thread of their
+// own.  Instead, the watcher descriptors for all such roots are multiplexed
+// onto a single reactor thread, and the io loop for each root is run in
+// steps on a bounded pool of io workers.  The steps for a given root are
+// serialized, so the io loop logic is unchanged; the settle timeout that the
+// io thread would have slept for becomes a timer on the reactor's wheel.
+
+#define DEFAULT_IO_REACTOR_THREADS 4
+
+namespace {
+struct io_reactor_globals {
+  watchman::IOReactor reactor;
+  watchman::ThreadPool pool;
+};
+}
+
+static io_reactor_globals* get_io_reactor() {
+  static std::once_flag once;
+  static io_reactor_globals* globals;
+
+  std::call_once(once, [] {
+    auto numThreads =
+        cfg_get_int(nullptr, "io_reactor_threads", DEFAULT_IO_REACTOR_THREADS);
+    if (numThreads < 1) {
+      numThreads = 1;
+    }
+    // This is intentionally never freed; roots may still be referencing
+    // it during process shutdown
+    globals = new io_reactor_globals;
+    globals->pool.start(size_t(numThreads), "io-worker");
+    globals->reactor.start("io-reactor");
+  });
+  return globals;
+}
+
+struct watchman_reactor_root
+    : public std::enable_shared_from_this<watchman_reactor_root> {
+  // We hold a reference on the root until we are stopped
+  w_root_t* root;
+  io_reactor_globals* globals;
+  watchman::SerialExecutor executor;
+
+  // true if a step is queued on the executor and has not yet started
+  std::atomic<bool> queued{false};
+  // true if someone pinged us since the last step started
+  std::atomic<bool> woken{false};
+
+  // The remaining members are only accessed from steps, which are
+  // serialized by the executor
+  bool stopped{false};
+  uint64_t fd_handle{0};
+  uint64_t timer_id{0};
+  struct watchman_io_loop_state state;
+
+  // Only accessed from the reactor thread
+  struct watchman_pending_collection notify_pending;
+
+  watchman_reactor_root(w_root_t* root, io_reactor_globals* globals)
+      : root(root), globals(globals), executor(globals->pool) {
+    w_root_addref(root);
+  }
+
+  void schedule() {
+    if (queued.exchange(true)) {
+      // There's already a step waiting to run; it will observe whatever
+      // we were scheduled to look at
+      return;
+    }
+    auto self = shared_from_this();
+    executor.run([self] { self->step(); });
+  }
+
+  void wake() {
+    woken = true;
+    schedule();
+  }
+
+  // Called on the reactor thread when the watcher descriptor is readable
+  void onNotify() {
+    if (w_root_consume_notify(root, &notify_pending)) {
+      wake();
+    }
+  }
+
+  void registerFd() {
+    auto fd = root->inner.watcher->getNotifyFd();
+    auto self = shared_from_this();
+    fd_handle = globals->reactor.addFd(fd, [self] { self->onNotify(); });
+  }
+
+  void unregisterFd() {
+    if (fd_handle) {
+      globals->reactor.removeFd(fd_handle);
+      fd_handle = 0;
+    }
+  }
+
+  void armTimer(int timeoutms) {
+    if (timer_id) {
+      globals->reactor.cancelTimer(timer_id);
+    }
+    auto self = shared_from_this();
+    timer_id = globals->reactor.addTimer(
+        std::chrono::milliseconds(timeoutms), [self] { self->schedule(); });
+  }
+
+  void stop() {
+    stopped = true;
+    if (timer_id) {
+      globals->reactor.cancelTimer(timer_id);
+      timer_id = 0;
+    }
+    unregisterFd();
+    w_log(W_LOG_DBG, "out of loop\n");
+
+    /* we'll remove it from watched roots if it isn't
+     * already out of there */
+    remove_root_from_watched(root);
+    w_root_delref_raw(root);
+    root = nullptr;
+  }
+
+  // Equivalent to one pass through the io_thread loop, except that
+  // rather than waiting for the pending collection to be pinged, we
+  // arm a timer and return.
+  void step() {
+    queued = false;
+    if (stopped) {
+      return;
+    }
+
+    struct unlocked_watchman_root unlocked = {root};
+
+    if (root->inner.cancelled) {
+      stop();
+      return;
+    }
+
+    {
+      bool should_recrawl = root->recrawlInfo.rlock()->shouldRecrawl;
+      if (should_recrawl) {
+        // The watcher (and its descriptor) is replaced by the recrawl
+        unregisterFd();
+        w_root_handle_should_recrawl(&unlocked);
+        if (root->inner.cancelled) {
+          stop();
+          return;
+        }
+        registerFd();
+      }
+    }
+
+    w_root_io_loop_crawl(&unlocked, &state);
+
+    bool pinged = woken.exchange(false);
+    auto root_pending = &root->ioThread.pending;
+    w_pending_coll_lock(root_pending);
+    if (root_pending->pending || root_pending->pinged) {
+      pinged = true;
+    }
+    root_pending->pinged = false;
+    bool more = w_root_pull_pending(root, &state.pending, state.cookies);
+    w_pending_coll_unlock(root_pending);
+
+    if (!w_root_io_loop_step(&unlocked, &state, pinged) ||
+        root->inner.cancelled) {
+      stop();
+      return;
+    }
+
+    if (more) {
+      // We stopped at a cookie barrier; go around again for the items
+      // that were queued after it
+      wake();
+      return;
+    }
+    armTimer(state.timeoutms);
+  }
+};
+
+bool w_root_reactor_enabled(w_root_t* root) {
+#ifdef HAVE_SYS_EPOLL_H
+  return cfg_get_bool(nullptr, "io_reactor", false) &&
+      root->inner.watcher->getNotifyFd() != -1;
+#else
+  unused_parameter(root);
+  return false;
+#endif
+}
+
+bool w_root_reactor_start(w_root_t* root, char** errmsg) {
+  if (!root->inner.watcher->start(root)) {
+    ignore_result(asprintf(
+        errmsg,
+        "failed to start root %s: %s",
+        root->root_path.c_str(),
+        root->failure_reason.c_str()));
+    return false;
+  }
+
+  auto binding =
+      std::make_shared<watchman_reactor_root>(root, get_io_reactor());
+  w_root_io_loop_init(root, &binding->state);
+  root->ioThread.reactor = binding;
+
+  binding->registerFd();
+  // Kick off the initial crawl
+  binding->wake();
+  return true;
+}
+
+void w_root_reactor_wake(w_root_t* root) {
+  root->ioThread.reactor->wake();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -17,9 +17,10 @@
 bool w_root_sync_to_now(struct unlocked_watchman_root *unlocked,
                         int timeoutms) {
   w_perf_t sample("sync_to_now");
+  watchman::CookieSync::Latency latency;
 
-  auto res =
-      unlocked->root->cookies.syncToNow(std::chrono::milliseconds(timeoutms));
+  auto res = unlocked->root->cookies.syncToNow(
+      std::chrono::milliseconds(timeoutms), &latency);
 
   // We want to know about all timeouts
   if (!res) {
@@ -29,7 +30,22 @@ bool w_root_sync_to_now(struct unlocked_watchman_root *unlocked,
     sample.add_root_meta(unlocked->root);
     sample.add_meta(
         "sync_to_now",
-        json_pack("{s:b, s:i}", "success", res, "timeoutms", timeoutms));
+        json_pack(
+            "{s:b, s:i, s:I, s:I, s:i}",
+            "success",
+            res,
+            "timeoutms",
+            timeoutms,
+            // How long it took for the cookie notification to arrive
+            // from the watcher, and how long until everything that was
+            // queued ahead of it was processed
+            "cookie_observed_us",
+            (json_int_t)latency.observed.count(),
+            "cookie_acknowledged_us",
+            (json_int_t)latency.acknowledged.count(),
+            // How many concurrent syncs shared the cookie
+            "cookie_waiters",
+            int(latency.waiters)));
     sample.log();
   }
 
@@ -26,6 +26,10 @@ static bool start_detached_root_thread(w_root_t *root, char **errmsg,
 }
 
 bool root_start(w_root_t *root, char **errmsg) {
+  if (w_root_reactor_enabled(root)) {
+    return w_root_reactor_start(root, errmsg);
+  }
+
   if (!start_detached_root_thread(root, errmsg,
         run_notify_thread, &root->notify_thread)) {
     return false;
@@ -61,6 +65,15 @@ void w_root_schedule_recrawl(w_root_t *root, const char *why) {
 }
 
 void signal_root_threads(w_root_t *root) {
+  if (root->ioThread.reactor) {
+    // There are no dedicated threads to interrupt; just make
+    // sure that the io loop gets to run
+    w_pending_coll_ping(&root->ioThread.pending);
+    w_root_reactor_wake(root);
+    root->inner.watcher->signalThreads();
+    return;
+  }
+
   // Send SIGUSR1 to interrupt blocking syscalls on the
   // worker threads.  They'll self-terminate.
   if (!pthread_equal(root->notify_thread, pthread_self())) {
@@ -59,7 +59,7 @@ void w_mark_dead(pid_t pid)
         break;
       }
 
-      w_assess_trigger(&lock, cmd.get());
+      w_assess_trigger(&lock, cmd.get(), time_generator);
       break;
     }
   }
@@ -128,14 +128,13 @@ static w_stm_t prepare_stdin(
       }
     case input_name_list:
       {
+        RelNameBuilder names;
         uint32_t i;
 
         for (i = 0; i < n_files; i++) {
-          if (w_stm_write(
-                  stdin_file,
-                  res->results[i].relname.data(),
-                  res->results[i].relname.size()) !=
-                  (int)res->results[i].relname.size() ||
+          auto name = names.build(res->results[i]);
+          if (w_stm_write(stdin_file, name.data(), name.size()) !=
+                  (int)name.size() ||
               w_stm_write(stdin_file, "\n", 1) != 1) {
             w_log(W_LOG_ERR,
               "write failure while producing trigger stdin: %s\n",
@@ -254,9 +253,11 @@ static void spawn_command(w_root_t *root,
     envp = NULL;
     argspace_remaining -= env_size;
 
+    RelNameBuilder names;
     for (const auto& item : res->results) {
+      auto name = names.build(item);
       // also: NUL terminator and entry in argv
-      uint32_t size = item.relname.size() + 1 + sizeof(char*);
+      uint32_t size = name.size() + 1 + sizeof(char*);
 
       if (argspace_remaining < size) {
         file_overflow = true;
@@ -264,7 +265,9 @@ static void spawn_command(w_root_t *root,
       }
       argspace_remaining -= size;
 
-      json_array_append_new(args, w_string_to_json(item.relname));
+      json_array_append_new(
+          args,
+          typed_string_len_to_json(name.data(), name.size(), W_STRING_BYTE));
     }
   }
 
@@ -407,7 +410,8 @@ static void spawn_command(w_root_t *root,
 
 /* must be called with root locked */
 void w_assess_trigger(struct write_locked_watchman_root *lock,
-                      struct watchman_trigger_command *cmd) {
+                      struct watchman_trigger_command *cmd,
+                      w_query_generator generator) {
   w_query_res res;
   auto since_spec = cmd->query->since_spec.get();
 
@@ -426,7 +430,7 @@ void w_assess_trigger(struct write_locked_watchman_root *lock,
   // at settle points which are by definition sync'd to the present time
   cmd->query->sync_timeout = 0;
   w_log(W_LOG_DBG, "assessing trigger %s %p\n", cmd->triggername.c_str(), cmd);
-  if (!w_query_execute_locked(cmd->query.get(), lock, &res, time_generator)) {
+  if (!w_query_execute_locked(cmd->query.get(), lock, &res, generator)) {
     w_log(
         W_LOG_ERR,
         "error running trigger \"%s\" query: %s",
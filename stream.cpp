@@ -84,3 +84,37 @@ bool w_stm_peer_is_owner(w_stm_t stm) {
   }
   return stm->ops->op_peer_is_owner(stm);
 }
+
+int w_stm_write_with_fd(w_stm_t stm, const void *buf, int size, int fd) {
+  if (!stm || stm->handle == NULL || stm->ops == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  if (!stm->ops->op_write_with_fd) {
+    errno = ENOTSOCK;
+    return -1;
+  }
+  return stm->ops->op_write_with_fd(stm, buf, size, fd);
+}
+
+int w_stm_take_fd(w_stm_t stm) {
+  if (!stm || stm->handle == NULL || stm->ops == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  if (!stm->ops->op_take_fd) {
+    return -1;
+  }
+  return stm->ops->op_take_fd(stm);
+}
+
+bool w_stm_peer_closed(w_stm_t stm) {
+  if (!stm || stm->handle == NULL || stm->ops == NULL) {
+    errno = EBADF;
+    return false;
+  }
+  if (!stm->ops->op_peer_closed) {
+    return false;
+  }
+  return stm->ops->op_peer_closed(stm);
+}
@@ -46,6 +46,9 @@ static struct watchman_stream_ops stdio_ops = {
   stdio_set_nonb,
   stdio_rewind,
   stdio_shutdown,
+  NULL,
+  NULL,
+  NULL,
   NULL
 };
 
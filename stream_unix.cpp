@@ -14,9 +14,16 @@ struct watchman_event {
   bool is_pipe;
 };
 
+// How many of the descriptors passed by the peer we hold on to until
+// they are taken; any more than this are closed
+#define MAX_PASSED_FDS 8
+
 struct unix_handle {
   int fd;
   struct watchman_event evt;
+  bool is_socket;
+  int passed_fds[MAX_PASSED_FDS];
+  int num_passed_fds;
 };
 
 static int unix_close(w_stm_t stm) {
@@ -25,15 +32,68 @@ static int unix_close(w_stm_t stm) {
 
   res = close(h->fd);
   if (res == 0) {
+    for (int i = 0; i < h->num_passed_fds; i++) {
+      close(h->passed_fds[i]);
+    }
     free(h);
     stm->handle = NULL;
   }
   return res;
 }
 
+// Reads from a socket, holding on to any descriptors that the peer passed
+// along with the data until they are taken by w_stm_take_fd
+static int unix_recv(struct unix_handle *h, void *buf, int size) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+  } control;
+  int flags = 0;
+  ssize_t res;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = size;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+  res = recvmsg(h->fd, &msg, flags);
+  if (res < 0) {
+    return -1;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < num_fds; i++) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + (i * sizeof(int)), sizeof(fd));
+      if (h->num_passed_fds < MAX_PASSED_FDS) {
+        h->passed_fds[h->num_passed_fds++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  return (int)res;
+}
+
 static int unix_read(w_stm_t stm, void *buf, int size) {
   auto h = (unix_handle*)stm->handle;
   errno = 0;
+  if (h->is_socket) {
+    return unix_recv(h, buf, size);
+  }
   return read(h->fd, buf, size);
 }
 
@@ -97,6 +157,71 @@ static bool unix_peer_is_owner(w_stm_t stm) {
   return false;
 }
 
+static bool unix_peer_closed(w_stm_t stm) {
+  auto h = (unix_handle*)stm->handle;
+  struct pollfd pfd;
+
+  pfd.fd = h->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, 0) <= 0) {
+    return false;
+  }
+  // A peer that has only shut down its writing side (for example, a
+  // client that sends its request and then half-closes) makes the
+  // socket readable at EOF but is still waiting for our response, so
+  // only a full hangup counts
+  return (pfd.revents & (POLLHUP | POLLERR)) != 0;
+}
+
+static int unix_write_with_fd(w_stm_t stm, const void *buf, int size,
+                              int fd) {
+  auto h = (unix_handle*)stm->handle;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  if (!h->is_socket) {
+    errno = ENOTSOCK;
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  memset(&control, 0, sizeof(control));
+  iov.iov_base = (void*)buf;
+  iov.iov_len = size;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+  errno = 0;
+  return (int)sendmsg(h->fd, &msg, 0);
+}
+
+static int unix_take_fd(w_stm_t stm) {
+  auto h = (unix_handle*)stm->handle;
+  int fd;
+
+  if (h->num_passed_fds == 0) {
+    return -1;
+  }
+  fd = h->passed_fds[0];
+  h->num_passed_fds--;
+  memmove(h->passed_fds, h->passed_fds + 1,
+          h->num_passed_fds * sizeof(h->passed_fds[0]));
+  return fd;
+}
+
 static struct watchman_stream_ops unix_ops = {
   unix_close,
   unix_read,
@@ -106,6 +231,9 @@ static struct watchman_stream_ops unix_ops = {
   unix_rewind,
   unix_shutdown,
   unix_peer_is_owner,
+  unix_peer_closed,
+  unix_write_with_fd,
+  unix_take_fd,
 };
 
 w_evt_t w_event_make(void) {
@@ -187,6 +315,7 @@ int w_poll_events(struct watchman_event_poll *p, int n, int timeoutms) {
 w_stm_t w_stm_fdopen(int fd) {
   w_stm_t stm;
   struct unix_handle *h;
+  struct stat st;
 
   stm = (w_stm_t)calloc(1, sizeof(*stm));
   if (!stm) {
@@ -200,6 +329,7 @@ w_stm_t w_stm_fdopen(int fd) {
   }
 
   h->fd = fd;
+  h->is_socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
 
   stm->handle = h;
   stm->ops = &unix_ops;
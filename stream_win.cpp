@@ -555,6 +555,16 @@ static bool win_peer_is_owner(w_stm_t stm) {
   return true;
 }
 
+static bool win_peer_closed(w_stm_t stm) {
+  auto h = (win_handle*)stm->handle;
+
+  if (h->file_type != FILE_TYPE_PIPE) {
+    return false;
+  }
+  return !PeekNamedPipe(h->h, nullptr, 0, nullptr, nullptr, nullptr) &&
+      GetLastError() == ERROR_BROKEN_PIPE;
+}
+
 static struct watchman_stream_ops win_ops = {
   win_close,
   win_read,
@@ -563,7 +573,8 @@ static struct watchman_stream_ops win_ops = {
   win_set_nonb,
   win_rewind,
   win_shutdown,
-  win_peer_is_owner
+  win_peer_is_owner,
+  win_peer_closed
 };
 
 w_evt_t w_event_make(void) {
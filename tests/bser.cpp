@@ -5,6 +5,8 @@
 #include "thirdparty/tap.h"
 #include "thirdparty/jansson/jansson_private.h"
 #include "thirdparty/jansson/strbuffer.h"
+#include <algorithm>
+#include <thread>
 
 static int dump_to_strbuffer(const char *buffer, size_t size, void *data)
 {
@@ -156,6 +158,555 @@ static void check_serialization(const char* json_in, const char* bser_out) {
   json_decref(input);
 }
 
+// Values appended by the caller should come out as a regular property
+static void check_extra_property(void) {
+  json_error_t jerr;
+  json_t *input, *expected, *decoded;
+  w_encoded_pdu pdu;
+  json_int_t needed, len;
+  const char *buf;
+
+  input = json_loads("{\"name\": \"Tom\"}", 0, &jerr);
+  expected = json_loads(
+      "{\"name\": \"Tom\", \"ages\": [{\"age\": 24}, {}]}", 0, &jerr);
+
+  ok(w_bser_encode_pdu(1, 0, input, "ages",
+                       [](std::string& out) {
+                         const char* keys[] = {"age"};
+                         w_bser_append_template_header(out, keys, 1, 2);
+                         w_bser_append_int(out, 24);
+                         w_bser_append_skip(out);
+                         return true;
+                       },
+                       &pdu),
+     "encoded pdu with an extra property");
+
+  // Skip the magic and the length
+  buf = pdu.data.data() + pdu.start + 2;
+  ok(bunser_int(buf, pdu.data.size(), &needed, &len), "decoded length");
+  buf += needed;
+
+  memset(&jerr, 0, sizeof(jerr));
+  decoded = bunser(buf, pdu.data.data() + pdu.data.size(), &needed, &jerr);
+  ok(decoded && json_equal(expected, decoded),
+     "extra property round-tripped (err = %s)", jerr.text);
+
+  json_decref(decoded);
+  json_decref(expected);
+  json_decref(input);
+}
+
+// Decodes the value in a BSER v2 PDU, expanding it first if need be
+static json_t* decode_v2_pdu(const w_encoded_pdu* pdu) {
+  const char* buf = pdu->data.data() + pdu->start + 2;
+  const char* end = pdu->data.data() + pdu->data.size();
+  json_int_t needed, caps, len;
+  json_error_t jerr;
+  std::string expanded;
+
+  memset(&jerr, 0, sizeof(jerr));
+  if (!bunser_int(buf, end - buf, &needed, &caps)) {
+    return nullptr;
+  }
+  buf += needed;
+  if (!bunser_int(buf, end - buf, &needed, &len)) {
+    return nullptr;
+  }
+  buf += needed;
+
+  if (caps & BSER_CAP_DEFLATE) {
+    if (!w_bser_inflate_payload(buf, end, expanded, &jerr)) {
+      return nullptr;
+    }
+    buf = expanded.data();
+    end = buf + expanded.size();
+  }
+  return bunser(buf, end, &needed, &jerr);
+}
+
+#define NUM_PREFIX_TESTS 5
+
+// Encodes a templated list of num_files results, with their names either
+// as plain or as prefix-compressed strings
+static void encode_names_pdu(size_t num_files, bool prefix_strings,
+                             w_encoded_pdu* pdu) {
+  auto response = json_pack("{s:s}", "clock", "c:1:2:3:4");
+  w_bser_encode_pdu(
+      2, prefix_strings ? BSER_CAP_PREFIX_STRINGS : 0, response, "files",
+      [num_files, prefix_strings](std::string& out) {
+        const char* keys[] = {"name", "size"};
+        std::string prev;
+        char name[128];
+        w_bser_append_template_header(out, keys, 2, num_files);
+        for (size_t i = 0; i < num_files; ++i) {
+          auto len = snprintf(name, sizeof(name),
+                              "fbcode/project%zu/src/module%zu/file%zu.cpp",
+                              i / 1000, i / 100, i);
+          if (prefix_strings) {
+            w_bser_append_prefix_string(out, prev, name, len);
+          } else {
+            w_bser_append_bytestring(out, name, len);
+          }
+          w_bser_append_int(out, i);
+        }
+        return true;
+      },
+      pdu);
+  pdu->pdu_type = is_bser_v2;
+  json_decref(response);
+}
+
+static void check_prefix_strings(void) {
+  std::string buf, prev;
+  json_t *plain, *compressed, *decoded;
+  json_int_t needed;
+  json_error_t jerr;
+  w_encoded_pdu plain_pdu, prefix_pdu;
+  static const char expected[] =
+      "\x0d\x03\x00\x03\x07" "foo/bar"
+      "\x0d\x03\x06\x03\x01" "z"
+      "\x0d\x03\x00\x03\x03" "qux";
+  static const char bad_prefix[] = "\x0d\x03\x05\x03\x01" "a";
+
+  w_bser_append_prefix_string(buf, prev, "foo/bar", 7);
+  w_bser_append_prefix_string(buf, prev, "foo/baz", 7);
+  w_bser_append_prefix_string(buf, prev, "qux", 3);
+  ok(buf.size() == sizeof(expected) - 1 &&
+         memcmp(buf.data(), expected, buf.size()) == 0,
+     "prefix strings encode only what differs");
+
+  memset(&jerr, 0, sizeof(jerr));
+  decoded = bunser(bad_prefix, bad_prefix + sizeof(bad_prefix) - 1, &needed,
+                   &jerr);
+  ok(decoded == nullptr, "prefix longer than the previous string: %s",
+     jerr.text);
+
+  encode_names_pdu(20000, false, &plain_pdu);
+  encode_names_pdu(20000, true, &prefix_pdu);
+  plain = decode_v2_pdu(&plain_pdu);
+  compressed = decode_v2_pdu(&prefix_pdu);
+
+  ok(plain != nullptr, "decoded the plain names");
+  ok(compressed && json_equal(plain, compressed),
+     "the prefix-compressed names decode to the same value");
+  ok((prefix_pdu.data.size() - prefix_pdu.start) * 2 <
+         plain_pdu.data.size() - plain_pdu.start,
+     "prefix compression shrank %u bytes to %u",
+     uint32_t(plain_pdu.data.size() - plain_pdu.start),
+     uint32_t(prefix_pdu.data.size() - prefix_pdu.start));
+
+  json_decref(compressed);
+  json_decref(plain);
+}
+
+static int append_to_string(const char* buffer, size_t size, void* ptr) {
+  ((std::string*)ptr)->append(buffer, size);
+  return 0;
+}
+
+// Finds the value in a plain BSER v1 or v2 PDU
+static void pdu_payload(const w_encoded_pdu* pdu, const char** buf,
+                        const char** end) {
+  json_int_t needed, val;
+
+  *buf = pdu->data.data() + pdu->start + 2;
+  *end = pdu->data.data() + pdu->data.size();
+  if (pdu->pdu_type == is_bser_v2) {
+    bunser_int(*buf, *end - *buf, &needed, &val);
+    *buf += needed;
+  }
+  bunser_int(*buf, *end - *buf, &needed, &val);
+  *buf += needed;
+}
+
+// Transcodes a BSER value to JSON, handing it over a few bytes at a time
+// so that items straddle the reads
+static bool transcode_to_json(const char* buf, const char* end, size_t flags,
+                              std::string& out, json_error_t* jerr) {
+  w_bser_read_func read = [&buf, end](char* dest, int size) {
+    int len = (int)std::min((ptrdiff_t)std::min(size, 7), end - buf);
+    memcpy(dest, buf, len);
+    buf += len;
+    return len;
+  };
+  memset(jerr, 0, sizeof(*jerr));
+  return w_bser_transcode_json(read, flags, append_to_string, &out, jerr);
+}
+
+static const char *transcode_inputs[] = {
+  "{\"name\": \"fr\\u00e9d \\\"q\\\"\\n\\ud83d\\ude00\", \"age\": -20, "
+      "\"tags\": [], \"props\": {}, \"nested\": [[1.25e3, [null]], {\"a\": "
+      "{\"b\": false}}]}",
+  "[{\"lemon\": 2.5}, null, 16000, true, false, \"\\/\"]",
+};
+
+#define NUM_TRANSCODE_TESTS 8
+
+static void check_transcode(void) {
+  json_t *expected, *decoded;
+  json_error_t jerr;
+  w_encoded_pdu pdu;
+  const char *buf, *end;
+  std::string out;
+  json_int_t needed;
+  bool all_ok = true;
+
+  // Everything that round trips through the DOM should round trip through
+  // the transcoders too
+  for (auto input : transcode_inputs) {
+    expected = json_loads(input, 0, &jerr);
+    if (!w_json_transcode_bser_pdu(1, 0, input, input + strlen(input), &pdu,
+                                   &jerr)) {
+      diag("failed to transcode %s: %s", input, jerr.text);
+      all_ok = false;
+      json_decref(expected);
+      continue;
+    }
+    pdu_payload(&pdu, &buf, &end);
+    decoded = bunser(buf, end, &needed, &jerr);
+    if (!decoded || !json_equal(expected, decoded)) {
+      diag("%s didn't decode to the same value", input);
+      all_ok = false;
+    }
+    json_decref(decoded);
+
+    out.clear();
+    decoded = nullptr;
+    if (transcode_to_json(buf, end, JSON_COMPACT, out, &jerr)) {
+      decoded = json_loads(out.c_str(), 0, &jerr);
+    }
+    if (!decoded || !json_equal(expected, decoded)) {
+      diag("%s came back as %s", input, out.c_str());
+      all_ok = false;
+    }
+    json_decref(decoded);
+    json_decref(expected);
+  }
+  ok(all_ok, "values round trip through both transcoders");
+
+  // With no objects of more than one property, the order of the keys
+  // can't differ, so the output should match that of json_dumps exactly
+  expected = json_loads(transcode_inputs[1], 0, &jerr);
+  w_json_transcode_bser_pdu(2, 0, transcode_inputs[1],
+                            transcode_inputs[1] + strlen(transcode_inputs[1]),
+                            &pdu, &jerr);
+  pdu_payload(&pdu, &buf, &end);
+  for (auto flags : {(size_t)JSON_COMPACT, (size_t)JSON_INDENT(4)}) {
+    auto dumped = json_dumps(expected, flags);
+    out.clear();
+    ok(transcode_to_json(buf, end, flags, out, &jerr) && out == dumped,
+       "formatted like json_dumps with flags %zx", flags);
+    free(dumped);
+  }
+  json_decref(expected);
+
+  // Templates and prefix-compressed strings
+  encode_names_pdu(2000, true, &pdu);
+  expected = decode_v2_pdu(&pdu);
+  pdu_payload(&pdu, &buf, &end);
+  out.clear();
+  decoded = nullptr;
+  if (transcode_to_json(buf, end, JSON_COMPACT, out, &jerr)) {
+    decoded = json_loads(out.c_str(), 0, &jerr);
+  }
+  ok(decoded && json_equal(expected, decoded),
+     "transcoded a template of prefix-compressed names");
+  json_decref(decoded);
+  json_decref(expected);
+
+  out.clear();
+  ok(!transcode_to_json(buf, end - 10, JSON_COMPACT, out, &jerr),
+     "noticed a truncated value: %s", jerr.text);
+  static const char bser_null[] = "\x0a";
+  ok(!transcode_to_json(bser_null, bser_null + 1, 0, out, &jerr),
+     "refused to encode a bare value: %s", jerr.text);
+
+  static const char truncated[] = "[1, 2";
+  static const char missing_colon[] = "{\"a\" 1}";
+  ok(!w_json_transcode_bser_pdu(1, 0, truncated,
+                                truncated + sizeof(truncated) - 1, &pdu,
+                                &jerr),
+     "refused truncated JSON: %s", jerr.text);
+  ok(!w_json_transcode_bser_pdu(1, 0, missing_colon,
+                                missing_colon + sizeof(missing_colon) - 1,
+                                &pdu, &jerr),
+     "refused invalid JSON: %s", jerr.text);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#define NUM_MEMFD_TESTS 4
+
+// A PDU written into a sealed memfd should arrive intact at the other
+// end of a unix socket, without its bytes going through the socket
+static void check_memfd(void) {
+  w_encoded_pdu pdu, mapped;
+  json_t *expected, *decoded = nullptr;
+  int fds[2], pipefds[2];
+  int memfd, received;
+  char byte = 0;
+  void* map;
+
+  encode_names_pdu(20000, false, &pdu);
+  expected = decode_v2_pdu(&pdu);
+
+  size_t len = pdu.data.size() - pdu.start;
+  memfd = memfd_create("bser-test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (write(memfd, pdu.data.data() + pdu.start, len) != (ssize_t)len ||
+      fcntl(memfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+    diag("failed to prepare the memfd: %s", strerror(errno));
+  }
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  auto sender = w_stm_fdopen(fds[0]);
+  auto receiver = w_stm_fdopen(fds[1]);
+  w_stm_write_with_fd(sender, "x", 1, memfd);
+  close(memfd);
+  w_stm_read(receiver, &byte, 1);
+  received = w_stm_take_fd(receiver);
+  ok(byte == 'x' && received != -1, "the memfd arrived with the stub");
+  ok(fcntl(received, F_GET_SEALS) & F_SEAL_WRITE,
+     "the memfd is still sealed");
+
+  map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, received, 0);
+  if (map != MAP_FAILED) {
+    mapped.pdu_type = is_bser_v2;
+    mapped.start = 0;
+    mapped.data.assign((const char*)map, len);
+    decoded = decode_v2_pdu(&mapped);
+    munmap(map, len);
+  }
+  ok(decoded && json_equal(expected, decoded),
+     "the mapped pdu decodes to the same value");
+  close(received);
+  w_stm_close(sender);
+  w_stm_close(receiver);
+
+  // Only sockets can carry descriptors
+  if (pipe(pipefds) == 0) {
+    auto pipe_stm = w_stm_fdopen(pipefds[1]);
+    ok(w_stm_write_with_fd(pipe_stm, "x", 1, pipefds[0]) == -1 &&
+           errno == ENOTSOCK,
+       "can't pass a descriptor through a pipe");
+    w_stm_close(pipe_stm);
+    close(pipefds[0]);
+  } else {
+    fail("pipe: %s", strerror(errno));
+  }
+
+  json_decref(decoded);
+  json_decref(expected);
+}
+#else
+#define NUM_MEMFD_TESTS 0
+#endif
+
+#ifdef HAVE_ZLIB
+#define NUM_DEFLATE_TESTS 5
+
+// Returns the time taken to send len bytes from buf over a unix socket
+// and read them at the other end
+static double time_transfer(const char* buf, size_t len) {
+  struct timeval start, end;
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    return -1;
+  }
+
+  gettimeofday(&start, NULL);
+  std::thread reader([&] {
+    char rbuf[WATCHMAN_IO_BUF_SIZE];
+    size_t total = 0;
+    while (total < len) {
+      auto r = read(fds[1], rbuf, sizeof(rbuf));
+      if (r <= 0) {
+        break;
+      }
+      total += r;
+    }
+  });
+  size_t sent = 0;
+  while (sent < len) {
+    auto w = write(fds[0], buf + sent, len - sent);
+    if (w <= 0) {
+      break;
+    }
+    sent += w;
+  }
+  reader.join();
+  gettimeofday(&end, NULL);
+
+  close(fds[0]);
+  close(fds[1]);
+  return w_timeval_diff(start, end);
+}
+
+// A large query result should compress well and come back out intact.
+// This also reports what compression costs and saves in encoding,
+// transferring and decoding such a result.
+static void check_deflate(void) {
+  struct timeval start, end;
+  w_encoded_pdu pdu, deflated;
+  size_t num_files = 200000;
+  double encode_time, deflate_time, plain_decode_time, deflated_decode_time;
+
+  pdu.pdu_type = is_bser_v2;
+  auto response = json_pack("{s:s, s:b}", "clock", "c:1:2:3:4",
+                            "is_fresh_instance", true);
+  gettimeofday(&start, NULL);
+  w_bser_encode_pdu(2, BSER_CAPS_SUPPORTED, response, "files",
+                    [num_files](std::string& out) {
+                      const char* keys[] = {"name", "size", "exists"};
+                      char name[128];
+                      w_bser_append_template_header(out, keys, 3, num_files);
+                      for (size_t i = 0; i < num_files; ++i) {
+                        auto len = snprintf(
+                            name, sizeof(name),
+                            "fbcode/project%zu/src/module%zu/file%zu.cpp",
+                            i / 10000, i / 100, i);
+                        w_bser_append_bytestring(out, name, len);
+                        w_bser_append_int(out, i * 37);
+                        w_bser_append_bool(out, true);
+                      }
+                      return true;
+                    },
+                    &pdu);
+  gettimeofday(&end, NULL);
+  encode_time = w_timeval_diff(start, end);
+
+  gettimeofday(&start, NULL);
+  bool compressed = w_bser_deflate_pdu(&pdu, &deflated);
+  gettimeofday(&end, NULL);
+  deflate_time = w_timeval_diff(start, end);
+
+  size_t plain_size = pdu.data.size() - pdu.start;
+  size_t deflated_size = deflated.data.size() - deflated.start;
+  ok(compressed && deflated_size * 4 < plain_size,
+     "compressed %u bytes to %u", uint32_t(plain_size),
+     uint32_t(deflated_size));
+
+  gettimeofday(&start, NULL);
+  auto plain = decode_v2_pdu(&pdu);
+  gettimeofday(&end, NULL);
+  plain_decode_time = w_timeval_diff(start, end);
+
+  gettimeofday(&start, NULL);
+  auto expanded = decode_v2_pdu(&deflated);
+  gettimeofday(&end, NULL);
+  deflated_decode_time = w_timeval_diff(start, end);
+
+  ok(plain != nullptr, "decoded the uncompressed pdu");
+  ok(expanded && json_equal(plain, expanded),
+     "the compressed pdu decodes to the same value");
+
+  diag("uncompressed: encode %.3fs, transfer %.3fs, decode %.3fs",
+       encode_time, time_transfer(pdu.data.data() + pdu.start, plain_size),
+       plain_decode_time);
+  diag("compressed: encode %.3fs, transfer %.3fs, decode %.3fs",
+       encode_time + deflate_time,
+       time_transfer(deflated.data.data() + deflated.start, deflated_size),
+       deflated_decode_time);
+
+  // The server refuses compressed requests as soon as it sees the header
+  int fds[2];
+  json_error_t jerr;
+  w_jbuffer_t reader;
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  auto sender = w_stm_fdopen(fds[0]);
+  auto receiver = w_stm_fdopen(fds[1]);
+  w_json_buffer_init(&reader);
+  reader.refused_capabilities = BSER_CAP_DEFLATE | BSER_CAP_MEMFD;
+  w_stm_write(sender, deflated.data.data() + deflated.start, 32);
+  memset(&jerr, 0, sizeof(jerr));
+  auto refused = w_json_buffer_next(&reader, receiver, &jerr);
+  ok(refused == nullptr && strstr(jerr.text, "not accepted"),
+     "refused a compressed request: %s", jerr.text);
+  w_json_buffer_free(&reader);
+  w_stm_close(sender);
+  w_stm_close(receiver);
+
+  // Nor does it believe a length that the stream can't expand to
+  std::string bogus;
+  std::string expanded_bogus;
+  w_bser_append_int(bogus, json_int_t(1) << 40);
+  bogus.append("\x78\x9c\x03\x00\x00\x00\x00\x01", 8);
+  memset(&jerr, 0, sizeof(jerr));
+  ok(!w_bser_inflate_payload(bogus.data(), bogus.data() + bogus.size(),
+                             expanded_bogus, &jerr) &&
+         expanded_bogus.empty(),
+     "refused an implausible expanded length: %s", jerr.text);
+
+  json_decref(expanded);
+  json_decref(plain);
+  json_decref(response);
+}
+#else
+#define NUM_DEFLATE_TESTS 0
+#endif
+
+// A non-blocking reader must be able to take a PDU a piece at a time,
+// starting part way through its header, without ever blocking
+#define NUM_INCREMENTAL_TESTS 3
+static void check_incremental_read(void) {
+  auto json = json_array();
+  char name[64];
+  char *end;
+  json_error_t jerr;
+  w_jbuffer_t reader;
+  json_t *decoded = nullptr;
+  int fds[2];
+  int partial = 0;
+  bool failed = false;
+
+  for (int i = 0; i < 100000; ++i) {
+    snprintf(name, sizeof(name), "fbcode/module%d/file%d.cpp", i / 100, i);
+    json_array_append_new(json, typed_string_to_json(name, W_STRING_BYTE));
+  }
+  strbuffer_t strbuff;
+  strbuffer_init(&strbuff);
+  w_bser_write_pdu(2, 0, dump_to_strbuffer, json, &strbuff);
+  end = strbuff.value + strbuff.length;
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  auto sender = w_stm_fdopen(fds[0]);
+  auto receiver = w_stm_fdopen(fds[1]);
+  w_stm_set_nonblock(receiver, true);
+  w_json_buffer_init(&reader);
+
+  const char *pos = strbuff.value;
+  size_t slice = 3;
+  while (!decoded && !failed) {
+    if (pos < end) {
+      auto len = std::min(slice, size_t(end - pos));
+      pos += w_stm_write(sender, pos, (int)len);
+      slice = 65536;
+    }
+    decoded = w_json_buffer_next(&reader, receiver, &jerr);
+    if (!decoded) {
+      if (errno == EAGAIN) {
+        partial++;
+      } else {
+        diag("failed to read the PDU: %s", jerr.text);
+        failed = true;
+      }
+    }
+  }
+
+  ok(decoded && json_equal(decoded, json), "read the PDU in pieces");
+  ok(partial > 2, "came back for more data %d times", partial);
+  ok(fcntl(fds[1], F_GETFL) & O_NONBLOCK,
+     "left the stream non-blocking");
+
+  w_json_buffer_free(&reader);
+  w_stm_close(sender);
+  w_stm_close(receiver);
+  strbuffer_close(&strbuff);
+  json_decref(decoded);
+  json_decref(json);
+}
+
 int main(int argc, char **argv)
 {
   int i, num_json_inputs, num_templ;
@@ -169,7 +720,13 @@ int main(int argc, char **argv)
   plan_tests(
       (6 * num_json_inputs) +
       (6 * num_templ) +
-      4 // raw tests
+      4 + // raw tests
+      3 + // extra property
+      NUM_PREFIX_TESTS +
+      NUM_TRANSCODE_TESTS +
+      NUM_MEMFD_TESTS +
+      NUM_DEFLATE_TESTS +
+      NUM_INCREMENTAL_TESTS
   );
 
   for (i = 0; i < num_json_inputs; i++) {
@@ -203,6 +760,16 @@ int main(int argc, char **argv)
   check_serialization("[1, 123, 12345, 1234567, 12345678912345678]",
       "\x00\x01\x03\x18\x00\x03\x05\x03\x01\x03\x7b\x04\x39\x30\x05\x87\xd6"
       "\x12\x00\x06\x4e\xd6\x14\x5e\x54\xdc\x2b\x00");
+  check_extra_property();
+  check_prefix_strings();
+  check_transcode();
+#ifdef HAVE_MEMFD_CREATE
+  check_memfd();
+#endif
+#ifdef HAVE_ZLIB
+  check_deflate();
+#endif
+  check_incremental_read();
   return exit_status();
 }
 
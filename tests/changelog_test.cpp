@@ -0,0 +1,162 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0. */
+
+#include "watchman.h"
+#include "thirdparty/tap.h"
+#include "ChangeLogRing.h"
+#include <thread>
+
+using watchman::ChangeLogRing;
+using watchman::ChangeLogRingReader;
+
+static void append_name(ChangeLogRing* ring, uint32_t tick, uint32_t flags,
+                        const char* name) {
+  ring->append(tick, flags, name, strlen(name));
+}
+
+static std::string make_name(uint32_t i) {
+  char name[64];
+  // Vary the length so that the records land at different alignments
+  snprintf(name, sizeof(name), "dir%u/%.*sfile%u", i % 7, int(i % 13),
+           "xxxxxxxxxxxxx", i);
+  return name;
+}
+
+static void check_basics(const std::string& path) {
+  std::vector<ChangeLogRingReader::Change> changes;
+  auto ring = ChangeLogRing::create(path, 0, 0600);
+  ring->reset("c:1:2:3:");
+  append_name(ring.get(), 1, W_CHANGELOG_EXISTS, "before");
+
+  auto reader = ChangeLogRingReader::open(path);
+  ok(ring && reader && ring->capacity() == W_CHANGELOG_MIN_CAPACITY,
+     "opened a minimum sized ring");
+
+  append_name(ring.get(), 2, W_CHANGELOG_EXISTS | W_CHANGELOG_NEW, "foo");
+  append_name(ring.get(), 2, W_CHANGELOG_EXISTS, "dir/bar");
+  append_name(ring.get(), 3, 0, "foo");
+  auto status = reader->read(changes);
+  ok(status == ChangeLogRingReader::Status::Ok && changes.size() == 3 &&
+         changes[0].name == "foo" && changes[0].tick == 2 &&
+         changes[0].flags == (W_CHANGELOG_EXISTS | W_CHANGELOG_NEW) &&
+         changes[1].name == "dir/bar" && changes[2].name == "foo" &&
+         changes[2].tick == 3 && changes[2].flags == 0,
+     "read the changes made after opening the ring");
+  ok(reader->clock() == "c:1:2:3:2", "clock is %s", reader->clock().c_str());
+
+  // Fill the ring a few times over without reading it
+  for (uint32_t i = 0; i < 20000; ++i) {
+    auto name = make_name(i);
+    append_name(ring.get(), 4, 0, name.c_str());
+  }
+  changes.clear();
+  ok(reader->read(changes) == ChangeLogRingReader::Status::Overrun &&
+         changes.empty(),
+     "noticed that the writer overran the reader");
+  reader->resync();
+  ok(reader->read(changes) == ChangeLogRingReader::Status::Ok &&
+         changes.empty(),
+     "caught up after resyncing");
+
+  // Keep pace with the writer across several trips around the ring
+  bool intact = true;
+  for (uint32_t i = 0; i < 20000; ++i) {
+    auto name = make_name(i);
+    append_name(ring.get(), 5 + i, 0, name.c_str());
+    if (i % 100 == 99) {
+      changes.clear();
+      if (reader->read(changes) != ChangeLogRingReader::Status::Ok ||
+          changes.size() != 100) {
+        intact = false;
+        break;
+      }
+      for (uint32_t j = 0; j < 100; ++j) {
+        if (changes[j].name != make_name(i - 99 + j)) {
+          intact = false;
+        }
+      }
+    }
+  }
+  ok(intact, "read every change while wrapping around the ring");
+
+  ring->reset("c:1:2:4:");
+  ok(reader->read(changes) == ChangeLogRingReader::Status::Reset,
+     "noticed the reset");
+  reader->resync();
+  append_name(ring.get(), 1, W_CHANGELOG_EXISTS, "after");
+  changes.clear();
+  ok(reader->read(changes) == ChangeLogRingReader::Status::Ok &&
+         changes.size() == 1 && changes[0].name == "after" &&
+         reader->clock() == "c:1:2:4:0",
+     "read the change made after the reset");
+
+  ring.reset();
+  ok(reader->read(changes) == ChangeLogRingReader::Status::Closed &&
+         access(path.c_str(), F_OK) != 0,
+     "the ring was closed and removed");
+}
+
+// A reader racing the writer must only ever see intact records
+static void check_concurrent(const std::string& path) {
+  const uint32_t num_changes = 500000;
+  // Large enough that the reader keeps up some of the time, but not all
+  auto ring = ChangeLogRing::create(path, 1 << 20, 0600);
+  ring->reset("c:1:2:3:");
+  auto reader = ChangeLogRingReader::open(path);
+  std::atomic<bool> done{false};
+  size_t num_read = 0, num_overruns = 0;
+  bool intact = true;
+
+  std::thread writer([&] {
+    for (uint32_t i = 0; i < num_changes; ++i) {
+      auto name = make_name(i);
+      append_name(ring.get(), i, 0, name.c_str());
+    }
+    done = true;
+  });
+
+  std::vector<ChangeLogRingReader::Change> changes;
+  while (true) {
+    bool finished = done;
+    changes.clear();
+    auto status = reader->read(changes, 1000);
+    for (auto& change : changes) {
+      if (change.name != make_name(change.tick)) {
+        intact = false;
+      }
+    }
+    num_read += changes.size();
+    if (status == ChangeLogRingReader::Status::Overrun) {
+      ++num_overruns;
+      reader->resync();
+    } else if (finished && changes.empty()) {
+      break;
+    }
+  }
+  writer.join();
+
+  ok(intact && num_read > 0,
+     "read %zu intact changes while racing the writer, with %zu overruns",
+     num_read, num_overruns);
+}
+
+int main(int, char**) {
+  char dir[] = "/tmp/changelog-test.XXXXXX";
+
+  plan_tests(10);
+
+  if (!mkdtemp(dir)) {
+    fail("mkdtemp: %s", strerror(errno));
+    return exit_status();
+  }
+  std::string path = std::string(dir) + "/changelog";
+
+  check_basics(path);
+  check_concurrent(path);
+
+  rmdir(dir);
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -0,0 +1,153 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2016-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import WatchmanInstance
+import WatchmanTestCase
+import json
+import os
+import os.path
+import socket
+import sys
+import time
+
+
+@WatchmanTestCase.expand_matrix
+class TestClientQueues(WatchmanTestCase.WatchmanTestCase):
+
+    def startInstance(self, config):
+        self.inst = WatchmanInstance.Instance(config=config)
+        self.inst.start()
+        self.addCleanup(self.stopInstance)
+        self.client = self.getClient(self.inst)
+
+    def stopInstance(self):
+        if hasattr(self, 'client'):
+            self.client.close()
+            delattr(self, 'client')
+        self.inst.stop()
+
+    def connectSlowReader(self):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        # Keep the socket buffers small, so that the server has to queue
+        # the notifications that we don't read
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        sock.settimeout(10)
+        sock.connect(self.inst.getSockPath())
+        self.addCleanup(sock.close)
+        return sock, sock.makefile('rb')
+
+    def subscribe(self, sock, fp, root, name):
+        sock.sendall(json.dumps(['subscribe', root, name, {
+            'fields': ['name']}]).encode('utf-8') + b'\n')
+        # Skip over the notifications of any earlier subscriptions
+        while True:
+            res = json.loads(fp.readline().decode('utf-8'))
+            if not res.get('unilateral'):
+                break
+        self.assertEqual(name, res['subscribe'])
+
+    def makeTree(self):
+        root = self.mkdtemp()
+        names = ['%s%d' % ('x' * 240, i) for i in range(1000)]
+        for name in names:
+            self.touchRelative(root, name)
+        self.watchmanCommand('watch', root)
+        self.assertEqual(len(names), self.watchmanCommand('query', root, {
+            'result_mode': 'count'})['count'])
+        return root, names
+
+    def touchUntil(self, root, names, cond):
+        # Each burst makes a notification of a few hundred KiB, so it
+        # doesn't take many of them to fill up the socket buffers
+        for _ in range(100):
+            for name in names:
+                self.touchRelative(root, name)
+            # Give the root a chance to settle between the bursts
+            time.sleep(0.1)
+            if cond():
+                return
+        self.fail('%s was not met' % cond)
+
+    def otherClients(self):
+        return [c for c in self.watchmanCommand('debug-client-queues')[
+                'clients'] if not c['self']]
+
+    def test_debugClientQueues(self):
+        self.startInstance({'client_max_queued_bytes': 1234})
+        res = self.watchmanCommand('debug-client-queues')
+        me = [c for c in res['clients'] if c['self']]
+        self.assertEqual(1, len(me))
+        me = me[0]
+        self.assertEqual(1234, me['max_queued_bytes'])
+        self.assertEqual(0, me['dropped'])
+        self.assertEqual(0, me['coalesced'])
+        self.assertFalse(me['overflowed'])
+        self.assertEqual([], me['subscriptions'])
+        for field in ('queue_depth', 'queued_bytes'):
+            self.assertIn(field, me)
+
+    def test_coalesce(self):
+        self.startInstance({})
+        root, names = self.makeTree()
+
+        sock, fp = self.connectSlowReader()
+        self.subscribe(sock, fp, root, 'sub')
+        # The notifications that we don't read are merged together
+        self.touchUntil(
+            root, names,
+            lambda: [c for c in self.otherClients() if c['coalesced'] > 0])
+        self.touchRelative(root, 'last')
+
+        # and nothing was lost along the way
+        seen = set()
+        while 'last' not in seen:
+            line = fp.readline()
+            self.assertTrue(line, 'connection closed by the server')
+            res = json.loads(line.decode('utf-8'))
+            self.assertNotIn('error', res)
+            self.assertEqual('sub', res['subscription'])
+            seen.update(res['files'])
+
+    def assertDisconnected(self, config):
+        self.startInstance(config)
+        root, names = self.makeTree()
+
+        # Two subscriptions, so that their notifications can't be merged
+        sock, fp = self.connectSlowReader()
+        self.subscribe(sock, fp, root, 'a')
+        self.subscribe(sock, fp, root, 'b')
+        # The client may already be gone by the time that we look
+        self.touchUntil(
+            root, names,
+            lambda: not [c for c in self.otherClients()
+                         if not c['overflowed']])
+
+        # The server gives up on the client rather than dropping any of
+        # its notifications, after saying why if there's room to
+        error = None
+        while True:
+            line = fp.readline()
+            if not line:
+                break
+            res = json.loads(line.decode('utf-8'))
+            if 'error' in res:
+                error = res['error']
+        if error is not None:
+            self.assertIn('too many unilateral responses', error)
+        self.assertWaitFor(lambda: not self.otherClients())
+
+    def test_overflow(self):
+        self.assertDisconnected({'client_max_queued_bytes': 2000})
+
+    def test_overflowReactor(self):
+        if not sys.platform.startswith('linux'):
+            self.skipTest('client_reactor is only available on Linux')
+        self.assertDisconnected({
+            'client_max_queued_bytes': 2000,
+            'client_reactor': True})
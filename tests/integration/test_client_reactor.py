@@ -0,0 +1,156 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2016-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import WatchmanInstance
+import WatchmanTestCase
+import json
+import os
+import os.path
+import socket
+import sys
+from pywatchman import bser
+
+
+@WatchmanTestCase.expand_matrix
+class TestClientReactor(WatchmanTestCase.WatchmanTestCase):
+
+    def checkOSApplicability(self):
+        if not sys.platform.startswith('linux'):
+            self.skipTest('client_reactor is only available on Linux')
+
+    def startReactor(self):
+        # A single worker, so that a client that parks it would stall
+        # every other client
+        self.inst = WatchmanInstance.Instance(config={
+            'client_reactor': True,
+            'client_reactor_threads': 1})
+        self.inst.start()
+        self.addCleanup(self.stopReactor)
+        # Route watchmanCommand and friends through the reactor instance
+        self.client = self.getClient(self.inst)
+
+    def stopReactor(self):
+        if hasattr(self, 'client'):
+            self.client.close()
+            delattr(self, 'client')
+        self.inst.stop()
+
+    def connectRaw(self):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(10)
+        sock.connect(self.inst.getSockPath())
+        self.addCleanup(sock.close)
+        return sock
+
+    def test_commands(self):
+        self.startReactor()
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'a'))
+        self.touchRelative(root, 'a', 'lemon')
+        self.touchRelative(root, 'b')
+
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, files=['a', 'a/lemon', 'b'])
+        clock = self.watchmanCommand('clock', root)['clock']
+
+        self.touchRelative(root, 'c')
+        self.waitForSync(root)
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'fields': ['name']})
+        self.assertFalse(res['is_fresh_instance'])
+        self.assertFileListContains(
+            self.normWatchmanFileList(res['files']), ['c'])
+
+    def test_subscribe(self):
+        if self.transport == 'cli':
+            self.skipTest('need persistent session')
+        self.startReactor()
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, files=['a'])
+        self.watchmanCommand('subscribe', root, 'sub', {'fields': ['name']})
+
+        dat = self.waitForSub('sub', root=root)[0]
+        self.assertTrue(dat['is_fresh_instance'])
+        self.assertFileListsEqual(self.normWatchmanFileList(dat['files']),
+                                  self.normFileList(['a']))
+
+        self.touchRelative(root, 'b')
+        dat = self.waitForSub('sub', root=root,
+                              accept=lambda x: self.findSubscriptionContainingFile(x, 'b'))
+        self.assertNotEqual(None, dat)
+
+    def test_partialRequest(self):
+        self.startReactor()
+        # Send the first part of a request and then stall
+        pdu = bser.dumps(['version'])
+        sock = self.connectRaw()
+        sock.sendall(pdu[:len(pdu) // 2])
+
+        # That doesn't hold up anybody else
+        self.assertIn('version', self.watchmanCommand('version'))
+
+        sock.sendall(pdu[len(pdu) // 2:])
+        buf = b''
+        while len(buf) < 16 or len(buf) < bser.pdu_len(buf):
+            data = sock.recv(8192)
+            self.assertTrue(data, 'connection closed by the server')
+            buf += data
+        self.assertIn('version', bser.loads(buf))
+
+    def test_slowChunkedReader(self):
+        self.startReactor()
+        root = self.mkdtemp()
+        num_files = 0
+        for d in range(20):
+            dir_name = os.path.join(root, 'd%d' % d)
+            os.mkdir(dir_name)
+            for i in range(500):
+                with open(os.path.join(dir_name, '%s%d' % ('f' * 200, i)),
+                          'w'):
+                    pass
+                num_files += 1
+        self.watchmanCommand('watch', root)
+        self.assertEqual(num_files, self.watchmanCommand('query', root, {
+            'expression': ['type', 'f'],
+            'result_mode': 'count'})['count'])
+
+        # Ask for several MiB of results in small chunks, and don't read
+        # any of them yet
+        sock = self.connectRaw()
+        sock.sendall(json.dumps(['query', root, {
+            'expression': ['type', 'f'],
+            'fields': ['name', 'size', 'mode', 'mtime_ms', 'ino', 'exists'],
+            'chunk_size': 10}]).encode('utf-8') + b'\n')
+
+        # The worker is free to serve other clients in the meantime
+        for _ in range(3):
+            res = self.watchmanCommand('query', root, {
+                'expression': ['name', 'd0', 'wholename'],
+                'fields': ['name']})
+            self.assertFileListsEqual(
+                self.normWatchmanFileList(res['files']), ['d0'])
+
+        # and the slow client gets all of its results in the end
+        fp = sock.makefile('rb')
+        files = 0
+        while True:
+            line = fp.readline()
+            self.assertTrue(line, 'connection closed by the server')
+            res = json.loads(line.decode('utf-8'))
+            self.assertNotIn('error', res)
+            files += len(res['files'])
+            if not res.get('partial'):
+                break
+        fp.close()
+        self.assertIn('clock', res)
+        self.assertEqual(num_files, files)
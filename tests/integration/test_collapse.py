@@ -0,0 +1,97 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2016-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import WatchmanTestCase
+import os
+import os.path
+
+
+@WatchmanTestCase.expand_matrix
+class TestCollapse(WatchmanTestCase.WatchmanTestCase):
+
+    def makeChanges(self):
+        root = self.mkdtemp()
+        for d in (('src', 'a'), ('src', 'b'), ('tools',)):
+            os.makedirs(os.path.join(root, *d))
+        self.touchRelative(root, 'src', 'a', 'x')
+        self.touchRelative(root, 'tools', 'y')
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, files=['src', 'src/a', 'src/a/x', 'src/b',
+                                         'tools', 'tools/y'])
+        clock = self.watchmanCommand('clock', root)['clock']
+
+        self.touchRelative(root, 'src', 'a', 'new1')
+        self.touchRelative(root, 'src', 'b', 'new2')
+        os.unlink(os.path.join(root, 'tools', 'y'))
+        self.waitForSync(root)
+        return root, clock
+
+    def dirsByName(self, dirs):
+        result = {}
+        for d in dirs:
+            name = self.decodeBSERUTF8(d['name'])
+            # The root is named by the empty string, which normPath
+            # would turn into '.'
+            result[self.normPath(name) if name else name] = d
+        return result
+
+    def test_dirs(self):
+        root, clock = self.makeChanges()
+
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'result_mode': 'dirs'})
+        self.assertNotIn('files', res)
+        dirs = self.dirsByName(res['dirs'])
+        self.assertEqual(
+            sorted(dirs.keys()),
+            sorted([self.normPath('src/a'), self.normPath('src/b'),
+                    'tools']))
+        self.assertEqual(1, dirs[self.normPath('src/a')]['added'])
+        self.assertEqual(1, dirs[self.normPath('src/b')]['added'])
+        self.assertEqual(1, dirs['tools']['removed'])
+        self.assertEqual(0, dirs['tools']['added'])
+
+    def test_dirsAtRoot(self):
+        root = self.mkdtemp()
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, files=[])
+        clock = self.watchmanCommand('clock', root)['clock']
+
+        self.touchRelative(root, 'a')
+        self.waitForSync(root)
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'result_mode': 'dirs'})
+        dirs = self.dirsByName(res['dirs'])
+        self.assertEqual([''], list(dirs.keys()))
+        self.assertEqual(1, dirs['']['added'])
+
+    def test_collapseThreshold(self):
+        root, clock = self.makeChanges()
+
+        # Under the threshold, the files are listed as usual
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'expression': ['type', 'f'],
+            'fields': ['name'],
+            'collapse_threshold': 10})
+        self.assertNotIn('dirs', res)
+        self.assertFileListsEqual(
+            self.normWatchmanFileList(res['files']),
+            ['src/a/new1', 'src/b/new2', 'tools/y'])
+
+        # Over it, they are collapsed
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'expression': ['type', 'f'],
+            'fields': ['name'],
+            'collapse_threshold': 2})
+        self.assertNotIn('files', res)
+        self.assertEqual(3, len(res['dirs']))
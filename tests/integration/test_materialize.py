@@ -0,0 +1,107 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2016-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import WatchmanTestCase
+import os
+import os.path
+import pywatchman
+
+
+@WatchmanTestCase.expand_matrix
+class TestMaterialize(WatchmanTestCase.WatchmanTestCase):
+
+    def materializeBuildFiles(self, root):
+        self.watchmanCommand('materialize', root, 'buildfiles', {
+            'expression': ['anyof', ['name', 'BUCK'], ['suffix', 'bzl']],
+            'fields': ['name']})
+
+    def test_materialize(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'lib'))
+        self.touchRelative(root, 'BUCK')
+        self.touchRelative(root, 'lib', 'defs.bzl')
+        self.touchRelative(root, 'lib', 'main.c')
+
+        self.watchmanCommand('watch', root)
+        self.materializeBuildFiles(root)
+
+        res = self.watchmanCommand('materialize-query', root, 'buildfiles')
+        self.assertFileListsEqual(self.normWatchmanFileList(res['files']),
+                                  ['BUCK', 'lib/defs.bzl'])
+
+        # The set follows the files as they change
+        self.touchRelative(root, 'lib', 'BUCK')
+        os.unlink(os.path.join(root, 'BUCK'))
+        self.assertWaitFor(
+            lambda: self.fileListsEqual(
+                self.normWatchmanFileList(self.watchmanCommand(
+                    'materialize-query', root, 'buildfiles')['files']),
+                ['lib/BUCK', 'lib/defs.bzl']))
+
+        views = self.watchmanCommand('materialize-list', root)['materialized']
+        self.assertEqual(1, len(views))
+        view = views[0]
+        self.assertEqualUTF8Strings('buildfiles', view['name'])
+        self.assertEqual(2, view['num_files'])
+        self.assertGreater(view['num_updates'], 0)
+
+        self.watchmanCommand('materialize-del', root, 'buildfiles')
+        with self.assertRaises(pywatchman.CommandError):
+            self.watchmanCommand('materialize-query', root, 'buildfiles')
+
+    def test_materializeDelta(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'BUCK')
+        self.touchRelative(root, 'old.bzl')
+
+        self.watchmanCommand('watch', root)
+        self.materializeBuildFiles(root)
+        clock = self.watchmanCommand(
+            'materialize-query', root, 'buildfiles')['clock']
+
+        self.touchRelative(root, 'new.bzl')
+        self.touchRelative(root, 'not-a-build-file')
+        os.unlink(os.path.join(root, 'old.bzl'))
+        self.waitForSync(root)
+
+        res = self.watchmanCommand('materialize-query', root, 'buildfiles',
+                                   clock)
+        self.assertFalse(res['is_fresh_instance'])
+        self.assertFileListsEqual(self.normWatchmanFileList(res['files']),
+                                  ['new.bzl'])
+        self.assertFileListsEqual(self.normWatchmanFileList(res['removed']),
+                                  ['old.bzl'])
+
+        # A member that changes again moves ahead of the newer ones, and a
+        # delta from either clock sees it
+        second = res['clock']
+        self.touchRelative(root, 'BUCK')
+        self.touchRelative(root, 'old.bzl')
+        self.waitForSync(root)
+
+        res = self.watchmanCommand('materialize-query', root, 'buildfiles',
+                                   second)
+        self.assertFileListsEqual(self.normWatchmanFileList(res['files']),
+                                  ['BUCK', 'old.bzl'])
+        self.assertEqual([], res['removed'])
+
+        res = self.watchmanCommand('materialize-query', root, 'buildfiles',
+                                   clock)
+        self.assertFileListsEqual(self.normWatchmanFileList(res['files']),
+                                  ['BUCK', 'new.bzl', 'old.bzl'])
+        self.assertEqual([], res['removed'])
+
+    def test_materializeRejectsGenerators(self):
+        root = self.mkdtemp()
+        self.watchmanCommand('watch', root)
+
+        with self.assertRaises(pywatchman.CommandError):
+            self.watchmanCommand('materialize', root, 'since', {
+                'since': 'c:0:0',
+                'fields': ['name']})
@@ -0,0 +1,68 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2016-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import WatchmanTestCase
+import os
+import os.path
+
+
+@WatchmanTestCase.expand_matrix
+class TestQueryBatch(WatchmanTestCase.WatchmanTestCase):
+
+    def test_queryBatch(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'lib'))
+        self.touchRelative(root, 'BUCK')
+        self.touchRelative(root, 'lib', 'BUCK')
+        self.touchRelative(root, 'lib', 'main.c')
+
+        self.watchmanCommand('watch', root)
+        clock = self.watchmanCommand('clock', root)['clock']
+        self.touchRelative(root, 'lib', 'util.c')
+
+        res = self.watchmanCommand('query-batch', root, [
+            {'expression': ['type', 'd'], 'fields': ['name']},
+            {'expression': ['name', 'BUCK'], 'fields': ['name']},
+            {'expression': ['suffix', 'c'], 'fields': ['name']},
+            {'since': clock, 'fields': ['name']},
+        ])
+        results = res['results']
+        self.assertEqual(4, len(results))
+        self.assertFileListsEqual(
+            self.normWatchmanFileList(results[0]['files']), ['lib'])
+        self.assertFileListsEqual(
+            self.normWatchmanFileList(results[1]['files']),
+            ['BUCK', 'lib/BUCK'])
+        self.assertFileListsEqual(
+            self.normWatchmanFileList(results[2]['files']),
+            ['lib/main.c', 'lib/util.c'])
+        self.assertFileListContains(
+            self.normWatchmanFileList(results[3]['files']), ['lib/util.c'])
+        self.assertFalse(results[3]['is_fresh_instance'])
+
+        # They all see the same view of the tree
+        for result in results:
+            self.assertEqual(results[0]['clock'], result['clock'])
+
+    def test_queryBatchErrors(self):
+        root = self.mkdtemp()
+        self.touchRelative(root, 'a')
+        self.watchmanCommand('watch', root)
+
+        # A bad query fails on its own without taking the others with it
+        res = self.watchmanCommand('query-batch', root, [
+            {'expression': ['nmae', 'a'], 'fields': ['name']},
+            {'expression': ['name', 'a'], 'fields': ['name']},
+        ])
+        results = res['results']
+        self.assertEqual(2, len(results))
+        self.assertIn('error', results[0])
+        self.assertNotIn('error', results[1])
+        self.assertFileListsEqual(
+            self.normWatchmanFileList(results[1]['files']), ['a'])
@@ -0,0 +1,147 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2016-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import WatchmanInstance
+import WatchmanTestCase
+import json
+import os
+import os.path
+import pywatchman
+import socket
+
+NUM_DIRS = 50
+FILES_PER_DIR = 100
+
+
+@WatchmanTestCase.expand_matrix
+class TestQueryLimits(WatchmanTestCase.WatchmanTestCase):
+
+    def makeTree(self, config=None):
+        root = self.mkdtemp()
+        if config:
+            with open(os.path.join(root, '.watchmanconfig'), 'w') as f:
+                f.write(json.dumps(config))
+        for d in range(NUM_DIRS):
+            dir_name = os.path.join(root, 'd%d' % d)
+            os.mkdir(dir_name)
+            for i in range(FILES_PER_DIR):
+                with open(os.path.join(dir_name, 'f%d' % i), 'w'):
+                    pass
+        self.watchmanCommand('watch', root)
+        res = self.watchmanCommand('query', root, {
+            'expression': ['type', 'f'],
+            'result_mode': 'count'})
+        files = NUM_DIRS * FILES_PER_DIR
+        self.assertEqual(files + 1 if config else files, res['count'])
+        return root
+
+    def slowQuery(self, **kwargs):
+        # Lots of terms that never match, so that every file is examined
+        # against all of them
+        query = {
+            'expression': ['anyof'] + [
+                ['match', '*%d*.nomatch' % i, 'wholename']
+                for i in range(200)] + [['name', 'f7']],
+            'fields': ['name']}
+        query.update(kwargs)
+        return query
+
+    def expectedSlowQueryResults(self):
+        return self.normFileList(['d%d/f7' % d for d in range(NUM_DIRS)])
+
+    def test_deadline(self):
+        root = self.makeTree()
+
+        with self.assertRaisesRegexp(pywatchman.CommandError,
+                                     'query exceeded its deadline_ms of 1'):
+            self.watchmanCommand('query', root, self.slowQuery(deadline_ms=1))
+
+        # A generous deadline doesn't get in the way
+        res = self.watchmanCommand('query', root,
+                                   self.slowQuery(deadline_ms=600000))
+        self.assertFileListsEqual(self.normWatchmanFileList(res['files']),
+                                  self.expectedSlowQueryResults())
+
+    def test_parallelDeadline(self):
+        root = self.makeTree({'query_parallel_threshold': 100})
+
+        res = self.watchmanCommand('query', root, self.slowQuery())
+        self.assertFileListsEqual(self.normWatchmanFileList(res['files']),
+                                  self.expectedSlowQueryResults())
+
+        # The workers give up too, and their reason is reported
+        with self.assertRaisesRegexp(pywatchman.CommandError,
+                                     'query exceeded its deadline_ms of 1'):
+            self.watchmanCommand('query', root, self.slowQuery(deadline_ms=1))
+
+    def test_yieldEvery(self):
+        root = self.makeTree()
+        clock = self.watchmanCommand('clock', root)['clock']
+
+        res = self.watchmanCommand('query', root, {
+            'expression': ['name', 'f7'],
+            'fields': ['name'],
+            'yield_every': 10})
+        self.assertFileListsEqual(self.normWatchmanFileList(res['files']),
+                                  self.expectedSlowQueryResults())
+
+        for d in range(0, NUM_DIRS, 5):
+            self.touchRelative(root, 'd%d' % d, 'new')
+        self.waitForSync(root)
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'expression': ['name', 'new'],
+            'fields': ['name'],
+            'yield_every': 1})
+        self.assertFalse(res['is_fresh_instance'])
+        self.assertFileListsEqual(
+            self.normWatchmanFileList(res['files']),
+            self.normFileList(['d%d/new' % d
+                               for d in range(0, NUM_DIRS, 5)]))
+
+    def test_halfClosedClient(self):
+        root = self.makeTree()
+
+        # A client that sends its query and then shuts down its writing
+        # side is still waiting for the results; it hasn't gone away
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(10)
+        sock.connect(WatchmanInstance.getSharedInstance().getSockPath())
+        self.addCleanup(sock.close)
+        sock.sendall(json.dumps(['query', root, {
+            'expression': ['type', 'f'],
+            'fields': ['name']}]).encode('utf-8') + b'\n')
+        sock.shutdown(socket.SHUT_WR)
+
+        buf = b''
+        while True:
+            data = sock.recv(65536)
+            if not data:
+                break
+            buf += data
+        res = json.loads(buf.decode('utf-8').splitlines()[0])
+        self.assertNotIn('error', res)
+        self.assertEqual(NUM_DIRS * FILES_PER_DIR, len(res['files']))
+
+    def test_invalidOptions(self):
+        root = self.mkdtemp()
+        self.watchmanCommand('watch', root)
+
+        with self.assertRaisesRegexp(pywatchman.CommandError,
+                                     'deadline_ms must be an integer'):
+            self.watchmanCommand('query', root, {'deadline_ms': -1})
+        with self.assertRaisesRegexp(pywatchman.CommandError,
+                                     'yield_every must be an integer'):
+            self.watchmanCommand('query', root, {'yield_every': 'often'})
+
+    def test_capabilities(self):
+        res = self.watchmanCommand('version', {
+            'required': ['deadline_ms', 'yield_every']})
+        self.assertTrue(res['capabilities']['deadline_ms'])
+        self.assertTrue(res['capabilities']['yield_every'])
@@ -0,0 +1,72 @@
+# vim:ts=4:sw=4:et:
+# Copyright 2016-present Facebook, Inc.
+# Licensed under the Apache License, Version 2.0
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+# no unicode literals
+
+import WatchmanTestCase
+import os
+import os.path
+import pywatchman
+
+
+@WatchmanTestCase.expand_matrix
+class TestResultMode(WatchmanTestCase.WatchmanTestCase):
+
+    def makeRoot(self):
+        root = self.mkdtemp()
+        os.mkdir(os.path.join(root, 'lib'))
+        for name in ('a.c', 'b.c', 'c.h'):
+            self.touchRelative(root, 'lib', name)
+        self.watchmanCommand('watch', root)
+        self.assertFileList(root, files=['lib', 'lib/a.c', 'lib/b.c',
+                                         'lib/c.h'])
+        return root
+
+    def test_count(self):
+        root = self.makeRoot()
+
+        res = self.watchmanCommand('query', root, {
+            'expression': ['suffix', 'c'],
+            'result_mode': 'count'})
+        self.assertEqual(2, res['count'])
+        self.assertNotIn('files', res)
+
+        res = self.watchmanCommand('query', root, {
+            'expression': ['suffix', 'py'],
+            'result_mode': 'count'})
+        self.assertEqual(0, res['count'])
+
+    def test_exists(self):
+        root = self.makeRoot()
+        clock = self.watchmanCommand('clock', root)['clock']
+
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'expression': ['suffix', 'c'],
+            'result_mode': 'exists'})
+        self.assertFalse(res['exists'])
+        self.assertNotIn('files', res)
+
+        self.touchRelative(root, 'lib', 'd.c')
+        self.waitForSync(root)
+        res = self.watchmanCommand('query', root, {
+            'since': clock,
+            'expression': ['suffix', 'c'],
+            'result_mode': 'exists'})
+        self.assertTrue(res['exists'])
+
+    def test_invalidMode(self):
+        root = self.makeRoot()
+        with self.assertRaises(pywatchman.CommandError):
+            self.watchmanCommand('query', root, {
+                'expression': ['suffix', 'c'],
+                'result_mode': 'some'})
+
+    def test_capability(self):
+        res = self.watchmanCommand('version', {
+            'required': ['result_mode']})
+        self.assertTrue(res['capabilities']['result_mode'])
@@ -0,0 +1,209 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0. */
+
+#include "watchman.h"
+#include "thirdparty/tap.h"
+#include "thirdparty/jansson/utf.h"
+#include <string>
+#include <vector>
+
+static int append_to_string(const char *buffer, size_t size, void *ptr) {
+  ((std::string *)ptr)->append(buffer, size);
+  return 0;
+}
+
+static int count_bytes(const char *buffer, size_t size, void *ptr) {
+  (void)buffer;
+  *(size_t *)ptr += size;
+  return 0;
+}
+
+static bool dump(const std::string &str, size_t flags, std::string &out) {
+  out.clear();
+  return json_dump_string(str.data(), str.size(), append_to_string, &out,
+                          flags) == 0;
+}
+
+// Each special character should be escaped wherever it lands relative to
+// the blocks that are scanned at once
+static void check_escaping(void) {
+  static const struct {
+    const char *raw;
+    const char *escaped;
+    const char *ascii_escaped;
+  } specials[] = {
+      {"\"", "\\\"", "\\\""},
+      {"\\", "\\\\", "\\\\"},
+      {"\n", "\\n", "\\n"},
+      {"\x01", "\\u0001", "\\u0001"},
+      {"\x1f", "\\u001f", "\\u001f"},
+      {"\x7f", "\x7f", "\x7f"},
+      {"/", "/", "/"},
+      {"\xc3\xa9", "\xc3\xa9", "\\u00e9"},
+      {"\xf0\x9f\x98\x80", "\xf0\x9f\x98\x80", "\\ud83d\\ude00"},
+  };
+  std::string out;
+  bool all_ok = true;
+
+  for (auto &special : specials) {
+    for (size_t len = 0; len < 40; ++len) {
+      for (size_t pos = 0; pos <= len; ++pos) {
+        std::string head(pos, 'a'), tail(len - pos, 'b');
+        auto str = head + special.raw + tail;
+
+        if (!dump(str, 0, out) ||
+            out != "\"" + head + special.escaped + tail + "\"" ||
+            !dump(str, JSON_ENSURE_ASCII, out) ||
+            out != "\"" + head + special.ascii_escaped + tail + "\"") {
+          diag("%s at %zu of %zu came out as %s", special.escaped, pos, len,
+               out.c_str());
+          all_ok = false;
+        }
+      }
+    }
+  }
+  ok(all_ok, "escaped special characters at every offset");
+
+  ok(dump("a/b/c/d/e/f/g/h/i/j/k/l", JSON_ESCAPE_SLASH, out) &&
+         out == "\"a\\/b\\/c\\/d\\/e\\/f\\/g\\/h\\/i\\/j\\/k\\/l\"",
+     "escaped slashes when asked to");
+}
+
+// Invalid sequences must still be refused wherever they land
+static void check_validation(void) {
+  static const char *invalid[] = {
+      "\xff",             // never valid
+      "\x80",             // stray continuation byte
+      "\xc0\xaf",         // overlong
+      "\xed\xa0\x80",     // surrogate half
+      "\xf4\x90\x80\x80", // beyond U+10FFFF
+      "\xe2\x82",         // truncated
+  };
+  std::string out;
+  bool all_refused = true, all_accepted = true;
+
+  for (auto seq : invalid) {
+    for (size_t len = 0; len < 40; ++len) {
+      for (size_t pos = 0; pos <= len; ++pos) {
+        std::string str(pos, 'a');
+        str += seq;
+        str.append(len - pos, 'b');
+        if (dump(str, 0, out) || utf8_check_string(str.data(), str.size())) {
+          diag("accepted an invalid sequence at %zu of %zu", pos, len);
+          all_refused = false;
+        }
+      }
+    }
+  }
+  ok(all_refused, "refused invalid UTF-8 at every offset");
+
+  for (size_t len = 0; len < 40; ++len) {
+    std::string str(len, 'x');
+    str += "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";
+    str.append(len, 'y');
+    if (!utf8_check_string(str.data(), str.size())) {
+      all_accepted = false;
+    }
+  }
+  ok(all_accepted, "accepted valid multi-byte sequences");
+}
+
+// The bulk scan must agree with one that looks at a byte at a time
+static void check_plain_ascii_length(void) {
+  bool all_ok = true;
+  char buf[128];
+
+  srand(1);
+  for (int trial = 0; trial < 10000; ++trial) {
+    size_t size = rand() % sizeof(buf);
+    size_t expected = size;
+
+    for (size_t i = 0; i < size; ++i) {
+      // Mostly plain characters, so that the runs get long
+      buf[i] = rand() % 64 ? ' ' + rand() % 95 : (char)(rand() % 256);
+    }
+    for (size_t i = 0; i < size; ++i) {
+      unsigned char u = (unsigned char)buf[i];
+      if (u < ' ' || u >= 0x80 || u == '"' || u == '\\') {
+        expected = i;
+        break;
+      }
+    }
+    if (utf8_plain_ascii_length(buf, size) != expected) {
+      all_ok = false;
+    }
+  }
+  ok(all_ok, "the bulk scan agrees with a byte at a time scan");
+}
+
+// Names that look like those in a large source tree, some of which have
+// characters that need escaping or aren't ASCII
+static std::vector<std::string> build_corpus(size_t num_paths) {
+  static const char *dirs[] = {
+      "fbcode", "xplat/js/node_modules", "third-party/boost", "docs/übersicht",
+      "www/flib/intern", "buck-out/gen/app#header-mode", "tests/fixtures",
+  };
+  static const char *suffixes[] = {
+      ".cpp", ".h", ".js", ".py", ".json", " (copy).txt", "\"quoted\".md",
+  };
+  std::vector<std::string> corpus;
+  char name[256];
+
+  corpus.reserve(num_paths);
+  for (size_t i = 0; i < num_paths; ++i) {
+    snprintf(name, sizeof(name), "%s/project%zu/src/module%zu/file_%zu%s",
+             dirs[i % 7], i / 5000, i / 100, i, suffixes[(i / 7) % 7]);
+    corpus.emplace_back(name);
+  }
+  return corpus;
+}
+
+static void bench_corpus(void) {
+  auto corpus = build_corpus(200000);
+  struct timeval start, end;
+  size_t total = 0, written = 0, valid = 0;
+  int rounds = 20;
+
+  for (auto &path : corpus) {
+    total += path.size();
+  }
+
+  gettimeofday(&start, NULL);
+  for (int n = 0; n < rounds; ++n) {
+    for (auto &path : corpus) {
+      json_dump_string(path.data(), path.size(), count_bytes, &written, 0);
+    }
+  }
+  gettimeofday(&end, NULL);
+  diag("json_dump_string: %zu paths, %.1f MB/s", corpus.size(),
+       (total * rounds) / w_timeval_diff(start, end) / (1024 * 1024));
+
+  gettimeofday(&start, NULL);
+  for (int n = 0; n < rounds; ++n) {
+    for (auto &path : corpus) {
+      valid += utf8_check_string(path.data(), (int)path.size());
+    }
+  }
+  gettimeofday(&end, NULL);
+  diag("utf8_check_string: %zu paths, %.1f MB/s", corpus.size(),
+       (total * rounds) / w_timeval_diff(start, end) / (1024 * 1024));
+
+  ok(valid == corpus.size() * rounds && written > total * rounds,
+     "dumped and validated the corpus");
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  plan_tests(6);
+  check_escaping();
+  check_validation();
+  check_plain_ascii_length();
+  bench_corpus();
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -126,11 +126,50 @@ static void bench_pending(void) {
   }
 }
 
+// Incrementally consuming a collection must keep the uniq index in
+// sync with the list, so that items added while we are consuming it
+// are neither lost nor consolidated with items that were already taken.
+static void test_take(void) {
+  struct watchman_pending_collection coll;
+  struct timeval now = {0, 0};
+  w_string a("/root/a", W_STRING_BYTE);
+  w_string b("/root/b", W_STRING_BYTE);
+  w_string b_kid("/root/b/kid", W_STRING_BYTE);
+  struct watchman_pending_fs *p;
+
+  w_pending_coll_add(&coll, a, now, 0);
+  w_pending_coll_add(&coll, b, now, W_PENDING_RECURSIVE);
+  ok(w_pending_coll_size(&coll) == 2, "have 2 items");
+
+  // The list is LIFO, so we get b first
+  p = w_pending_coll_take(&coll);
+  ok(p && w_string_equal(p->path, b), "took b");
+  ok(w_pending_coll_size(&coll) == 1, "have 1 item left");
+  w_pending_fs_free(p);
+
+  // b is no longer pending, so this is not obsoleted by it
+  w_pending_coll_add(&coll, b_kid, now, 0);
+  ok(w_pending_coll_size(&coll) == 2, "b/kid was added");
+
+  // and re-adding a consolidates with the existing entry
+  w_pending_coll_add(&coll, a, now, 0);
+  ok(w_pending_coll_size(&coll) == 2, "a was consolidated");
+
+  size_t taken = 0;
+  while ((p = w_pending_coll_take(&coll)) != NULL) {
+    w_pending_fs_free(p);
+    ++taken;
+  }
+  ok(taken == 2, "took the remaining 2 items");
+  ok(w_pending_coll_size(&coll) == 0, "collection is empty");
+}
+
 int main(int argc, char **argv) {
   (void)argc;
   (void)argv;
 
-  plan_tests(1);
+  plan_tests(8);
+  test_take();
   bench_pending();
   pass("got here");
 
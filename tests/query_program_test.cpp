@@ -0,0 +1,286 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0. */
+
+#include "watchman.h"
+#include "make_unique.h"
+#include "thirdparty/tap.h"
+#include <unordered_map>
+#include <vector>
+
+// Compares the compiled QueryProgram against evaluating the expression
+// tree directly, both for correctness and for speed.
+
+// The test doesn't link the full query parser, so it provides a minimal
+// registry for the terms that it does link in.
+static std::unordered_map<std::string, w_query_expr_parser>& term_parsers() {
+  static std::unordered_map<std::string, w_query_expr_parser> parsers;
+  return parsers;
+}
+
+bool w_query_register_expression_parser(
+    const char* term,
+    w_query_expr_parser parser) {
+  term_parsers()[term] = parser;
+  return true;
+}
+
+std::unique_ptr<QueryExpr> w_query_expr_parse(w_query* query, json_t* exp) {
+  const char* name = json_is_string(exp)
+      ? json_string_value(exp)
+      : json_string_value(json_array_get(exp, 0));
+  auto it = term_parsers().find(name ? name : "");
+  if (it == term_parsers().end()) {
+    query->errmsg = strdup("unknown term");
+    return nullptr;
+  }
+  return it->second(query, exp);
+}
+
+void w_capability_register(const char*) {}
+
+// The queries in this test never have a since clause
+w_clockspec::~w_clockspec() {}
+
+w_query::~w_query() {
+  free(errmsg);
+}
+
+w_query_ctx::w_query_ctx(w_query* q, read_locked_watchman_root* lock)
+    : query(q), lock(lock) {}
+
+w_query_ctx::~w_query_ctx() {}
+
+w_string_t* w_query_ctx_get_wholename(struct w_query_ctx* ctx) {
+  static w_string wholename;
+  if (!ctx->wholename) {
+    auto name = w_file_get_name(ctx->file);
+    wholename = w_string::printf("src/lib/%.*s", name->len, name->buf);
+    ctx->wholename = wholename;
+  }
+  return ctx->wholename;
+}
+
+static const char* basenames[] = {
+    "main.c",
+    "main.h",
+    "util.c",
+    "util.cpp",
+    "README",
+    "Makefile",
+    "foo.c",
+    "bar.py",
+    "baz.txt",
+    "lib",
+};
+
+static std::vector<watchman_file*> make_files(size_t n) {
+  std::vector<watchman_file*> files;
+  files.reserve(n);
+
+  for (size_t i = 0; i < n; ++i) {
+    w_string name(
+        basenames[rand() % (sizeof(basenames) / sizeof(basenames[0]))],
+        W_STRING_BYTE);
+    auto file = (watchman_file*)calloc(
+        1, sizeof(watchman_file) + w_string_embedded_size(name));
+    new (file) watchman_file();
+    w_string_embedded_copy(w_file_get_name(file), name);
+
+    file->exists = rand() % 10 != 0;
+    switch (rand() % 4) {
+      case 0:
+        file->stat.mode = S_IFDIR | 0755;
+        break;
+      case 1:
+        file->stat.mode = S_IFLNK | 0777;
+        break;
+      default:
+        file->stat.mode = S_IFREG | 0644;
+    }
+    file->stat.size = rand() % 4 == 0 ? 0 : rand() % 4096;
+    files.push_back(file);
+  }
+  return files;
+}
+
+static void free_files(std::vector<watchman_file*>& files) {
+  for (auto file : files) {
+    file->~watchman_file();
+    free(file);
+  }
+  files.clear();
+}
+
+static json_t* random_leaf() {
+  switch (rand() % 12) {
+    case 0:
+      return json_pack("[s,s]", "type", "f");
+    case 1:
+      return json_pack("[s,s]", "type", "d");
+    case 2:
+      return json_pack("[s,s]", "suffix", "c");
+    case 3:
+      return json_pack("[s,s]", "suffix", "h");
+    case 4:
+      return json_pack("[s,s]", "name", "main.c");
+    case 5:
+      return json_pack("[s,[s,s],s]", "name", "README", "foo.c", "wholename");
+    case 6:
+      return json_pack("[s,s]", "match", "*.c*");
+    case 7:
+      return json_pack("[s,s,s]", "match", "src/**/u*", "wholename");
+    case 8:
+      return json_pack("[s]", "exists");
+    case 9:
+      return json_pack("[s]", "empty");
+    case 10:
+      return json_pack("[s,s,i]", "size", "gt", 1024);
+    default:
+      return json_pack("[s]", rand() % 2 ? "true" : "false");
+  }
+}
+
+static json_t* random_expr(int depth) {
+  if (depth == 0 || rand() % 4 == 0) {
+    return random_leaf();
+  }
+
+  switch (rand() % 3) {
+    case 0:
+      return json_pack("[s,o]", "not", random_expr(depth - 1));
+    default: {
+      auto list = json_pack("[s]", rand() % 2 ? "allof" : "anyof");
+      auto n = 1 + rand() % 4;
+      for (int i = 0; i < n; ++i) {
+        json_array_append_new(list, random_expr(depth - 1));
+      }
+      return list;
+    }
+  }
+}
+
+// Returns the number of files for which the tree and the program
+// disagree
+static size_t count_mismatches(
+    w_query* query,
+    const std::vector<watchman_file*>& files) {
+  w_query_ctx ctx(query, nullptr);
+  size_t mismatches = 0;
+
+  for (auto file : files) {
+    ctx.file = file;
+    ctx.wholename = nullptr;
+    bool tree = query->expr->evaluate(&ctx, file);
+    ctx.wholename = nullptr;
+    bool program = query->program->evaluate(&ctx, file);
+    if (tree != program) {
+      ++mismatches;
+    }
+  }
+  return mismatches;
+}
+
+static void test_equivalence(const std::vector<watchman_file*>& files) {
+  for (int i = 0; i < 40; ++i) {
+    w_query query;
+    auto spec = random_expr(4);
+    query.expr = w_query_expr_parse(&query, spec);
+    if (!query.expr) {
+      fail("failed to parse: %s", query.errmsg);
+      json_decref(spec);
+      continue;
+    }
+    query.program = watchman::make_unique<QueryProgram>(query.expr.get());
+
+    auto mismatches = count_mismatches(&query, files);
+    char* dumped = json_dumps(spec, JSON_COMPACT);
+    ok(mismatches == 0,
+       "%u mismatches for %s (%u instructions)",
+       uint32_t(mismatches),
+       dumped,
+       uint32_t(query.program->size()));
+    free(dumped);
+    json_decref(spec);
+  }
+}
+
+template <typename Func>
+static double time_evaluation(
+    w_query* query,
+    const std::vector<watchman_file*>& files,
+    size_t* matches,
+    Func evaluate) {
+  w_query_ctx ctx(query, nullptr);
+  struct timeval start, end;
+
+  *matches = 0;
+  gettimeofday(&start, NULL);
+  for (int iter = 0; iter < 10; ++iter) {
+    for (auto file : files) {
+      ctx.file = file;
+      ctx.wholename = nullptr;
+      if (evaluate(&ctx, file)) {
+        ++*matches;
+      }
+    }
+  }
+  gettimeofday(&end, NULL);
+  return w_timeval_diff(start, end);
+}
+
+// An expression in the style of those that we see from tools: an
+// expensive wholename match ahead of cheap type and suffix terms
+static void bench_program(const std::vector<watchman_file*>& files) {
+  w_query query;
+  auto spec = json_pack(
+      "[s, [s, s, s], [s, [s, s], [s, s]], [s, s], [s]]",
+      "allof",
+      "match",
+      "src/**/*.*",
+      "wholename",
+      "anyof",
+      "suffix",
+      "c",
+      "suffix",
+      "h",
+      "type",
+      "f",
+      "exists");
+  query.expr = w_query_expr_parse(&query, spec);
+  query.program = watchman::make_unique<QueryProgram>(query.expr.get());
+  json_decref(spec);
+
+  size_t tree_matches, program_matches;
+  auto tree_time = time_evaluation(
+      &query, files, &tree_matches, [&](w_query_ctx* ctx, watchman_file* f) {
+        return query.expr->evaluate(ctx, f);
+      });
+  auto program_time = time_evaluation(
+      &query, files, &program_matches, [&](w_query_ctx* ctx, watchman_file* f) {
+        return query.program->evaluate(ctx, f);
+      });
+
+  diag(
+      "tree: %.3fs, program: %.3fs for %u evaluations",
+      tree_time,
+      program_time,
+      uint32_t(files.size() * 10));
+  ok(tree_matches == program_matches,
+     "tree and program matched the same %u files",
+     uint32_t(program_matches));
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  (void)argv;
+
+  srand(42);
+  auto files = make_files(100000);
+
+  plan_tests(41);
+  test_equivalence(files);
+  bench_program(files);
+
+  free_files(files);
+  return exit_status();
+}
@@ -0,0 +1,134 @@
+/* Copyright 2016-present Facebook, Inc.
+ * Licensed under the Apache License, Version 2.0. */
+
+#include "watchman.h"
+#include "IOReactor.h"
+#include "ThreadPool.h"
+#include "thirdparty/tap.h"
+#include <atomic>
+
+using namespace watchman;
+using std::chrono::milliseconds;
+
+// The wheel should only ask to be woken up when a timer is due, however
+// far off that is, and should fire the timers on the right tick
+static void check_timer_wheel(void) {
+  TimerWheel wheel(milliseconds(10), 8);
+  std::vector<TimerWheel::Callback> due;
+  int fired = 0;
+
+  ok(wheel.nextTimeoutMs(TimerWheel::Clock::now()) == -1,
+     "no timeout while there are no timers");
+
+  // Take the time after adding, as that is when the wheel starts counting
+  wheel.add(milliseconds(5000), [&fired] { fired |= 1; });
+  auto start = TimerWheel::Clock::now();
+  auto timeout = wheel.nextTimeoutMs(start);
+  ok(timeout > 4900 && timeout <= 5000,
+     "waits for the timer that is many revolutions away: %d", timeout);
+
+  auto cancelled = wheel.add(milliseconds(30), [&fired] { fired |= 2; });
+  wheel.add(milliseconds(50), [&fired] { fired |= 4; });
+  timeout = wheel.nextTimeoutMs(start);
+  ok(timeout > 20 && timeout <= 30, "waits for the soonest timer: %d",
+     timeout);
+  ok(wheel.cancel(cancelled) && !wheel.cancel(cancelled),
+     "cancels a timer only once");
+  timeout = wheel.nextTimeoutMs(start);
+  ok(timeout > 40 && timeout <= 50, "forgets the cancelled timer: %d",
+     timeout);
+
+  wheel.advance(start + milliseconds(40), due);
+  ok(due.empty(), "nothing is due early");
+  wheel.advance(start + milliseconds(50), due);
+  for (auto& func : due) {
+    func();
+  }
+  ok(due.size() == 1 && fired == 4, "fired the timer that was due");
+
+  due.clear();
+  wheel.advance(start + milliseconds(4990), due);
+  ok(due.empty() && wheel.size() == 1,
+     "the distant timer survives passing its slot");
+  wheel.advance(start + milliseconds(5000), due);
+  for (auto& func : due) {
+    func();
+  }
+  ok(due.size() == 1 && fired == 5 && wheel.size() == 0,
+     "fired the distant timer on time");
+}
+
+static void check_thread_pool(void) {
+  ThreadPool pool;
+  std::atomic<int> count{0};
+  int num_tasks = 1000;
+
+  pool.start(4, "test");
+  ok(pool.numThreads() == 4, "started the workers");
+  for (int i = 0; i < num_tasks; ++i) {
+    pool.run([&count] { ++count; });
+  }
+  pool.stop();
+  ok(count == num_tasks, "ran every task before stopping: %d", count.load());
+
+  bool refused = false;
+  try {
+    pool.run([] {});
+  } catch (const std::exception&) {
+    refused = true;
+  }
+  ok(refused, "refuses work once stopped");
+}
+
+// Tasks on one executor must run in order and never overlap, even though
+// they share the pool with another executor
+static void check_serial_executor(void) {
+  ThreadPool pool;
+  std::atomic<int> active{0};
+  std::atomic<bool> overlapped{false};
+  std::vector<int> order;
+  std::atomic<int> other{0};
+  int num_tasks = 1000;
+
+  pool.start(4, "test");
+  {
+    SerialExecutor serial(pool);
+    SerialExecutor neighbour(pool);
+
+    for (int i = 0; i < num_tasks; ++i) {
+      serial.run([&, i] {
+        if (++active > 1) {
+          overlapped = true;
+        }
+        order.push_back(i);
+        --active;
+      });
+      neighbour.run([&other] { ++other; });
+    }
+    // The executors go away before their queues have drained
+  }
+  pool.stop();
+
+  bool in_order = order.size() == (size_t)num_tasks;
+  for (size_t i = 0; in_order && i < order.size(); ++i) {
+    in_order = order[i] == (int)i;
+  }
+  ok(!overlapped, "never ran two tasks at once");
+  ok(in_order, "ran the tasks in the order they were queued");
+  ok(other == num_tasks, "ran the other executor's tasks too");
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  plan_tests(15);
+  check_timer_wheel();
+  check_thread_pool();
+  check_serial_executor();
+
+  return exit_status();
+}
+
+/* vim:ts=2:sw=2:et:
+ */
@@ -65,9 +65,9 @@ static int dump_indent(size_t flags, int depth, int space, json_dump_callback_t
     return 0;
 }
 
-static int dump_string(const char *str, json_dump_callback_t dump, void *data, size_t flags)
+static int dump_string(const char *str, size_t len, json_dump_callback_t dump, void *data, size_t flags)
 {
-    const char *pos, *end;
+    const char *pos, *end, *limit = str + len;
     int32_t codepoint;
 
     if(dump("\"", 1, data))
@@ -80,8 +80,19 @@ static int dump_string(const char *str, json_dump_callback_t dump, void *data, s
         char seq[13];
         int length;
 
-        while(*end)
+        while(end < limit && *end)
         {
+            /* skip over the characters that don't need escaping */
+            if(!(flags & JSON_ESCAPE_SLASH))
+            {
+                end = pos += utf8_plain_ascii_length(pos, limit - pos);
+                if(end == limit || !*end)
+                    break;
+            }
+
+            /* don't let a truncated sequence read beyond the string */
+            if(utf8_check_first(*pos) > limit - pos)
+                return -1;
             end = utf8_iterate(pos, &codepoint);
             if(!end)
                 return -1;
@@ -212,7 +223,10 @@ static int do_dump(const json_t *json, size_t flags, int depth,
         }
 
         case JSON_STRING:
-            return dump_string(json_string_value(json), dump, data, flags);
+            {
+            w_string_t *str = json_to_w_string(json);
+            return dump_string(str->buf, str->len, dump, data, flags);
+        }
 
         case JSON_ARRAY:
         {
@@ -333,7 +347,7 @@ static int do_dump(const json_t *json, size_t flags, int depth,
                     value = json_object_get(json, key);
                     assert(value);
 
-                    dump_string(key, dump, data, flags);
+                    dump_string(key, strlen(key), dump, data, flags);
                     if(dump(separator, separator_length, data) ||
                        do_dump(value, flags, depth + 1, dump, data))
                     {
@@ -370,7 +384,10 @@ static int do_dump(const json_t *json, size_t flags, int depth,
                 {
                     void *next = json_object_iter_next((json_t *)json, iter);
 
-                    dump_string(json_object_iter_key(iter), dump, data, flags);
+                    {
+                        const char *key = json_object_iter_key(iter);
+                        dump_string(key, strlen(key), dump, data, flags);
+                    }
                     if(dump(separator, separator_length, data) ||
                        do_dump(json_object_iter_value(iter), flags, depth + 1,
                                dump, data))
@@ -406,6 +423,23 @@ static int do_dump(const json_t *json, size_t flags, int depth,
     }
 }
 
+int json_dump_string(const char *str, size_t len, json_dump_callback_t callback, void *data, size_t flags)
+{
+    return dump_string(str, len, callback, data, flags);
+}
+
+int json_dump_real(double value, json_dump_callback_t callback, void *data)
+{
+    char buffer[MAX_REAL_STR_LENGTH];
+    int size;
+
+    size = jsonp_dtostr(buffer, MAX_REAL_STR_LENGTH, value);
+    if(size < 0)
+        return -1;
+
+    return callback(buffer, size, data);
+}
+
 char *json_dumps(const json_t *json, size_t flags)
 {
     strbuffer_t strbuff;
@@ -261,6 +261,9 @@ char *json_dumps(const json_t *json, size_t flags);
 int json_dumpf(const json_t *json, FILE *output, size_t flags);
 int json_dump_file(const json_t *json, const char *path, size_t flags);
 int json_dump_callback(const json_t *json, json_dump_callback_t callback, void *data, size_t flags);
+/* dump a single string or real, as they would appear within a document */
+int json_dump_string(const char *str, size_t len, json_dump_callback_t callback, void *data, size_t flags);
+int json_dump_real(double value, json_dump_callback_t callback, void *data);
 
 /* custom memory allocation */
 
@@ -7,6 +7,9 @@
 
 #include <string.h>
 #include "utf.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 int utf8_encode(int32_t codepoint, char *buffer, int *size)
 {
@@ -171,7 +174,13 @@ int utf8_check_string(const char *string, int length)
 
     for(i = 0; i < length; i++)
     {
-        int count = utf8_check_first(string[i]);
+        int count;
+
+        i += (int)utf8_plain_ascii_length(string + i, length - i);
+        if(i == length)
+            break;
+
+        count = utf8_check_first(string[i]);
         if(count == 0)
             return 0;
         else if(count > 1)
@@ -188,3 +197,59 @@ int utf8_check_string(const char *string, int length)
 
     return 1;
 }
+
+size_t utf8_plain_ascii_length(const char *buffer, size_t size)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    /* 16 bytes at a time.  The comparison with the space is signed, so
+       it also catches the bytes that have the high bit set. */
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+
+    for(; i + 16 <= size; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buffer + i));
+        __m128i special = _mm_or_si128(
+            _mm_cmplt_epi8(chunk, space),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                         _mm_cmpeq_epi8(chunk, backslash)));
+        int mask = _mm_movemask_epi8(special);
+
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    /* 8 bytes at a time.  (x - n) & ~x has the high bit of a byte set
+       if some byte of x is below n; a borrow can only spill into the
+       bytes above such a byte.  That is only used to find the word that
+       holds the first special byte, which is then found below. */
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+
+    for(; i + 8 <= size; i += 8)
+    {
+        uint64_t word, quotes, backslashes;
+
+        memcpy(&word, buffer + i, sizeof(word));
+        quotes = word ^ (ones * '"');
+        backslashes = word ^ (ones * '\\');
+        if((((word - ones * ' ') & ~word) |
+            ((quotes - ones) & ~quotes) |
+            ((backslashes - ones) & ~backslashes) |
+            word) & highs)
+            break;
+    }
+#endif
+
+    for(; i < size; i++)
+    {
+        unsigned char u = (unsigned char)buffer[i];
+
+        if(u < ' ' || u >= 0x80 || u == '"' || u == '\\')
+            break;
+    }
+    return i;
+}
@@ -28,6 +28,8 @@ typedef int int32_t;
 
 #endif /* HAVE_CONFIG_H */
 
+#include <stddef.h>
+
 int utf8_encode(int codepoint, char *buffer, int *size);
 
 int utf8_check_first(char byte);
@@ -36,4 +38,9 @@ const char *utf8_iterate(const char *buffer, int32_t *codepoint);
 
 int utf8_check_string(const char *string, int length);
 
+/* Returns the number of bytes at the start of buffer, up to size, that are
+   printable ASCII characters other than '"' and '\\'.  They are valid
+   UTF-8 and need no escaping in JSON, so they can be skipped in bulk. */
+size_t utf8_plain_ascii_length(const char *buffer, size_t size);
+
 #endif
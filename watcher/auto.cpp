@@ -16,6 +16,10 @@ bool Watcher::start(w_root_t*) {
 
 void Watcher::signalThreads() {}
 
+int Watcher::getNotifyFd() const {
+  return -1;
+}
+
 // These are listed in order of preference in the case that a
 // given system offers multiple choices
 static Watcher* available_watchers[] = {
@@ -90,6 +90,10 @@ struct InotifyWatcher : public Watcher {
 
   bool waitNotify(int timeoutms) override;
 
+  int getNotifyFd() const override {
+    return infd;
+  }
+
   void process_inotify_event(
       w_root_t* root,
       struct watchman_pending_collection* coll,
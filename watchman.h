@@ -36,9 +36,9 @@ typedef void *watchman_watcher_t;
 #define WATCHMAN_IO_BUF_SIZE 1048576
 #define WATCHMAN_BATCH_LIMIT (16*1024)
 
+#include "watchman_perf.h"
 #include "watchman_root.h"
 #include "watchman_pdu.h"
-#include "watchman_perf.h"
 #include "watchman_query.h"
 #include "watchman_client.h"
 
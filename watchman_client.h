@@ -5,9 +5,22 @@
 struct watchman_client_response {
   struct watchman_client_response *next;
   json_t *json;
+  // If set, this is what gets sent; json holds the rest of the response
+  // without the part that was encoded straight into the PDU
+  struct w_encoded_pdu *pdu;
+  // Roughly how many bytes this takes up on the wire
+  size_t size;
+  // If this is (part of) a notification for a subscription: the id of
+  // the subscription, and the clock that the notification's results are
+  // relative to.  See w_client_coalesce_subscription.
+  uint64_t sub_id;
+  bool has_since;
+  uint32_t since_root_number;
+  uint32_t since_ticks;
 };
 
 struct watchman_client_subscription;
+struct watchman_client_reactor;
 
 struct watchman_client_state_assertion {
   w_root_t *root; // Holds a ref on the root
@@ -35,7 +48,25 @@ struct watchman_client {
   // used to deliver signals.
   pthread_t thread_handle;
 
+  // Set if the session is served by the client reactor rather than
+  // a thread of its own; see listener-reactor.cpp
+  struct watchman_client_reactor *reactor;
+
   struct watchman_client_response *head, *tail;
+  // These are guarded by w_client_lock.
+  // The number and size of the responses in the list above
+  uint32_t queue_depth;
+  size_t queued_bytes;
+  // The number of unilateral responses that were dropped because the
+  // queue was full, and of subscription notifications that were merged
+  // into a later one
+  uint64_t num_dropped;
+  uint64_t num_coalesced;
+  // Log messages that would take queued_bytes past this are dropped, and
+  // any other unilateral response that would do so sets overflowed, which
+  // has the client disconnected.  0 means that there is no limit.
+  size_t max_queued_bytes;
+  bool overflowed;
 };
 
 // These are approximations for managing derived client "classes"
@@ -46,7 +77,12 @@ extern const uint32_t derived_client_size;
 struct watchman_client_subscription {
   w_root_t *root;
   w_string_t *name;
+  // Unique for the life of the process, unlike the name
+  uint64_t id;
   std::shared_ptr<w_query> query;
+  // Canonical form of the parts of the query spec that determine
+  // the results; equal keys and cursors produce equal results
+  w_string spec_key;
   bool vcs_defer;
   uint32_t last_sub_tick;
   struct w_query_field_list field_list;
@@ -72,3 +108,41 @@ extern w_ht_t *clients;
 void w_client_lock_init(void);
 
 void w_client_vacate_states(struct watchman_user_client *client);
+void w_client_delete(struct watchman_client *client);
+// Removes and returns the responses that are queued for the client
+struct watchman_client_response *w_client_take_responses(
+    struct watchman_client *client);
+// Queues a notification for sub, whose results are relative to since.
+// continued is set for the chunks after the first of a notification.
+// Returns false if the client's queue has overflowed.
+bool w_client_enqueue_notification(struct watchman_client *client,
+    struct watchman_client_subscription *sub, const struct w_clockspec *since,
+    json_t *json, struct w_encoded_pdu *pdu, bool continued);
+// Returns true, and logs why, if the client has overflowed its queue and
+// is to be disconnected
+bool w_client_overflowed(struct watchman_client *client);
+// Called with w_client_lock held when sub is about to produce another
+// notification.  If the client hasn't yet taken the previous one, it is
+// removed from the queue and sub's cursor is moved back to where that
+// one started, so that the next notification covers both.
+void w_client_coalesce_subscription(struct watchman_client *client,
+    struct watchman_client_subscription *sub);
+
+// Writes a response to stm in the format that the client used for
+// its request
+bool w_client_write_response(struct watchman_client *client, w_stm_t stm,
+    json_t *response, const struct w_encoded_pdu *pdu);
+
+bool w_client_reactor_enabled(void);
+// Starts serving the session on the client reactor.  Returns false if
+// that wasn't possible, in which case the caller still owns the client.
+bool w_client_reactor_add(struct watchman_client *client);
+// Arranges for the responses queued for the client to be sent
+void w_client_reactor_wake(struct watchman_client *client);
+bool w_client_reactor_send_now(struct watchman_client *client,
+    json_t *response, struct w_encoded_pdu *pdu);
+void w_client_reactor_send_series(struct watchman_client *client,
+    std::function<bool()> produce);
+// Closes the session once the response to any command that is in flight
+// has been written out, or at once if force is set
+void w_client_reactor_stop(struct watchman_client *client, bool force);
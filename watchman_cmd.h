@@ -73,10 +73,19 @@ json_t *w_capability_get_list(void);
 
 void send_error_response(struct watchman_client *client,
     const char *fmt, ...);
+// These take ownership of response and pdu.  pdu is the encoded form of
+// the response produced by w_query_render_results, if it made one.
 void send_and_dispose_response(struct watchman_client *client,
-    json_t *response);
+    json_t *response, struct w_encoded_pdu *pdu = nullptr);
 bool enqueue_response(struct watchman_client *client,
-    json_t *json, bool ping);
+    json_t *json, bool ping, struct w_encoded_pdu *pdu = nullptr);
+bool send_response_now(struct watchman_client *client, json_t *response,
+    struct w_encoded_pdu *pdu = nullptr);
+// Sends a response made up of a series of PDUs.  produce sends the next
+// of them with send_response_now, and returns false once it has sent the
+// last one, or failed.
+void w_client_send_series(struct watchman_client *client,
+    std::function<bool()> produce);
 
 bool resolve_root_or_err(struct watchman_client *client, json_t *args,
                          int root_index, bool create,
@@ -15,8 +15,48 @@ struct watchman_json_buffer {
   uint32_t allocd;
   uint32_t rpos, wpos;
   enum w_pdu_type pdu_type;
+  // When reading: the capabilities of the last BSER v2 PDU that was read.
+  // When writing: the capabilities of the peer, which determine whether
+  // the BSER v2 PDUs that are at least memfd_threshold bytes long are
+  // passed in a memfd, and whether those that are at least
+  // deflate_threshold bytes long are compressed.
+  uint32_t bser_capabilities;
+  uint32_t deflate_threshold;
+  uint32_t memfd_threshold;
+  // When reading: the capabilities that a PDU must not have.  The server
+  // refuses compressed and memfd requests, so that a client can't make it
+  // expand or map an arbitrary amount of data.
+  uint32_t refused_capabilities;
 };
 
+// BSER v2 capabilities.  Each PDU carries those of its sender.
+// The sender can decode PDUs whose payload is compressed
+#define BSER_CAP_ACCEPT_DEFLATE 0x1
+// The payload of this PDU is the length of the BSER value that it holds,
+// followed by that value compressed as a zlib stream
+#define BSER_CAP_DEFLATE 0x2
+// The sender can decode prefix-compressed strings
+#define BSER_CAP_ACCEPT_PREFIX_STRINGS 0x4
+// This PDU holds prefix-compressed strings
+#define BSER_CAP_PREFIX_STRINGS 0x8
+// The sender can receive PDUs through a sealed memfd
+#define BSER_CAP_ACCEPT_MEMFD 0x10
+// The value of this PDU is the size of the memfd that was passed along
+// with it, which holds the actual PDU
+#define BSER_CAP_MEMFD 0x20
+#ifdef HAVE_ZLIB
+#define BSER_CAPS_ZLIB BSER_CAP_ACCEPT_DEFLATE
+#else
+#define BSER_CAPS_ZLIB 0
+#endif
+#ifdef HAVE_MEMFD_CREATE
+#define BSER_CAPS_MEMFD BSER_CAP_ACCEPT_MEMFD
+#else
+#define BSER_CAPS_MEMFD 0
+#endif
+#define BSER_CAPS_SUPPORTED \
+  (BSER_CAPS_ZLIB | BSER_CAP_ACCEPT_PREFIX_STRINGS | BSER_CAPS_MEMFD)
+
 typedef struct bser_ctx {
   uint32_t bser_version;
   uint32_t bser_capabilities;
@@ -73,4 +113,111 @@ json_t* bunser(
 
 #ifdef __cplusplus
 }
+
+#include <functional>
+#include <string>
+
+// A PDU that was encoded ahead of the time that it is written.  The
+// PDU starts at data[start]; the bytes before that are the unused part
+// of the space that was set aside for its header.
+struct w_encoded_pdu {
+  enum w_pdu_type pdu_type{need_data};
+  std::string data;
+  size_t start{0};
+};
+
+// Appends an encoded value to a PDU that is being built
+typedef std::function<bool(std::string& buf)> w_pdu_value_encoder;
+
+// Encodes json as a PDU of pdu_type.  If key is not null, json must be an
+// object, and the encoded object gains an extra property with that name,
+// whose value is appended by encode_value.  This lets callers encode
+// large values straight into the PDU, rather than building json_t trees
+// for them.  Returns false if pdu_type can't be encoded this way.
+// bser_capabilities are added to those in the header of a BSER v2 PDU,
+// to describe what encode_value put in it.
+bool w_ser_encode_pdu(
+    enum w_pdu_type pdu_type,
+    uint32_t bser_capabilities,
+    json_t* json,
+    const char* key,
+    const w_pdu_value_encoder& encode_value,
+    w_encoded_pdu* pdu);
+bool w_ser_write_encoded_pdu(
+    w_jbuffer_t* jr,
+    w_stm_t stm,
+    const w_encoded_pdu* pdu);
+// Decodes an encoded PDU back into json
+json_t* w_encoded_pdu_to_json(const w_encoded_pdu* pdu, json_error_t* jerr);
+
+bool w_bser_encode_pdu(
+    uint32_t bser_version,
+    uint32_t bser_capabilities,
+    json_t* json,
+    const char* key,
+    const w_pdu_value_encoder& encode_value,
+    w_encoded_pdu* pdu);
+
+// Compresses the payload of the BSER v2 PDU in pdu into out.  Returns false
+// if this was built without zlib, or the PDU doesn't get any smaller.
+bool w_bser_deflate_pdu(const w_encoded_pdu* pdu, w_encoded_pdu* out);
+// Expands the payload of a PDU with BSER_CAP_DEFLATE set into the BSER
+// value that it holds
+bool w_bser_inflate_payload(
+    const char* buf,
+    const char* end,
+    std::string& out,
+    json_error_t* jerr);
+
+// Supplies a BSER value to w_bser_transcode_json a piece at a time.  It
+// reads up to size bytes of the value into buf, and returns the number of
+// bytes read, 0 once there are no more, or -1 on error.
+typedef std::function<int(char* buf, int size)> w_bser_read_func;
+
+// Writes the BSER value supplied by read to dump as JSON, formatted as
+// json_dump_callback would format it with flags, without decoding it into
+// a json_t.  Memory use is bounded by the largest string in the value
+// rather than by the size of the value.
+bool w_bser_transcode_json(
+    const w_bser_read_func& read,
+    size_t flags,
+    json_dump_callback_t dump,
+    void* data,
+    json_error_t* jerr);
+// Encodes the JSON text in [buf, end) as a BSER PDU, without decoding it
+// into a json_t
+bool w_json_transcode_bser_pdu(
+    uint32_t bser_version,
+    uint32_t bser_capabilities,
+    const char* buf,
+    const char* end,
+    w_encoded_pdu* pdu,
+    json_error_t* jerr);
+
+// These append individual BSER values to buf
+void w_bser_append_int(std::string& buf, json_int_t val);
+void w_bser_append_real(std::string& buf, double val);
+void w_bser_append_bool(std::string& buf, bool val);
+void w_bser_append_null(std::string& buf);
+void w_bser_append_skip(std::string& buf);
+void w_bser_append_bytestring(std::string& buf, const char* str, size_t len);
+// Appends str as a prefix-compressed string.  prev holds the previous
+// string that was appended this way to the PDU; only the part of str that
+// differs from it is encoded, and str becomes the new prev.  The PDU must
+// be sent with BSER_CAP_PREFIX_STRINGS, to a peer that accepts them.
+void w_bser_append_prefix_string(
+    std::string& buf,
+    std::string& prev,
+    const char* str,
+    size_t len);
+void w_bser_append_array_header(std::string& buf, size_t num_items);
+void w_bser_append_object_header(std::string& buf, size_t num_props);
+// Starts a templated array of num_items objects.  It must be followed by
+// num_keys values for each object, in the order of keys, with a skip for
+// any that aren't set.
+void w_bser_append_template_header(
+    std::string& buf,
+    const char* const* keys,
+    size_t num_keys,
+    size_t num_items);
 #endif
@@ -1,6 +1,7 @@
 /* Copyright 2012-present Facebook, Inc.
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
+#include <vector>
 
 #define W_PENDING_RECURSIVE 1
 #define W_PENDING_VIA_NOTIFY 2
@@ -37,6 +38,12 @@ void w_pending_coll_append(struct watchman_pending_collection *target,
     struct watchman_pending_collection *src);
 struct watchman_pending_fs *w_pending_coll_pop(
     struct watchman_pending_collection *coll);
+struct watchman_pending_fs *w_pending_coll_take(
+    struct watchman_pending_collection *coll);
+bool w_pending_coll_extract_prefix(
+    struct watchman_pending_collection *coll,
+    const w_string& prefix,
+    std::vector<w_string>& paths);
 bool w_pending_coll_lock_and_wait(struct watchman_pending_collection *coll,
     int timeoutms);
 void w_pending_coll_ping(struct watchman_pending_collection *coll);
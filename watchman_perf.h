@@ -66,6 +66,26 @@ struct watchman_perf_sample {
 };
 typedef struct watchman_perf_sample w_perf_t;
 
+// A histogram with power-of-two sized buckets.  Bucket 0 counts
+// zero values and bucket N counts values in the range [2^(N-1), 2^N).
+// This does no locking of its own; the owner is responsible for
+// serializing access to it.
+struct watchman_log2_histogram {
+  uint64_t buckets[65];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+
+  watchman_log2_histogram();
+
+  void add(uint64_t value);
+
+  // Render as {"count", "sum", "max", "buckets"} where buckets
+  // is a list of [upper bound, count] tuples for the non-empty buckets
+  json_t* to_json() const;
+};
+typedef struct watchman_log2_histogram w_log2_histogram;
+
 
 
 #ifdef __cplusplus
@@ -3,10 +3,18 @@
 
 #ifndef WATCHMAN_QUERY_H
 #define WATCHMAN_QUERY_H
+#include <chrono>
 #include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "watchman_pdu.h"
 
 struct w_query;
 typedef struct w_query w_query;
+class QueryParallelizer;
 
 struct w_query_since {
   bool is_timestamp;
@@ -23,28 +31,147 @@ struct w_query_since {
 
 struct watchman_rule_match {
   uint32_t root_number;
-  w_string relname;
+  // The number of leading characters of the full path of file that are
+  // dropped to make its name relative to the root (or relative_root)
+  uint32_t name_start;
   bool is_new;
   const watchman_file* file;
+  // The name relative to the root, if whoever produced the match already
+  // had it; otherwise it is built from file when the match is rendered
+  w_string relname;
 
   watchman_rule_match(
       uint32_t root_number,
-      const w_string& relname,
+      uint32_t name_start,
       bool is_new,
       const watchman_file* file)
       : root_number(root_number),
-        relname(relname),
+        name_start(name_start),
         is_new(is_new),
         file(file) {}
+
+  watchman_rule_match(
+      uint32_t root_number,
+      const w_string& relname,
+      bool is_new,
+      const watchman_file* file)
+      : root_number(root_number),
+        name_start(0),
+        is_new(is_new),
+        file(file),
+        relname(relname) {}
+};
+
+// Builds the names of files relative to the root into a buffer that is
+// reused from one file to the next.  Consecutive files usually share a
+// parent, so the parent's portion of the name is kept and only the file
+// name is replaced.  The file nodes must still be live, so this must be
+// used with the root locked.
+class RelNameBuilder {
+ public:
+  // Returns the name of file, dropping the first name_start characters
+  // of its full path.  The name is NUL terminated and remains valid until
+  // the next call.
+  w_string_piece build(const watchman_file* file, uint32_t name_start);
+  w_string_piece build(const watchman_rule_match& match) {
+    if (match.relname) {
+      return match.relname;
+    }
+    return build(match.file, match.name_start);
+  }
+
+ private:
+  std::string buf_;
+  const watchman_dir* parent_{nullptr};
+  // The length of the full path of parent_, plus the separator
+  size_t parent_len_{0};
+};
+
+// Holds copies of the names that must outlive the evaluation of the file
+// that produced them, such as the keys of the dedup set.  They are carved
+// out of large blocks that are all released along with the arena, rather
+// than each being allocated and reference counted.
+class QueryNameArena {
+ public:
+  QueryNameArena() = default;
+  QueryNameArena(const QueryNameArena&) = delete;
+  QueryNameArena& operator=(const QueryNameArena&) = delete;
+
+  // The returned string belongs to the arena; it must not be addref'd
+  // or delref'd, and must not be used once the arena is gone
+  w_string_t* copy(w_string_piece name);
+
+ private:
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char* next_{nullptr};
+  size_t avail_{0};
 };
 
+// The changes to the files beneath a directory, used when the results of
+// a query are collapsed into directories
+struct w_query_dir_summary {
+  // Relative to the root (or relative_root); empty for the root itself
+  w_string name;
+  uint32_t added{0};
+  uint32_t modified{0};
+  uint32_t removed{0};
+
+  void add(const w_query_dir_summary& other) {
+    added += other.added;
+    modified += other.modified;
+    removed += other.removed;
+  }
+};
+
+// How the query planner chose to produce the candidate files for a
+// query that uses the default generators
+enum w_query_plan_driver {
+  // Run the generators selected by the query, one after the other
+  W_QUERY_DRIVE_DEFAULT,
+  // Walk the suffix index for suffixes required by the expression
+  W_QUERY_DRIVE_SUFFIX,
+  // Walk the subtree of a directory required by the expression
+  W_QUERY_DRIVE_SUBTREE,
+};
+
+struct w_query_plan {
+  enum w_query_plan_driver driver{W_QUERY_DRIVE_DEFAULT};
+  // Suffixes that every matching file must have, for W_QUERY_DRIVE_SUFFIX
+  std::vector<w_string> suffixes;
+  // Directory that every matching file must be under, relative to the
+  // relative root, for W_QUERY_DRIVE_SUBTREE
+  w_string dirname;
+  // Estimated number of candidate files for each approach, or -1 if
+  // the approach wasn't applicable.  The estimates stop counting once
+  // they exceed the smallest alternative.
+  int64_t default_estimate{-1};
+  int64_t suffix_estimate{-1};
+  int64_t subtree_estimate{-1};
+  bool planned{false};
+
+  json_t* to_json() const;
+};
+
+// How many files w_query_process_file sees between checks for
+// cancellation; the client check costs a syscall
+#define QUERY_CANCEL_CHECK_INTERVAL 64
+
 // Holds state for the execution of a query
 struct w_query_ctx {
   struct w_query *query;
   struct read_locked_watchman_root *lock;
   const watchman_file* file{nullptr};
-  w_string wholename;
+  // The name of file relative to the root, once w_query_ctx_get_wholename
+  // has built it into names; it is only valid until the next file
+  w_string_t* wholename{nullptr};
+  w_string_t wholename_str;
+  RelNameBuilder names;
   struct w_query_since since;
+  // The clockspecs of the query's since terms, evaluated against the
+  // root when the query is prepared; indexed by the slot of the term.
+  // They live here rather than in the terms so that the parsed query
+  // stays read-only while it is being evaluated.
+  std::vector<struct w_query_since> since_terms;
 
   std::deque<watchman_rule_match> results;
 
@@ -53,12 +180,44 @@ struct w_query_ctx {
   w_string_t* last_parent_path{nullptr};
 
   // When deduping the results, effectively a set<wholename> of
-  // the files held in results
+  // the files held in results; the names are held in dedup_names
   w_ht_t* dedup{nullptr};
+  QueryNameArena dedup_names;
 
   // How many times we suppressed a result due to dedup checking
   uint32_t num_deduped{0};
 
+  // The number of matches, when the query doesn't collect the results
+  uint32_t num_matches{0};
+
+  // Set once the query has everything that it needs; w_query_process_file
+  // returns false so that the generators stop producing files
+  bool complete{false};
+
+  // If set, w_query_process_file periodically checks whether the query
+  // has been cancelled or has run past the deadline (if it has one)
+  bool check_cancel{false};
+  std::chrono::steady_clock::time_point deadline;
+  uint32_t num_until_check{0};
+
+  // The root that the read lock in lock came from; if set, the
+  // generators may use w_query_ctx_yield to release the lock for a while
+  struct unlocked_watchman_root* unlocked{nullptr};
+  uint32_t num_yields{0};
+
+  // Set when the results are being collapsed into directories; the
+  // matches are tallied in dirs against their parent rather than
+  // being held in results
+  bool collapsed{false};
+  std::unordered_map<const watchman_dir*, w_query_dir_summary> dirs;
+
+  // The choice made by the query planner
+  struct w_query_plan plan;
+
+  // If set, w_query_process_file hands the files to this for evaluation
+  // on a pool of worker threads
+  QueryParallelizer* parallel{nullptr};
+
   w_query_ctx(w_query* q, read_locked_watchman_root* lock);
   ~w_query_ctx();
   w_query_ctx(const w_query_ctx&) = delete;
@@ -70,18 +229,104 @@ struct w_query_path {
   int depth;
 };
 
+class QueryProgram;
+
 class QueryExpr {
  public:
   virtual ~QueryExpr();
   virtual bool evaluate(w_query_ctx* ctx, const watchman_file* file) = 0;
+
+  // Called once per execution of the query, with the root locked, before
+  // any files are evaluated.  Terms can use this to hoist work that does
+  // not depend on the file being evaluated.
+  virtual void prepare(w_query_ctx* ctx);
+
+  // The estimated relative cost of evaluating this term for one file;
+  // comparing a basename costs around 1
+  virtual double estimateCost() const;
+  // The estimated proportion of files for which this term is true
+  virtual double estimateSelectivity() const;
+
+  // Emit the instructions to evaluate this expression into prog, such
+  // that control transfers to onTrue or onFalse depending on the outcome.
+  // Returns the label of the first instruction of the expression.
+  // The default emits a single instruction that calls evaluate().
+  virtual uint32_t
+  compile(QueryProgram* prog, uint32_t onTrue, uint32_t onFalse);
+
+  // Support for the query planner.
+  // If every file matched by this expression must have one of a set of
+  // suffixes, append them to suffixes and return true.
+  virtual bool requiredSuffixes(std::vector<w_string>& suffixes) const;
+  // If every file matched by this expression must be within a directory,
+  // set dirname to its path relative to the relative root and return true.
+  virtual bool requiredDirName(w_string& dirname) const;
+};
+
+// A flattened form of an expression tree.
+// The boolean structure of the tree (allof, anyof, not, true and false)
+// is compiled into branches between the remaining terms, with the
+// children of allof and anyof ordered by their estimated cost and
+// selectivity, so that evaluating a file is a loop over instructions
+// rather than a recursive descent through virtual calls.
+class QueryProgram {
+ public:
+  static const uint32_t kAccept = 0xffffffff;
+  static const uint32_t kReject = 0xfffffffe;
+
+  explicit QueryProgram(QueryExpr* expr);
+
+  // Append an instruction that evaluates expr and branches to onTrue
+  // or onFalse.  Returns its label.
+  uint32_t emit(QueryExpr* expr, uint32_t onTrue, uint32_t onFalse);
+
+  void prepare(w_query_ctx* ctx);
+
+  bool evaluate(w_query_ctx* ctx, const watchman_file* file) const {
+    auto pc = entry_;
+    while (pc < kReject) {
+      const auto& instr = instrs_[pc];
+      pc = instr.expr->evaluate(ctx, file) ? instr.onTrue : instr.onFalse;
+    }
+    return pc == kAccept;
+  }
+
+  size_t size() const {
+    return instrs_.size();
+  }
+
+ private:
+  struct Instr {
+    QueryExpr* expr;
+    uint32_t onTrue;
+    uint32_t onFalse;
+  };
+  std::vector<Instr> instrs_;
+  uint32_t entry_;
 };
 
 struct watchman_glob_tree;
 
+// What a query produces for the files that match it
+enum w_query_result_mode {
+  // The files, rendered according to the field list
+  W_QUERY_RESULT_FILES,
+  // Only the number of files that matched
+  W_QUERY_RESULT_COUNT,
+  // Only whether anything matched; the query stops at the first match
+  W_QUERY_RESULT_EXISTS,
+  // The directories that contain the files, with counts of the changes
+  W_QUERY_RESULT_DIRS,
+};
+
 struct w_query {
   bool case_sensitive{false};
   bool empty_on_fresh_instance{false};
   bool dedup_results{false};
+  enum w_query_result_mode result_mode{W_QUERY_RESULT_FILES};
+  // If non-zero, a files query with more matches than this produces
+  // its results collapsed into directories instead
+  uint32_t collapse_threshold{0};
 
   /* optional full path to relative root, without and with trailing slash */
   w_string_t* relative_root{nullptr};
@@ -99,14 +344,32 @@ struct w_query {
 
   uint32_t sync_timeout{0};
   uint32_t lock_timeout{0};
+  // If non-zero, the query is abandoned once it has spent this long
+  // evaluating files
+  uint32_t deadline_ms{0};
+  // If non-zero, the time ordered walks release the root lock after
+  // every this many files, so that writers aren't held off
+  uint32_t yield_every{0};
+  // If non-zero, the files are delivered in a series of PDUs holding at
+  // most this many each, rather than all in one
+  uint32_t chunk_size{0};
+
+  // If set, polled while the query runs; returning true abandons it.
+  // Used to stop work on behalf of a client that has gone away.
+  std::function<bool()> is_cancelled;
 
   // We can't (and mustn't!) evaluate the clockspec
   // fully until we execute query, because we have
   // to evaluate named cursors and determine fresh
   // instance at the time we execute
   std::unique_ptr<w_clockspec> since_spec;
+  // The number of since terms in expr; each has a slot in
+  // w_query_ctx::since_terms
+  uint32_t num_since_terms{0};
 
   std::unique_ptr<QueryExpr> expr;
+  // expr, compiled for evaluation
+  std::unique_ptr<QueryProgram> program;
 
   // Error message placeholder while parsing
   char* errmsg{nullptr};
@@ -117,6 +380,50 @@ struct w_query {
   ~w_query();
 };
 
+// Evaluates the files produced by the generators for a query on a pool
+// of worker threads, once there are enough of them to make that
+// worthwhile.  The generators run on the calling thread, which holds the
+// root lock for the duration of the query; the workers only read from
+// the view and each has its own w_query_ctx, so no further locking is
+// required.  The results are merged in the order that the files were
+// generated.
+class QueryParallelizer {
+ public:
+  // threshold is the number of files at which we switch from evaluating
+  // on the calling thread to evaluating on the workers
+  QueryParallelizer(w_query_ctx* ctx, size_t threshold);
+  QueryParallelizer(const QueryParallelizer&) = delete;
+  ~QueryParallelizer();
+
+  // Returns false once a worker has given up on the query, so that the
+  // generator can stop producing files
+  bool add(const watchman_file* file);
+
+  // Evaluates the files that are still pending, waits for the workers
+  // and merges their results into the ctx.  Returns false and sets
+  // errmsg if a worker failed, or the query was cancelled or ran past
+  // its deadline while they were evaluating it.
+  bool finish(char** errmsg);
+
+  // Returns a description of the parallel evaluation for the perf log,
+  // or nullptr if we didn't reach the threshold
+  json_t* stats() const;
+
+ private:
+  struct Chunk;
+  struct State;
+
+  void dispatch();
+
+  w_query_ctx* ctx_;
+  size_t threshold_;
+  size_t numFiles_{0};
+  bool parallel_{false};
+  std::vector<const watchman_file*> pending_;
+  std::vector<std::shared_ptr<Chunk>> chunks_;
+  std::shared_ptr<State> state_;
+};
+
 typedef std::unique_ptr<QueryExpr> (
     *w_query_expr_parser)(w_query* query, json_t* term);
 
@@ -153,10 +460,59 @@ bool time_generator(
     struct w_query_ctx* ctx,
     int64_t* num_walked);
 
+// The subscriptions and triggers for a root are all evaluated at the
+// same settle point, and most of them are looking at the changes since
+// the previous settle.  Rather than have each of them walk the recency
+// list, the files that changed since the oldest of their cursors are
+// collected once and then shared by their generators.
+class SettleCandidates {
+ public:
+  explicit SettleCandidates(struct read_locked_watchman_root* lock);
+
+  // Hint that a query will want the changes since ticks, so that
+  // the candidates are collected back to there on the first walk
+  void include(uint32_t ticks);
+
+  // Used in place of time_generator
+  bool generate(
+      w_query* query,
+      struct read_locked_watchman_root* lock,
+      struct w_query_ctx* ctx,
+      int64_t* num_walked);
+
+  w_query_generator generator() {
+    return [this](
+        w_query* query,
+        struct read_locked_watchman_root* lock,
+        struct w_query_ctx* ctx,
+        int64_t* num_walked) {
+      return generate(query, lock, ctx, num_walked);
+    };
+  }
+
+ private:
+  struct read_locked_watchman_root* lock_;
+  uint32_t boundary_;
+  bool collected_{false};
+  bool supported_{true};
+  std::vector<const watchman_file*> files_;
+};
+
 struct w_query_result {
   bool is_fresh_instance;
   std::deque<watchman_rule_match> results;
+  // The number of files that matched; the size of results unless the
+  // query's result_mode meant that they weren't collected
+  uint32_t num_matches;
+  // If set, the matches were collapsed into the minimal set of
+  // directories that contain them, held in dirs, rather than results
+  bool collapsed;
+  std::vector<w_query_dir_summary> dirs;
   uint32_t root_number;
+  // The view's age out generation when the matches were produced.  Once
+  // it or the root number changes, the files that the matches refer to
+  // may have been freed.
+  uint32_t age_out_generation;
   uint32_t ticks;
   char* errmsg{nullptr};
 
@@ -170,19 +526,70 @@ bool w_query_execute(
     w_query_res* results,
     w_query_generator generator);
 
+// As w_query_execute, but if it succeeds it returns with the root still
+// locked through lock, so that the results can be rendered before the
+// files that they refer to can be freed.  The caller releases it with
+// w_root_read_unlock.
+bool w_query_execute_and_hold(
+    w_query* query,
+    struct unlocked_watchman_root* unlocked,
+    w_query_res* results,
+    w_query_generator generator,
+    struct read_locked_watchman_root* lock);
+
+// Returns true if the files that the matches in res refer to are still
+// valid under lock, which need not be the lock that produced them
+bool w_query_res_is_current(
+    const w_query_res* res,
+    struct read_locked_watchman_root* lock);
+
 bool w_query_execute_locked(
     w_query* query,
     struct write_locked_watchman_root* lock,
     w_query_res* results,
     w_query_generator generator);
 
+// Executes each of the queries, after syncing (once) with the longest
+// of their sync_timeouts, under a single acquisition of the root lock.
+// Queries that would each walk every file in the view share a single
+// walk instead, and those that only look at the recent changes share
+// the list of changed files.  results is populated in the same order
+// as queries.  Returns true with the root still locked through lock, so
+// that the results can be rendered before releasing it, or false with
+// the reason in the errmsg of every result.
+bool w_query_execute_batch(
+    const std::vector<w_query*>& queries,
+    struct unlocked_watchman_root* unlocked,
+    std::deque<w_query_res>& results,
+    struct read_locked_watchman_root* lock);
+
+// As above, but a named cursor in the since clause is only read;
+// it is not advanced
+bool w_query_execute_locked(
+    w_query* query,
+    struct read_locked_watchman_root* lock,
+    w_query_res* results,
+    w_query_generator generator);
+
 // Returns a shared reference to the wholename
-// of the file.  The caller must not delref
-// the reference.
+// of the file.  The caller must not addref or delref
+// the reference, which is only valid until the
+// ctx moves on to the next file.
 w_string_t *w_query_ctx_get_wholename(
     struct w_query_ctx *ctx
 );
 
+// The number of leading characters of the full path of a file that
+// are dropped to make its name relative to the root of the query
+uint32_t w_query_ctx_name_start(struct w_query_ctx* ctx);
+
+// Enables deduplication of the results of the query
+void w_query_ctx_enable_dedup(struct w_query_ctx* ctx);
+
+// Returns true if name was already produced by the query; otherwise
+// remembers it and returns false
+bool w_query_ctx_is_dup(struct w_query_ctx* ctx, w_string_piece name);
+
 struct w_query_field_renderer;
 struct w_query_field_list {
   unsigned int num_fields;
@@ -204,6 +611,58 @@ json_t* w_query_results_to_json(
     struct w_query_field_list* field_list,
     uint32_t num_results,
     const std::deque<watchman_rule_match>& results);
+// As above, but renders only the num_results results starting at start
+json_t* w_query_results_slice_to_json(
+    struct w_query_field_list* field_list,
+    const std::deque<watchman_rule_match>& results,
+    size_t start,
+    size_t num_results);
+
+// Releases the read lock held by ctx, giving writers the opportunity to
+// make progress, and then reacquires it.  Returns false, setting the
+// query's errmsg, if the view was replaced in the meantime, in which case
+// the generator must stop; the lock is held again either way.
+bool w_query_ctx_yield(struct w_query_ctx* ctx);
+
+// Switches ctx over to collapsing its results into directories, folding
+// in any matches that it already holds
+void w_query_ctx_collapse(struct w_query_ctx* ctx);
+
+// The name of the response property that carries the results of query,
+// and its value: the rendered files, the count or existence of matches,
+// or the directories that they were collapsed into
+const char* w_query_result_prop_name(w_query* query, w_query_res* res);
+json_t* w_query_result_to_json(
+    w_query* query,
+    struct w_query_field_list* field_list,
+    w_query_res* res);
+
+// Adds the num_results results starting at start to response, as its key
+// property.  When pdu_type has a direct encoder, the results are encoded
+// from the matches straight into a PDU along with the rest of response,
+// which is returned and should be sent in place of response; response
+// itself is left without the property.  Otherwise the results are added
+// to response as json and nullptr is returned.  Either way, response must
+// be complete before this is called.  bser_capabilities are those of the
+// peer that the PDU is for, and determine which BSER v2 encodings it uses.
+w_encoded_pdu* w_query_render_results(
+    enum w_pdu_type pdu_type,
+    uint32_t bser_capabilities,
+    json_t* response,
+    const char* key,
+    struct w_query_field_list* field_list,
+    const std::deque<watchman_rule_match>& results,
+    size_t start,
+    size_t num_results);
+// As above, but renders the whole result of the query, in whichever form
+// its result_mode calls for
+w_encoded_pdu* w_query_render_result(
+    enum w_pdu_type pdu_type,
+    uint32_t bser_capabilities,
+    w_query* query,
+    struct w_query_field_list* field_list,
+    w_query_res* res,
+    json_t* response);
 
 void w_query_init_all(void);
 
@@ -2,7 +2,9 @@
  * Licensed under the Apache License, Version 2.0 */
 #pragma once
 #include <condition_variable>
+#include <deque>
 #include <unordered_map>
+#include <vector>
 #include "CookieSync.h"
 #include "QueryableView.h"
 #include "watchman_shared_mutex.h"
@@ -12,6 +14,15 @@
 #define CFG_HINT_NUM_DIRS "hint_num_dirs"
 
 #define DEFAULT_SETTLE_PERIOD 20
+
+/* Upper bounds on the amount of pending work that the io thread will
+ * process while holding the root lock before it yields to readers */
+#define DEFAULT_IO_SLICE_ITEMS 4096
+#define DEFAULT_IO_SLICE_MS 50
+
+/* Queries whose generators produce at least this many files are
+ * evaluated on a pool of worker threads */
+#define DEFAULT_QUERY_PARALLEL_THRESHOLD 100000
 #define DEFAULT_QUERY_SYNC_MS 60000
 
 /* Prune out nodes that were deleted roughly 12-36 hours ago */
@@ -22,6 +33,27 @@
 #define DEFAULT_REAP_AGE (86400*5)
 
 struct watchman_client_state_assertion;
+struct watchman_reactor_root;
+class SettleCandidates;
+namespace watchman {
+class SerialExecutor;
+class MaterializedQuery;
+class ChangeLogRing;
+}
+
+/* State that is carried across iterations of the io loop.  This lives
+ * on the stack of the io thread, or in the reactor binding for roots
+ * that are multiplexed on the shared io reactor */
+struct watchman_io_loop_state {
+  /* current settle timeout; backs off exponentially while idle */
+  int timeoutms{0};
+  /* upper bound on timeoutms */
+  int biggest_timeout{0};
+  /* items that we've pulled from the root and are processing */
+  struct watchman_pending_collection pending;
+  /* cookies that may be acknowledged once pending has been processed */
+  std::vector<w_string> cookies;
+};
 
 struct watchman_root {
   std::atomic<long> refcnt{1};
@@ -40,8 +72,45 @@ struct watchman_root {
 
     /* queue of items that we need to stat/process */
     struct watchman_pending_collection pending;
+
+    /* The notify side recognizes our cookies as soon as they are decoded
+     * and splits the queue at that point.  A barrier holds the cookies
+     * along with the items that arrived after them; the io thread can
+     * acknowledge the cookies as soon as everything ahead of the barrier
+     * has been processed, rather than also waiting for those later items.
+     * Protected by the pending lock. */
+    struct CookieBarrier {
+      std::vector<w_string> cookies;
+      std::unique_ptr<watchman_pending_collection> after;
+    };
+    std::deque<CookieBarrier> barriers;
+
+    /* If set, this root has no notify or io thread of its own; its
+     * watcher is multiplexed on the shared io reactor and the io
+     * loop runs on the shared io worker pool */
+    std::shared_ptr<watchman_reactor_root> reactor;
+
+    /* Distribution of the number of items processed per slice, and of
+     * the time (in microseconds) that the root lock was held for each
+     * slice.  Protected by the root lock. */
+    w_log2_histogram slice_items;
+    w_log2_histogram slice_lock_hold_us;
   } ioThread;
 
+  /* Used when subscriptions are dispatched on the subscription pool
+   * rather than on the io thread; see process_subscriptions */
+  struct SubscriptionDispatch {
+    std::shared_ptr<watchman::SerialExecutor> executor;
+    /* true if a run is queued on the executor and has not yet started */
+    std::atomic<bool> queued{false};
+    /* whether a VCS operation looked to be in progress at the
+     * most recent settle */
+    std::atomic<bool> vcs_in_progress{false};
+    /* the most recent tick at the most recent settle; a run only
+     * evaluates the subscriptions while the view is still at that tick */
+    std::atomic<uint32_t> settle_tick{0};
+  } subscriptionDispatch;
+
   /* map of rule id => struct watchman_trigger_command */
   watchman::Synchronized<
       std::unordered_map<w_string, std::unique_ptr<watchman_trigger_command>>>
@@ -49,9 +118,18 @@ struct watchman_root {
 
   watchman::CookieSync cookies;
 
+  /* map of name => materialized query; see MaterializedQuery.h */
+  watchman::Synchronized<std::unordered_map<
+      w_string,
+      std::shared_ptr<watchman::MaterializedQuery>>>
+      materialized;
+
   struct watchman_ignore ignore;
 
   int trigger_settle{0};
+  int io_slice_items{0};
+  int io_slice_ms{0};
+  int query_parallel_threshold{0};
   int gc_interval{0};
   int gc_age{0};
   int idle_reap_age{0};
@@ -74,6 +152,11 @@ struct watchman_root {
   // Why we failed to watch
   w_string failure_reason;
 
+  /* If changelog_size is configured, the ring that the view logs its
+   * changes to; see ChangeLogRing.h.  It outlives the views, and is
+   * reset whenever the view is rebuilt. */
+  std::unique_ptr<watchman::ChangeLogRing> changeLog;
+
   // map of state name => watchman_client_state_assertion for
   // asserted states
   watchman::Synchronized<std::unordered_map<
@@ -218,8 +301,34 @@ void w_root_read_unlock(
 void process_pending_symlink_targets(struct unlocked_watchman_root* unlocked);
 void* run_io_thread(void* arg);
 void* run_notify_thread(void* arg);
-void process_subscriptions(struct write_locked_watchman_root* lock);
-void process_triggers(struct write_locked_watchman_root* lock);
+void w_root_io_loop_init(
+    w_root_t* root,
+    struct watchman_io_loop_state* state);
+void w_root_io_loop_crawl(
+    struct unlocked_watchman_root* unlocked,
+    struct watchman_io_loop_state* state);
+bool w_root_io_loop_step(
+    struct unlocked_watchman_root* unlocked,
+    struct watchman_io_loop_state* state,
+    bool pinged);
+bool w_root_consume_notify(
+    w_root_t* root,
+    struct watchman_pending_collection* pending);
+bool w_root_pull_pending(
+    w_root_t* root,
+    struct watchman_pending_collection* coll,
+    std::vector<w_string>& cookies);
+void w_root_handle_should_recrawl(struct unlocked_watchman_root* unlocked);
+bool w_root_reactor_enabled(w_root_t* root);
+bool w_root_reactor_start(w_root_t* root, char** errmsg);
+void w_root_reactor_wake(w_root_t* root);
+void process_subscriptions(
+    struct write_locked_watchman_root* lock,
+    SettleCandidates* candidates);
+void process_triggers(
+    struct write_locked_watchman_root* lock,
+    SettleCandidates* candidates);
+void w_root_update_materialized(struct read_locked_watchman_root* lock);
 void consider_age_out(struct write_locked_watchman_root* lock);
 bool consider_reap(struct write_locked_watchman_root* lock);
 void remove_from_file_list(struct watchman_file* file);
@@ -25,6 +25,9 @@ struct watchman_stream_ops {
   bool (*op_rewind)(w_stm_t stm);
   bool (*op_shutdown)(w_stm_t stm);
   bool (*op_peer_is_owner)(w_stm_t stm);
+  bool (*op_peer_closed)(w_stm_t stm);
+  int (*op_write_with_fd)(w_stm_t stm, const void *buf, int size, int fd);
+  int (*op_take_fd)(w_stm_t stm);
 };
 
 struct watchman_stream {
@@ -60,6 +63,18 @@ void w_stm_set_nonblock(w_stm_t stm, bool nonb);
 bool w_stm_rewind(w_stm_t stm);
 bool w_stm_shutdown(w_stm_t stm);
 bool w_stm_peer_is_owner(w_stm_t stm);
+// Returns true if the other end of the stream has hung up.  A peer that
+// has only shut down its writing side hasn't hung up, as it can still
+// read our response.  Doesn't block or consume any of the pending input.
+bool w_stm_peer_closed(w_stm_t stm);
+// Writes like w_stm_write, and passes a copy of fd to the peer along
+// with the data.  Only unix domain sockets can do this; other streams
+// fail with ENOTSOCK without writing anything.
+int w_stm_write_with_fd(w_stm_t stm, const void *buf, int size, int fd);
+// Returns the oldest of the descriptors that the peer passed along with
+// the data that has been read so far, which the caller then owns, or -1
+// if there are none.
+int w_stm_take_fd(w_stm_t stm);
 
 w_stm_t w_stm_stdout(void);
 w_stm_t w_stm_stdin(void);
@@ -31,6 +31,7 @@ struct watchman_trigger_command {
 };
 
 void w_assess_trigger(struct write_locked_watchman_root *lock,
-                      struct watchman_trigger_command *cmd);
+                      struct watchman_trigger_command *cmd,
+                      w_query_generator generator);
 std::unique_ptr<watchman_trigger_command>
 w_build_trigger_from_def(const w_root_t* root, json_t* trig, char** errmsg);
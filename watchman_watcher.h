@@ -54,6 +54,12 @@ struct Watcher {
 
   // Wait for an inotify event to become available
   virtual bool waitNotify(int timeoutms) = 0;
+
+  // Returns a descriptor that becomes readable when consumeNotify()
+  // has something to consume, or -1 if the watcher has no such
+  // descriptor.  Watchers that return a descriptor can be driven
+  // by the shared io reactor rather than a dedicated notify thread.
+  virtual int getNotifyFd() const;
 };
 
 bool w_watcher_init(w_root_t *root, char **errmsg);